@@ -72,9 +72,8 @@ WS_DLL_PUBLIC_DEF const int plugin_want_minor = WIRESHARK_VERSION_MINOR;
 #define HOMA_ACK_PACKET 0x18
 
 #define COMMON_HEADER_LENGTH 28
-#define HOMA_ACK_LENGTH 12
-#define DATA_SEGMENT_LENGTH (8 + HOMA_ACK_LENGTH)
-#define DATA_HEADER_LENGTH (12 + DATA_SEGMENT_LENGTH)
+#define HOMA_ACK_LENGTH 10
+#define DATA_HEADER_LENGTH (18 + HOMA_ACK_LENGTH)
 #define RESEND_HEADER_LENGTH 9
 #define GRANT_HEADER_LENGTH 5
 #define CUTOFFS_HEADER_LENGTH 34
@@ -91,10 +90,9 @@ static int hf_homa_data_message_length = -1;
 static int hf_homa_data_incoming = -1;
 static int hf_homa_data_cutoff_version = -1;
 static int hf_homa_data_retransmit = -1;
+static int hf_homa_data_deadline = -1;
 static int hf_homa_data_offset = -1;
-static int hf_homa_data_segment_length = -1;
 static int hf_homa_ack_client_id = -1;
-static int hf_homa_ack_client_port = -1;
 static int hf_homa_ack_server_port = -1;
 static int hf_homa_grant_offset = -1;
 static int hf_homa_grant_priority = -1;
@@ -200,26 +198,23 @@ static int dissect_homa(tvbuff_t *tvb, packet_info *pinfo, proto_tree *tree _U_,
 		proto_tree_add_item(homa_tree_data, hf_homa_data_incoming, tvb,
 				    COMMON_HEADER_LENGTH + 4, 4,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_data_cutoff_version,
-				    tvb, COMMON_HEADER_LENGTH + 8, 2,
-				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_data_retransmit,
-				    tvb, COMMON_HEADER_LENGTH + 10, 1,
+		proto_tree_add_item(homa_tree_data, hf_homa_ack_client_id, tvb,
+				    COMMON_HEADER_LENGTH + 8, 8,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_data_offset, tvb,
-				    COMMON_HEADER_LENGTH + 12, 4,
+		proto_tree_add_item(homa_tree_data, hf_homa_ack_server_port,
+				    tvb, COMMON_HEADER_LENGTH + 16, 2,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_data_segment_length,
-				    tvb, COMMON_HEADER_LENGTH + 16, 4,
+		proto_tree_add_item(homa_tree_data, hf_homa_data_cutoff_version,
+				    tvb, COMMON_HEADER_LENGTH + 18, 2,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_ack_client_id, tvb,
-				    COMMON_HEADER_LENGTH + 20, 8,
+		proto_tree_add_item(homa_tree_data, hf_homa_data_retransmit,
+				    tvb, COMMON_HEADER_LENGTH + 20, 1,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_ack_client_port,
-				    tvb, COMMON_HEADER_LENGTH + 28, 2,
+		proto_tree_add_item(homa_tree_data, hf_homa_data_deadline,
+				    tvb, COMMON_HEADER_LENGTH + 21, 3,
 				    ENC_BIG_ENDIAN);
-		proto_tree_add_item(homa_tree_data, hf_homa_ack_server_port,
-				    tvb, COMMON_HEADER_LENGTH + 30, 2,
+		proto_tree_add_item(homa_tree_data, hf_homa_data_offset, tvb,
+				    COMMON_HEADER_LENGTH + 24, 4,
 				    ENC_BIG_ENDIAN);
 		break;
 	case HOMA_RESEND_PACKET:
@@ -313,20 +308,17 @@ static void proto_register_homa(void)
 		{ &hf_homa_data_retransmit,
 		  { "Homa retransmit", "homa.retransmit", FT_UINT8, BASE_DEC,
 		    NULL, 0x0, NULL, HFILL } },
+		{ &hf_homa_data_deadline,
+		  { "Homa deadline (usecs left)", "homa.deadline_us",
+		    FT_UINT24, BASE_DEC, NULL, 0x0, NULL, HFILL } },
 		{ &hf_homa_data_offset,
 		  { "Homa segment offset", "homa.offset", FT_UINT32, BASE_DEC,
-		    NULL, 0x0, NULL, HFILL } },
-		{ &hf_homa_data_segment_length,
-		  { "Homa segment length", "homa.segment_length", FT_UINT32,
-		    BASE_DEC, NULL, 0x0, NULL, HFILL } }
+		    NULL, 0x0, NULL, HFILL } }
 	};
 	static hf_register_info hf_homa_ack[] = {
 		{ &hf_homa_ack_client_id,
 		  { "Homa client id", "homa.client_id", FT_UINT64, BASE_DEC,
 		    NULL, 0x0, NULL, HFILL } },
-		{ &hf_homa_ack_client_port,
-		  { "Homa client port", "homa.client_port", FT_UINT16, BASE_DEC,
-		    NULL, 0x0, NULL, HFILL } },
 		{ &hf_homa_ack_server_port,
 		  { "Homa server port", "homa.server_port", FT_UINT16, BASE_DEC,
 		    NULL, 0x0, NULL, HFILL } }
@@ -70,14 +70,28 @@ struct homa_sendmsg_args {
 	 */
 	__u32 flags;
 
-	/** @reserved: Not currently used. */
-	__u32 reserved;
+	/**
+	 * @deadline_us: (in) Used only for request messages. If nonzero,
+	 * the RPC must complete within this many microseconds. Homa
+	 * estimates how long it will take to transmit the request, given
+	 * the data already queued for output on this host; if the estimate
+	 * exceeds the deadline, the request is rejected with ETIME instead
+	 * of being queued. Otherwise, if the response has not been received
+	 * when the deadline passes, the RPC fails with ETIME. The deadline
+	 * is also passed to the server. 0 means no deadline.
+	 */
+	__u32 deadline_us;
 };
 
 /* Flag bits for homa_sendmsg_args.flags (see man page for documentation):
  */
 #define HOMA_SENDMSG_PRIVATE       0x01
+#ifndef __STRIP__ /* See strip.py */
+#define HOMA_SENDMSG_SNDBUF        0x02
+#define HOMA_SENDMSG_VALID_FLAGS   0x03
+#else /* See strip.py */
 #define HOMA_SENDMSG_VALID_FLAGS   0x01
+#endif /* See strip.py */
 
 /**
  * struct homa_recvmsg_args - Provides information needed by Homa's
@@ -116,6 +130,14 @@ struct homa_recvmsg_args {
 	 * bpage_offsets in a future recvmsg invocation.
 	 */
 	__u32 bpage_offsets[HOMA_MAX_BPAGES];
+
+	/**
+	 * @deadline_us: (out) For requests with a deadline (see
+	 * homa_sendmsg_args), the number of microseconds left before
+	 * the deadline (at least 1, even if the deadline has passed).
+	 * 0 means the request has no deadline or the message is a response.
+	 */
+	__u32 deadline_us;
 };
 
 #ifndef __STRIP__ /* See strip.py */
@@ -150,6 +172,27 @@ struct homa_abort_args {
  */
 #define SO_HOMA_SERVER 11
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * define SO_HOMA_GRANT_WEIGHT: setsockopt option for specifying the
+ * socket's share of incoming bandwidth relative to other sockets on the
+ * same host.
+ */
+#define SO_HOMA_GRANT_WEIGHT 12
+
+/**
+ * define HOMA_MAX_GRANT_WEIGHT - Largest value that may be specified
+ * with SO_HOMA_GRANT_WEIGHT.
+ */
+#define HOMA_MAX_GRANT_WEIGHT 100
+
+/**
+ * define SO_HOMA_SNDBUF: setsockopt option for registering a region of
+ * memory from which outgoing messages will be sent.
+ */
+#define SO_HOMA_SNDBUF 13
+#endif /* See strip.py */
+
 /** struct homa_rcvbuf_args - setsockopt argument for SO_HOMA_RCVBUF. */
 struct homa_rcvbuf_args {
 	/** @start: Address of first byte of buffer region in user space. */
@@ -159,6 +202,20 @@ struct homa_rcvbuf_args {
 	size_t length;
 };
 
+#ifndef __STRIP__ /* See strip.py */
+/** struct homa_sndbuf_args - setsockopt argument for SO_HOMA_SNDBUF. */
+struct homa_sndbuf_args {
+	/**
+	 * @start: Address of first byte of send region in user space; must
+	 * be page-aligned.
+	 */
+	__u64 start;
+
+	/** @length: Total number of bytes in the region. */
+	size_t length;
+};
+#endif /* See strip.py */
+
 /* Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
  */
@@ -169,6 +226,13 @@ struct homa_rcvbuf_args {
  */
 #define HOMA_FLAG_DONT_THROTTLE   2
 
+/**
+ * define HOMA_FLAG_SRPT_XMIT - schedule all output transmissions on this
+ * host in SRPT order: an RPC may transmit immediately only if no throttled
+ * RPC has fewer bytes left to send; otherwise it is queued for the pacer.
+ */
+#define HOMA_FLAG_SRPT_XMIT       4
+
 /* I/O control calls on Homa sockets. These are mapped into the
  * SIOCPROTOPRIVATE range of 0x89e0 through 0x89ef.
  */
@@ -95,6 +95,7 @@ struct homa_grant *homa_grant_alloc(void)
 	grant->max_incoming = 400000;
 	spin_lock_init(&grant->lock);
 	INIT_LIST_HEAD(&grant->grantable_peers);
+	INIT_LIST_HEAD(&grant->fifo_rpcs);
 	grant->window_param = 10000;
 	grant->max_rpcs_per_peer = 1;
 	grant->max_overcommit = 8;
@@ -262,6 +263,107 @@ int homa_grant_priority(struct homa *homa, int rank)
 	return (priority < 0) ? 0 : priority;
 }
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_grant_share() - Return the number of slots in active_rpcs that
+ * a socket is entitled to, based on its grant weight relative to the
+ * weights of the other sockets that have messages needing grants.
+ * @grant:   Grant management information.
+ * @hsk:     Socket whose share is desired.
+ * Return:   See above. The result is always at least 1; if @hsk is the
+ *           only socket needing grants, it is grant->max_overcommit.
+ */
+int homa_grant_share(struct homa_grant *grant, struct homa_sock *hsk)
+	__must_hold(&grant->lock)
+{
+	int total, share;
+
+	total = grant->grantable_weight;
+	if (hsk->num_grantable_rpcs == 0)
+		total += hsk->grant_weight;
+	if (total <= hsk->grant_weight)
+		return grant->max_overcommit;
+	share = grant->max_overcommit * hsk->grant_weight / total;
+	return (share < 1) ? 1 : share;
+}
+
+/**
+ * homa_grant_find_victim() - Find an RPC in active_rpcs whose socket
+ * holds more than its share of active_rpcs (as computed by homa_grant_share).
+ * @grant:   Grant management information.
+ * Return:   The index in active_rpcs of the lowest-priority such RPC, or
+ *           -1 if every socket is within its share.
+ */
+int homa_grant_find_victim(struct homa_grant *grant)
+	__must_hold(&grant->lock)
+{
+	struct homa_sock *hsk;
+	int i;
+
+	for (i = grant->num_active_rpcs - 1; i >= 0; i--) {
+		hsk = grant->active_rpcs[i]->hsk;
+		if (hsk->grant_active_rpcs > homa_grant_share(grant, hsk))
+			return i;
+	}
+	return -1;
+}
+#endif /* See strip.py */
+
+/**
+ * homa_grant_add_active() - Insert an RPC into active_rpcs at a given
+ * rank, shifting lower-priority RPCs down. There must be room in
+ * active_rpcs for the new entry.
+ * @grant:   Grant management information.
+ * @rpc:     RPC to insert; must not currently be in active_rpcs.
+ * @rank:    Index in active_rpcs where @rpc should be stored.
+ */
+static void homa_grant_add_active(struct homa_grant *grant,
+				  struct homa_rpc *rpc, int rank)
+	__must_hold(&grant->lock)
+{
+	struct homa_rpc *other;
+	int i;
+
+	for (i = grant->num_active_rpcs - 1; i >= rank; i--) {
+		other = grant->active_rpcs[i];
+		other->msgin.rank = i + 1;
+		grant->active_rpcs[i + 1] = other;
+	}
+	grant->active_rpcs[rank] = rpc;
+	rpc->msgin.rank = rank;
+	grant->num_active_rpcs++;
+	rpc->peer->active_rpcs++;
+	IF_NO_STRIP(rpc->hsk->grant_active_rpcs++);
+}
+
+/**
+ * homa_grant_del_active() - Remove the RPC at a given rank from
+ * active_rpcs, shifting lower-priority RPCs up to fill the gap.
+ * @grant:   Grant management information.
+ * @rank:    Index in active_rpcs of the RPC to remove.
+ * Return:   The RPC that was removed.
+ */
+static struct homa_rpc *homa_grant_del_active(struct homa_grant *grant,
+					      int rank)
+	__must_hold(&grant->lock)
+{
+	struct homa_rpc *rpc, *other;
+	int i;
+
+	rpc = grant->active_rpcs[rank];
+	for (i = rank + 1; i < grant->num_active_rpcs; i++) {
+		other = grant->active_rpcs[i];
+		other->msgin.rank = i - 1;
+		grant->active_rpcs[i - 1] = other;
+	}
+	grant->num_active_rpcs--;
+	grant->active_rpcs[grant->num_active_rpcs] = NULL;
+	rpc->msgin.rank = -1;
+	rpc->peer->active_rpcs--;
+	IF_NO_STRIP(rpc->hsk->grant_active_rpcs--);
+	return rpc;
+}
+
 /**
  * homa_grant_insert_active() - Try to insert an RPC in homa->active_rpcs.
  * @rpc:   RPC to insert (if possible).
@@ -274,15 +376,16 @@ struct homa_rpc *homa_grant_insert_active(struct homa_rpc *rpc)
 	__must_hold(&rpc->hsk->homa->grant->lock)
 {
 	struct homa_grant *grant = rpc->hsk->homa->grant;
-	struct homa_rpc *other, *result;
+	struct homa_rpc *other;
 	int insert_after;
-	int last_to_copy;
 	int peer_index;
+	int victim;
 	int i;
+	IF_NO_STRIP(int sock_index = -1);
 
 	/* Scan active_rpcs backwards to find the lowest-priority message
 	 * with higher priority than @rpc. Also find the lowest-priority
-	 * message with the same peer as @rpc, if one appears.
+	 * message with the same peer (and socket) as @rpc, if one appears.
 	 */
 	insert_after = -1;
 	peer_index = -1;
@@ -294,10 +397,14 @@ struct homa_rpc *homa_grant_insert_active(struct homa_rpc *rpc)
 		}
 		if (peer_index < 0 && other->peer == rpc->peer)
 			peer_index = i;
+#ifndef __STRIP__ /* See strip.py */
+		if (sock_index < 0 && other->hsk == rpc->hsk)
+			sock_index = i;
+#endif /* See strip.py */
 	}
 
 	if (rpc->peer->active_rpcs >= grant->max_rpcs_per_peer) {
-		if (peer_index <= i)
+		if (peer_index < 0)
 			/* All the other RPCs with the same peer are higher
 			 * priority than @rpc and we can't have any more RPCs
 			 * with the same peer, so bump @rpc.
@@ -308,40 +415,50 @@ struct homa_rpc *homa_grant_insert_active(struct homa_rpc *rpc)
 		 * for the new RPC. @rpc will be in a slot with lower index
 		 * (higher priority) than the bumped one.
 		 */
-		result = grant->active_rpcs[peer_index];
-		result->msgin.rank = -1;
-		result->peer->active_rpcs--;
-		last_to_copy = peer_index - 1;
+		victim = peer_index;
+	} else if (grant->num_active_rpcs < grant->max_overcommit) {
+		victim = -1;
+#ifndef __STRIP__ /* See strip.py */
+	} else if (rpc->hsk->grant_active_rpcs >=
+		   homa_grant_share(grant, rpc->hsk)) {
+		/* active_rpcs is full and @rpc's socket already has its
+		 * share of it, so @rpc can only displace a lower-priority
+		 * RPC from its own socket.
+		 */
+		if (sock_index < 0)
+			return rpc;
+		victim = sock_index;
+	} else {
+		/* @rpc's socket is below its share; take a slot from a
+		 * socket that is above its share, if there is one,
+		 * regardless of SRPT order.
+		 */
+		victim = homa_grant_find_victim(grant);
+		if (victim < 0) {
+			if (insert_after >= grant->max_overcommit - 1)
+				return rpc;
+			victim = grant->num_active_rpcs - 1;
+		}
+#else /* See strip.py */
 	} else {
 		if (insert_after >= grant->max_overcommit - 1)
 			/* active_rpcs is full and @rpc is too low priority;
 			 * bump it.
 			 */
 			return rpc;
-
-		if (grant->num_active_rpcs >= grant->max_overcommit) {
-			result = grant->active_rpcs[grant->num_active_rpcs - 1];
-			result->msgin.rank = -1;
-			result->peer->active_rpcs--;
-			last_to_copy = grant->num_active_rpcs - 2;
-		} else {
-			result = NULL;
-			last_to_copy = grant->num_active_rpcs - 1;
-			grant->num_active_rpcs++;
-		}
+		victim = grant->num_active_rpcs - 1;
+#endif /* See strip.py */
 	}
 
-	/* Move existing RPCs in active_rpcs down to make room for @rpc. */
-	for (i = last_to_copy; i > insert_after; i--) {
-		other = grant->active_rpcs[i];
-		other->msgin.rank = i + 1;
-		grant->active_rpcs[i + 1] = other;
+	if (victim < 0) {
+		homa_grant_add_active(grant, rpc, insert_after + 1);
+		return NULL;
 	}
-	grant->active_rpcs[insert_after + 1] = rpc;
-	rpc->msgin.rank = insert_after + 1;
-	rpc->peer->active_rpcs++;
-
-	return result;
+	other = homa_grant_del_active(grant, victim);
+	if (victim <= insert_after)
+		insert_after--;
+	homa_grant_add_active(grant, rpc, insert_after + 1);
+	return other;
 }
 
 /**
@@ -416,12 +533,17 @@ void homa_grant_manage_rpc(struct homa_rpc *rpc)
 {
 	struct homa_grant *grant = rpc->hsk->homa->grant;
 	struct homa_rpc *bumped;
-	u64 time = homa_clock();
+	u64 time;
 
 	BUG_ON(rpc->msgin.rank >= 0 || !list_empty(&rpc->grantable_links));
 
 	homa_grant_lock(grant);
 
+	/* Birth times must be assigned while holding the grant lock, so that
+	 * appending to fifo_rpcs keeps the list sorted by age.
+	 */
+	time = homa_clock();
+
 	INC_METRIC(grantable_rpcs_integral, grant->num_grantable_rpcs *
 		   (time - grant->last_grantable_change));
 	grant->last_grantable_change = time;
@@ -431,6 +553,11 @@ void homa_grant_manage_rpc(struct homa_rpc *rpc)
 	if (grant->num_grantable_rpcs > grant->max_grantable_rpcs)
 		grant->max_grantable_rpcs = grant->num_grantable_rpcs;
 	rpc->msgin.birth = time;
+	list_add_tail(&rpc->fifo_links, &grant->fifo_rpcs);
+#ifndef __STRIP__ /* See strip.py */
+	if (rpc->hsk->num_grantable_rpcs++ == 0)
+		grant->grantable_weight += rpc->hsk->grant_weight;
+#endif /* See strip.py */
 
 	bumped = homa_grant_insert_active(rpc);
 	if (bumped)
@@ -487,6 +614,69 @@ void homa_grant_remove_grantable(struct homa_rpc *rpc)
 	}
 }
 
+/**
+ * homa_grant_pick_grantable() - Select an RPC from grantable_peers to
+ * promote into active_rpcs.
+ * @grant:   Grant management information.
+ * @strict:  If true, only return an RPC whose socket has fewer than its
+ *           share of active_rpcs (see homa_grant_share).
+ * Return:   The highest-priority RPC whose peer is below its limit on
+ *           active RPCs, preferring RPCs from sockets below their share
+ *           of active_rpcs, or NULL if there is no suitable RPC.
+ */
+struct homa_rpc *homa_grant_pick_grantable(struct homa_grant *grant,
+					   bool strict)
+	__must_hold(&grant->lock)
+{
+	struct homa_rpc *first = NULL;
+	struct homa_peer *peer;
+	struct homa_rpc *rpc;
+	IF_NO_STRIP(int scanned = 0);
+
+	list_for_each_entry(peer, &grant->grantable_peers, grantable_links) {
+		if (peer->active_rpcs >= grant->max_rpcs_per_peer)
+			continue;
+		list_for_each_entry(rpc, &peer->grantable_rpcs,
+				    grantable_links) {
+			if (!first)
+				first = rpc;
+#ifndef __STRIP__ /* See strip.py */
+			if (rpc->hsk->grant_active_rpcs <
+			    homa_grant_share(grant, rpc->hsk))
+				return rpc;
+			if (++scanned >= HOMA_GRANT_SHARE_SCAN)
+				return strict ? NULL : first;
+#else /* See strip.py */
+			return first;
+#endif /* See strip.py */
+		}
+	}
+	return strict ? NULL : first;
+}
+
+/**
+ * homa_grant_promote() - Move an RPC from grantable_peers into
+ * active_rpcs, at the position given by its priority.
+ * @grant:   Grant management information.
+ * @rpc:     RPC to promote; must currently be in grantable_peers, and
+ *           there must be room for it in active_rpcs.
+ * @cand:    @rpc is added here so that it will be considered for grants.
+ */
+static void homa_grant_promote(struct homa_grant *grant, struct homa_rpc *rpc,
+			       struct homa_grant_candidates *cand)
+	__must_hold(&grant->lock)
+{
+	int rank;
+
+	homa_grant_remove_grantable(rpc);
+	for (rank = grant->num_active_rpcs; rank > 0; rank--) {
+		if (!homa_grant_outranks(rpc, grant->active_rpcs[rank - 1]))
+			break;
+	}
+	homa_grant_add_active(grant, rpc, rank);
+	homa_grant_cand_add(cand, rpc);
+}
+
 /**
  * homa_grant_remove_active() - Remove an RPC from active_rpcs and promote
  * an RPC from grantable_peers if possible.
@@ -498,37 +688,16 @@ void homa_grant_remove_active(struct homa_rpc *rpc,
 	__must_hold(&rpc->hsk->homa->grant->lock)
 {
 	struct homa_grant *grant = rpc->hsk->homa->grant;
-	struct homa_peer *peer;
 	struct homa_rpc *other;
-	int i;
 
-	for (i = rpc->msgin.rank + 1; i < grant->num_active_rpcs; i++) {
-		other = grant->active_rpcs[i];
-		other->msgin.rank = i - 1;
-		grant->active_rpcs[i - 1] = other;
-	}
-	rpc->msgin.rank = -1;
-	rpc->peer->active_rpcs--;
-	grant->num_active_rpcs--;
-	grant->active_rpcs[grant->num_active_rpcs] = NULL;
+	homa_grant_del_active(grant, rpc->msgin.rank);
 
-	/* Pull the highest-priority entry (if there is one) from
+	/* Pull the highest-priority eligible entry (if there is one) from
 	 * grantable_peers into active_rpcs.
 	 */
-	list_for_each_entry(peer, &grant->grantable_peers, grantable_links) {
-		if (peer->active_rpcs >= grant->max_rpcs_per_peer)
-			continue;
-		other =	list_first_entry(&peer->grantable_rpcs,
-					 struct homa_rpc,
-					 grantable_links);
-		homa_grant_remove_grantable(other);
-		peer->active_rpcs++;
-		grant->active_rpcs[grant->num_active_rpcs] = other;
-		other->msgin.rank = grant->num_active_rpcs;
-		grant->num_active_rpcs++;
-		homa_grant_cand_add(cand, other);
-		break;
-	}
+	other = homa_grant_pick_grantable(grant, false);
+	if (other)
+		homa_grant_promote(grant, other, cand);
 }
 
 /**
@@ -553,16 +722,62 @@ void homa_grant_unmanage_rpc(struct homa_rpc *rpc,
 	grant->num_grantable_rpcs--;
 	tt_record2("Decremented num_grantable_rpcs to %d, id %d",
 		   grant->num_grantable_rpcs, rpc->id);
+#ifndef __STRIP__ /* See strip.py */
+	if (--rpc->hsk->num_grantable_rpcs == 0)
+		grant->grantable_weight -= rpc->hsk->grant_weight;
+#endif /* See strip.py */
 
 	if (rpc->msgin.rank >= 0)
 		homa_grant_remove_active(rpc, cand);
 	if (!list_empty(&rpc->grantable_links))
 		homa_grant_remove_grantable(rpc);
+	list_del_init(&rpc->fifo_links);
 	grant->window = homa_grant_window(grant);
 
 	homa_grant_unlock(grant);
 }
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_grant_set_weight() - Change the grant weight for a socket and
+ * rebalance active_rpcs so that each socket holds no more than its new
+ * share (as long as other sockets have RPCs that can use the slots).
+ * @hsk:     Socket whose weight is changing.
+ * @weight:  New weight for the socket.
+ */
+void homa_grant_set_weight(struct homa_sock *hsk, int weight)
+{
+	struct homa_grant *grant = hsk->homa->grant;
+	struct homa_grant_candidates cand;
+	struct homa_rpc *rpc, *victim;
+	int i, rank;
+
+	homa_grant_cand_init(&cand);
+	homa_grant_lock(grant);
+	if (hsk->num_grantable_rpcs > 0)
+		grant->grantable_weight += weight - hsk->grant_weight;
+	WRITE_ONCE(hsk->grant_weight, weight);
+
+	/* Each iteration moves one slot in active_rpcs from a socket above
+	 * its share to a socket below its share.
+	 */
+	for (i = 0; i < grant->max_overcommit; i++) {
+		rank = homa_grant_find_victim(grant);
+		if (rank < 0)
+			break;
+		rpc = homa_grant_pick_grantable(grant, true);
+		if (!rpc)
+			break;
+		victim = homa_grant_del_active(grant, rank);
+		homa_grant_promote(grant, rpc, &cand);
+		homa_grant_insert_grantable(victim);
+	}
+	grant->window = homa_grant_window(grant);
+	homa_grant_unlock(grant);
+	homa_grant_cand_check(&cand, grant);
+}
+#endif /* See strip.py */
+
 /**
  * homa_grant_update_incoming() - Figure out how much incoming data there is
  * for an RPC (i.e., data that has been granted but not yet received) and make
@@ -632,6 +847,9 @@ int homa_grant_update_granted(struct homa_rpc *rpc, struct homa_grant *grant)
 	}
 	if (new_grant_offset <= rpc->msgin.granted)
 		return -1;
+	if (grant->grant_nonfifo != 0)
+		atomic_sub(new_grant_offset - rpc->msgin.granted,
+			   &grant->nonfifo_left);
 	rpc->msgin.granted = new_grant_offset;
 
 	/* The reason we compute the priority here rather than, say, in
@@ -726,8 +944,33 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	needy_rank = INT_MAX;
 	now = homa_clock();
 	homa_grant_update_incoming(rpc, grant);
+	if (homa_rpc_expired(rpc, now)) {
+		/* The RPC's deadline has passed, so more grants would only
+		 * waste bandwidth; homa_timer will discard the RPC.
+		 */
+		tt_record1("homa_grant_check_rpc not granting to id %d: deadline passed",
+			   rpc->id);
+		return;
+	}
 	if (now >= READ_ONCE(grant->next_recalc)) {
 		/* Situation 2. */
+		if (READ_ONCE(grant->num_active_rpcs) < 2) {
+			/* Order can't be wrong; no need for the grant lock. */
+			WRITE_ONCE(grant->next_recalc,
+				   now + grant->recalc_cycles);
+			INC_METRIC(grant_check_recalc_skips, 1);
+			goto recalc_done;
+		}
+		if (atomic_read(&grant->total_incoming) >=
+		    grant->max_incoming) {
+			/* No RPC can receive additional grants right now,
+			 * so the order doesn't matter yet. Leave next_recalc
+			 * unchanged so that the order will be fixed as soon
+			 * as headroom becomes available.
+			 */
+			INC_METRIC(grant_check_recalc_skips, 1);
+			goto recalc_done;
+		}
 		locked = 1;
 		tt_record1("homa_grant_check_rpc acquiring grant lock to fix order (id %d)",
 			   rpc->id);
@@ -739,6 +982,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 			   rpc->id);
 		INC_METRIC(grant_check_recalcs, 1);
 	}
+recalc_done:
 
 	rank = READ_ONCE(rpc->msgin.rank);
 	stalled_rank = atomic_read(&grant->stalled_rank);
@@ -801,6 +1045,17 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 		INC_METRIC(grant_check_others, 1);
 	}
 
+	if (grant->grant_nonfifo != 0 &&
+	    atomic_read(&grant->nonfifo_left) <= 0) {
+		/* Situation 3. */
+		locked = 1;
+		homa_rpc_hold(rpc);
+		homa_rpc_unlock(rpc);
+		homa_grant_check_fifo(grant);
+		homa_rpc_lock(rpc);
+		homa_rpc_put(rpc);
+	}
+
 	INC_METRIC(grant_check_locked, locked);
 	tt_record1("homa_grant_check_rpc finished with id %d", rpc->id);
 }
@@ -838,134 +1093,102 @@ int homa_grant_fix_order(struct homa_grant *grant)
 }
 
 /**
- * homa_grant_find_oldest() - Recompute the value of homa->oldest_rpc.
- * @homa:    Overall data about the Homa protocol implementation. The
- *           grant_lock must be held by the caller.
+ * homa_grant_find_oldest() - Find the oldest incoming message that should
+ * receive a FIFO grant.
+ * @grant:   Grant management information. The grant lock must be held
+ *           by the caller.
+ * Return:   The oldest RPC in @grant->grantable_peers that doesn't
+ *           already have an outstanding FIFO grant, or NULL if there is
+ *           no such RPC.
  */
-void homa_grant_find_oldest(struct homa *homa)
+struct homa_rpc *homa_grant_find_oldest(struct homa_grant *grant)
+	__must_hold(&grant->lock)
 {
-	int max_incoming = homa->grant->window + 2 * homa->grant->fifo_grant_increment;
-	struct homa_rpc *rpc, *oldest;
-	struct homa_peer *peer;
-	u64 oldest_birth;
-
-	oldest = NULL;
-	oldest_birth = ~0;
+	int max_incoming = grant->window + 2 * grant->fifo_grant_increment;
+	struct homa_rpc *rpc;
 
-	/* Find the oldest message that doesn't currently have an
-	 * outstanding "pity grant".
+	/* Because fifo_rpcs is sorted by age, the first acceptable RPC is
+	 * the oldest one; the only entries we skip are RPCs in active_rpcs
+	 * (at most max_overcommit of them) and RPCs whose previous FIFO
+	 * grants haven't been used yet.
 	 */
-	list_for_each_entry(peer, &homa->grant->grantable_peers, grantable_links) {
-		list_for_each_entry(rpc, &peer->grantable_rpcs,
-				    grantable_links) {
-			int received, incoming;
-
-			if (rpc->msgin.birth >= oldest_birth)
-				continue;
-
-			received = (rpc->msgin.length
-					- rpc->msgin.bytes_remaining);
-			incoming = rpc->msgin.granted - received;
-			if (incoming >= max_incoming) {
-				/* This RPC has been granted way more bytes
-				 * than by the grant window. This can only
-				 * happen for FIFO grants, and it means the
-				 * peer isn't responding to grants we've sent.
-				 * Pick a different "oldest" RPC.
-				 */
-				continue;
-			}
-			oldest = rpc;
-			oldest_birth = rpc->msgin.birth;
+	list_for_each_entry(rpc, &grant->fifo_rpcs, fifo_links) {
+		int received, incoming;
+
+		if (rpc->msgin.rank >= 0 || rpc->state == RPC_DEAD)
+			continue;
+		received = rpc->msgin.length - rpc->msgin.bytes_remaining;
+		incoming = rpc->msgin.granted - received;
+		if (incoming >= max_incoming) {
+			/* This RPC has been granted way more bytes than
+			 * allowed by the grant window. This can only happen
+			 * for FIFO grants, and it means the peer isn't
+			 * responding to grants we've sent. Pick a different
+			 * "oldest" RPC.
+			 */
+			continue;
 		}
+		return rpc;
 	}
-	homa->grant->oldest_rpc = oldest;
+	return NULL;
 }
 
-#ifndef __STRIP__ /* See strip.py */
-#if 0
 /**
- * homa_choose_fifo_grant() - This function is invoked occasionally to give
- * a high-priority grant to the oldest incoming message. We do this in
- * order to reduce the starvation that SRPT can cause for long messages.
- * Note: this method is obsolete and should never be invoked; it's code is
- * being retained until fifo grants are reimplemented using the new grant
- * mechanism.
- * @homa:    Overall data about the Homa protocol implementation. The
- *           grant lock must be held by the caller.
- * Return: An RPC to which to send a FIFO grant, or NULL if there is
- *         no appropriate RPC. This method doesn't actually send a grant,
- *         but it updates @msgin.granted to reflect the desired grant.
- *         Also updates homa->total_incoming.
+ * homa_grant_check_fifo() - If enough bytes have been granted using SRPT
+ * priority since the last FIFO grant, send a "pity" grant of
+ * @fifo_grant_increment bytes to the oldest message that needs grants.
+ * FIFO grants prevent long messages from starving under a steady load of
+ * shorter messages.
+ * @grant:   Grant management information. The caller must not hold the
+ *           grant lock or any RPC locks.
  */
-struct homa_rpc *homa_choose_fifo_grant(struct homa *homa)
+void homa_grant_check_fifo(struct homa_grant *grant)
 {
-	struct homa_rpc *rpc, *oldest;
-	u64 oldest_birth;
-	int granted;
-
-	oldest = NULL;
-	oldest_birth = ~0;
-
-	/* Find the oldest message that doesn't currently have an
-	 * outstanding "pity grant".
-	 */
-	list_for_each_entry(rpc, &homa->grantable_rpcs, grantable_links) {
-		int received, on_the_way;
+	struct homa_grant_candidates cand;
+	struct homa_rpc *rpc;
+	int received;
 
-		if (rpc->msgin.birth >= oldest_birth)
-			continue;
+	homa_grant_lock(grant);
+	if (atomic_read(&grant->nonfifo_left) > 0 || grant->grant_nonfifo == 0) {
+		/* Someone else issued the FIFO grant while we were waiting
+		 * for the lock.
+		 */
+		homa_grant_unlock(grant);
+		return;
+	}
+	atomic_add(grant->grant_nonfifo, &grant->nonfifo_left);
+	rpc = homa_grant_find_oldest(grant);
+	if (rpc)
+		homa_rpc_hold(rpc);
+	homa_grant_unlock(grant);
+	if (!rpc)
+		return;
 
-		received = (rpc->msgin.length
-				- rpc->msgin.bytes_remaining);
-		on_the_way = rpc->msgin.granted - received;
-		if (on_the_way > homa->unsched_bytes) {
-			/* The last "pity" grant hasn't been used
-			 * up yet.
-			 */
-			continue;
-		}
-		oldest = rpc;
-		oldest_birth = rpc->msgin.birth;
+	homa_rpc_lock(rpc);
+	if (rpc->state == RPC_DEAD || rpc->msgin.granted >= rpc->msgin.length) {
+		homa_rpc_unlock(rpc);
+		homa_rpc_put(rpc);
+		return;
 	}
-	if (!oldest)
-		return NULL;
+	received = rpc->msgin.length - rpc->msgin.bytes_remaining;
 	INC_METRIC(fifo_grants, 1);
-	if ((oldest->msgin.length - oldest->msgin.bytes_remaining)
-			== oldest->msgin.granted)
+	if (received >= rpc->msgin.granted)
 		INC_METRIC(fifo_grants_no_incoming, 1);
-
-	oldest->silent_ticks = 0;
-	granted = homa->fifo_grant_increment;
-	oldest->msgin.granted += granted;
-	if (oldest->msgin.granted >= oldest->msgin.length) {
-		granted -= oldest->msgin.granted - oldest->msgin.length;
-		oldest->msgin.granted = oldest->msgin.length;
-		// homa_remove_grantable_locked(homa, oldest);
-	}
-
-	/* Try to update homa->total_incoming; if we can't lock
-	 * the RPC, just skip it (waiting could deadlock), and it
-	 * will eventually get updated elsewhere.
-	 */
-	if (homa_rpc_try_lock(oldest)) {
-		homa_grant_update_incoming(oldest, homa);
-		homa_rpc_unlock(oldest);
-	}
-
-	if (oldest->msgin.granted < (oldest->msgin.length
-				- oldest->msgin.bytes_remaining)) {
-		/* We've already received all of the bytes in the new
-		 * grant; most likely this means that the sender sent extra
-		 * data after the last fifo grant (e.g. by rounding up to a
-		 * TSO packet). Don't send this grant.
-		 */
-		return NULL;
-	}
-	return oldest;
+	rpc->msgin.granted += grant->fifo_grant_increment;
+	if (rpc->msgin.granted > rpc->msgin.length)
+		rpc->msgin.granted = rpc->msgin.length;
+	homa_grant_update_incoming(rpc, grant);
+	homa_grant_cand_init(&cand);
+	if (rpc->msgin.granted >= rpc->msgin.length)
+		homa_grant_unmanage_rpc(rpc, &cand);
+	homa_rpc_unlock(rpc);
+	tt_record2("sending FIFO grant for id %d, offset %d", rpc->id,
+		   rpc->msgin.granted);
+	homa_grant_send(rpc, rpc->hsk->homa->max_sched_prio);
+	if (!homa_grant_cand_empty(&cand))
+		homa_grant_cand_check(&cand, grant);
+	homa_rpc_put(rpc);
 }
-#endif
-#endif /* See strip.py */
 
 /**
  * homa_grant_cand_add() - Add an RPC into the struct, if there is
@@ -1063,6 +1286,7 @@ void homa_grant_update_sysctl_deps(struct homa_grant *grant)
 		tmp = (1000 * grant->fifo_grant_increment) / tmp -
 				grant->fifo_grant_increment;
 	grant->grant_nonfifo = tmp;
+	atomic_set(&grant->nonfifo_left, grant->grant_nonfifo);
 
 	grant->recalc_cycles = homa_usecs_to_cycles(grant->recalc_usecs);
 
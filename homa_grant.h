@@ -14,6 +14,13 @@
  */
 #define HOMA_MAX_GRANTS 10
 
+/**
+ * define HOMA_GRANT_SHARE_SCAN - Maximum number of entries in
+ * grantable_peers that homa_grant_pick_grantable will examine when looking
+ * for an RPC whose socket hasn't received its share of active_rpcs.
+ */
+#define HOMA_GRANT_SHARE_SCAN 32
+
 /**
  * struct homa_grant - Holds information used to manage the sending of
  * grants for incoming messages. There is one instance of this object
@@ -93,6 +100,14 @@ struct homa_grant {
 	 */
 	u64 last_grantable_change;
 
+	/**
+	 * @grantable_weight: Sum of the grant_weight values of all the
+	 * sockets that currently have RPCs needing grants (i.e., sockets
+	 * with nonzero num_grantable_rpcs). Used to compute each socket's
+	 * share of @active_rpcs (see homa_grant_share).
+	 */
+	int grantable_weight;
+
 	/**
 	 * @max_grantable_rpcs: The largest value that has been seen for
 	 * num_grantable_rpcs since this value was reset to 0 (it can be
@@ -168,19 +183,21 @@ struct homa_grant {
 	int grant_nonfifo;
 
 	/**
-	 * @grant_nonfifo_left: Counts down bytes granted using the normal
+	 * @nonfifo_left: Counts down bytes granted using the normal
 	 * priority mechanism. When this reaches zero, it's time to grant
-	 * to the oldest message.
+	 * to the oldest message. Decremented without holding the grant
+	 * lock; only reset while holding it.
 	 */
-	int grant_nonfifo_left;
+	atomic_t nonfifo_left;
 
 	/**
-	 * @oldest_rpc: The RPC with incoming data whose start_cycles is
-	 * farthest in the past). NULL means either there are no incoming
-	 * RPCs or the oldest needs to be recomputed. Must hold grant_lock
-	 * to update.
+	 * @fifo_rpcs: Contains all of the RPCs in @active_rpcs and
+	 * @grantable_peers (linked through their fifo_links), sorted by
+	 * msgin.birth (oldest first). New RPCs are always appended, so the
+	 * list stays sorted without any searching; this allows the oldest
+	 * RPC to be found in constant time for FIFO grants.
 	 */
-	struct homa_rpc *oldest_rpc;
+	struct list_head fifo_rpcs;
 
 #ifndef __STRIP__ /* See strip.py */
 	/**
@@ -234,7 +251,10 @@ void     homa_grant_check_rpc(struct homa_rpc *rpc);
 int      homa_grant_dointvec(const struct ctl_table *table, int write,
 			     void *buffer, size_t *lenp, loff_t *ppos);
 void     homa_grant_end_rpc(struct homa_rpc *rpc);
-void     homa_grant_find_oldest(struct homa *homa);
+void     homa_grant_check_fifo(struct homa_grant *grant);
+int      homa_grant_find_victim(struct homa_grant *grant);
+struct homa_rpc
+	*homa_grant_find_oldest(struct homa_grant *grant);
 int      homa_grant_fix_order(struct homa_grant *grant);
 void     homa_grant_free(struct homa_grant *grant);
 void     homa_grant_init_rpc(struct homa_rpc *rpc, int unsched);
@@ -246,12 +266,16 @@ void     homa_grant_lock_slow(struct homa_grant *grant);
 void     homa_grant_log_tt(struct homa *homa);
 int      homa_grant_outranks(struct homa_rpc *rpc1,
 			     struct homa_rpc *rpc2);
+struct homa_rpc
+	*homa_grant_pick_grantable(struct homa_grant *grant, bool strict);
 void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 int      homa_grant_priority(struct homa *homa, int rank);
 void     homa_grant_remove_active(struct homa_rpc *rpc,
 				  struct homa_grant_candidates *cand);
 void     homa_grant_remove_grantable(struct homa_rpc *rpc);
 void     homa_grant_send(struct homa_rpc *rpc, int priority);
+void     homa_grant_set_weight(struct homa_sock *hsk, int weight);
+int      homa_grant_share(struct homa_grant *grant, struct homa_sock *hsk);
 void     homa_grant_unmanage_rpc(struct homa_rpc *rpc,
 				 struct homa_grant_candidates *cand);
 int      homa_grant_update_granted(struct homa_rpc *rpc,
@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* This file implements Homa's network impairment stage, which can drop,
+ * delay, and reorder packets in order to emulate an imperfect network.
+ * All decisions are driven by seeded pseudo-random generators, so
+ * experiments (and unit tests) are repeatable.
+ */
+
+#include "homa_impl.h"
+#include "homa_impair.h"
+
+#ifndef __STRIP__ /* See strip.py */
+/* Used to enable sysctl access to impairment-specific configuration
+ * parameters. The @data fields are actually offsets within a struct
+ * homa_impair; these are converted to pointers into a net-specific
+ * struct homa_impair later.
+ */
+#define OFFSET(field) ((void *)offsetof(struct homa_impair, field))
+static struct ctl_table impair_ctl_table[] = {
+	{
+		.procname	= "impair_burst",
+		.data		= OFFSET(burst),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_delay_usecs",
+		.data		= OFFSET(delay_usecs),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_dirs",
+		.data		= OFFSET(dirs),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_jitter_usecs",
+		.data		= OFFSET(jitter_usecs),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_loss_ppm",
+		.data		= OFFSET(loss_ppm),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_reorder_depth",
+		.data		= OFFSET(reorder_depth),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_reorder_ppm",
+		.data		= OFFSET(reorder_ppm),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+	{
+		.procname	= "impair_seed",
+		.data		= OFFSET(seed),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_impair_dointvec
+	},
+};
+#endif /* See strip.py */
+
+/**
+ * homa_impair_alloc() - Allocate and initialize a new impairment object.
+ * All impairments are initially disabled.
+ * @net:    Network namespace whose packets will pass through the new
+ *          object; its sysctl parameters are registered in this namespace.
+ * Return:  A pointer to the new struct homa_impair, or a negative errno.
+ */
+struct homa_impair *homa_impair_alloc(struct net *net)
+{
+	struct homa_impair *impair;
+	int err;
+
+	impair = kmalloc(sizeof(*impair), GFP_KERNEL | __GFP_ZERO);
+	if (!impair) {
+		pr_err("%s couldn't allocate impair structure\n", __func__);
+		return ERR_PTR(-ENOMEM);
+	}
+	spin_lock_init(&impair->lock);
+	INIT_LIST_HEAD(&impair->held);
+	INIT_LIST_HEAD(&impair->reorder);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0)
+	hrtimer_init(&impair->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	impair->timer.function = &homa_impair_timer;
+#else
+	hrtimer_setup(&impair->timer, homa_impair_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_SOFT);
+#endif
+	impair->dirs = HOMA_IMPAIR_RX;
+	impair->seed = 1;
+	impair->burst = 1;
+	impair->reorder_depth = 3;
+
+#ifndef __STRIP__ /* See strip.py */
+	impair->sysctl_header = register_net_sysctl(net, "net/homa",
+						    impair_ctl_table);
+	if (!impair->sysctl_header) {
+		err = -ENOMEM;
+		pr_err("couldn't register sysctl parameters for Homa impairments\n");
+		goto error;
+	}
+#endif /* See strip.py */
+	homa_impair_update_sysctl_deps(impair);
+	return impair;
+
+error:
+	homa_impair_free(impair);
+	return ERR_PTR(err);
+}
+
+/**
+ * homa_impair_free() - Cleanup and free an impairment object. Any packets
+ * still being held are discarded.
+ * @impair:   Object to free; caller must not reference the object
+ *            again once this function returns.
+ */
+void homa_impair_free(struct homa_impair *impair)
+{
+	struct homa_impair_pkt *pkt, *tmp;
+
+	hrtimer_cancel(&impair->timer);
+#ifndef __STRIP__ /* See strip.py */
+	if (impair->sysctl_header) {
+		unregister_net_sysctl_table(impair->sysctl_header);
+		impair->sysctl_header = NULL;
+	}
+#endif /* See strip.py */
+	list_splice_tail_init(&impair->reorder, &impair->held);
+	list_for_each_entry_safe(pkt, tmp, &impair->held, links) {
+		kfree_skb(pkt->skb);
+		kfree(pkt);
+	}
+	kfree(impair);
+}
+
+/**
+ * homa_impair_rand() - Return the next value from a pseudo-random
+ * generator (xorshift64*).
+ * @state:   State of the generator; must not be zero. Updated.
+ * Return:   The next value in the sequence.
+ */
+u32 homa_impair_rand(u64 *state)
+{
+	u64 x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/**
+ * homa_impair_lose() - Decide whether the next packet in one direction
+ * should be dropped. Always consumes exactly one pseudo-random value, so
+ * that later decisions don't depend on the outcome. The caller must hold
+ * @impair->lock.
+ * @impair:      Impairment configuration.
+ * @rand:        Pseudo-random generator for the packet's direction.
+ * @burst_left:  Remaining drops in the current burst for the packet's
+ *               direction. Updated.
+ * Return:       True means the packet should be dropped.
+ */
+static bool homa_impair_lose(struct homa_impair *impair, u64 *rand,
+			     int *burst_left)
+{
+	u32 r = homa_impair_rand(rand);
+
+	if (*burst_left > 0) {
+		(*burst_left)--;
+		return true;
+	}
+	if (r % 1000000 < impair->loss_ppm) {
+		*burst_left = impair->burst - 1;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * homa_impair_arm() - Make sure that @impair->timer will fire when the
+ * next held packet becomes eligible for release by time. The caller must
+ * hold @impair->lock.
+ * @impair:   Impairment configuration and state.
+ * @now:      Current homa_clock() time.
+ */
+static void homa_impair_arm(struct homa_impair *impair, u64 now)
+{
+	struct homa_impair_pkt *pkt;
+	u64 next = 0;
+
+	pkt = list_first_entry_or_null(&impair->held, struct homa_impair_pkt,
+				       links);
+	if (pkt)
+		next = pkt->release_time;
+	pkt = list_first_entry_or_null(&impair->reorder,
+				       struct homa_impair_pkt, links);
+	if (pkt && (next == 0 || pkt->expire_time < next))
+		next = pkt->expire_time;
+	if (next == 0 || next == impair->timer_time)
+		return;
+	impair->timer_time = next;
+	hrtimer_start(&impair->timer,
+		      ns_to_ktime(next > now ? div_u64((next - now) * 1000000,
+						       homa_clock_khz()) : 0),
+		      HRTIMER_MODE_REL_SOFT);
+}
+
+/**
+ * homa_impair_hold_reorder() - Add a packet whose delay has elapsed to
+ * @impair->reorder, where it waits for later packets to pass it. The
+ * caller must hold @impair->lock.
+ * @impair:   Impairment configuration and state.
+ * @pkt:      Packet to add; must not currently be linked into a list.
+ * @now:      Current homa_clock() time.
+ */
+static void homa_impair_hold_reorder(struct homa_impair *impair,
+				     struct homa_impair_pkt *pkt, u64 now)
+{
+	pkt->release_count = impair->rx_count + impair->reorder_depth;
+	pkt->expire_time = now + impair->reorder_cycles;
+	list_add_tail(&pkt->links, &impair->reorder);
+}
+
+/**
+ * homa_impair_rx_pkt() - Slow path for homa_impair_rx: decides whether an
+ * incoming packet should be dropped, delayed, or held back for reordering.
+ * @impair:   Impairment configuration and state.
+ * @skb:      Incoming packet; skb->data must refer to the Homa header.
+ * Return:    True means the impairment stage has taken ownership of @skb;
+ *            false means the caller should process it normally.
+ */
+bool homa_impair_rx_pkt(struct homa_impair *impair, struct sk_buff *skb)
+{
+	struct homa_impair_pkt *pkt, *prev;
+	u32 r_delay, r_reorder;
+	u64 delay, now;
+	bool reorder;
+
+	spin_lock_bh(&impair->lock);
+	if (homa_impair_lose(impair, &impair->rx_rand,
+			     &impair->rx_burst_left)) {
+		spin_unlock_bh(&impair->lock);
+		tt_record("homa_impair_rx dropping packet");
+		INC_METRIC(impair_drops, 1);
+		kfree_skb(skb);
+		return true;
+	}
+	r_delay = homa_impair_rand(&impair->rx_rand);
+	r_reorder = homa_impair_rand(&impair->rx_rand);
+	delay = impair->delay_cycles;
+	if (impair->jitter_cycles)
+		delay += r_delay % impair->jitter_cycles;
+	reorder = r_reorder % 1000000 < impair->reorder_ppm;
+	if ((delay == 0 && !reorder) ||
+	    impair->num_held >= HOMA_IMPAIR_MAX_HELD)
+		goto pass;
+	pkt = kmalloc(sizeof(*pkt), GFP_ATOMIC);
+	if (!pkt)
+		goto pass;
+	now = homa_clock();
+	pkt->skb = skb;
+	pkt->release_time = now + delay;
+	pkt->reorder = reorder;
+	if (delay == 0) {
+		homa_impair_hold_reorder(impair, pkt, now);
+	} else {
+		/* Keep @held sorted by release_time. Without jitter every
+		 * new packet goes at the tail; with jitter the scan only
+		 * covers packets that arrived within the jitter window.
+		 */
+		list_for_each_entry_reverse(prev, &impair->held, links) {
+			if (prev->release_time <= pkt->release_time)
+				break;
+		}
+		list_add(&pkt->links, &prev->links);
+	}
+	impair->num_held++;
+	homa_impair_arm(impair, now);
+	spin_unlock_bh(&impair->lock);
+	INC_METRIC(impair_holds, 1);
+	return true;
+
+pass:
+	impair->rx_count++;
+	spin_unlock_bh(&impair->lock);
+	return false;
+}
+
+/**
+ * homa_impair_tx_pkt() - Slow path for homa_impair_tx: decides whether an
+ * outgoing packet should be dropped.
+ * @impair:   Impairment configuration and state.
+ * Return:    True means the packet should be discarded.
+ */
+bool homa_impair_tx_pkt(struct homa_impair *impair)
+{
+	bool drop;
+
+	spin_lock_bh(&impair->lock);
+	drop = homa_impair_lose(impair, &impair->tx_rand,
+				&impair->tx_burst_left);
+	spin_unlock_bh(&impair->lock);
+	if (drop) {
+		tt_record("homa_impair_tx dropping packet");
+		INC_METRIC(impair_drops, 1);
+	}
+	return drop;
+}
+
+/**
+ * homa_impair_release() - Pass on (to homa_dispatch_pkts) any held
+ * packets that are now eligible for release. Invoked at the end of each
+ * call to homa_softirq (packets passed on there may release packets held
+ * for reordering) and by @impair->timer (so held packets get released
+ * on time even if no more packets arrive). Only the heads of @impair->held
+ * and @impair->reorder are examined, so the cost is proportional to the
+ * number of packets released.
+ * @impair:   Impairment configuration and state.
+ */
+void homa_impair_release(struct homa_impair *impair)
+{
+	struct homa_impair_pkt *pkt, *tmp;
+	LIST_HEAD(ready);
+	u64 now;
+
+	if (READ_ONCE(impair->num_held) == 0)
+		return;
+	spin_lock_bh(&impair->lock);
+	now = homa_clock();
+	while (1) {
+		pkt = list_first_entry_or_null(&impair->held,
+					       struct homa_impair_pkt, links);
+		if (!pkt || now < pkt->release_time)
+			break;
+		list_del(&pkt->links);
+		if (pkt->reorder) {
+			homa_impair_hold_reorder(impair, pkt, now);
+			continue;
+		}
+		list_add_tail(&pkt->links, &ready);
+		impair->num_held--;
+		impair->rx_count++;
+	}
+	while (1) {
+		pkt = list_first_entry_or_null(&impair->reorder,
+					       struct homa_impair_pkt, links);
+		if (!pkt || (now < pkt->expire_time &&
+			     impair->rx_count < pkt->release_count))
+			break;
+		list_move_tail(&pkt->links, &ready);
+		impair->num_held--;
+	}
+	homa_impair_arm(impair, now);
+	spin_unlock_bh(&impair->lock);
+
+	local_bh_disable();
+	list_for_each_entry_safe(pkt, tmp, &ready, links) {
+		struct sk_buff *skb = pkt->skb;
+
+		kfree(pkt);
+		skb->next = NULL;
+		homa_dispatch_pkts(skb);
+	}
+	local_bh_enable();
+}
+
+/**
+ * homa_impair_timer() - Invoked by the hrtimer mechanism when the next
+ * held packet becomes eligible for release.
+ * @timer:   The @timer field of a struct homa_impair.
+ * Return:   Always HRTIMER_NORESTART (homa_impair_release rearms the
+ *           timer if more packets are held).
+ */
+enum hrtimer_restart homa_impair_timer(struct hrtimer *timer)
+{
+	struct homa_impair *impair = container_of(timer, struct homa_impair,
+						  timer);
+
+	spin_lock_bh(&impair->lock);
+	impair->timer_time = 0;
+	spin_unlock_bh(&impair->lock);
+	homa_impair_release(impair);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * homa_impair_update_sysctl_deps() - Invoked whenever an impairment
+ * parameter is modified; recomputes dependent values and restarts the
+ * pseudo-random sequences from @impair->seed.
+ * @impair:   Object to update.
+ */
+void homa_impair_update_sysctl_deps(struct homa_impair *impair)
+{
+	bool rx, tx;
+
+	if (impair->burst < 1)
+		impair->burst = 1;
+	if (impair->reorder_depth < 1)
+		impair->reorder_depth = 1;
+	impair->delay_cycles = homa_usecs_to_cycles(impair->delay_usecs);
+	impair->jitter_cycles = homa_usecs_to_cycles(impair->jitter_usecs);
+	impair->reorder_cycles =
+			homa_usecs_to_cycles(HOMA_IMPAIR_REORDER_USECS);
+
+	spin_lock_bh(&impair->lock);
+	impair->rx_rand = (u32)impair->seed ? (u32)impair->seed : 1;
+	impair->tx_rand = impair->rx_rand ^ 0x9e3779b97f4a7c15ULL;
+	impair->rx_burst_left = 0;
+	impair->tx_burst_left = 0;
+	spin_unlock_bh(&impair->lock);
+
+	rx = (impair->dirs & HOMA_IMPAIR_RX) &&
+	     (impair->loss_ppm > 0 || impair->delay_usecs > 0 ||
+	      impair->jitter_usecs > 0 || impair->reorder_ppm > 0);
+	tx = (impair->dirs & HOMA_IMPAIR_TX) && impair->loss_ppm > 0;
+	WRITE_ONCE(impair->rx_active, rx);
+	WRITE_ONCE(impair->tx_active, tx);
+}
+
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_impair_dointvec() - This function is a wrapper around proc_dointvec.
+ * It is invoked to read and write impairment-related sysctl values.
+ * @table:    sysctl table describing value to be read or written.
+ * @write:    Nonzero means value is being written, 0 means read.
+ * @buffer:   Address in user space of the input/output data.
+ * @lenp:     Not exactly sure.
+ * @ppos:     Not exactly sure.
+ *
+ * Return: 0 for success, nonzero for error.
+ */
+int homa_impair_dointvec(const struct ctl_table *table, int write,
+			 void *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct homa_impair *impair;
+	struct ctl_table table_copy;
+	int result;
+
+	impair = homa_net_from_net(current->nsproxy->net_ns)->impair;
+
+	/* Generate a new ctl_table that refers to a field in the
+	 * net-specific struct homa_impair.
+	 */
+	table_copy = *table;
+	table_copy.data = ((char *)impair) + (uintptr_t)table_copy.data;
+
+	result = proc_dointvec(&table_copy, write, buffer, lenp, ppos);
+	if (write)
+		homa_impair_update_sysctl_deps(impair);
+	return result;
+}
+#endif /* See strip.py */
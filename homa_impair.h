@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* This file defines structs and functions for Homa's network impairment
+ * stage, which emulates packet loss, delay, and reordering in a
+ * repeatable fashion for performance experiments and testing.
+ */
+
+#ifndef _HOMA_IMPAIR_H
+#define _HOMA_IMPAIR_H
+
+#include "homa_impl.h"
+
+/**
+ * define HOMA_IMPAIR_RX - Bit in @homa_impair.dirs that enables
+ * impairments for incoming packets.
+ */
+#define HOMA_IMPAIR_RX 1
+
+/**
+ * define HOMA_IMPAIR_TX - Bit in @homa_impair.dirs that enables
+ * impairments (loss only) for outgoing packets.
+ */
+#define HOMA_IMPAIR_TX 2
+
+/**
+ * define HOMA_IMPAIR_MAX_HELD - Maximum number of incoming packets that
+ * can be held for delay or reordering at once; once this limit is reached,
+ * additional packets are not delayed or reordered (they can still be
+ * dropped).
+ */
+#define HOMA_IMPAIR_MAX_HELD 10000
+
+/**
+ * define HOMA_IMPAIR_REORDER_USECS - A packet held back for reordering
+ * is released after this many microseconds even if @homa_impair.reorder_depth
+ * later packets haven't arrived (e.g. it was the last packet of a message).
+ */
+#define HOMA_IMPAIR_REORDER_USECS 1000
+
+/**
+ * struct homa_impair_pkt - Describes an incoming packet that is being held
+ * by the impairment stage.
+ */
+struct homa_impair_pkt {
+	/**
+	 * @links: For linking into @homa_impair.held or
+	 * @homa_impair.reorder.
+	 */
+	struct list_head links;
+
+	/** @skb: The held packet. */
+	struct sk_buff *skb;
+
+	/**
+	 * @release_time: homa_clock() time before which the packet must
+	 * not be released.
+	 */
+	u64 release_time;
+
+	/**
+	 * @reorder: True means the packet is being held back for reordering:
+	 * once @release_time is reached it moves to @homa_impair.reorder
+	 * instead of being released.
+	 */
+	bool reorder;
+
+	/**
+	 * @release_count: Used only in @homa_impair.reorder: the packet must
+	 * not be released until @homa_impair.rx_count reaches this value
+	 * (unless @expire_time is reached first).
+	 */
+	u64 release_count;
+
+	/**
+	 * @expire_time: Used only in @homa_impair.reorder: homa_clock() time
+	 * at which the packet is released regardless of @release_count.
+	 */
+	u64 expire_time;
+};
+
+/**
+ * struct homa_impair - Configuration and state for the impairment stage.
+ * There is one instance of this object stored in each struct homa_net.
+ * Decisions are made with a pseudo-random generator that is reset from
+ * @seed whenever a parameter is written, with separate streams for the
+ * receive and transmit directions, so a given sequence of packets always
+ * experiences the same loss pattern.
+ */
+struct homa_impair {
+	/**
+	 * @lock: Used to synchronize access to all of the state fields
+	 * below (but not the configuration parameters).
+	 */
+	spinlock_t lock;
+
+	/**
+	 * @dirs: OR-ed combination of HOMA_IMPAIR_RX and HOMA_IMPAIR_TX;
+	 * selects which directions are impaired. Set externally via sysctl.
+	 */
+	int dirs;
+
+	/**
+	 * @seed: Seed for the pseudo-random generators. Set externally
+	 * via sysctl.
+	 */
+	int seed;
+
+	/**
+	 * @loss_ppm: Probability (in parts per million) that a packet
+	 * starts a loss burst. Set externally via sysctl.
+	 */
+	int loss_ppm;
+
+	/**
+	 * @burst: Number of consecutive packets dropped in each loss burst.
+	 * Set externally via sysctl.
+	 */
+	int burst;
+
+	/**
+	 * @delay_usecs: Fixed delay added to every incoming packet. Set
+	 * externally via sysctl.
+	 */
+	int delay_usecs;
+
+	/**
+	 * @jitter_usecs: Each incoming packet is delayed by an additional
+	 * amount chosen uniformly from [0, @jitter_usecs). Set externally
+	 * via sysctl.
+	 */
+	int jitter_usecs;
+
+	/**
+	 * @reorder_ppm: Probability (in parts per million) that an incoming
+	 * packet is held back for reordering. Set externally via sysctl.
+	 */
+	int reorder_ppm;
+
+	/**
+	 * @reorder_depth: A packet held back for reordering is released
+	 * once this many later packets have been passed on. Set externally
+	 * via sysctl.
+	 */
+	int reorder_depth;
+
+	/** @delay_cycles: Same as @delay_usecs, in homa_clock() units. */
+	u64 delay_cycles;
+
+	/** @jitter_cycles: Same as @jitter_usecs, in homa_clock() units. */
+	u64 jitter_cycles;
+
+	/**
+	 * @reorder_cycles: Same as HOMA_IMPAIR_REORDER_USECS, in
+	 * homa_clock() units.
+	 */
+	u64 reorder_cycles;
+
+	/**
+	 * @rx_active: True means incoming packets must pass through
+	 * homa_impair_rx. Computed from the configuration parameters.
+	 */
+	bool rx_active;
+
+	/**
+	 * @tx_active: True means outgoing packets must pass through
+	 * homa_impair_tx. Computed from the configuration parameters.
+	 */
+	bool tx_active;
+
+	/** @rx_rand: State of the pseudo-random generator for input. */
+	u64 rx_rand;
+
+	/** @tx_rand: State of the pseudo-random generator for output. */
+	u64 tx_rand;
+
+	/**
+	 * @rx_burst_left: Number of additional incoming packets to drop
+	 * in the current loss burst.
+	 */
+	int rx_burst_left;
+
+	/**
+	 * @tx_burst_left: Number of additional outgoing packets to drop
+	 * in the current loss burst.
+	 */
+	int tx_burst_left;
+
+	/**
+	 * @rx_count: Number of incoming packets that have been passed
+	 * on, either immediately by homa_impair_rx or after a delay by
+	 * homa_impair_release (packets held back for reordering aren't
+	 * counted).
+	 */
+	u64 rx_count;
+
+	/** @num_held: Number of entries in @held and @reorder combined. */
+	int num_held;
+
+	/**
+	 * @held: struct homa_impair_pkts for incoming packets whose
+	 * release_time hasn't been reached yet, sorted in increasing order
+	 * of release_time.
+	 */
+	struct list_head held;
+
+	/**
+	 * @reorder: struct homa_impair_pkts for packets held back for
+	 * reordering whose release_time has passed; they are waiting for
+	 * later packets to be passed on. Packets are added at the tail, so
+	 * both release_count and expire_time increase along the list.
+	 */
+	struct list_head reorder;
+
+	/**
+	 * @timer: Used to release held packets when their time comes, even
+	 * if no more packets arrive.
+	 */
+	struct hrtimer timer;
+
+	/**
+	 * @timer_time: homa_clock() time for which @timer is currently
+	 * armed, or 0 if it isn't armed.
+	 */
+	u64 timer_time;
+
+#ifndef __STRIP__ /* See strip.py */
+	/**
+	 * @sysctl_header: Used to remove sysctl values when this structure
+	 * is destroyed.
+	 */
+	struct ctl_table_header *sysctl_header;
+#endif /* See strip.py */
+};
+
+struct homa_impair
+	*homa_impair_alloc(struct net *net);
+int      homa_impair_dointvec(const struct ctl_table *table, int write,
+			      void *buffer, size_t *lenp, loff_t *ppos);
+void     homa_impair_free(struct homa_impair *impair);
+u32      homa_impair_rand(u64 *state);
+void     homa_impair_release(struct homa_impair *impair);
+bool     homa_impair_rx_pkt(struct homa_impair *impair, struct sk_buff *skb);
+enum hrtimer_restart
+	 homa_impair_timer(struct hrtimer *timer);
+bool     homa_impair_tx_pkt(struct homa_impair *impair);
+void     homa_impair_update_sysctl_deps(struct homa_impair *impair);
+
+/**
+ * homa_impair_rx() - Pass an incoming packet through the impairment stage.
+ * @impair:   Impairment configuration and state.
+ * @skb:      Incoming packet; skb->data must refer to the Homa header.
+ * Return:    True means the impairment stage has taken ownership of @skb
+ *            (it was dropped or is being held); false means the caller
+ *            should process it normally.
+ */
+static inline bool homa_impair_rx(struct homa_impair *impair,
+				  struct sk_buff *skb)
+{
+	if (likely(!READ_ONCE(impair->rx_active)))
+		return false;
+	return homa_impair_rx_pkt(impair, skb);
+}
+
+/**
+ * homa_impair_tx() - Decide whether an outgoing packet should be dropped
+ * by the impairment stage.
+ * @impair:   Impairment configuration and state.
+ * Return:    True means the caller should discard the packet instead of
+ *            transmitting it.
+ */
+static inline bool homa_impair_tx(struct homa_impair *impair)
+{
+	if (likely(!READ_ONCE(impair->tx_active)))
+		return false;
+	return homa_impair_tx_pkt(impair);
+}
+
+#endif /* _HOMA_IMPAIR_H */
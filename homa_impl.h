@@ -30,13 +30,17 @@
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/completion.h>
+#include <linux/hash.h>
 #include <linux/proc_fs.h>
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
+#include <linux/udp.h>
 #include <linux/vmalloc.h>
 #include <net/icmp.h>
 #include <net/ip.h>
+#include <net/ip6_checksum.h>
 #include <net/netns/generic.h>
 #include <net/protocol.h>
 #include <net/inet_common.h>
@@ -101,6 +105,46 @@ union sockaddr_in_union {
 	struct sockaddr_in6 in6;
 };
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * define HOMA_PRIO_HIST_BUCKETS - Number of buckets in the histogram of
+ * incoming unscheduled bytes used by homa_prio_adapt; bucket i holds bytes
+ * from messages whose length is in [2^i, 2^(i+1)). Must be large enough
+ * to cover HOMA_MAX_MESSAGE_LENGTH.
+ */
+#define HOMA_PRIO_HIST_BUCKETS 20
+
+/**
+ * define HOMA_PRIO_ADAPT_MIN_BYTES - homa_prio_adapt won't consider
+ * moving the priority boundary until at least this many bytes of incoming
+ * messages have been observed since the last evaluation.
+ */
+#define HOMA_PRIO_ADAPT_MIN_BYTES 1000000
+
+/**
+ * define HOMA_PRIO_ADAPT_HYSTERESIS - How far (in thousandths of a
+ * priority level) the ideal number of unscheduled levels must move past
+ * the midpoint between levels before homa_prio_adapt moves the boundary.
+ */
+#define HOMA_PRIO_ADAPT_HYSTERESIS 250
+
+/**
+ * struct homa_prio_counts - Incoming traffic recorded on one core by
+ * homa_prio_count_msg, for use by homa_prio_adapt. The counts only ever
+ * increase; homa_prio_adapt remembers how much it has already consumed.
+ */
+struct homa_prio_counts {
+	/**
+	 * @unsched_hist: Unscheduled bytes in incoming messages, bucketed
+	 * by message length (see HOMA_PRIO_HIST_BUCKETS).
+	 */
+	u64 unsched_hist[HOMA_PRIO_HIST_BUCKETS];
+
+	/** @sched_bytes: Scheduled bytes in incoming messages. */
+	u64 sched_bytes;
+};
+#endif /* See strip.py */
+
 /**
  * struct homa - Stores overall information about the Homa transport, which
  * is shared across all Homa sockets and all network namespaces.
@@ -190,6 +234,59 @@ struct homa {
 	 */
 	int skb_page_pool_min_kb;
 
+	/**
+	 * @skb_page_reserve_ms: Each sk_buff page pool tries to keep enough
+	 * free pages to satisfy this many milliseconds of its recent demand
+	 * (pages are allocated in the background to maintain this reserve).
+	 * Set externally via sysctl.
+	 */
+	int skb_page_reserve_ms;
+
+	/**
+	 * @skb_page_pressure_time: homa_clock() time until which background
+	 * refilling of sk_buff page pools is suspended, because the kernel
+	 * recently asked Homa to release memory.
+	 */
+	u64 skb_page_pressure_time;
+
+	/**
+	 * @skb_refill_needed: True means that at least one sk_buff page
+	 * pool has fallen below its target, so @skb_refill_kthread should
+	 * allocate more pages.
+	 */
+	bool skb_refill_needed;
+
+	/**
+	 * @skb_refill_exit: True means that @skb_refill_kthread should exit
+	 * as soon as possible.
+	 */
+	bool skb_refill_exit;
+
+	/**
+	 * @skb_refill_wait_queue: Used to block @skb_refill_kthread when
+	 * no page pool needs refilling.
+	 */
+	struct wait_queue_head skb_refill_wait_queue;
+
+	/**
+	 * @skb_refill_kthread: Kernel thread that refills the sk_buff page
+	 * pools. High-order allocations can block for a long time in direct
+	 * reclaim, so they are done here rather than in the timer thread.
+	 * NULL if the thread isn't running.
+	 */
+	struct task_struct *skb_refill_kthread;
+
+	/**
+	 * @skb_refill_done: Used to wait for @skb_refill_kthread to exit.
+	 */
+	struct completion skb_refill_done;
+
+	/**
+	 * @skb_page_shrinker: Allows the kernel to reclaim free pages from
+	 * the sk_buff page pools when memory is low. NULL if not registered.
+	 */
+	struct shrinker *skb_page_shrinker;
+
 	/**
 	 * @unsched_bytes: The number of bytes that may be sent in a
 	 * new message without receiving any grants. There used to be a
@@ -255,6 +352,28 @@ struct homa {
 	 * next version change.  Can be set externally via sysctl.
 	 */
 	int cutoff_version;
+
+	/**
+	 * @prio_adapt_ticks: If nonzero, homa_prio_adapt is invoked every
+	 * this many timer ticks to move the boundary between unscheduled and
+	 * scheduled priority levels (and recompute @unsched_cutoffs) based on
+	 * the mix of incoming traffic. This overrides values of
+	 * @unsched_cutoffs set via sysctl. Set externally via sysctl.
+	 */
+	int prio_adapt_ticks;
+
+	/**
+	 * @prio_counts: Per-core counts of incoming traffic; only
+	 * maintained if @prio_adapt_ticks is nonzero. Each core updates
+	 * only its own counts, so no atomic operations are needed.
+	 */
+	struct homa_prio_counts __percpu *prio_counts;
+
+	/**
+	 * @prio_consumed: Sum over all cores of @prio_counts as of the last
+	 * boundary evaluation. Accessed only by homa_prio_adapt.
+	 */
+	struct homa_prio_counts prio_consumed;
 #endif /* See strip.py */
 
 	/**
@@ -303,6 +422,15 @@ struct homa {
 	 */
 	int dead_buffs_limit;
 
+	/**
+	 * @teardown_rpcs: If a socket has at least this many RPCs when it
+	 * is shut down, the RPCs are ended and reaped in the background by
+	 * homa_timer (see homa_socktab_reap_dying) rather than by the thread
+	 * shutting down the socket. 0 means always tear down synchronously.
+	 * Set externally via sysctl.
+	 */
+	int teardown_rpcs;
+
 	/**
 	 * @max_dead_buffs: The largest aggregate number of packet buffers
 	 * in dead (but not yet reaped) RPCs that has existed so far in a
@@ -347,6 +475,38 @@ struct homa {
 	 */
 	int hijack_tcp;
 
+	/**
+	 * @udp_encap_port: Nonzero means encapsulate outgoing Homa packets
+	 * in UDP packets with this destination port, so that NICs can use
+	 * UDP segmentation offload and UDP GRO; overrides @hijack_tcp. Only
+	 * affects sockets created after it is set. Incoming packets are
+	 * received through UDP tunnel sockets bound to this port in every
+	 * network namespace (see homa_udp_tunnel_update_all). Set externally
+	 * via sysctl (0-65535).
+	 */
+	int udp_encap_port;
+
+	/**
+	 * @flow_chunk_bytes: If nonzero, outgoing messages are divided into
+	 * chunks of this many bytes and each chunk after the first is sent
+	 * with its own flow entropy (the UDP source port if packets are
+	 * encapsulated in UDP, and the IPv6 flow label), so that NIC RSS and
+	 * ECMP spread large messages across queues and paths. The first chunk
+	 * of each message (hence all of a small message) uses the socket's
+	 * normal flow. Set externally via sysctl.
+	 */
+	int flow_chunk_bytes;
+
+	/**
+	 * @flow_spray: Nonzero means spray the scheduled part of each
+	 * outgoing message across network paths: every chunk of
+	 * @flow_chunk_bytes (or every packet, if @flow_chunk_bytes is 0)
+	 * past the unscheduled bytes gets its own flow entropy. Receivers
+	 * should set @reorder_usecs so that the resulting reordering doesn't
+	 * trigger spurious RESENDs. Set externally via sysctl.
+	 */
+	int flow_spray;
+
 	/**
 	 * @max_gro_skbs: Maximum number of socket buffers that can be
 	 * aggregated by the GRO mechanism.  Set externally via sysctl.
@@ -417,6 +577,20 @@ struct homa {
 	 * @gro_busy_cycles: Same as busy_usecs except in homa_clock() units.
 	 */
 	int gro_busy_cycles;
+
+	/**
+	 * @reorder_usecs: A gap in an incoming message is assumed to be
+	 * caused by reordering (e.g. from packet spraying, see @flow_spray),
+	 * not loss, until it is this old; RESENDs are not requested for
+	 * younger gaps. Set externally via sysctl.
+	 */
+	int reorder_usecs;
+
+	/**
+	 * @reorder_cycles: Same as @reorder_usecs except in homa_clock()
+	 * units.
+	 */
+	int reorder_cycles;
 #endif /* See strip.py */
 
 	/**
@@ -518,6 +692,36 @@ struct homa_net {
 	 * for this namespace. Managed by homa_peer.c under the peertab lock.
 	 */
 	int num_peers;
+
+#ifndef __STRIP__ /* See strip.py */
+	/**
+	 * @impair: Configuration and state for the network impairment
+	 * stage for this namespace; managed by homa_impair.c.
+	 */
+	struct homa_impair *impair;
+
+	/**
+	 * @udp_mutex: Serializes opening and closing of @udp4_sock and
+	 * @udp6_sock.
+	 */
+	struct mutex udp_mutex;
+
+	/**
+	 * @udp4_sock: UDP tunnel socket that receives IPv4 Homa-over-UDP
+	 * packets for this namespace, or NULL if UDP encapsulation is
+	 * disabled.
+	 */
+	struct socket *udp4_sock;
+
+	/** @udp6_sock: Same as @udp4_sock, except for IPv6. */
+	struct socket *udp6_sock;
+
+	/**
+	 * @udp_port: Port to which @udp4_sock and @udp6_sock are bound;
+	 * 0 means they are not open.
+	 */
+	int udp_port;
+#endif /* See strip.py */
 };
 
 /**
@@ -760,16 +964,24 @@ void     homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk);
 void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 int      homa_dointvec(const struct ctl_table *table, int write,
 		       void *buffer, size_t *lenp, loff_t *ppos);
+u32      homa_flow_entropy(struct homa_rpc *rpc, int offset);
 void     homa_incoming_sysctl_changed(struct homa *homa);
 int      homa_ioc_abort(struct sock *sk, int *karg);
 int      homa_message_in_init(struct homa_rpc *rpc, int length,
 			      int unsched);
+void     homa_prio_adapt(struct homa *homa);
+void     homa_prio_count_msg(struct homa *homa, int length, int unsched);
 void     homa_prios_changed(struct homa *homa);
 void     homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			  int priority);
 int      homa_sysctl_softirq_cores(const struct ctl_table *table,
 				   int write, void *buffer, size_t *lenp,
 				   loff_t *ppos);
+int      homa_sysctl_udp_encap_port(const struct ctl_table *table,
+				    int write, void *buffer, size_t *lenp,
+				    loff_t *ppos);
+void     homa_udp_encap(struct sk_buff *skb, struct homa_sock *hsk,
+		        struct homa_peer *peer, u32 entropy);
 int      homa_unsched_priority(struct homa *homa, struct homa_peer *peer,
 			       int length);
 void     __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc,
@@ -58,6 +58,8 @@ int homa_message_in_init(struct homa_rpc *rpc, int length)
 	}
 #ifndef __STRIP__ /* See strip.py */
 	homa_grant_init_rpc(rpc, unsched);
+	if (rpc->hsk->homa->prio_adapt_ticks)
+		homa_prio_count_msg(rpc->hsk->homa, length, unsched);
 	if (length < HOMA_NUM_SMALL_COUNTS * 64) {
 		INC_METRIC(small_msg_bytes[(length - 1) >> 6], length);
 	} else if (length < HOMA_NUM_MEDIUM_COUNTS * 1024) {
@@ -105,14 +107,28 @@ void homa_request_retrans(struct homa_rpc *rpc)
 	struct homa_resend_hdr resend;
 	struct homa_gap *gap;
 	int offset, length;
-
 #ifndef __STRIP__ /* See strip.py */
+	u64 now = homa_clock();
+
 	resend.priority = rpc->hsk->homa->num_priorities - 1;
 #endif /* See strip.py */
 
 	if (rpc->msgin.length >= 0) {
 		/* Issue RESENDS for any gaps in incoming data. */
 		list_for_each_entry(gap, &rpc->msgin.gaps, links) {
+#ifndef __STRIP__ /* See strip.py */
+			if (now - gap->time < rpc->hsk->homa->reorder_cycles) {
+				/* The missing data may simply have been
+				 * reordered (e.g. by packet spraying); give
+				 * it more time to arrive.
+				 */
+				tt_record3("Deferring RESEND for id %d, offset %d, length %d",
+					   rpc->id, gap->start,
+					   gap->end - gap->start);
+				INC_METRIC(resends_deferred, 1);
+				continue;
+			}
+#endif /* See strip.py */
 			resend.offset = htonl(gap->start);
 			resend.length = htonl(gap->end - gap->start);
 			tt_record4("Sending RESEND for id %d, peer 0x%x, offset %d, length %d",
@@ -256,6 +272,9 @@ keep:
 #ifndef __STRIP__ /* See strip.py */
 	if (h->retransmit)
 		INC_METRIC(resent_packets_used, 1);
+	else if (end < rpc->msgin.recv_end)
+		/* Packet filled (part of) a gap, so it arrived out of order. */
+		INC_METRIC(reordered_packets, 1);
 #endif /* See strip.py */
 	__skb_queue_tail(&rpc->msgin.packets, skb);
 	rpc->msgin.bytes_remaining -= length;
@@ -1309,6 +1328,7 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 	homa->poll_cycles = homa_usecs_to_cycles(homa->poll_usecs);
 	homa->busy_cycles = homa_usecs_to_cycles(homa->busy_usecs);
 	homa->gro_busy_cycles = homa_usecs_to_cycles(homa->gro_busy_usecs);
+	homa->reorder_cycles = homa_usecs_to_cycles(homa->reorder_usecs);
 	homa->bpage_lease_cycles =
 			homa_usecs_to_cycles(homa->bpage_lease_usecs);
 }
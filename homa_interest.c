@@ -151,31 +151,51 @@ void homa_interest_notify_private(struct homa_rpc *rpc)
  * choose the best one to handle an incoming message.
  * @hsk:         Socket for which message is intended. Must be locked by caller,
  *               and must have at least one queued interest.
- * Return:       The interest to use. This function tries to pick an
- *               interest whose thread is running on a core that isn't
- *               currently busy doing Homa transport work.
+ * Return:       The interest to use. This function prefers interests whose
+ *               threads are running on cores that aren't currently busy
+ *               doing Homa transport work; among those, it picks the one
+ *               closest (in the cache hierarchy) to the current core,
+ *               which is normally the one where the message's packets
+ *               were processed. Ties are broken in favor of the most
+ *               recently registered interest, which is most likely to
+ *               have warm cache state.
  */
 struct homa_interest *homa_choose_interest(struct homa_sock *hsk)
 	__must_hold(&hsk->lock)
 {
 	u64 busy_time = homa_clock() - hsk->homa->busy_cycles;
-	struct homa_interest *interest, *first;
+	struct homa_interest *interest, *first, *best;
+	int core = raw_smp_processor_id();
+	int best_score = INT_MAX;
+	int score;
 
 	first = list_first_entry(&hsk->interests, struct homa_interest,
 				 links);
+	best = first;
 	list_for_each_entry(interest, &hsk->interests, links) {
-		if (per_cpu(homa_offload_core, interest->core).last_active <
-				busy_time) {
-			if (interest != first)
-				INC_METRIC(handoffs_alt_thread, 1);
-			return interest;
+		score = homa_core_distance(core, interest->core);
+
+		/* Idleness trumps locality: the thread on a busy core may
+		 * not run for a long time.
+		 */
+		if (per_cpu(homa_offload_core, interest->core).last_active >=
+		    busy_time)
+			score += HOMA_CORE_DIST_REMOTE + 1;
+		if (score < best_score) {
+			best = interest;
+			best_score = score;
+			if (score <= HOMA_CORE_DIST_SMT)
+				break;
 		}
 	}
 
-	/* All interested threads are on busy cores; return the first,
-	 * which is also the most recent one to be registered, hence
-	 * most likely to have warm cache state.
-	 */
-	return first;
+	if (best != first)
+		INC_METRIC(handoffs_alt_thread, 1);
+	score = homa_core_distance(core, best->core);
+	if (score >= HOMA_CORE_DIST_NODE)
+		INC_METRIC(handoffs_other_llc, 1);
+	if (score == HOMA_CORE_DIST_REMOTE)
+		INC_METRIC(handoffs_other_node, 1);
+	return best;
 }
 #endif /* See strip.py */
@@ -177,6 +177,10 @@ char *homa_metrics_print(void)
 		  m->skb_page_allocs);
 		M("skb_page_alloc_cycles     %15llu  Time spent allocating pages for sk_buff frags\n",
 		  m->skb_page_alloc_cycles);
+		M("skb_page_refills          %15llu  Pages allocated in background to refill page pools\n",
+		  m->skb_page_refills);
+		M("skb_page_shrinks          %15llu  Pages released from page pools by the shrinker\n",
+		  m->skb_page_shrinks);
 		M("requests_received         %15llu  Incoming request messages\n",
 		  m->requests_received);
 		M("responses_received        %15llu  Incoming response messages\n",
@@ -191,6 +195,10 @@ char *homa_metrics_print(void)
 		  m->handoffs_thread_waiting);
 		M("handoffs_alt_thread       %15llu  RPC handoffs not to first on list (avoid busy core)\n",
 		  m->handoffs_alt_thread);
+		M("handoffs_other_llc        %15llu  RPC handoffs to a thread outside the completing core's LLC\n",
+		  m->handoffs_other_llc);
+		M("handoffs_other_node       %15llu  RPC handoffs to a thread on a different NUMA node\n",
+		  m->handoffs_other_node);
 		M("poll_cycles               %15llu  Time spent polling for incoming messages\n",
 		  m->poll_cycles);
 		M("softirq_calls             %15llu  Calls to homa_softirq (i.e. # GRO pkts received)\n",
@@ -207,6 +215,10 @@ char *homa_metrics_print(void)
 		  m->send_cycles);
 		M("send_calls                %15llu  Total invocations of homa_sendmsg for equests\n",
 		  m->send_calls);
+		M("send_deadline_rejects     %15llu  Requests rejected by homa_sendmsg because they couldn't meet their deadline\n",
+		  m->send_deadline_rejects);
+		M("sndbuf_msgs               %15llu  Outgoing messages copied from a registered send region\n",
+		  m->sndbuf_msgs);
 		// It is possible for us to get here at a time when a
 		// thread has been blocked for a long time and has
 		// recorded blocked_cycles, but hasn't finished the
@@ -240,6 +252,10 @@ char *homa_metrics_print(void)
 		  m->timer_cycles);
 		M("timer_reap_cycles         %15llu  Time in homa_timer spent reaping RPCs\n",
 		  m->timer_reap_cycles);
+		M("sock_teardown_cycles      %15llu  Time in homa_timer spent tearing down closed sockets\n",
+		  m->sock_teardown_cycles);
+		M("sock_async_teardowns      %15llu  Sockets whose RPCs were terminated in the background\n",
+		  m->sock_async_teardowns);
 		M("data_pkt_reap_cycles      %15llu  Time in homa_data_pkt spent reaping RPCs\n",
 		  m->data_pkt_reap_cycles);
 		M("pacer_cycles              %15llu  Time spent in homa_pacer_main\n",
@@ -257,6 +273,8 @@ char *homa_metrics_print(void)
 		  m->pacer_skipped_rpcs);
 		M("pacer_needed_help         %15llu  homa_pacer_xmit invocations from homa_check_pacer\n",
 		  m->pacer_needed_help);
+		M("pacer_urgent_bytes        %15llu  Bytes sent using reserved NIC queue budget for urgent packets\n",
+		  m->pacer_urgent_bytes);
 		M("throttled_cycles          %15llu  Time when the throttled queue was nonempty\n",
 		  m->throttled_cycles);
 		M("resent_packets            %15llu  DATA packets sent in response to RESENDs\n",
@@ -287,8 +305,20 @@ char *homa_metrics_print(void)
 		  m->resent_discards);
 		M("resent_packets_used       %15llu  Retransmitted packets that were actually used\n",
 		  m->resent_packets_used);
+		M("reordered_packets         %15llu  Non-resent packets that filled a gap in a message\n",
+		  m->reordered_packets);
+		M("resends_deferred          %15llu  RESENDs skipped because gap might be reordering\n",
+		  m->resends_deferred);
+		M("prio_adapt_changes        %15llu  Times unsched/sched priority boundary moved\n",
+		  m->prio_adapt_changes);
+		M("impair_drops              %15llu  Packets dropped by impairment stage\n",
+		  m->impair_drops);
+		M("impair_holds              %15llu  Packets delayed/reordered by impairment stage\n",
+		  m->impair_holds);
 		M("rpc_timeouts             %15llu   RPCs aborted because peer was nonresponsive\n",
 		  m->rpc_timeouts);
+		M("rpc_deadline_expirations  %15llu  RPCs discarded because their deadline passed\n",
+		  m->rpc_deadline_expirations);
 		M("server_rpc_discards       %15llu  RPCs discarded by server because of errors\n",
 		  m->server_rpc_discards);
 		M("server_rpcs_unknown       %15llu  RPCs aborted by server because unknown to client\n",
@@ -327,6 +357,8 @@ char *homa_metrics_print(void)
 		  m->grant_check_others);
 		M("grant_check_recalcs       %15llu  Number of times homa_grant_check_rpc updated grant priority order\n",
 		  m->grant_check_recalcs);
+		M("grant_check_recalc_skips  %15llu  Number of times homa_grant_check_rpc skipped an unneeded priority check\n",
+		  m->grant_check_recalc_skips);
 		M("grant_priority_bumps      %15llu  Number of times an RPC moved up in the grant priority order\n",
 		  m->grant_priority_bumps);
 		M("fifo_grants               %15llu  Grants issued using FIFO priority\n",
@@ -365,6 +397,10 @@ char *homa_metrics_print(void)
 		  m->gro_grant_bypasses);
 		M("gro_data_bypasses         %15llu  Data packets passed directly to homa_softirq by homa_gro_receive\n",
 		  m->gro_data_bypasses);
+		M("udp_encap_packets         %15llu  Incoming Homa packets that were encapsulated in UDP\n",
+		  m->udp_encap_packets);
+		M("flow_entropy_packets      %15llu  Data packets sent with per-chunk flow entropy\n",
+		  m->flow_entropy_packets);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			M("temp%-2d                  %15llu  Temporary use in testing\n",
 			  i, m->temp[i]);
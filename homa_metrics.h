@@ -98,6 +98,18 @@ struct homa_metrics {
 	/** @skb_page_alloc_cycles: total time spent in homa_skb_page_alloc. */
 	u64 skb_page_alloc_cycles;
 
+	/**
+	 * @skb_page_refills: total number of pages allocated in the
+	 * background by homa_skb_refill_pages to replenish page pools.
+	 */
+	u64 skb_page_refills;
+
+	/**
+	 * @skb_page_shrinks: total number of pages released from page
+	 * pools because the kernel's shrinker asked for memory.
+	 */
+	u64 skb_page_shrinks;
+
 	/**
 	 * @requests_received: total number of request messages received.
 	 */
@@ -136,10 +148,25 @@ struct homa_metrics {
 	/**
 	 * @handoffs_alt_thread: total number of times that a thread other
 	 * than the first on the list was chosen for a handoff (because the
-	 * first thread was on a busy core).
+	 * first thread was on a busy core, or another thread was running
+	 * closer to the core that completed the RPC).
 	 */
 	u64 handoffs_alt_thread;
 
+	/**
+	 * @handoffs_other_llc: total number of times that an RPC was handed
+	 * off to a thread on a core that doesn't share a last-level cache
+	 * with the core that completed the RPC.
+	 */
+	u64 handoffs_other_llc;
+
+	/**
+	 * @handoffs_other_node: total number of times that an RPC was
+	 * handed off to a thread on a different NUMA node from the core
+	 * that completed the RPC.
+	 */
+	u64 handoffs_other_node;
+
 	/**
 	 * @poll_cycles: total time spent in the polling loop in
 	 * homa_wait_for_message.
@@ -191,6 +218,20 @@ struct homa_metrics {
 	 */
 	u64 send_calls;
 
+	/**
+	 * @send_deadline_rejects: total number of requests rejected by
+	 * homa_sendmsg because they couldn't be transmitted before the
+	 * deadline specified by the application.
+	 */
+	u64 send_deadline_rejects;
+
+	/**
+	 * @sndbuf_msgs: total number of outgoing messages whose data was
+	 * copied from a registered send region (SO_HOMA_SNDBUF) rather
+	 * than through user-space mappings.
+	 */
+	u64 sndbuf_msgs;
+
 	/**
 	 * @recv_cycles: total time spent executing homa_recvmsg (including
 	 * time when the thread is blocked).
@@ -254,6 +295,20 @@ struct homa_metrics {
 	 */
 	u64 timer_reap_cycles;
 
+	/**
+	 * @sock_teardown_cycles: total time spent by homa_timer ending and
+	 * reaping RPCs for sockets being torn down in the background. This
+	 * time is included in @timer_cycles.
+	 */
+	u64 sock_teardown_cycles;
+
+	/**
+	 * @sock_async_teardowns: total number of sockets that had so many
+	 * RPCs when shut down that their RPCs were terminated in the
+	 * background by homa_timer.
+	 */
+	u64 sock_async_teardowns;
+
 	/**
 	 * @data_pkt_reap_cycles: total time spent by homa_data_pkt to reap
 	 * dead RPCs.
@@ -292,6 +347,13 @@ struct homa_metrics {
 	 */
 	u64 pacer_needed_help;
 
+	/**
+	 * @pacer_urgent_bytes: total number of bytes that were transmitted
+	 * using the pacer's reserved budget for high-priority packets (i.e.
+	 * they would have been throttled otherwise).
+	 */
+	u64 pacer_urgent_bytes;
+
 	/**
 	 * @throttled_cycles: total amount of time that @homa->throttled_rpcs
 	 * is nonempty.
@@ -387,12 +449,51 @@ struct homa_metrics {
 	 */
 	u64 resent_packets_used;
 
+	/**
+	 * @reordered_packets: total number of non-retransmitted data packets
+	 * that filled in a gap in an incoming message (i.e. they arrived
+	 * out of order).
+	 */
+	u64 reordered_packets;
+
+	/**
+	 * @resends_deferred: total number of times a RESEND was not sent
+	 * for a gap in an incoming message because the gap was younger than
+	 * the reorder_usecs sysctl parameter.
+	 */
+	u64 resends_deferred;
+
+	/**
+	 * @prio_adapt_changes: total number of times homa_prio_adapt moved
+	 * the boundary between unscheduled and scheduled priority levels.
+	 */
+	u64 prio_adapt_changes;
+
+	/**
+	 * @impair_drops: total number of packets (incoming or outgoing)
+	 * discarded by the impairment stage (see homa_impair.c).
+	 */
+	u64 impair_drops;
+
+	/**
+	 * @impair_holds: total number of incoming packets delayed or held
+	 * back for reordering by the impairment stage.
+	 */
+	u64 impair_holds;
+
 	/**
 	 * @rpc_timeouts: total number of times an RPC (either client or
 	 * server) was aborted because the peer was nonresponsive.
 	 */
 	u64 rpc_timeouts;
 
+	/**
+	 * @rpc_deadline_expirations: total number of times an RPC (either
+	 * client or server) was discarded by homa_timer because its deadline
+	 * had passed.
+	 */
+	u64 rpc_deadline_expirations;
+
 	/**
 	 * @server_rpc_discards: total number of times an RPC was aborted on
 	 * the server side because of a timeout.
@@ -502,6 +603,14 @@ struct homa_metrics {
 	 */
 	u64 grant_check_recalcs;
 
+	/**
+	 * @grant_check_recalc_skips: cumulative number of times that
+	 * homa_grant_check_rpc skipped a scheduled priority check because
+	 * it couldn't change anything (fewer than 2 active RPCs, or no
+	 * incoming headroom).
+	 */
+	u64 grant_check_recalc_skips;
+
 	/**
 	 * @grant_check_others: cumulative number of times homa_grant_check_rpc
 	 * checked other RPCs besides the invoking one for potential grants.
@@ -628,6 +737,19 @@ struct homa_metrics {
 	 */
 	u64 gro_data_bypasses;
 
+	/**
+	 * @udp_encap_packets: total number of incoming Homa-over-UDP packets
+	 * whose UDP headers were stripped by homa_udp_gro_receive or
+	 * homa_udp_encap_rcv.
+	 */
+	u64 udp_encap_packets;
+
+	/**
+	 * @flow_entropy_packets: total number of outgoing data packets that
+	 * were sent with per-chunk flow entropy (see flow_chunk_bytes).
+	 */
+	u64 flow_entropy_packets;
+
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	u64 temp[NUM_TEMP_METRICS];
@@ -8,6 +8,13 @@
 #include "homa_offload.h"
 #include "homa_pacer.h"
 
+#include <linux/cacheinfo.h>
+#include <linux/topology.h>
+#ifndef __STRIP__ /* See strip.py */
+#include <net/udp.h>
+#include <net/udp_tunnel.h>
+#endif /* See strip.py */
+
 DEFINE_PER_CPU(struct homa_offload_core, homa_offload_core);
 
 #define CORES_TO_CHECK 4
@@ -35,6 +42,34 @@ static struct net_offload hook_tcp_net_offload;
 static struct net_offload hook_tcp6_net_offload;
 #endif /* See strip.py */
 
+/**
+ * homa_offload_topology() - Fill in the fields of a homa_offload_core
+ * that describe where its core sits in the cache hierarchy (these are
+ * used by homa_core_distance).
+ * @core:          Core whose information is being initialized.
+ * @offload_core:  Per-core information for @core.
+ */
+static void homa_offload_topology(int core,
+				  struct homa_offload_core *offload_core)
+{
+#ifdef __UNIT_TEST__
+	/* Pretend that pairs of cores are SMT siblings and groups of
+	 * 4 cores share an LLC.
+	 */
+	offload_core->smt_id = core & ~1;
+	offload_core->llc_id = core & ~3;
+#else /* __UNIT_TEST__ */
+	offload_core->smt_id = cpumask_first(topology_sibling_cpumask(core));
+	offload_core->llc_id = get_cpu_cacheinfo_id(core, 3);
+	if (offload_core->llc_id < 0)
+		/* No cache information available; assume that each
+		 * socket has a single LLC.
+		 */
+		offload_core->llc_id = topology_physical_package_id(core);
+#endif /* __UNIT_TEST__ */
+	offload_core->numa_node = cpu_to_node(core);
+}
+
 /**
  * homa_offload_init() - Invoked to enable GRO and GSO. Typically invoked
  * when the Homa module loads.
@@ -59,6 +94,7 @@ int homa_offload_init(void)
 		offload_core->last_app_active = 0;
 		offload_core->held_skb = NULL;
 		offload_core->held_bucket = 0;
+		homa_offload_topology(i, offload_core);
 	}
 
 	int res1 = inet_add_offload(&homa_offload, IPPROTO_HOMA);
@@ -162,6 +198,283 @@ struct sk_buff *homa_tcp_gro_receive(struct list_head *held_list,
 	return homa_gro_receive(held_list, skb);
 }
 
+/**
+ * homa_udp_strip() - Remove the UDP header from a Homa-over-UDP packet by
+ * sliding the MAC and IP headers forward over it, then fix up the IP header
+ * so that the packet looks as if it had been sent with IPPROTO_HOMA.
+ * @skb:     Incoming packet; its transport header must refer to the
+ *           UDP header.
+ * Return:   Zero for success, or a negative errno if the UDP header
+ *           couldn't be made available.
+ */
+static int homa_udp_strip(struct sk_buff *skb)
+{
+	unsigned char *start;
+	int length;
+
+	if (!pskb_may_pull(skb, skb_transport_offset(skb) +
+			   sizeof(struct udphdr)))
+		return -EINVAL;
+	start = skb_mac_header_was_set(skb) ? skb_mac_header(skb) :
+			skb_network_header(skb);
+	length = skb_transport_header(skb) - start;
+	memmove(start + sizeof(struct udphdr), start, length);
+	if (skb_mac_header_was_set(skb))
+		skb->mac_header += sizeof(struct udphdr);
+	skb->network_header += sizeof(struct udphdr);
+	skb->transport_header += sizeof(struct udphdr);
+	__skb_pull(skb, sizeof(struct udphdr));
+
+	/* The packet's checksum (if any) no longer matches its contents;
+	 * the UDP checksum has already been verified by our caller.
+	 */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		skb->ip_summed = CHECKSUM_NONE;
+
+	if (skb_is_ipv6(skb)) {
+		struct ipv6hdr *ip6h = ipv6_hdr(skb);
+
+		ip6h->payload_len = htons(ntohs(ip6h->payload_len) -
+					  sizeof(struct udphdr));
+		ip6h->nexthdr = IPPROTO_HOMA;
+	} else {
+		struct iphdr *iph = ip_hdr(skb);
+		__be16 tot_len = htons(ntohs(iph->tot_len) -
+				       sizeof(struct udphdr));
+
+		csum_replace2(&iph->check, iph->tot_len, tot_len);
+		iph->tot_len = tot_len;
+		iph->check = ~csum16_add(csum16_sub(~iph->check,
+						    htons(iph->protocol)),
+					 htons(IPPROTO_HOMA));
+		iph->protocol = IPPROTO_HOMA;
+	}
+	INC_METRIC(udp_encap_packets, 1);
+	return 0;
+}
+
+/**
+ * homa_udp_gro_receive() - Invoked by UDP's gro_receive function for
+ * packets addressed to one of Homa's UDP tunnel sockets (see the
+ * udp_encap_port sysctl parameter). Strips the UDP header and passes the
+ * packet to Homa's GRO mechanism; later processing will see an
+ * IPPROTO_HOMA packet, so it will be dispatched directly to Homa.
+ * @sk:         The UDP tunnel socket.
+ * @held_list:  Pointer to header for list of packets that are being
+ *              held for possible GRO merging.
+ * @skb:        The newly arrived packet.
+ * Return:      See homa_gro_receive.
+ */
+struct sk_buff *homa_udp_gro_receive(struct sock *sk,
+				     struct list_head *held_list,
+				     struct sk_buff *skb)
+{
+	struct udphdr *uh = udp_hdr(skb);
+
+	/* UDP normally validates the checksum before invoking us; if it
+	 * couldn't, let the packet take the normal UDP path, where
+	 * homa_udp_encap_rcv will verify it.
+	 */
+	if (uh->check && !skb_csum_unnecessary(skb) &&
+	    !NAPI_GRO_CB(skb)->csum_valid) {
+		NAPI_GRO_CB(skb)->flush = 1;
+		return NULL;
+	}
+	if (homa_udp_strip(skb) != 0) {
+		NAPI_GRO_CB(skb)->flush = 1;
+		return NULL;
+	}
+
+	/* UDP has already advanced the GRO offset past its header, which
+	 * has now been removed.
+	 */
+	NAPI_GRO_CB(skb)->data_offset -= sizeof(struct udphdr);
+	return homa_gro_receive(held_list, skb);
+}
+
+/**
+ * homa_udp_gro_complete() - GRO completion callback for Homa's UDP tunnel
+ * sockets. Packets merged by homa_udp_gro_receive are normally completed
+ * by homa_gro_complete (their IP headers now say IPPROTO_HOMA), but UDP
+ * requires a gro_complete function for tunnel sockets that do GRO.
+ * @sk:     The UDP tunnel socket.
+ * @skb:    The packet for which GRO processing is now finished.
+ * @nhoff:  Offset of the Homa header within @skb.
+ * Return:  See homa_gro_complete.
+ */
+int homa_udp_gro_complete(struct sock *sk, struct sk_buff *skb, int nhoff)
+{
+	return homa_gro_complete(skb, nhoff);
+}
+
+/**
+ * homa_udp_encap_rcv() - Invoked by UDP for each packet that arrives on
+ * one of Homa's UDP tunnel sockets without having been converted to Homa
+ * during GRO. Verifies the UDP checksum, strips the UDP header, and
+ * passes the packet to Homa.
+ * @sk:     The UDP tunnel socket.
+ * @skb:    The incoming packet; skb->data refers to the UDP header.
+ * Return:  Always 0, which means the packet has been consumed.
+ */
+int homa_udp_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	/* UDP verifies the checksum before calling us; this check is cheap
+	 * in that case, and makes sure nothing unverified reaches Homa.
+	 */
+	if (udp_lib_checksum_complete(skb)) {
+		tt_record("homa_udp_encap_rcv discarding packet with bad checksum");
+		kfree_skb(skb);
+		return 0;
+	}
+	if (!pskb_may_pull(skb, sizeof(struct udphdr))) {
+		kfree_skb(skb);
+		return 0;
+	}
+	__skb_pull(skb, sizeof(struct udphdr));
+	skb_reset_transport_header(skb);
+	INC_METRIC(udp_encap_packets, 1);
+	homa_softirq(skb);
+	return 0;
+}
+
+/**
+ * homa_udp_tunnel_sock() - Create a UDP tunnel socket that delivers
+ * Homa-over-UDP packets to Homa.
+ * @hnet:    Network namespace in which to create the socket.
+ * @family:  AF_INET or AF_INET6.
+ * @port:    UDP port on which to receive packets.
+ * @sockp:   The new socket is stored here.
+ * Return:   Zero for success, otherwise a negative errno.
+ */
+static int homa_udp_tunnel_sock(struct homa_net *hnet, int family, int port,
+				struct socket **sockp)
+{
+	struct udp_tunnel_sock_cfg tunnel_cfg;
+	struct udp_port_cfg cfg;
+	int err;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.family = family;
+	cfg.local_udp_port = htons(port);
+	if (family == AF_INET6) {
+		cfg.ipv6_v6only = 1;
+		cfg.local_ip6 = in6addr_any;
+	} else {
+		cfg.local_ip.s_addr = htonl(INADDR_ANY);
+	}
+	err = udp_sock_create(hnet->net, &cfg, sockp);
+	if (err < 0)
+		return err;
+
+	memset(&tunnel_cfg, 0, sizeof(tunnel_cfg));
+	tunnel_cfg.sk_user_data = hnet;
+	tunnel_cfg.encap_type = 1;
+	tunnel_cfg.encap_rcv = homa_udp_encap_rcv;
+	tunnel_cfg.gro_receive = homa_udp_gro_receive;
+	tunnel_cfg.gro_complete = homa_udp_gro_complete;
+	setup_udp_tunnel_sock(hnet->net, *sockp, &tunnel_cfg);
+	return 0;
+}
+
+/**
+ * homa_udp_tunnel_update() - Make the UDP tunnel sockets for a network
+ * namespace consistent with the current value of homa->udp_encap_port:
+ * close any existing sockets and (if the port is nonzero) open new ones.
+ * @hnet:    Network namespace whose sockets should be updated.
+ * Return:   Zero for success, otherwise a negative errno (in which case
+ *           no tunnel sockets are open).
+ */
+int homa_udp_tunnel_update(struct homa_net *hnet)
+{
+	int err = 0;
+	int port;
+
+	mutex_lock(&hnet->udp_mutex);
+	port = READ_ONCE(hnet->homa->udp_encap_port);
+	if (port == hnet->udp_port)
+		goto done;
+	homa_udp_tunnel_close_locked(hnet);
+	if (port == 0)
+		goto done;
+	err = homa_udp_tunnel_sock(hnet, AF_INET, port, &hnet->udp4_sock);
+	if (err == 0)
+		err = homa_udp_tunnel_sock(hnet, AF_INET6, port,
+					   &hnet->udp6_sock);
+	if (err != 0) {
+		pr_err("Homa couldn't open UDP tunnel socket on port %d: %d\n",
+		       port, err);
+		homa_udp_tunnel_close_locked(hnet);
+		goto done;
+	}
+	hnet->udp_port = port;
+
+done:
+	mutex_unlock(&hnet->udp_mutex);
+	return err;
+}
+
+/**
+ * homa_udp_tunnel_update_all() - Invoke homa_udp_tunnel_update for every
+ * network namespace that uses @homa, so that all of them reflect the
+ * current value of homa->udp_encap_port (which is shared by all
+ * namespaces). Namespaces that are not yet on the namespace list get
+ * their sockets from homa_net_init; one whose homa_net_init runs
+ * concurrently with a change may keep the old port until the next change.
+ * @homa:    Overall information about the Homa transport.
+ * Return:   Zero for success, otherwise the negative errno from the first
+ *           namespace whose sockets couldn't be opened; namespaces after
+ *           that one are not updated.
+ */
+int homa_udp_tunnel_update_all(struct homa *homa)
+{
+	struct homa_net *hnet;
+	struct net *net;
+	int err = 0;
+
+	down_read(&net_rwsem);
+	for_each_net(net) {
+		hnet = homa_net_from_net(net);
+		if (!hnet || hnet->homa != homa)
+			continue;
+		err = homa_udp_tunnel_update(hnet);
+		if (err != 0)
+			break;
+	}
+	up_read(&net_rwsem);
+	return err;
+}
+
+/**
+ * homa_udp_tunnel_close_locked() - Close any UDP tunnel sockets that are
+ * open for a network namespace.
+ * @hnet:    Network namespace whose sockets should be closed. The caller
+ *           must hold @hnet->udp_mutex.
+ */
+void homa_udp_tunnel_close_locked(struct homa_net *hnet)
+{
+	if (hnet->udp4_sock) {
+		udp_tunnel_sock_release(hnet->udp4_sock);
+		hnet->udp4_sock = NULL;
+	}
+	if (hnet->udp6_sock) {
+		udp_tunnel_sock_release(hnet->udp6_sock);
+		hnet->udp6_sock = NULL;
+	}
+	hnet->udp_port = 0;
+}
+
+/**
+ * homa_udp_tunnel_close() - Close any UDP tunnel sockets that are open for
+ * a network namespace.
+ * @hnet:    Network namespace whose sockets should be closed.
+ */
+void homa_udp_tunnel_close(struct homa_net *hnet)
+{
+	mutex_lock(&hnet->udp_mutex);
+	homa_udp_tunnel_close_locked(hnet);
+	mutex_unlock(&hnet->udp_mutex);
+}
+
 /**
  * homa_set_softirq_cpu() - Arrange for SoftIRQ processing of a packet to
  * occur on a specific core (creates a socket flow table entry for the core,
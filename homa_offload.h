@@ -69,9 +69,59 @@ struct homa_offload_core {
 	 * verify that @held_skb is still available.
 	 */
 	int held_bucket;
+
+	/**
+	 * @smt_id: identifies the physical core containing this core:
+	 * the lowest-numbered core among this core and its SMT siblings.
+	 */
+	int smt_id;
+
+	/**
+	 * @llc_id: identifies the last-level cache used by this core;
+	 * cores with the same value share that cache.
+	 */
+	int llc_id;
+
+	/** @numa_node: NUMA node containing this core. */
+	int numa_node;
 };
 DECLARE_PER_CPU(struct homa_offload_core, homa_offload_core);
 
+/*
+ * Values returned by homa_core_distance, in order of increasing distance
+ * (and hence increasing cost to move cached data between the cores).
+ */
+#define HOMA_CORE_DIST_SAME     0
+#define HOMA_CORE_DIST_SMT      1
+#define HOMA_CORE_DIST_LLC      2
+#define HOMA_CORE_DIST_NODE     3
+#define HOMA_CORE_DIST_REMOTE   4
+
+/**
+ * homa_core_distance() - Returns an indication of how "far apart" two
+ * cores are in the cache hierarchy, based on the topology information
+ * recorded by homa_offload_init.
+ * @core1:    First core.
+ * @core2:    Second core.
+ * Return:    One of the HOMA_CORE_DIST_ values.
+ */
+static inline int homa_core_distance(int core1, int core2)
+{
+	struct homa_offload_core *oc1, *oc2;
+
+	if (core1 == core2)
+		return HOMA_CORE_DIST_SAME;
+	oc1 = &per_cpu(homa_offload_core, core1);
+	oc2 = &per_cpu(homa_offload_core, core2);
+	if (oc1->smt_id == oc2->smt_id)
+		return HOMA_CORE_DIST_SMT;
+	if (oc1->llc_id == oc2->llc_id)
+		return HOMA_CORE_DIST_LLC;
+	if (oc1->numa_node == oc2->numa_node)
+		return HOMA_CORE_DIST_NODE;
+	return HOMA_CORE_DIST_REMOTE;
+}
+
 int      homa_gro_complete(struct sk_buff *skb, int thoff);
 void     homa_gro_gen2(struct homa *homa, struct sk_buff *skb);
 void     homa_gro_gen3(struct homa *homa, struct sk_buff *skb);
@@ -89,6 +139,16 @@ void     homa_send_ipis(void);
 #ifndef __STRIP__ /* See strip.py */
 struct sk_buff *homa_tcp_gro_receive(struct list_head *held_list,
 				     struct sk_buff *skb);
+int      homa_udp_encap_rcv(struct sock *sk, struct sk_buff *skb);
+int      homa_udp_gro_complete(struct sock *sk, struct sk_buff *skb,
+			       int nhoff);
+struct sk_buff *homa_udp_gro_receive(struct sock *sk,
+				     struct list_head *held_list,
+				     struct sk_buff *skb);
+void     homa_udp_tunnel_close(struct homa_net *hnet);
+void     homa_udp_tunnel_close_locked(struct homa_net *hnet);
+int      homa_udp_tunnel_update(struct homa_net *hnet);
+int      homa_udp_tunnel_update_all(struct homa *homa);
 #endif /* See strip.py */
 
 #endif /* _HOMA_OFFLOAD_H */
@@ -9,6 +9,7 @@
 #include "homa_peer.h"
 #include "homa_rpc.h"
 #ifndef __STRIP__ /* See strip.py */
+#include "homa_impair.h"
 #include "homa_skb.h"
 #endif /* See strip.py */
 #include "homa_wire.h"
@@ -35,6 +36,7 @@ void homa_message_out_init(struct homa_rpc *rpc, int length)
 		rpc->msgout.unscheduled = length;
 #endif /* See strip.py */
 	rpc->msgout.init_time = homa_clock();
+	rpc->msgout.track_unsent = READ_ONCE(rpc->hsk->homa->pacer->track_unsent);
 }
 
 #ifndef __STRIP__ /* See strip.py */
@@ -42,7 +44,8 @@ void homa_message_out_init(struct homa_rpc *rpc, int length)
  * homa_fill_data_interleaved() - This function is invoked to fill in the
  * part of a data packet after the initial header, when GSO is being used
  * but TCP hijacking is not. As result, homa_seg_hdrs must be interleaved
- * with the data to provide the correct offset for each segment.
+ * with the data to provide the correct offset for each segment (or
+ * complete homa_data_hdrs, if packets are encapsulated in UDP).
  * @rpc:            RPC whose output message is being created. Must be
  *                  locked by caller.
  * @skb:            The packet being filled. The initial homa_data_hdr was
@@ -76,15 +79,27 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
 	int seg_length = homa_info->seg_length;
 	int bytes_left = homa_info->data_bytes;
 	int offset = homa_info->offset;
+	struct homa_data_hdr h;
+	void *hdr = &h.seg;
+	int hdr_length = sizeof(h.seg);
 	int err;
 
+#ifndef __STRIP__ /* See strip.py */
+	if (rpc->hsk->sock.sk_protocol == IPPROTO_UDP) {
+		/* UDP GSO replicates only the UDP header, so each segment
+		 * needs a complete Homa header of its own.
+		 */
+		h = *(struct homa_data_hdr *)skb_transport_header(skb);
+		hdr = &h;
+		hdr_length = sizeof(h);
+	}
+#endif /* See strip.py */
+
 	/* Each iteration of the following loop adds info for one packet,
 	 * which includes a homa_seg_hdr followed by the data for that
 	 * segment. The first homa_seg_hdr was already added by the caller.
 	 */
 	while (1) {
-		struct homa_seg_hdr seg;
-
 		if (bytes_left < seg_length)
 			seg_length = bytes_left;
 		err = homa_skb_append_from_iter(rpc->hsk->homa, skb, iter,
@@ -97,9 +112,10 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
 		if (bytes_left == 0)
 			break;
 
-		seg.offset = htonl(offset);
-		err = homa_skb_append_to_frag(rpc->hsk->homa, skb, &seg,
-					      sizeof(seg));
+		h.seg.offset = htonl(offset);
+		IF_NO_STRIP(h.common.sequence = h.seg.offset);
+		err = homa_skb_append_to_frag(rpc->hsk->homa, skb, hdr,
+					      hdr_length);
 		if (err != 0)
 			return err;
 	}
@@ -175,6 +191,7 @@ struct sk_buff *homa_tx_data_pkt_alloc(struct homa_rpc *rpc,
 	h->cutoff_version = rpc->peer->cutoff_version;
 #endif /* See strip.py */
 	h->retransmit = 0;
+	homa_data_set_deadline(h, homa_rpc_usecs_left(rpc));
 #ifndef __STRIP__ /* See strip.py */
 	h->seg.offset = htonl(-1);
 #else /* See strip.py */
@@ -190,7 +207,11 @@ struct sk_buff *homa_tx_data_pkt_alloc(struct homa_rpc *rpc,
 	homa_info->offset = offset;
 
 #ifndef __STRIP__ /* See strip.py */
-	if (segs > 1 && rpc->hsk->sock.sk_protocol != IPPROTO_TCP) {
+	if (segs > 1 && rpc->hsk->sock.sk_protocol == IPPROTO_UDP) {
+		h->seg.offset = htonl(offset);
+		gso_size = max_seg_data + sizeof(struct homa_data_hdr);
+		err = homa_fill_data_interleaved(rpc, skb, iter);
+	} else if (segs > 1 && rpc->hsk->sock.sk_protocol != IPPROTO_TCP) {
 #else /* See strip.py */
 	if (segs > 1) {
 #endif /* See strip.py */
@@ -218,6 +239,10 @@ struct sk_buff *homa_tx_data_pkt_alloc(struct homa_rpc *rpc,
 		 */
 		skb_shinfo(skb)->gso_type =
 		    rpc->hsk->homa->gso_force_software ? 0xd : SKB_GSO_TCPV6;
+#ifndef __STRIP__ /* See strip.py */
+		if (rpc->hsk->sock.sk_protocol == IPPROTO_UDP)
+			skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+#endif /* See strip.py */
 	}
 	return skb;
 
@@ -232,9 +257,12 @@ error:
  * user space and (possibly) begins transmitting the message.
  * @rpc:     RPC for which to send message; this function must not
  *           previously have been called for the RPC. Must be locked. The RPC
- *           will be unlocked while copying data, but will be locked again
- *           before returning.
- * @iter:    Describes location(s) of message data in user space.
+ *           will be unlocked while computing packet geometry and copying
+ *           data (it is relocked only briefly to publish each new packet),
+ *           but will be locked again before returning.
+ * @iter:    Describes location(s) of message data in user space (or, for
+ *           HOMA_SENDMSG_SNDBUF, in the pinned pages of the socket's send
+ *           region).
  * @xmit:    Nonzero means this method should start transmitting packets;
  *           transmission will be overlapped with copying from user space.
  *           Zero means the caller will initiate transmission after this
@@ -267,6 +295,11 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	/* Bytes of the message that haven't yet been copied into skbs. */
 	int bytes_left;
 
+	/* Amount of data to put in the next skb, if not limited by
+	 * something else. When pipelining, this starts small and grows
+	 * so that the first packets reach the wire quickly.
+	 */
+	int skb_bytes;
 	int gso_size;
 	int err;
 
@@ -279,6 +312,20 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		goto error;
 	}
 	homa_message_out_init(rpc, iter->count);
+#ifndef __STRIP__ /* See strip.py */
+	rpc->msgout.granted = rpc->msgout.unscheduled;
+#endif /* See strip.py */
+	homa_pacer_update_unsent(rpc);
+
+	/* From here on, the RPC is unlocked except when publishing new
+	 * packets. Until copied_from_user reaches msgout.length, other code
+	 * (e.g. grant and resend handling) sees the message as being filled
+	 * and will only touch the packets that have already been published.
+	 * Nothing below needs the RPC lock: computing the geometry may
+	 * require a route lookup, and stashing pages acquires the global
+	 * page pool lock.
+	 */
+	homa_rpc_unlock(rpc);
 
 	/* Compute the geometry of packets. */
 	dst = homa_get_dst(rpc->peer, rpc->hsk);
@@ -293,13 +340,19 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 #ifndef __STRIP__ /* See strip.py */
 	/* Round gso_size down to an even # of mtus; calculation depends
 	 * on whether we're doing TCP hijacking (need more space in TSO packet
-	 * if no hijacking).
+	 * if no hijacking) or UDP encapsulation (every segment carries a
+	 * full Homa header).
 	 */
 	if (rpc->hsk->sock.sk_protocol == IPPROTO_TCP) {
 		/* Hijacking */
 		segs_per_gso = gso_size - rpc->hsk->ip_header_length
 				- sizeof(struct homa_data_hdr);
 		do_div(segs_per_gso, max_seg_data);
+	} else if (rpc->hsk->sock.sk_protocol == IPPROTO_UDP) {
+		/* UDP encapsulation */
+		segs_per_gso = gso_size - rpc->hsk->ip_header_length;
+		do_div(segs_per_gso, max_seg_data +
+				sizeof(struct homa_data_hdr));
 	} else {
 		/* No hijacking */
 		segs_per_gso = gso_size - rpc->hsk->ip_header_length -
@@ -322,10 +375,17 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	UNIT_LOG("; ", "mtu %d, max_seg_data %d, max_gso_data %d",
 		 mtu, max_seg_data, max_gso_data);
 
+	/* If the message is long enough, overlap copying with transmission:
+	 * the first packets are built with a single segment and each
+	 * subsequent packet doubles in size until reaching max_gso_data.
+	 * Packets built during this ramp are transmitted directly by
+	 * this thread (without waiting for the pacer) so that the first
+	 * bytes reach the wire as soon as possible; after that, the pacer
+	 * transmits while this thread continues copying.
+	 */
 	overlap_xmit = rpc->msgout.length > 2 * max_gso_data;
-#ifndef __STRIP__ /* See strip.py */
-	rpc->msgout.granted = rpc->msgout.unscheduled;
-#endif /* See strip.py */
+	skb_bytes = (overlap_xmit && xmit) ? max_seg_data
+			: max_gso_data;
 	homa_skb_stash_pages(rpc->hsk->homa, rpc->msgout.length);
 
 	/* Each iteration of the loop below creates one GSO packet. */
@@ -340,9 +400,10 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	for (bytes_left = rpc->msgout.length; bytes_left > 0; ) {
 		int skb_data_bytes, offset;
 		struct sk_buff *skb;
+		bool ramp;
 
-		homa_rpc_unlock(rpc);
-		skb_data_bytes = max_gso_data;
+		ramp = skb_bytes < max_gso_data;
+		skb_data_bytes = skb_bytes;
 		offset = rpc->msgout.length - bytes_left;
 #ifndef __STRIP__ /* See strip.py */
 		if (offset < rpc->msgout.unscheduled &&
@@ -383,9 +444,25 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 #else /* See strip.py */
 		    xmit) {
 #endif /* See strip.py */
-			tt_record1("waking up pacer for id %d", rpc->id);
-			homa_pacer_manage_rpc(rpc);
+			if (ramp) {
+				homa_xmit_data(rpc, false);
+				if (rpc->state == RPC_DEAD) {
+					err = -EINVAL;
+					goto error;
+				}
+			} else {
+				tt_record1("waking up pacer for id %d",
+					   rpc->id);
+				homa_pacer_manage_rpc(rpc);
+			}
 		}
+		if (ramp) {
+			skb_bytes *= 2;
+			if (skb_bytes > max_gso_data)
+				skb_bytes = max_gso_data;
+		}
+		if (bytes_left > 0)
+			homa_rpc_unlock(rpc);
 	}
 	tt_record2("finished copy from user space for id %d, length %d",
 		   rpc->id, rpc->msgout.length);
@@ -475,6 +552,12 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 	}
 #ifndef __STRIP__ /* See strip.py */
 	priority = hsk->homa->num_priorities - 1;
+	if (unlikely(homa_impair_tx(hsk->hnet->impair))) {
+		kfree_skb(skb);
+		return 0;
+	}
+	if (hsk->sock.sk_protocol == IPPROTO_UDP)
+		homa_udp_encap(skb, hsk, peer, 0);
 #endif /* See strip.py */
 	skb->ooo_okay = 1;
 	skb_get(skb);
@@ -607,6 +690,14 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 #endif /* See strip.py */
 		struct sk_buff *skb = *rpc->msgout.next_xmit;
 
+		if (unlikely(rpc->error != 0)) {
+			/* The RPC has been aborted (e.g. its deadline
+			 * passed); the rest of the message isn't needed.
+			 */
+			tt_record1("homa_xmit_data not transmitting aborted id %d",
+				   rpc->id);
+			break;
+		}
 #ifndef __STRIP__ /* See strip.py */
 		if (rpc->msgout.next_xmit_offset >= rpc->msgout.granted) {
 			tt_record3("homa_xmit_data stopping at offset %d for id %u: granted is %d",
@@ -616,24 +707,36 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		}
 #endif /* See strip.py */
 
+#ifndef __STRIP__ /* See strip.py */
+		if (rpc->msgout.next_xmit_offset < rpc->msgout.unscheduled) {
+			priority = homa_unsched_priority(homa, rpc->peer,
+							 rpc->msgout.length);
+		} else {
+			priority = rpc->msgout.sched_priority;
+		}
+#endif /* See strip.py */
+
 		if ((rpc->msgout.length - rpc->msgout.next_xmit_offset)
 				>= homa->pacer->throttle_min_bytes) {
+			if (unlikely(homa->flags & HOMA_FLAG_SRPT_XMIT) &&
+			    !force && homa_pacer_outranked(homa->pacer, rpc)) {
+				tt_record1("homa_xmit_data deferring id %u to shorter throttled message",
+					   rpc->id);
+				homa_pacer_manage_rpc(rpc);
+				break;
+			}
+#ifndef __STRIP__ /* See strip.py */
+			if (!homa_pacer_check_nic_q(homa->pacer, skb, force,
+						    priority)) {
+#else /* See strip.py */
 			if (!homa_pacer_check_nic_q(homa->pacer, skb, force)) {
+#endif /* See strip.py */
 				tt_record1("homa_xmit_data adding id %u to throttle queue",
 					   rpc->id);
 				homa_pacer_manage_rpc(rpc);
 				break;
 			}
 		}
-
-#ifndef __STRIP__ /* See strip.py */
-		if (rpc->msgout.next_xmit_offset < rpc->msgout.unscheduled) {
-			priority = homa_unsched_priority(homa, rpc->peer,
-							 rpc->msgout.length);
-		} else {
-			priority = rpc->msgout.sched_priority;
-		}
-#endif /* See strip.py */
 		rpc->msgout.next_xmit = &(homa_get_skb_info(skb)->next_skb);
 		rpc->msgout.next_xmit_offset +=
 				homa_get_skb_info(skb)->data_bytes;
@@ -657,10 +760,74 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		if (rpc->state == RPC_DEAD)
 			break;
 	}
+	homa_pacer_update_unsent(rpc);
 	homa_rpc_put(rpc);
 }
 
 #ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_flow_entropy() - Returns the flow entropy to use when transmitting
+ * a data packet (see the flow_chunk_bytes and flow_spray sysctl parameters).
+ * @rpc:     RPC that the packet belongs to.
+ * @offset:  Offset within the message of the packet's first byte of data.
+ * Return:   Zero means the packet should be sent on the socket's normal
+ *           flow; otherwise the value should be used to vary the flow
+ *           hash. The value is the same for all packets in a chunk.
+ */
+u32 homa_flow_entropy(struct homa_rpc *rpc, int offset)
+{
+	struct homa *homa = rpc->hsk->homa;
+	int chunk_bytes = homa->flow_chunk_bytes;
+	u64 chunk;
+
+	if (homa->flow_spray && offset >= rpc->msgout.unscheduled)
+		/* Without a chunk size, each packet (or GSO batch) gets
+		 * its own entropy.
+		 */
+		chunk = chunk_bytes > 0 ? offset / chunk_bytes : offset;
+	else if (chunk_bytes > 0 && offset >= chunk_bytes)
+		chunk = offset / chunk_bytes;
+	else
+		return 0;
+	return hash_64(rpc->id ^ (chunk << 32), 32) | 1;
+}
+
+/**
+ * homa_udp_encap() - Prepend a UDP header to an outgoing Homa packet; used
+ * for sockets whose packets are encapsulated in UDP (see the udp_encap_port
+ * sysctl parameter). On return the transport header of @skb refers to the
+ * UDP header and the UDP checksum has been set up for offload (UDP GSO
+ * requires this).
+ * @skb:     Packet to encapsulate; skb->data must refer to the Homa header,
+ *           and the UDP header is written into the packet's headroom.
+ * @hsk:     Socket from which the packet is being sent.
+ * @peer:    Peer to which the packet will be sent.
+ * @entropy: Flow entropy from homa_flow_entropy; if nonzero, it selects
+ *           the UDP source port (otherwise the Homa port is used).
+ */
+void homa_udp_encap(struct sk_buff *skb, struct homa_sock *hsk,
+		    struct homa_peer *peer, u32 entropy)
+{
+	struct udphdr *uh;
+
+	uh = skb_push(skb, sizeof(*uh));
+	skb_reset_transport_header(skb);
+	uh->source = htons(entropy ? (u16)(entropy | 0x8000) : hsk->port);
+	uh->dest = htons(hsk->homa->udp_encap_port);
+	uh->len = htons(skb->len);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+	if (hsk->inet.sk.sk_family == AF_INET6)
+		uh->check = ~csum_ipv6_magic(&peer->flow.u.ip6.saddr,
+					     &peer->flow.u.ip6.daddr,
+					     skb->len, IPPROTO_UDP, 0);
+	else
+		uh->check = ~csum_tcpudp_magic(peer->flow.u.ip4.saddr,
+					       peer->flow.u.ip4.daddr,
+					       skb->len, IPPROTO_UDP, 0);
+}
+
 /**
  * __homa_xmit_data() - Handles packet transmission stuff that is common
  * to homa_xmit_data and homa_resend_data.
@@ -682,6 +849,7 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc)
 #endif /* See strip.py */
 {
 #ifndef __STRIP__ /* See strip.py */
+	u32 entropy;
 	int err;
 
 	/* Update info that may have changed since the message was initially
@@ -689,6 +857,21 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc)
 	 */
 	((struct homa_data_hdr *)skb_transport_header(skb))->cutoff_version =
 			rpc->peer->cutoff_version;
+
+	/* A nonzero skb hash determines the IPv6 flow label (ip6_xmit
+	 * computes the label from it).
+	 */
+	entropy = homa_flow_entropy(rpc, homa_get_skb_info(skb)->offset);
+	if (entropy) {
+		skb_set_hash(skb, entropy, PKT_HASH_TYPE_L4);
+		INC_METRIC(flow_entropy_packets, 1);
+	}
+
+	if (unlikely(homa_impair_tx(rpc->hsk->hnet->impair))) {
+		/* Pretend the packet was lost in the network. */
+		kfree_skb(skb);
+		return;
+	}
 #endif /* See strip.py */
 
 	skb_dst_set(skb, homa_get_dst(rpc->peer, rpc->hsk));
@@ -697,6 +880,24 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc)
 	skb->ip_summed = CHECKSUM_PARTIAL;
 	skb->csum_start = skb_transport_header(skb) - skb->head;
 	skb->csum_offset = offsetof(struct homa_common_hdr, checksum);
+#ifndef __STRIP__ /* See strip.py */
+	if (rpc->hsk->sock.sk_protocol == IPPROTO_UDP) {
+		struct sk_buff *clone;
+
+		/* Encapsulate a clone, so that the transport header of the
+		 * original still refers to the Homa header if the packet's
+		 * data must be retransmitted later.
+		 */
+		clone = skb_clone(skb, GFP_ATOMIC);
+		kfree_skb(skb);
+		if (unlikely(!clone)) {
+			INC_METRIC(data_xmit_errors, 1);
+			return;
+		}
+		skb = clone;
+		homa_udp_encap(skb, rpc->hsk, rpc->peer, entropy);
+	}
+#endif /* See strip.py */
 	if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
 		tt_record4("calling ip6_xmit: wire_bytes %d, peer 0x%x, id %d, offset %d",
 			   homa_get_skb_info(skb)->wire_bytes,
@@ -829,6 +1030,7 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end)
 			h->common.sequence = htonl(offset);
 			h->seg.offset = htonl(offset);
 			h->retransmit = 1;
+			homa_data_set_deadline(h, homa_rpc_usecs_left(rpc));
 			IF_NO_STRIP(h->incoming = htonl(end));
 			err = homa_skb_append_from_skb(rpc->hsk->homa, new_skb,
 						       skb, seg_offset,
@@ -851,11 +1053,13 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end)
 			new_homa_info->offset = offset;
 			tt_record3("retransmitting offset %d, length %d, id %d",
 				   offset, seg_length, rpc->id);
-			homa_pacer_check_nic_q(rpc->hsk->homa->pacer, new_skb,
-					       true);
 #ifndef __STRIP__ /* See strip.py */
+			homa_pacer_check_nic_q(rpc->hsk->homa->pacer, new_skb,
+					       true, priority);
 			__homa_xmit_data(new_skb, rpc, priority);
 #else /* See strip.py */
+			homa_pacer_check_nic_q(rpc->hsk->homa->pacer, new_skb,
+					       true);
 			__homa_xmit_data(new_skb, rpc);
 #endif /* See strip.py */
 			INC_METRIC(resent_packets, 1);
@@ -43,6 +43,20 @@ static struct ctl_table pacer_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_pacer_dointvec
 	},
+	{
+		.procname	= "urgent_nic_queue_ns",
+		.data		= OFFSET(urgent_nic_queue_ns),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_pacer_dointvec
+	},
+	{
+		.procname	= "urgent_prio",
+		.data		= OFFSET(urgent_prio),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_pacer_dointvec
+	},
 };
 #endif /* See strip.py */
 
@@ -71,6 +85,10 @@ struct homa_pacer *homa_pacer_alloc(struct homa *homa)
 	pacer->max_nic_queue_ns = 5000;
 	pacer->link_mbps = 25000;
 	pacer->throttle_min_bytes = 1000;
+#ifndef __STRIP__ /* See strip.py */
+	/* urgent_prio is set by homa_init once num_priorities is known. */
+	pacer->urgent_nic_queue_ns = 0;
+#endif /* See strip.py */
 	pacer->exit = false;
 	init_waitqueue_head(&pacer->wait_queue);
 	pacer->kthread = kthread_run(homa_pacer_main, pacer, "homa_pacer");
@@ -123,6 +141,29 @@ void homa_pacer_free(struct homa_pacer *pacer)
 	kfree(pacer);
 }
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_pacer_check_nic_q() - This function is invoked before passing a
+ * packet to the NIC for transmission. It serves two purposes. First, it
+ * maintains an estimate of the NIC queue length. Second, it indicates to
+ * the caller whether the NIC queue is so full that no new packets should be
+ * queued (Homa's SRPT depends on keeping the NIC queue short).
+ * @pacer:    Pacer information for a Homa transport.
+ * @skb:      Packet that is about to be transmitted.
+ * @force:    True means this packet is going to be transmitted
+ *            regardless of the queue length.
+ * @priority: Priority level at which @skb will be transmitted. Packets
+ *            with priority at least pacer->urgent_prio may also use the
+ *            queue budget reserved by pacer->urgent_nic_queue_cycles.
+ * Return:    Nonzero is returned if either the NIC queue length is
+ *            acceptably short or @force was specified. 0 means that the
+ *            NIC queue is at capacity or beyond, so the caller should delay
+ *            the transmission of @skb. If nonzero is returned, then the
+ *            queue estimate is updated to reflect the transmission of @skb.
+ */
+int homa_pacer_check_nic_q(struct homa_pacer *pacer, struct sk_buff *skb,
+			   bool force, int priority)
+#else /* See strip.py */
 /**
  * homa_pacer_check_nic_q() - This function is invoked before passing a
  * packet to the NIC for transmission. It serves two purposes. First, it
@@ -141,20 +182,31 @@ void homa_pacer_free(struct homa_pacer *pacer)
  */
 int homa_pacer_check_nic_q(struct homa_pacer *pacer, struct sk_buff *skb,
 			   bool force)
+#endif /* See strip.py */
 {
-	u64 idle, new_idle, clock, cycles_for_packet;
+	u64 idle, new_idle, clock, cycles_for_packet, max_queue_cycles;
 	int bytes;
+	IF_NO_STRIP(bool urgent = false);
 
 	bytes = homa_get_skb_info(skb)->wire_bytes;
 	cycles_for_packet = pacer->cycles_per_mbyte;
 	cycles_for_packet *= bytes;
 	do_div(cycles_for_packet, 1000000);
+	max_queue_cycles = pacer->max_nic_queue_cycles;
+#ifndef __STRIP__ /* See strip.py */
+	if (priority >= pacer->urgent_prio)
+		max_queue_cycles += pacer->urgent_nic_queue_cycles;
+#endif /* See strip.py */
 	while (1) {
 		clock = homa_clock();
 		idle = atomic64_read(&pacer->link_idle_time);
-		if ((clock + pacer->max_nic_queue_cycles) < idle && !force &&
+		if ((clock + max_queue_cycles) < idle && !force &&
 		    !(pacer->homa->flags & HOMA_FLAG_DONT_THROTTLE))
 			return 0;
+#ifndef __STRIP__ /* See strip.py */
+		urgent = (clock + pacer->max_nic_queue_cycles) < idle &&
+			 !force;
+#endif /* See strip.py */
 #ifndef __STRIP__ /* See strip.py */
 		if (!list_empty(&pacer->throttled_rpcs))
 			INC_METRIC(pacer_bytes, bytes);
@@ -182,6 +234,10 @@ int homa_pacer_check_nic_q(struct homa_pacer *pacer, struct sk_buff *skb,
 					     new_idle) == idle)
 			break;
 	}
+#ifndef __STRIP__ /* See strip.py */
+	if (urgent)
+		INC_METRIC(pacer_urgent_bytes, bytes);
+#endif /* See strip.py */
 	return 1;
 }
 
@@ -340,6 +396,12 @@ void homa_pacer_manage_rpc(struct homa_rpc *rpc)
 
 	if (!list_empty(&rpc->throttled_links))
 		return;
+
+	/* RPCs of a socket that has been shut down are no longer sent
+	 * (see homa_sock_shutdown).
+	 */
+	if (rpc->hsk->shutdown)
+		return;
 	IF_NO_STRIP(now = homa_clock());
 #ifndef __STRIP__ /* See strip.py */
 	if (!list_empty(&pacer->throttled_rpcs))
@@ -374,6 +436,122 @@ done:
 //	tt_record("woke up pacer thread");
 }
 
+/**
+ * homa_pacer_unsent_class() - Return the index in pacer->unsent_bytes
+ * for a message of a given length.
+ * @length:   Total number of bytes in the message.
+ * Return:    See above.
+ */
+static int homa_pacer_unsent_class(int length)
+{
+	int class = (length > 0) ? ilog2(length) : 0;
+
+	return (class < HOMA_UNSENT_CLASSES) ? class : HOMA_UNSENT_CLASSES - 1;
+}
+
+/**
+ * homa_pacer_update_unsent() - Make sure that the contribution of an
+ * RPC's outgoing message to pacer->unsent_bytes reflects its current
+ * state. Does nothing unless the message was created while
+ * pacer->track_unsent was set.
+ * @rpc:    RPC whose output message may have changed (e.g., more bytes
+ *          were transmitted or granted, or the RPC ended). Must be locked
+ *          by caller.
+ */
+void homa_pacer_update_unsent(struct homa_rpc *rpc)
+	__must_hold(rpc_bucket_lock)
+{
+	int unsent, delta;
+
+	if (!rpc->msgout.track_unsent)
+		return;
+	if (rpc->state == RPC_DEAD) {
+		unsent = 0;
+	} else {
+#ifndef __STRIP__ /* See strip.py */
+		unsent = rpc->msgout.granted - rpc->msgout.next_xmit_offset;
+#else /* See strip.py */
+		unsent = rpc->msgout.length - rpc->msgout.next_xmit_offset;
+#endif /* See strip.py */
+		if (unsent < 0)
+			unsent = 0;
+	}
+	delta = unsent - rpc->msgout.unsent_recorded;
+	if (delta == 0)
+		return;
+	atomic64_add(delta, &rpc->hsk->homa->pacer->unsent_bytes[
+		     homa_pacer_unsent_class(rpc->msgout.length)]);
+	rpc->msgout.unsent_recorded = unsent;
+}
+
+/**
+ * homa_pacer_predict_cycles() - Estimate how long it will take before a
+ * new outgoing message has been completely handed off to the NIC. The
+ * estimate assumes that the message must wait for the data currently in
+ * the NIC queue plus any transmittable data in messages no longer than
+ * the new one (which SRPT will send ahead of it). The first call to this
+ * function enables the tracking of unsent bytes, so its estimates are low
+ * until messages created before then have been transmitted.
+ * @pacer:    Pacer information for a Homa transport.
+ * @length:   Number of bytes in the new message.
+ * Return:    The predicted delay, in homa_clock() units.
+ */
+u64 homa_pacer_predict_cycles(struct homa_pacer *pacer, int length)
+{
+	s64 backlog, unsent;
+	int class, i;
+	u64 result;
+
+	if (unlikely(!READ_ONCE(pacer->track_unsent)))
+		WRITE_ONCE(pacer->track_unsent, true);
+	backlog = atomic64_read(&pacer->link_idle_time) - homa_clock();
+	if (backlog < 0)
+		backlog = 0;
+	class = homa_pacer_unsent_class(length);
+	unsent = 0;
+	for (i = 0; i <= class; i++)
+		unsent += atomic64_read(&pacer->unsent_bytes[i]);
+	if (unsent < 0)
+		unsent = 0;
+	result = (unsent + length) * pacer->cycles_per_mbyte;
+	do_div(result, 1000000);
+	return result + backlog;
+}
+
+/**
+ * homa_pacer_outranked() - Determine whether some RPC waiting for the pacer
+ * should transmit before a given RPC (i.e., it has fewer bytes left to
+ * transmit). Used to enforce SRPT ordering across all RPCs on this host
+ * when HOMA_FLAG_SRPT_XMIT is set.
+ * @pacer:    Pacer information for a Homa transport.
+ * @rpc:      RPC that would like to transmit. Must be locked by caller.
+ * Return:    True if @rpc should defer to the pacer, false if it may
+ *            transmit immediately.
+ */
+bool homa_pacer_outranked(struct homa_pacer *pacer, struct homa_rpc *rpc)
+	__must_hold(rpc_bucket_lock)
+{
+	struct homa_rpc *first;
+	int bytes_left;
+	bool result;
+
+	if (list_empty(&pacer->throttled_rpcs))
+		return false;
+	bytes_left = rpc->msgout.length - rpc->msgout.next_xmit_offset;
+
+	/* The throttled list is sorted by bytes remaining, so only its
+	 * first entry needs to be checked.
+	 */
+	homa_pacer_throttle_lock(pacer);
+	first = list_first_entry_or_null(&pacer->throttled_rpcs,
+					 struct homa_rpc, throttled_links);
+	result = first && first != rpc &&
+		 (first->msgout.length - first->msgout.next_xmit_offset) <
+		 bytes_left;
+	homa_pacer_throttle_unlock(pacer);
+	return result;
+}
+
 /**
  * homa_pacer_unmanage_rpc() - Make sure that an RPC is no longer managed
  * by the pacer.
@@ -397,6 +575,24 @@ void homa_pacer_unmanage_rpc(struct homa_rpc *rpc)
 	}
 }
 
+#ifndef __STRIP__ /* See strip.py */
+/**
+ * homa_pacer_clamp_urgent_prio() - Make sure that @pacer->urgent_prio
+ * refers to a priority level that exists. Invoked whenever urgent_prio or
+ * the number of priority levels changes.
+ * @pacer:   Pacer whose urgent_prio should be checked.
+ */
+void homa_pacer_clamp_urgent_prio(struct homa_pacer *pacer)
+{
+	int max_prio = pacer->homa->num_priorities - 1;
+
+	if (pacer->urgent_prio > max_prio)
+		pacer->urgent_prio = max_prio;
+	if (pacer->urgent_prio < 0)
+		pacer->urgent_prio = 0;
+}
+#endif /* See strip.py */
+
 /**
  * homa_pacer_update_sysctl_deps() - Update any pacer fields that depend
  * on values set by sysctl. This function is invoked anytime a pacer sysctl
@@ -409,6 +605,11 @@ void homa_pacer_update_sysctl_deps(struct homa_pacer *pacer)
 
 	pacer->max_nic_queue_cycles =
 			homa_ns_to_cycles(pacer->max_nic_queue_ns);
+#ifndef __STRIP__ /* See strip.py */
+	pacer->urgent_nic_queue_cycles =
+			homa_ns_to_cycles(pacer->urgent_nic_queue_ns);
+	homa_pacer_clamp_urgent_prio(pacer);
+#endif /* See strip.py */
 
 	/* Underestimate link bandwidth (overestimate time) by 1%. */
 	tmp = 101 * 8000 * (u64)homa_clock_khz();
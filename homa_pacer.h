@@ -14,6 +14,13 @@
 #include "homa_metrics.h"
 #endif /* See strip.py */
 
+/**
+ * define HOMA_UNSENT_CLASSES - Number of size classes (powers of 2 of
+ * message length) in homa_pacer->unsent_bytes. Must be large enough to
+ * hold ilog2(HOMA_MAX_MESSAGE_LENGTH).
+ */
+#define HOMA_UNSENT_CLASSES 20
+
 /**
  * struct homa_pacer - Contains information that the pacer users to
  * manage packet output. There is one instance of this object stored
@@ -83,6 +90,30 @@ struct homa_pacer {
 	 */
 	int max_nic_queue_cycles;
 
+#ifndef __STRIP__ /* See strip.py */
+	/**
+	 * @urgent_nic_queue_ns: Additional NIC queue budget (beyond
+	 * @max_nic_queue_ns) that only packets at priority @urgent_prio or
+	 * higher may use. 0 means no budget is reserved. Set externally via
+	 * sysctl.
+	 */
+	int urgent_nic_queue_ns;
+
+	/**
+	 * @urgent_nic_queue_cycles: Same as urgent_nic_queue_ns except in
+	 * homa_clock() units.
+	 */
+	int urgent_nic_queue_cycles;
+
+	/**
+	 * @urgent_prio: Packets transmitted at this priority level or
+	 * higher may use @urgent_nic_queue_ns. Set externally via sysctl;
+	 * always less than homa->num_priorities (defaults to the highest
+	 * level).
+	 */
+	int urgent_prio;
+#endif /* See strip.py */
+
 	/**
 	 * @link_mbps: The raw bandwidth of the network uplink, in
 	 * units of 1e06 bits per second.  Set externally via sysctl.
@@ -108,6 +139,14 @@ struct homa_pacer {
 	 */
 	int throttle_min_bytes;
 
+	/**
+	 * @track_unsent: Nonzero means that @unsent_bytes is being
+	 * maintained for new outgoing messages. Set the first time a
+	 * request is sent with a deadline; until then, no one needs
+	 * @unsent_bytes so it isn't worth the cost of updating it.
+	 */
+	bool track_unsent;
+
 #ifndef __STRIP__ /* See strip.py */
 	/**
 	 * @sysctl_header: Used to remove sysctl values when this structure
@@ -148,11 +187,28 @@ struct homa_pacer {
 	 * severe underestimate if there is competing traffic from, say, TCP.
 	 */
 	atomic64_t link_idle_time ____cacheline_aligned_in_smp;
+
+	/**
+	 * @unsent_bytes: Number of bytes in outgoing messages on this host
+	 * that could be transmitted now (they have been granted) but have
+	 * not yet been passed to the NIC. Entry i holds bytes from messages
+	 * whose length is in [2^i, 2^(i+1)) (the last entry also holds all
+	 * longer messages). Only maintained when @track_unsent is set; used
+	 * by homa_pacer_predict_cycles. Kept on its own cache line(s) so
+	 * updates don't interfere with @link_idle_time.
+	 */
+	atomic64_t unsent_bytes[HOMA_UNSENT_CLASSES] ____cacheline_aligned_in_smp;
 };
 
 struct homa_pacer *homa_pacer_alloc(struct homa *homa);
+#ifndef __STRIP__ /* See strip.py */
+int      homa_pacer_check_nic_q(struct homa_pacer *pacer,
+				struct sk_buff *skb, bool force, int priority);
+void     homa_pacer_clamp_urgent_prio(struct homa_pacer *pacer);
+#else /* See strip.py */
 int      homa_pacer_check_nic_q(struct homa_pacer *pacer,
 				struct sk_buff *skb, bool force);
+#endif /* See strip.py */
 int      homa_pacer_dointvec(const struct ctl_table *table, int write,
 			     void *buffer, size_t *lenp, loff_t *ppos);
 void     homa_pacer_free(struct homa_pacer *pacer);
@@ -160,8 +216,12 @@ void     homa_pacer_unmanage_rpc(struct homa_rpc *rpc);
 void     homa_pacer_log_throttled(struct homa_pacer *pacer);
 int      homa_pacer_main(void *transport);
 void     homa_pacer_manage_rpc(struct homa_rpc *rpc);
+bool     homa_pacer_outranked(struct homa_pacer *pacer,
+			      struct homa_rpc *rpc);
+u64      homa_pacer_predict_cycles(struct homa_pacer *pacer, int length);
 void     homa_pacer_throttle_lock_slow(struct homa_pacer *pacer);
 void     homa_pacer_update_sysctl_deps(struct homa_pacer *pacer);
+void     homa_pacer_update_unsent(struct homa_rpc *rpc);
 void     homa_pacer_xmit(struct homa_pacer *pacer);
 
 /**
@@ -7,7 +7,9 @@
 #include "homa_impl.h"
 #ifndef __STRIP__ /* See strip.py */
 #include "homa_grant.h"
+#include "homa_impair.h"
 #include "homa_offload.h"
+#include "homa_sndbuf.h"
 #endif /* See strip.py */
 #include "homa_pacer.h"
 #include "homa_peer.h"
@@ -169,6 +171,10 @@ static struct inet6_protocol homav6_protocol = {
  * to pointers into a net-specific struct homa later.
  */
 #define OFFSET(field) ((void *)offsetof(struct homa, field))
+
+/* Largest legal value for the udp_encap_port sysctl parameter. */
+static int homa_max_udp_port = 65535;
+
 static struct ctl_table homa_ctl_table[] = {
 	{
 		.procname	= "accept_bits",
@@ -226,6 +232,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "flow_chunk_bytes",
+		.data		= OFFSET(flow_chunk_bytes),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
+	{
+		.procname	= "flow_spray",
+		.data		= OFFSET(flow_spray),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "freeze_type",
 		.data		= OFFSET(freeze_type),
@@ -317,6 +337,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "prio_adapt_ticks",
+		.data		= OFFSET(prio_adapt_ticks),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "priority_map",
 		.data		= OFFSET(priority_map),
@@ -331,6 +358,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "reorder_usecs",
+		.data		= OFFSET(reorder_usecs),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "request_ack_ticks",
 		.data		= OFFSET(request_ack_ticks),
@@ -366,6 +400,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "skb_page_reserve_ms",
+		.data		= OFFSET(skb_page_reserve_ms),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "temp",
 		.data		= OFFSET(temp[0]),
@@ -373,6 +414,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "teardown_rpcs",
+		.data		= OFFSET(teardown_rpcs),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "timeout_resends",
 		.data		= OFFSET(timeout_resends),
@@ -387,6 +435,15 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "udp_encap_port",
+		.data		= OFFSET(udp_encap_port),
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_sysctl_udp_encap_port,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= &homa_max_udp_port
+	},
 	{
 		.procname	= "unsched_bytes",
 		.data		= OFFSET(unsched_bytes),
@@ -905,6 +962,32 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 		else
 			hsk->is_server = false;
 		ret = 0;
+#ifndef __STRIP__ /* See strip.py */
+	} else if (optname == SO_HOMA_GRANT_WEIGHT) {
+		int arg;
+
+		if (optlen != sizeof(arg))
+			return -EINVAL;
+
+		if (copy_from_sockptr(&arg, optval, optlen))
+			return -EFAULT;
+
+		if (arg < 1 || arg > HOMA_MAX_GRANT_WEIGHT)
+			return -EINVAL;
+		homa_grant_set_weight(hsk, arg);
+		ret = 0;
+	} else if (optname == SO_HOMA_SNDBUF) {
+		struct homa_sndbuf_args args;
+
+		if (optlen != sizeof(struct homa_sndbuf_args))
+			return -EINVAL;
+
+		if (copy_from_sockptr(&args, optval, optlen))
+			return -EFAULT;
+
+		ret = homa_sndbuf_set_region(hsk, u64_to_user_ptr(args.start),
+					     args.length);
+#endif /* See strip.py */
 	} else {
 		ret = -ENOPROTOOPT;
 	}
@@ -927,6 +1010,8 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 {
 	struct homa_sock *hsk = homa_sk(sk);
 	struct homa_rcvbuf_args rcvbuf_args;
+	IF_NO_STRIP(struct homa_sndbuf_args sndbuf_args);
+	IF_NO_STRIP(int grant_weight);
 	void *result;
 	int is_server;
 	int len;
@@ -952,6 +1037,22 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 		is_server = hsk->is_server;
 		len = sizeof(is_server);
 		result = &is_server;
+#ifndef __STRIP__ /* See strip.py */
+	} else if (optname == SO_HOMA_GRANT_WEIGHT) {
+		if (len < sizeof(grant_weight))
+			return -EINVAL;
+
+		grant_weight = READ_ONCE(hsk->grant_weight);
+		len = sizeof(grant_weight);
+		result = &grant_weight;
+	} else if (optname == SO_HOMA_SNDBUF) {
+		if (len < sizeof(sndbuf_args))
+			return -EINVAL;
+
+		homa_sndbuf_get_args(hsk, &sndbuf_args);
+		len = sizeof(sndbuf_args);
+		result = &sndbuf_args;
+#endif /* See strip.py */
 	} else {
 		return -ENOPROTOOPT;
 	}
@@ -976,9 +1077,11 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
 {
 	struct homa_sock *hsk = homa_sk(sk);
+	struct iov_iter *iter = &msg->msg_iter;
 	struct homa_sendmsg_args args;
 	union sockaddr_in_union *addr;
 #ifndef __STRIP__ /* See strip.py */
+	struct iov_iter sndbuf_iter;
 	u64 start = homa_clock();
 #endif /* See strip.py */
 	struct homa_rpc *rpc = NULL;
@@ -1006,11 +1109,18 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
 		result = -EFAULT;
 		goto error;
 	}
-	if (args.flags & ~HOMA_SENDMSG_VALID_FLAGS ||
-	    args.reserved != 0) {
+	if (args.flags & ~HOMA_SENDMSG_VALID_FLAGS) {
 		result = -EINVAL;
 		goto error;
 	}
+#ifndef __STRIP__ /* See strip.py */
+	if (args.flags & HOMA_SENDMSG_SNDBUF) {
+		result = homa_sndbuf_import_offset(hsk, iter, &sndbuf_iter);
+		if (result != 0)
+			goto error;
+		iter = &sndbuf_iter;
+	}
+#endif /* See strip.py */
 
 	if (!homa_sock_wmem_avl(hsk)) {
 		result = homa_sock_wait_wmem(hsk,
@@ -1033,6 +1143,19 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
 
 	if (!args.id) {
 		/* This is a request message. */
+		if (args.deadline_us != 0 &&
+		    homa_pacer_predict_cycles(hsk->homa->pacer, length) >
+		    homa_usecs_to_cycles(args.deadline_us)) {
+			/* Admission control: the host is so backlogged that
+			 * this request can't meet its deadline, so reject it
+			 * now to let the application shed load.
+			 */
+			tt_record2("homa_sendmsg rejecting request of length %d: deadline %d usecs",
+				   length, args.deadline_us);
+			INC_METRIC(send_deadline_rejects, 1);
+			result = -ETIME;
+			goto error;
+		}
 		rpc = homa_rpc_alloc_client(hsk, addr);
 		if (IS_ERR(rpc)) {
 			result = PTR_ERR(rpc);
@@ -1048,7 +1171,10 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
 			   : tt_addr(addr->in6.sin6_addr),
 			   ntohs(addr->in6.sin6_port), rpc->id, length);
 		rpc->completion_cookie = args.completion_cookie;
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
+		if (args.deadline_us != 0)
+			rpc->deadline = rpc->start_time +
+					homa_usecs_to_cycles(args.deadline_us);
+		result = homa_message_out_fill(rpc, iter, 1);
 		if (result)
 			goto error;
 		args.id = rpc->id;
@@ -1104,7 +1230,7 @@ int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
 		}
 		rpc->state = RPC_OUTGOING;
 
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
+		result = homa_message_out_fill(rpc, iter, 1);
 		if (result && rpc->state != RPC_DEAD)
 			goto error;
 		homa_rpc_unlock(rpc); /* Locked by homa_rpc_find_server. */
@@ -1165,6 +1291,7 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 				    sizeof(control))))
 		return -EFAULT;
 	control.completion_cookie = 0;
+	control.deadline_us = 0;
 	tt_record2("homa_recvmsg starting, port %d, pid %d",
 		   hsk->port, current->pid);
 
@@ -1232,6 +1359,8 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 	/* Collect result information. */
 	control.id = rpc->id;
 	control.completion_cookie = rpc->completion_cookie;
+	if (!homa_is_client(rpc->id))
+		control.deadline_us = homa_rpc_usecs_left(rpc);
 	if (likely(rpc->msgin.length >= 0)) {
 		control.num_bpages = rpc->msgin.num_bpages;
 		memcpy(control.bpage_offsets, rpc->msgin.bpage_offsets,
@@ -1327,7 +1456,8 @@ int homa_softirq(struct sk_buff *skb)
 {
 	struct sk_buff *packets, *other_pkts, *next;
 	struct sk_buff **prev_link, **other_link;
-	IF_NO_STRIP(struct homa *homa = homa_from_skb(skb));
+	IF_NO_STRIP(struct homa_net *hnet = homa_net_from_skb(skb));
+	IF_NO_STRIP(struct homa *homa = hnet->homa);
 	struct homa_common_hdr *h;
 	int header_offset;
 #ifndef __STRIP__ /* See strip.py */
@@ -1405,6 +1535,17 @@ int homa_softirq(struct sk_buff *skb)
 		}
 #endif /* See strip.py */
 
+#ifndef __STRIP__ /* See strip.py */
+		if (homa_impair_rx(hnet->impair, skb)) {
+			/* The packet was dropped or is being held; either
+			 * way it now belongs to the impairment stage (it may
+			 * already have been freed), so don't touch it again.
+			 */
+			*prev_link = next;
+			continue;
+		}
+#endif /* See strip.py */
+
 		/* Process the packet now if it is a control packet or
 		 * if it contains an entire short message.
 		 */
@@ -1470,6 +1611,7 @@ discard:
 	}
 
 #ifndef __STRIP__ /* See strip.py */
+	homa_impair_release(hnet->impair);
 	atomic_dec(&per_cpu(homa_offload_core, raw_smp_processor_id()).softirq_backlog);
 #endif /* See strip.py */
 	INC_METRIC(softirq_cycles, homa_clock() - start);
@@ -1487,7 +1629,6 @@ discard:
 int homa_err_handler_v4(struct sk_buff *skb, u32 info)
 {
 	const struct icmphdr *icmp = icmp_hdr(skb);
-	struct homa *homa = homa_from_skb(skb);
 	struct in6_addr daddr;
 	int type = icmp->type;
 	int code = icmp->code;
@@ -1513,7 +1654,7 @@ int homa_err_handler_v4(struct sk_buff *skb, u32 info)
 			  __func__, info, type, code);
 	}
 	if (error != 0)
-		homa_abort_rpcs(homa, &daddr, port, error);
+		homa_abort_rpcs(homa_net_from_skb(skb), &daddr, port, error);
 	return 0;
 }
 
@@ -1533,7 +1674,6 @@ int homa_err_handler_v6(struct sk_buff *skb, struct inet6_skb_parm *opt,
 			u8 type,  u8 code,  int offset,  __be32 info)
 {
 	const struct ipv6hdr *iph = (const struct ipv6hdr *)skb->data;
-	struct homa *homa = homa_from_skb(skb);
 	int error = 0;
 	int port = 0;
 
@@ -1549,7 +1689,8 @@ int homa_err_handler_v6(struct sk_buff *skb, struct inet6_skb_parm *opt,
 		error = -EPROTONOSUPPORT;
 	}
 	if (error != 0)
-		homa_abort_rpcs(homa, &iph->daddr, port, error);
+		homa_abort_rpcs(homa_net_from_skb(skb), &iph->daddr, port,
+				error);
 	return 0;
 }
 
@@ -1748,6 +1889,42 @@ done:
 	kfree(values);
 	return result;
 }
+
+/**
+ * homa_sysctl_udp_encap_port() - This function is invoked to handle sysctl
+ * requests for the "udp_encap_port" target: it range-checks new values
+ * and opens or closes the UDP tunnel sockets for every network namespace.
+ * If the sockets can't be opened in some namespace, the old port is
+ * restored everywhere.
+ * @table:    sysctl table describing value to be read or written.
+ * @write:    Nonzero means value is being written, 0 means read.
+ * @buffer:   Address in user space of the input/output data.
+ * @lenp:     Not exactly sure.
+ * @ppos:     Not exactly sure.
+ *
+ * Return: 0 for success, nonzero for error.
+ */
+int homa_sysctl_udp_encap_port(const struct ctl_table *table, int write,
+			       void *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct homa *homa = homa_net_from_net(current->nsproxy->net_ns)->homa;
+	struct ctl_table table_copy;
+	int old_port, result;
+
+	table_copy = *table;
+	table_copy.data = ((char *)homa) + (uintptr_t)table_copy.data;
+	old_port = homa->udp_encap_port;
+	result = proc_dointvec_minmax(&table_copy, write, buffer, lenp, ppos);
+	if (!write || result != 0)
+		return result;
+
+	result = homa_udp_tunnel_update_all(homa);
+	if (result != 0) {
+		WRITE_ONCE(homa->udp_encap_port, old_port);
+		homa_udp_tunnel_update_all(homa);
+	}
+	return result;
+}
 #endif /* See strip.py */
 
 /**
@@ -61,6 +61,7 @@ struct homa_rpc *homa_rpc_alloc_client(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&crpc->dead_links);
 #ifndef __STRIP__ /* See strip.py */
 	INIT_LIST_HEAD(&crpc->grantable_links);
+	INIT_LIST_HEAD(&crpc->fifo_links);
 #endif /* See strip.py */
 	INIT_LIST_HEAD(&crpc->throttled_links);
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
@@ -119,6 +120,7 @@ struct homa_rpc *homa_rpc_alloc_server(struct homa_sock *hsk,
 	u64 id = homa_local_id(h->common.sender_id);
 	struct homa_rpc_bucket *bucket;
 	struct homa_rpc *srpc = NULL;
+	u32 deadline_us;
 	int err;
 
 	if (!hsk->buffer_pool)
@@ -165,11 +167,16 @@ struct homa_rpc *homa_rpc_alloc_server(struct homa_sock *hsk,
 	INIT_LIST_HEAD(&srpc->dead_links);
 #ifndef __STRIP__ /* See strip.py */
 	INIT_LIST_HEAD(&srpc->grantable_links);
+	INIT_LIST_HEAD(&srpc->fifo_links);
 #endif /* See strip.py */
 	INIT_LIST_HEAD(&srpc->throttled_links);
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->magic = HOMA_RPC_MAGIC;
 	srpc->start_time = homa_clock();
+	deadline_us = homa_data_get_deadline(h);
+	if (deadline_us != 0 && deadline_us != HOMA_MAX_WIRE_DEADLINE)
+		srpc->deadline = srpc->start_time +
+				 homa_usecs_to_cycles(deadline_us);
 #ifndef __STRIP__ /* See strip.py */
 	tt_record2("Incoming message for id %d has %d unscheduled bytes",
 		   srpc->id, ntohl(h->incoming));
@@ -313,6 +320,7 @@ void homa_rpc_end(struct homa_rpc *rpc)
 		}
 	}
 	rpc->hsk->dead_skbs += rpc->msgout.num_skbs;
+	homa_pacer_update_unsent(rpc);
 	if (rpc->hsk->dead_skbs > rpc->hsk->homa->max_dead_buffs)
 		/* This update isn't thread-safe; it's just a
 		 * statistic so it's OK if updates occasionally get
@@ -329,8 +337,9 @@ void homa_rpc_end(struct homa_rpc *rpc)
  * @rpc:     RPC to be terminated.  Must be locked by caller.
  * @error:   A negative errno value indicating the error that caused the abort.
  *           If this is a client RPC, the error will be returned to the
- *           application; if it's a server RPC, the error is ignored and
- *           we just free the RPC.
+ *           application (and no more of the request will be transmitted);
+ *           if it's a server RPC, the error is ignored and we just free
+ *           the RPC.
  */
 void homa_rpc_abort(struct homa_rpc *rpc, int error)
 	__must_hold(rpc_bucket_lock)
@@ -345,46 +354,86 @@ void homa_rpc_abort(struct homa_rpc *rpc, int error)
 	tt_record3("aborting client RPC: peer 0x%x, id %d, error %d",
 		   tt_addr(rpc->peer->addr), rpc->id, error);
 	rpc->error = error;
+	homa_pacer_unmanage_rpc(rpc);
 	homa_rpc_handoff(rpc);
 }
 
+/**
+ * homa_abort_bucket_rpcs() - Abort all of the RPCs in one hash table
+ * bucket that are to/from a particular peer. Helper for homa_abort_rpcs.
+ * @bucket:  Bucket to scan; must not be locked by the caller.
+ * @id:      An RPC id of the same kind (client or server) as the RPCs in
+ *           @bucket; used only for lock metrics.
+ * @addr:    Address (network order) of the peer whose RPCs are to be
+ *           aborted.
+ * @port:    If nonzero, then RPCs will only be aborted if they were
+ *	     targeted at this server port.
+ * @error:   Negative errno value indicating the reason for the abort.
+ */
+static void homa_abort_bucket_rpcs(struct homa_rpc_bucket *bucket, u64 id,
+				   const struct in6_addr *addr, int port,
+				   int error)
+{
+	struct homa_rpc *rpc;
+
+	/* Skip the lock acquisition if there's no work to do. */
+	if (hlist_empty(&bucket->rpcs))
+		return;
+	homa_bucket_lock(bucket, id);
+restart:
+	hlist_for_each_entry(rpc, &bucket->rpcs, hash_links) {
+		if (!ipv6_addr_equal(&rpc->peer->addr, addr))
+			continue;
+		if (port && rpc->dport != port)
+			continue;
+		if (homa_is_client(rpc->id)) {
+			if (!rpc->error)
+				homa_rpc_abort(rpc, error);
+			continue;
+		}
+
+		/* Aborting a server RPC removes it from the bucket, and
+		 * homa_grant_end_rpc may release the bucket lock briefly,
+		 * so the scan must start over.
+		 */
+		homa_rpc_abort(rpc, error);
+		goto restart;
+	}
+	homa_bucket_unlock(bucket, id);
+}
+
 /**
  * homa_abort_rpcs() - Abort all RPCs to/from a particular peer.
- * @homa:    Overall data about the Homa protocol implementation.
+ * @hnet:    Network namespace in which to abort RPCs.
  * @addr:    Address (network order) of the destination whose RPCs are
  *           to be aborted.
  * @port:    If nonzero, then RPCs will only be aborted if they were
  *	     targeted at this server port.
  * @error:   Negative errno value indicating the reason for the abort.
  */
-void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
+void homa_abort_rpcs(struct homa_net *hnet, const struct in6_addr *addr,
 		     int port, int error)
 {
 	struct homa_socktab_scan scan;
-	struct homa_rpc *rpc;
 	struct homa_sock *hsk;
+	int i;
 
-	for (hsk = homa_socktab_start_scan(homa->socktab, &scan); hsk;
+	/* RPCs are found through each socket's hash buckets rather than
+	 * through any per-peer index, so that the RPC creation and
+	 * deletion paths don't have to maintain a shared structure. The
+	 * bucket locks also serve as the RPC locks, so no RPC needs to
+	 * be locked individually.
+	 */
+	for (hsk = homa_socktab_start_scan(hnet->homa->socktab, &scan); hsk;
 	     hsk = homa_socktab_next(&scan)) {
-		/* Skip the (expensive) lock acquisition if there's no
-		 * work to do.
-		 */
-		if (list_empty(&hsk->active_rpcs))
-			continue;
-		if (!homa_protect_rpcs(hsk))
+		if (hsk->hnet != hnet || list_empty(&hsk->active_rpcs))
 			continue;
-		rcu_read_lock();
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
-			if (!ipv6_addr_equal(&rpc->peer->addr, addr))
-				continue;
-			if (port && rpc->dport != port)
-				continue;
-			homa_rpc_lock(rpc);
-			homa_rpc_abort(rpc, error);
-			homa_rpc_unlock(rpc);
-		}
-		rcu_read_unlock();
-		homa_unprotect_rpcs(hsk);
+		for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++)
+			homa_abort_bucket_rpcs(&hsk->client_rpc_buckets[i], 0,
+					       addr, port, error);
+		for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++)
+			homa_abort_bucket_rpcs(&hsk->server_rpc_buckets[i], 1,
+					       addr, port, error);
 	}
 	homa_socktab_end_scan(&scan);
 }
@@ -92,6 +92,18 @@ struct homa_message_out {
 	 * Used to find the oldest outgoing message.
 	 */
 	u64 init_time;
+
+	/**
+	 * @track_unsent: True means this message's unsent bytes are counted
+	 * in homa->pacer->unsent_bytes (see homa_pacer_update_unsent).
+	 */
+	bool track_unsent;
+
+	/**
+	 * @unsent_recorded: Number of bytes currently included in
+	 * homa->pacer->unsent_bytes for this message.
+	 */
+	int unsent_recorded;
 };
 
 /**
@@ -106,8 +118,9 @@ struct homa_gap {
 	int end;
 
 	/**
-	 * @time: homa_clock() time when the gap was first detected.
-	 * As of 7/2024 this isn't used for anything.
+	 * @time: homa_clock() time when the gap was first detected. Used
+	 * to defer RESENDs for gaps that may be due to reordering (see the
+	 * reorder_usecs sysctl parameter).
 	 */
 	u64 time;
 
@@ -368,6 +381,14 @@ struct homa_rpc {
 	 * accessing.
 	 */
 	struct list_head grantable_links;
+
+	/**
+	 * @fifo_links: Used to link this RPC into homa->grant->fifo_rpcs
+	 * while its incoming message is managed for grants. If this RPC
+	 * isn't in fifo_rpcs, this is an empty list pointing to itself.
+	 * Must hold homa->grant->lock when accessing.
+	 */
+	struct list_head fifo_links;
 #endif /* See strip.py */
 
 	/**
@@ -413,9 +434,17 @@ struct homa_rpc {
 	 * occasionally for testing.
 	 */
 	u64 start_time;
+
+	/**
+	 * @deadline: homa_clock() time by which this RPC must complete, or
+	 * 0 if it has no deadline. Once the deadline has passed, no more
+	 * grants are issued for the RPC's incoming message and homa_timer
+	 * discards the RPC.
+	 */
+	u64 deadline;
 };
 
-void     homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
+void     homa_abort_rpcs(struct homa_net *hnet, const struct in6_addr *addr,
 			 int port, int error);
 void     homa_abort_sock_rpcs(struct homa_sock *hsk, int error);
 void     homa_rpc_abort(struct homa_rpc *crpc, int error);
@@ -553,4 +582,41 @@ static inline bool homa_rpc_needs_attention(struct homa_rpc *rpc)
 	return (rpc->error != 0 || atomic_read(&rpc->flags) & RPC_PKTS_READY);
 }
 
+/**
+ * homa_rpc_expired() - Returns true if @rpc has a deadline and the
+ * deadline has passed.
+ * @rpc:  RPC to check.
+ * @now:  Current time, in homa_clock() units.
+ * Return: See above.
+ */
+static inline bool homa_rpc_expired(struct homa_rpc *rpc, u64 now)
+{
+	return rpc->deadline != 0 && now >= rpc->deadline;
+}
+
+/**
+ * homa_rpc_usecs_left() - Returns the number of microseconds remaining
+ * before @rpc's deadline, in the form used for DATA packets and recvmsg
+ * results.
+ * @rpc:  RPC of interest.
+ * Return: 0 if @rpc has no deadline; otherwise the number of microseconds
+ *         left, but at least 1 (so the value won't be mistaken for "no
+ *         deadline" once the deadline has passed).
+ */
+static inline u32 homa_rpc_usecs_left(struct homa_rpc *rpc)
+{
+	u64 now, left;
+
+	if (rpc->deadline == 0)
+		return 0;
+	now = homa_clock();
+	if (now >= rpc->deadline)
+		return 1;
+	left = (rpc->deadline - now) * 1000;
+	do_div(left, homa_clock_khz());
+	if (left == 0)
+		return 1;
+	return left > U32_MAX ? U32_MAX : left;
+}
+
 #endif /* _HOMA_RPC_H */
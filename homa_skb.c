@@ -39,6 +39,8 @@ int homa_skb_init(struct homa *homa)
 	homa->pages_to_free_slots = 0;
 	homa->skb_page_free_time = 0;
 	homa->skb_page_pool_min_kb = (3 * HOMA_MAX_MESSAGE_LENGTH) / 1000;
+	homa->skb_page_reserve_ms = 5;
+	homa->skb_page_pressure_time = 0;
 
 	/* Initialize NUMA-specfific page pools. */
 	homa->max_numa = -1;
@@ -60,6 +62,29 @@ int homa_skb_init(struct homa *homa)
 		skb_core->pool = homa->page_pools[numa];
 	}
 	pr_notice("%s found max NUMA node %d\n", __func__, homa->max_numa);
+
+	homa->skb_page_shrinker = shrinker_alloc(SHRINKER_NUMA_AWARE,
+						 "homa-skb-pages");
+	if (!homa->skb_page_shrinker)
+		return -ENOMEM;
+	homa->skb_page_shrinker->count_objects = homa_skb_shrink_count;
+	homa->skb_page_shrinker->scan_objects = homa_skb_shrink_scan;
+	homa->skb_page_shrinker->private_data = homa;
+	shrinker_register(homa->skb_page_shrinker);
+
+	homa->skb_refill_exit = false;
+	init_waitqueue_head(&homa->skb_refill_wait_queue);
+	init_completion(&homa->skb_refill_done);
+	homa->skb_refill_kthread = kthread_run(homa_skb_refill_main, homa,
+					       "homa_skb_refill");
+	if (IS_ERR(homa->skb_refill_kthread)) {
+		int err = PTR_ERR(homa->skb_refill_kthread);
+
+		homa->skb_refill_kthread = NULL;
+		pr_err("Homa couldn't create skb refill thread: error %d\n",
+		       err);
+		return err;
+	}
 	return 0;
 }
 
@@ -72,6 +97,21 @@ void homa_skb_cleanup(struct homa *homa)
 {
 	int i, j;
 
+	/* The refill thread and the shrinker must both be stopped before
+	 * freeing pools, so that they can't access the pools concurrently.
+	 */
+	if (homa->skb_refill_kthread) {
+		homa->skb_refill_exit = true;
+		wake_up(&homa->skb_refill_wait_queue);
+		kthread_stop(homa->skb_refill_kthread);
+		wait_for_completion(&homa->skb_refill_done);
+		homa->skb_refill_kthread = NULL;
+	}
+	if (homa->skb_page_shrinker) {
+		shrinker_free(homa->skb_page_shrinker);
+		homa->skb_page_shrinker = NULL;
+	}
+
 	for (i = 0; i < nr_cpu_ids; i++) {
 		struct homa_skb_core *skb_core = &per_cpu(homa_skb_core, i);
 
@@ -85,6 +125,8 @@ void homa_skb_cleanup(struct homa *homa)
 			put_page(skb_core->stashed_pages[j]);
 		skb_core->pool = NULL;
 		skb_core->num_stashed_pages = 0;
+		skb_core->pages_used = 0;
+		skb_core->pages_used_snapshot = 0;
 	}
 
 	for (i = 0; i < MAX_NUMNODES; i++) {
@@ -257,6 +299,7 @@ bool homa_skb_page_alloc(struct homa *homa, struct homa_skb_core *skb_core)
 		}
 		put_page(skb_core->skb_page);
 	}
+	skb_core->pages_used++;
 
 	/* Step 1: does this core have a stashed page? */
 	skb_core->page_size = HOMA_SKB_PAGE_SIZE;
@@ -579,15 +622,65 @@ void homa_skb_get(struct sk_buff *skb, void *dest, int offset, int length)
 	}
 }
 
+/**
+ * homa_skb_update_targets() - Recompute the demand for each sk_buff page
+ * pool, based on the pages used by its cores since the last call, and
+ * from that the number of free pages the pool should try to keep on hand.
+ * Invoked by homa_skb_release_pages every 0.5 second.
+ * @homa:  Overall information about the Homa transport.
+ */
+void homa_skb_update_targets(struct homa *homa)
+{
+	int i, core;
+
+	for (i = 0; i <= homa->max_numa; i++) {
+		struct homa_page_pool *pool = homa->page_pools[i];
+		int target, used;
+
+		if (!pool)
+			continue;
+		used = 0;
+		for (core = 0; core < nr_cpu_ids; core++) {
+			struct homa_skb_core *skb_core;
+			u32 count;
+
+			skb_core = &per_cpu(homa_skb_core, core);
+			if (skb_core->pool != pool)
+				continue;
+			count = READ_ONCE(skb_core->pages_used);
+			used += count - skb_core->pages_used_snapshot;
+			skb_core->pages_used_snapshot = count;
+		}
+
+		/* Respond immediately to increases in demand, but back off
+		 * gradually so that a brief lull doesn't discard the reserve.
+		 */
+		pool->demand = (pool->demand + used) / 2;
+		if (pool->demand < used)
+			pool->demand = used;
+
+		/* Demand is measured over 500 ms. */
+		target = div_u64((u64)pool->demand * homa->skb_page_reserve_ms,
+				 500);
+		if (target > HOMA_PAGE_POOL_SIZE)
+			target = HOMA_PAGE_POOL_SIZE;
+		WRITE_ONCE(pool->target, target);
+		tt_record3("NUMA node %d skb page demand %d, target %d",
+			   i, pool->demand, target);
+	}
+}
+
 /**
  * homa_skb_release_pages() - This function is invoked occasionally; it's
  * job is to gradually release pages from the sk_buff page pools back to
- * Linux, based on sysctl parameters such as skb_page_frees_per_sec.
+ * Linux, based on sysctl parameters such as skb_page_frees_per_sec. Pages
+ * are released only if they exceed both skb_page_pool_min_kb and the
+ * pool's demand-based target.
  * @homa:  Overall information about the Homa transport.
  */
 void homa_skb_release_pages(struct homa *homa)
 {
-	int i, max_low_mark, min_pages, release, release_max;
+	int i, max_excess, min_pages, release, release_max;
 	struct homa_page_pool *max_pool;
 	u64 now = homa_clock();
 
@@ -596,6 +689,7 @@ void homa_skb_release_pages(struct homa *homa)
 
 	/* Free pages every 0.5 second. */
 	homa->skb_page_free_time = now + (500 * homa_clock_khz());
+	homa_skb_update_targets(homa);
 	release_max = homa->skb_page_frees_per_sec / 2;
 	if (homa->pages_to_free_slots < release_max) {
 		struct page **old = homa->skb_pages_to_free;
@@ -613,30 +707,37 @@ void homa_skb_release_pages(struct homa *homa)
 	}
 
 	/* Find the pool with the largest number of pages that haven't
-	 * been used recently.
+	 * been used recently and aren't needed for its reserve.
 	 */
-	max_low_mark = -1;
+	min_pages = ((homa->skb_page_pool_min_kb * 1000)
+			+ (HOMA_SKB_PAGE_SIZE - 1)) / HOMA_SKB_PAGE_SIZE;
+	max_excess = 0;
+	max_pool = NULL;
 	spin_lock_bh(&homa->page_pool_mutex);
 	for (i = 0; i <= homa->max_numa; i++) {
 		struct homa_page_pool *pool = homa->page_pools[i];
+		int pool_keep;
 
 		if (!pool)
 			continue;
-		if (pool->low_mark > max_low_mark) {
-			max_low_mark = pool->low_mark;
+		pool_keep = max(min_pages, pool->target);
+		if (pool->low_mark - pool_keep > max_excess) {
+			max_excess = pool->low_mark - pool_keep;
 			max_pool = pool;
 		}
 		tt_record3("NUMA node %d has %d pages in skb page pool, low mark %d",
 			   i, pool->avail, pool->low_mark);
 		pool->low_mark = pool->avail;
 	}
+	if (!max_pool) {
+		spin_unlock_bh(&homa->page_pool_mutex);
+		return;
+	}
 
 	/* Collect pages to free (but don't free them until after
 	 * releasing the lock, since freeing is expensive).
 	 */
-	min_pages = ((homa->skb_page_pool_min_kb * 1000)
-			+ (HOMA_SKB_PAGE_SIZE - 1)) / HOMA_SKB_PAGE_SIZE;
-	release = max_low_mark - min_pages;
+	release = max_excess;
 	if (release > release_max)
 		release = release_max;
 	for (i = 0; i < release; i++) {
@@ -655,3 +756,179 @@ void homa_skb_release_pages(struct homa *homa)
 		put_page(page);
 	}
 }
+
+/**
+ * homa_skb_request_refill() - Invoked by the timer thread; wakes up the
+ * refill thread if any sk_buff page pool has fallen below its target.
+ * This function doesn't allocate any pages itself.
+ * @homa:  Overall information about the Homa transport.
+ */
+void homa_skb_request_refill(struct homa *homa)
+{
+	struct homa_page_pool *pool;
+	int node;
+
+	if (homa_clock() < READ_ONCE(homa->skb_page_pressure_time))
+		return;
+	for (node = 0; node <= homa->max_numa; node++) {
+		pool = homa->page_pools[node];
+		if (!pool)
+			continue;
+		if (READ_ONCE(pool->avail) < READ_ONCE(pool->target)) {
+			WRITE_ONCE(homa->skb_refill_needed, true);
+			wake_up(&homa->skb_refill_wait_queue);
+			return;
+		}
+	}
+}
+
+/**
+ * homa_skb_refill_main() - Top-level function for the thread that refills
+ * sk_buff page pools.
+ * @arg:   Pointer to the struct homa.
+ *
+ * Return: Always 0.
+ */
+int homa_skb_refill_main(void *arg)
+{
+	struct homa *homa = arg;
+	int status;
+
+	while (1) {
+		if (homa->skb_refill_exit)
+			break;
+		if (READ_ONCE(homa->skb_refill_needed)) {
+			WRITE_ONCE(homa->skb_refill_needed, false);
+			homa_skb_refill_pages(homa);
+		}
+		status = wait_event_interruptible(homa->skb_refill_wait_queue,
+				homa->skb_refill_exit ||
+				READ_ONCE(homa->skb_refill_needed));
+		if (status != 0 && status != -ERESTARTSYS)
+			break;
+	}
+	kthread_complete_and_exit(&homa->skb_refill_done, 0);
+	return 0;
+}
+
+/**
+ * homa_skb_refill_pages() - Allocate pages in the background so that each
+ * sk_buff page pool holds at least its target number of free pages; this
+ * keeps page allocation (and its latency) off the transmit path. Invoked
+ * by the refill thread; refilling is suspended for a while after the
+ * kernel has reclaimed pages through the shrinker. Pages come only from
+ * each pool's own NUMA node (a page from another node would just be
+ * cached in that node's pool). Must be invoked in process context with
+ * no locks held.
+ * @homa:  Overall information about the Homa transport.
+ */
+void homa_skb_refill_pages(struct homa *homa)
+{
+	struct page *pages[HOMA_SKB_REFILL_BATCH];
+	int i, node, needed;
+
+	if (homa_clock() < READ_ONCE(homa->skb_page_pressure_time))
+		return;
+	for (node = 0; node <= homa->max_numa; node++) {
+		struct homa_page_pool *pool = homa->page_pools[node];
+
+		if (!pool)
+			continue;
+		needed = READ_ONCE(pool->target) - READ_ONCE(pool->avail);
+		if (needed <= 0)
+			continue;
+		if (needed > HOMA_SKB_REFILL_BATCH)
+			needed = HOMA_SKB_REFILL_BATCH;
+		for (i = 0; i < needed; i++) {
+			pages[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP
+					| __GFP_NOWARN | __GFP_NORETRY
+					| __GFP_THISNODE,
+					HOMA_SKB_PAGE_ORDER);
+			if (!pages[i])
+				break;
+		}
+		if (i == 0)
+			continue;
+		tt_record2("homa_skb_refill_pages adding %d pages to pool for NUMA node %d",
+			   i, node);
+		homa_skb_cache_pages(homa, pages, i);
+		INC_METRIC(skb_page_refills, i);
+	}
+}
+
+/**
+ * homa_skb_shrink_count() - Shrinker callback that tells the kernel how
+ * many free pages Homa could release from an sk_buff page pool.
+ * @shrinker:  Homa's shrinker; private_data refers to the struct homa.
+ * @sc:        Describes the reclaim request; @sc->nid selects the pool.
+ * Return:     Number of pages in the pool, or SHRINK_EMPTY.
+ */
+unsigned long homa_skb_shrink_count(struct shrinker *shrinker,
+				    struct shrink_control *sc)
+{
+	struct homa *homa = shrinker->private_data;
+	struct homa_page_pool *pool;
+	int avail;
+
+	if (sc->nid < 0 || sc->nid > homa->max_numa)
+		return SHRINK_EMPTY;
+	pool = homa->page_pools[sc->nid];
+	if (!pool)
+		return SHRINK_EMPTY;
+	avail = READ_ONCE(pool->avail);
+	return avail ? avail : SHRINK_EMPTY;
+}
+
+/**
+ * homa_skb_shrink_scan() - Shrinker callback that releases free pages
+ * from an sk_buff page pool when the kernel is short of memory. Background
+ * refilling of the pools is suspended for HOMA_SKB_PRESSURE_MS afterwards.
+ * @shrinker:  Homa's shrinker; private_data refers to the struct homa.
+ * @sc:        Describes the reclaim request: @sc->nid selects the pool and
+ *             @sc->nr_to_scan is the maximum number of pages to release.
+ * Return:     Number of pages released, or SHRINK_STOP if none.
+ */
+unsigned long homa_skb_shrink_scan(struct shrinker *shrinker,
+				   struct shrink_control *sc)
+{
+	struct homa *homa = shrinker->private_data;
+	struct page *pages[HOMA_SKB_REFILL_BATCH];
+	struct homa_page_pool *pool;
+	unsigned long freed = 0;
+	int i, count;
+
+	WRITE_ONCE(homa->skb_page_pressure_time, homa_clock() +
+		   HOMA_SKB_PRESSURE_MS * homa_clock_khz());
+	if (sc->nid < 0 || sc->nid > homa->max_numa)
+		return SHRINK_STOP;
+	pool = homa->page_pools[sc->nid];
+	if (!pool)
+		return SHRINK_STOP;
+
+	/* Remove pages in batches, freeing them after releasing the lock. */
+	while (freed < sc->nr_to_scan) {
+		count = HOMA_SKB_REFILL_BATCH;
+		if (count > sc->nr_to_scan - freed)
+			count = sc->nr_to_scan - freed;
+		spin_lock_bh(&homa->page_pool_mutex);
+		if (count > pool->avail)
+			count = pool->avail;
+		for (i = 0; i < count; i++) {
+			pool->avail--;
+			pages[i] = pool->pages[pool->avail];
+		}
+		if (pool->low_mark > pool->avail)
+			pool->low_mark = pool->avail;
+		spin_unlock_bh(&homa->page_pool_mutex);
+		if (count == 0)
+			break;
+		for (i = 0; i < count; i++)
+			put_page(pages[i]);
+		freed += count;
+	}
+	sc->nr_scanned = freed;
+	INC_METRIC(skb_page_shrinks, freed);
+	tt_record2("homa_skb_shrink_scan released %d pages from NUMA node %d",
+		   freed, sc->nid);
+	return freed ? freed : SHRINK_STOP;
+}
@@ -8,6 +8,7 @@
 #define _HOMA_SKB_H
 
 #include <linux/percpu-defs.h>
+#include <linux/shrinker.h>
 
 /**
  * define HOMA_SKB_PAGE_ORDER - exponent (power of two) determining how
@@ -21,6 +22,19 @@
  */
 #define HOMA_SKB_PAGE_SIZE (PAGE_SIZE << HOMA_SKB_PAGE_ORDER)
 
+/**
+ * define HOMA_SKB_REFILL_BATCH - maximum number of pages that
+ * homa_skb_refill_pages will allocate for a single pool in one call.
+ */
+#define HOMA_SKB_REFILL_BATCH 16
+
+/**
+ * define HOMA_SKB_PRESSURE_MS - after the shrinker has reclaimed pages
+ * from the page pools, background refilling is suspended for this many
+ * milliseconds.
+ */
+#define HOMA_SKB_PRESSURE_MS 1000
+
 /**
  * struct homa_page_pool - A cache of free pages available for use in tx skbs.
  * Each page is of size HOMA_SKB_PAGE_SIZE, and a pool is dedicated for
@@ -37,6 +51,22 @@ struct homa_page_pool {
 	 */
 	int low_mark;
 
+	/**
+	 * @demand: Number of pages recently consumed from this pool (or
+	 * allocated because the pool was empty) per 0.5-second interval.
+	 * Grows immediately when demand increases but decays gradually.
+	 * Computed by homa_skb_update_targets.
+	 */
+	int demand;
+
+	/**
+	 * @target: Number of free pages this pool should hold, based on
+	 * @demand; homa_skb_refill_pages allocates pages in the background
+	 * to keep @avail at least this large, and homa_skb_release_pages
+	 * won't release pages below this level.
+	 */
+	int target;
+
 #define HOMA_PAGE_POOL_SIZE 1000
 
 	/**
@@ -92,6 +122,19 @@ struct homa_skb_core {
 	 * HOMA_SKB_PAGE_SIZE in length.
 	 */
 	struct page *stashed_pages[HOMA_MAX_STASHED(HOMA_MAX_MESSAGE_LENGTH)];
+
+	/**
+	 * @pages_used: total number of new pages that homa_skb_page_alloc
+	 * has started using on this core (wraps around). Used to compute
+	 * @homa_page_pool.demand.
+	 */
+	u32 pages_used;
+
+	/**
+	 * @pages_used_snapshot: value of @pages_used the last time it was
+	 * read by homa_skb_update_targets.
+	 */
+	u32 pages_used_snapshot;
 };
 DECLARE_PER_CPU(struct homa_skb_core, homa_skb_core);
 
@@ -118,7 +161,15 @@ void     homa_skb_get(struct sk_buff *skb, void *dest, int offset,
 int      homa_skb_init(struct homa *homa);
 bool     homa_skb_page_alloc(struct homa *homa,
 			     struct homa_skb_core *core);
+int      homa_skb_refill_main(void *arg);
+void     homa_skb_refill_pages(struct homa *homa);
 void     homa_skb_release_pages(struct homa *homa);
+void     homa_skb_request_refill(struct homa *homa);
+unsigned long homa_skb_shrink_count(struct shrinker *shrinker,
+				    struct shrink_control *sc);
+unsigned long homa_skb_shrink_scan(struct shrinker *shrinker,
+				   struct shrink_control *sc);
 void     homa_skb_stash_pages(struct homa *homa, int length);
+void     homa_skb_update_targets(struct homa *homa);
 
 #endif /* _HOMA_SKB_H */
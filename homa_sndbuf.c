@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* This file implements registered send regions (SO_HOMA_SNDBUF): regions
+ * of user memory that are pinned once, so that messages named by their
+ * offset within a region (HOMA_SENDMSG_SNDBUF) can be copied without
+ * faulting on or walking the page tables of the application's address
+ * space.
+ */
+
+#include "homa_impl.h"
+#include "homa_sndbuf.h"
+
+/**
+ * homa_sndbuf_alloc() - Pin the pages of a region of user memory and
+ * create a struct homa_sndbuf describing them. The pinned pages are
+ * charged against the RLIMIT_MEMLOCK limit of the current process.
+ * @start:    Address of the first byte of the region; must be page-aligned.
+ * @length:   Number of bytes in the region.
+ * Return:    The new struct, or an ERR_PTR if the region couldn't be pinned.
+ */
+struct homa_sndbuf *homa_sndbuf_alloc(void __user *start, size_t length)
+{
+	unsigned long addr = (unsigned long)start;
+	struct page *pages[HOMA_SNDBUF_PIN_BATCH];
+	struct mm_struct *mm = current->mm;
+	struct homa_sndbuf *sndbuf;
+	int i, num_pages, pinned, count, err;
+	unsigned long lock_limit;
+
+	if ((addr & ~PAGE_MASK) || length == 0 ||
+	    length > HOMA_SNDBUF_MAX_LENGTH)
+		return ERR_PTR(-EINVAL);
+	if (!mm)
+		return ERR_PTR(-EINVAL);
+	num_pages = (length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	sndbuf = kzalloc(sizeof(*sndbuf), GFP_KERNEL);
+	if (!sndbuf)
+		return ERR_PTR(-ENOMEM);
+	sndbuf->bvecs = kvmalloc_array(num_pages, sizeof(struct bio_vec),
+				       GFP_KERNEL);
+	if (!sndbuf->bvecs) {
+		kfree(sndbuf);
+		return ERR_PTR(-ENOMEM);
+	}
+	sndbuf->start = addr;
+	sndbuf->length = length;
+
+	lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	if (atomic64_add_return(num_pages, &mm->pinned_vm) > lock_limit &&
+	    !capable(CAP_IPC_LOCK)) {
+		atomic64_sub(num_pages, &mm->pinned_vm);
+		err = -ENOMEM;
+		goto error;
+	}
+	mmgrab(mm);
+	sndbuf->mm = mm;
+
+	for (pinned = 0; pinned < num_pages; pinned += count) {
+		count = num_pages - pinned;
+		if (count > HOMA_SNDBUF_PIN_BATCH)
+			count = HOMA_SNDBUF_PIN_BATCH;
+		/* FOLL_WRITE breaks any copy-on-write sharing now, so that
+		 * later writes by the application land in the pinned pages
+		 * rather than in fresh copies.
+		 */
+		count = pin_user_pages_fast(addr + ((unsigned long)pinned
+					    << PAGE_SHIFT), count,
+					    FOLL_WRITE | FOLL_LONGTERM, pages);
+		if (count <= 0) {
+			err = count ? count : -EFAULT;
+			goto error;
+		}
+		for (i = 0; i < count; i++)
+			bvec_set_page(&sndbuf->bvecs[pinned + i], pages[i],
+				      PAGE_SIZE, 0);
+		sndbuf->num_pages = pinned + count;
+	}
+	return sndbuf;
+
+error:
+	homa_sndbuf_free(sndbuf);
+	return ERR_PTR(err);
+}
+
+/**
+ * homa_sndbuf_free() - Unpin the pages of a send region and release all
+ * of the resources associated with it.
+ * @sndbuf:   Region to free; must not be in use.
+ */
+void homa_sndbuf_free(struct homa_sndbuf *sndbuf)
+{
+	int i;
+
+	for (i = 0; i < sndbuf->num_pages; i++)
+		unpin_user_page(sndbuf->bvecs[i].bv_page);
+	if (sndbuf->mm) {
+		atomic64_sub((sndbuf->length + PAGE_SIZE - 1) >> PAGE_SHIFT,
+			     &sndbuf->mm->pinned_vm);
+		mmdrop(sndbuf->mm);
+	}
+	kvfree(sndbuf->bvecs);
+	kfree(sndbuf);
+}
+
+/**
+ * homa_sndbuf_set_region() - Register a send region with a socket. This
+ * can happen only once per socket; the region stays registered until the
+ * socket is destroyed.
+ * @hsk:      Socket to register with; must not be locked.
+ * @start:    Address of the first byte of the region; must be page-aligned.
+ * @length:   Number of bytes in the region.
+ * Return:    Zero for success, otherwise a negative errno.
+ */
+int homa_sndbuf_set_region(struct homa_sock *hsk, void __user *start,
+			   size_t length)
+{
+	struct homa_sndbuf *sndbuf;
+
+	/* Pin before locking the socket, since pinning can sleep. */
+	sndbuf = homa_sndbuf_alloc(start, length);
+	if (IS_ERR(sndbuf))
+		return PTR_ERR(sndbuf);
+
+	homa_sock_lock(hsk);
+	if (hsk->sndbuf) {
+		homa_sock_unlock(hsk);
+		homa_sndbuf_free(sndbuf);
+		return -EINVAL;
+	}
+
+	/* Pairs with smp_load_acquire in homa_sndbuf_import_offset. */
+	smp_store_release(&hsk->sndbuf, sndbuf);
+	homa_sock_unlock(hsk);
+	return 0;
+}
+
+/**
+ * homa_sndbuf_get_args() - Return information needed to handle getsockopt
+ * for SO_HOMA_SNDBUF.
+ * @hsk:      Socket for which information is needed.
+ * @args:     Store info here; both fields are zero if no region has
+ *            been registered.
+ */
+void homa_sndbuf_get_args(struct homa_sock *hsk,
+			  struct homa_sndbuf_args *args)
+{
+	struct homa_sndbuf *sndbuf = smp_load_acquire(&hsk->sndbuf);
+
+	if (sndbuf) {
+		args->start = sndbuf->start;
+		args->length = sndbuf->length;
+	} else {
+		args->start = 0;
+		args->length = 0;
+	}
+}
+
+/**
+ * homa_sndbuf_iter() - Initialize an iterator that refers to a range of
+ * bytes in the pinned pages of a send region.
+ * @sndbuf:   Region containing the data.
+ * @offset:   Offset within the region of the first byte of data.
+ * @length:   Number of bytes of data; the data must lie entirely within
+ *            the region.
+ * @dst:      Iterator to initialize.
+ */
+static void homa_sndbuf_iter(struct homa_sndbuf *sndbuf, unsigned long offset,
+			     size_t length, struct iov_iter *dst)
+{
+	unsigned long page_offset = offset & ~PAGE_MASK;
+	int first = offset >> PAGE_SHIFT;
+	int last = (offset + length - 1) >> PAGE_SHIFT;
+
+	iov_iter_bvec(dst, ITER_SOURCE, &sndbuf->bvecs[first],
+		      last + 1 - first, page_offset + length);
+	iov_iter_advance(dst, page_offset);
+	INC_METRIC(sndbuf_msgs, 1);
+}
+
+/**
+ * homa_sndbuf_import_offset() - Invoked by sendmsg when the application
+ * has specified HOMA_SENDMSG_SNDBUF: the message is named by its offset
+ * and length within the socket's registered send region, rather than by
+ * its address in user space.
+ * @hsk:      Socket on which the message is being sent.
+ * @iter:     Iterator from sendmsg; it must have a single segment, whose
+ *            base holds the offset of the message within the region and
+ *            whose length is the length of the message. No user memory is
+ *            accessed through this iterator.
+ * @dst:      If the function returns 0, this is initialized to refer to
+ *            the message's data in the pinned pages.
+ * Return:    Zero for success, otherwise a negative errno.
+ */
+int homa_sndbuf_import_offset(struct homa_sock *hsk, struct iov_iter *iter,
+			      struct iov_iter *dst)
+{
+	/* Pairs with smp_store_release in homa_sndbuf_set_region. */
+	struct homa_sndbuf *sndbuf = smp_load_acquire(&hsk->sndbuf);
+	unsigned long offset;
+
+	if (!sndbuf || current->mm != sndbuf->mm)
+		return -EINVAL;
+	if (!iter_is_ubuf(iter) && !(iter_is_iovec(iter) &&
+				     iter->nr_segs == 1))
+		return -EINVAL;
+	offset = (unsigned long)iter_iov_addr(iter);
+	if (iter->count == 0 || offset >= sndbuf->length ||
+	    iter->count > sndbuf->length - offset)
+		return -EINVAL;
+	homa_sndbuf_iter(sndbuf, offset, iter->count, dst);
+	return 0;
+}
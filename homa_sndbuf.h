@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* This file defines structs and functions for registered send regions.
+ * An application can use the SO_HOMA_SNDBUF socket option to register a
+ * region of its address space; Homa pins the pages of the region once,
+ * and messages named by their offset within the region (with
+ * HOMA_SENDMSG_SNDBUF) are then copied from the pinned pages through
+ * kernel mappings, without page faults or page table walks.
+ */
+
+#ifndef _HOMA_SNDBUF_H
+#define _HOMA_SNDBUF_H
+
+#include <linux/bvec.h>
+
+#include "homa_impl.h"
+#include "homa_sock.h"
+
+/**
+ * define HOMA_SNDBUF_MAX_LENGTH - Largest region that may be registered
+ * with SO_HOMA_SNDBUF.
+ */
+#define HOMA_SNDBUF_MAX_LENGTH (1ULL << 32)
+
+/**
+ * define HOMA_SNDBUF_PIN_BATCH - Maximum number of pages pinned by a
+ * single call to pin_user_pages_fast when registering a region.
+ */
+#define HOMA_SNDBUF_PIN_BATCH 32
+
+/**
+ * struct homa_sndbuf - Describes a region of user memory that has been
+ * registered with a socket for sending messages. Once a region has been
+ * registered it remains in place (and pinned) until the socket is
+ * destroyed, so the send path can access it without locking.
+ */
+struct homa_sndbuf {
+	/** @start: User-space address of the first byte of the region. */
+	unsigned long start;
+
+	/** @length: Number of bytes in the region. */
+	size_t length;
+
+	/** @num_pages: Number of entries in @bvecs. */
+	int num_pages;
+
+	/**
+	 * @bvecs: One entry for each page of the region, in order. Each
+	 * entry refers to a pinned page and covers the entire page.
+	 */
+	struct bio_vec *bvecs;
+
+	/**
+	 * @mm: Address space whose pinned_vm was charged for the pages
+	 * of the region. We hold a reference on this (mmgrab).
+	 */
+	struct mm_struct *mm;
+};
+
+struct homa_sndbuf
+	*homa_sndbuf_alloc(void __user *start, size_t length);
+void     homa_sndbuf_free(struct homa_sndbuf *sndbuf);
+void     homa_sndbuf_get_args(struct homa_sock *hsk,
+			      struct homa_sndbuf_args *args);
+int      homa_sndbuf_import_offset(struct homa_sock *hsk,
+				   struct iov_iter *iter,
+				   struct iov_iter *dst);
+int      homa_sndbuf_set_region(struct homa_sock *hsk, void __user *start,
+				size_t length);
+
+#endif /* _HOMA_SNDBUF_H */
@@ -4,11 +4,13 @@
 
 #include "homa_impl.h"
 #include "homa_interest.h"
+#include "homa_pacer.h"
 #include "homa_peer.h"
 #include "homa_pool.h"
 
 #ifndef __STRIP__ /* See strip.py */
 #include "homa_grant.h"
+#include "homa_sndbuf.h"
 #endif /* See strip.py */
 
 /**
@@ -22,6 +24,8 @@ void homa_socktab_init(struct homa_socktab *socktab)
 	spin_lock_init(&socktab->write_lock);
 	for (i = 0; i < HOMA_SOCKTAB_BUCKETS; i++)
 		INIT_HLIST_HEAD(&socktab->buckets[i]);
+	INIT_LIST_HEAD(&socktab->dying);
+	mutex_init(&socktab->reap_mutex);
 }
 
 /**
@@ -48,6 +52,11 @@ void homa_socktab_destroy(struct homa_socktab *socktab, struct homa_net *hnet)
 		homa_sock_destroy(&hsk->sock);
 	}
 	homa_socktab_end_scan(&scan);
+
+	/* Sockets being torn down in the background are no longer in the
+	 * table, but they must be finished off before the socktab goes away.
+	 */
+	homa_socktab_reap_dying(socktab, true);
 }
 
 /**
@@ -162,7 +171,9 @@ int homa_sock_init(struct homa_sock *hsk)
 	hsk->sock.sk_sndbuf = homa->wmem_max;
 	sock_set_flag(&hsk->inet.sk, SOCK_RCU_FREE);
 #ifndef __STRIP__ /* See strip.py */
-	if (homa->hijack_tcp)
+	if (homa->udp_encap_port)
+		hsk->sock.sk_protocol = IPPROTO_UDP;
+	else if (homa->hijack_tcp)
 		hsk->sock.sk_protocol = IPPROTO_TCP;
 #endif /* See strip.py */
 
@@ -205,9 +216,19 @@ int homa_sock_init(struct homa_sock *hsk)
 	hsk->inet.inet_sport = htons(hsk->port);
 
 	hsk->is_server = false;
+#ifndef __STRIP__ /* See strip.py */
+	hsk->grant_weight = 1;
+	hsk->grant_active_rpcs = 0;
+	hsk->num_grantable_rpcs = 0;
+#endif /* See strip.py */
+	IF_NO_STRIP(hsk->sndbuf = NULL);
 	hsk->shutdown = false;
 	hsk->ip_header_length = (hsk->inet.sk.sk_family == AF_INET) ?
 				sizeof(struct iphdr) : sizeof(struct ipv6hdr);
+#ifndef __STRIP__ /* See strip.py */
+	if (hsk->sock.sk_protocol == IPPROTO_UDP)
+		hsk->ip_header_length += sizeof(struct udphdr);
+#endif /* See strip.py */
 	spin_lock_init(&hsk->lock);
 	atomic_set(&hsk->protect_count, 0);
 	INIT_LIST_HEAD(&hsk->active_rpcs);
@@ -216,6 +237,8 @@ int homa_sock_init(struct homa_sock *hsk)
 	INIT_LIST_HEAD(&hsk->waiting_for_bufs);
 	INIT_LIST_HEAD(&hsk->ready_rpcs);
 	INIT_LIST_HEAD(&hsk->interests);
+	INIT_LIST_HEAD(&hsk->dying_links);
+	hsk->destroyed = false;
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
 		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
 
@@ -268,6 +291,7 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 {
 	struct homa_interest *interest;
 	struct homa_rpc *rpc;
+	int count = 0;
 
 	tt_record1("Starting shutdown for socket %d", hsk->port);
 	homa_sock_lock(hsk);
@@ -283,7 +307,9 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	 * 2. Remove the socket from its socktab: this ensures that
 	 *    incoming packets for the socket will be dropped.
 	 * 3. Go through all of the RPCs and delete them; this will
-	 *    synchronize with any operations in progress.
+	 *    synchronize with any operations in progress. If there are
+	 *    many RPCs, this is done later by homa_socktab_reap_dying
+	 *    instead, so the caller isn't delayed.
 	 * 4. Perform other socket cleanup: at this point we know that
 	 *    there will be no concurrent activities on individual RPCs.
 	 * 5. Don't delete the buffer pool until after all of the RPCs
@@ -295,13 +321,48 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	homa_sock_unlink(hsk);
 	homa_sock_unlock(hsk);
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
-		homa_rpc_lock(rpc);
-		homa_rpc_end(rpc);
-		homa_rpc_unlock(rpc);
+	if (hsk->homa->teardown_rpcs > 0) {
+		rcu_read_lock();
+		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+			count++;
+			if (count >= hsk->homa->teardown_rpcs)
+				break;
+		}
+		rcu_read_unlock();
+	}
+	if (count > 0 && count >= hsk->homa->teardown_rpcs) {
+		tt_record2("Socket %d has at least %d RPCs; tearing down in background",
+			   hsk->port, count);
+		INC_METRIC(sock_async_teardowns, 1);
+		sock_hold(&hsk->sock);
+		spin_lock_bh(&hsk->homa->socktab->write_lock);
+		list_add_tail(&hsk->dying_links, &hsk->homa->socktab->dying);
+		spin_unlock_bh(&hsk->homa->socktab->write_lock);
+
+		/* The RPCs won't be ended until homa_socktab_reap_dying gets
+		 * to them, which could take a while; remove them from the
+		 * pacer now so that they stop transmitting. They can't be
+		 * added back, since homa_pacer_manage_rpc ignores RPCs whose
+		 * socket has been shut down.
+		 */
+		rcu_read_lock();
+		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+			if (list_empty(&rpc->throttled_links))
+				continue;
+			homa_rpc_lock(rpc);
+			homa_pacer_unmanage_rpc(rpc);
+			homa_rpc_unlock(rpc);
+		}
+		rcu_read_unlock();
+	} else {
+		rcu_read_lock();
+		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+			homa_rpc_lock(rpc);
+			homa_rpc_end(rpc);
+			homa_rpc_unlock(rpc);
+		}
+		rcu_read_unlock();
 	}
-	rcu_read_unlock();
 
 	homa_sock_lock(hsk);
 	while (!list_empty(&hsk->interests)) {
@@ -315,6 +376,145 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	tt_record1("Finished shutdown for socket %d", hsk->port);
 }
 
+/**
+ * homa_sock_teardown_batch() - Perform part or all of the work of
+ * terminating the RPCs of a socket that is being torn down in the
+ * background (see homa_socktab_reap_dying). Work is done in bounded
+ * batches so that locks needed by packet processing are never held
+ * for long periods.
+ * @hsk:   Socket whose RPCs are to be terminated; must have been shut
+ *         down.
+ * @all:   False means just do one batch of work; true means don't
+ *         return until all of the RPCs have been ended and reaped.
+ * Return: True if the socket has no remaining RPCs (either active or
+ *         dead), false if more work remains.
+ */
+bool homa_sock_teardown_batch(struct homa_sock *hsk, bool all)
+{
+#ifdef __UNIT_TEST__
+#define TEARDOWN_BATCH 2
+#else /* __UNIT_TEST__ */
+#define TEARDOWN_BATCH 1000
+#endif /* __UNIT_TEST__ */
+	struct homa_rpc *rpc;
+	bool done;
+	int i;
+
+	do {
+		rcu_read_lock();
+		for (i = 0; i < TEARDOWN_BATCH; i++) {
+			rpc = list_first_or_null_rcu(&hsk->active_rpcs,
+						     struct homa_rpc,
+						     active_links);
+			if (!rpc)
+				break;
+			homa_rpc_lock(rpc);
+			homa_rpc_end(rpc);
+			homa_rpc_unlock(rpc);
+		}
+		rcu_read_unlock();
+
+		for (i = 0; i < TEARDOWN_BATCH; i++) {
+			if (homa_rpc_reap(hsk, false) == 0)
+				break;
+		}
+
+		homa_sock_lock(hsk);
+		done = list_empty(&hsk->active_rpcs) &&
+		       list_empty(&hsk->dead_rpcs);
+		homa_sock_unlock(hsk);
+	} while (all && !done);
+	return done;
+}
+
+/**
+ * homa_socktab_reap_dying() - Make progress on tearing down the sockets
+ * in a socktab's dying list (sockets that had many RPCs when they were
+ * shut down). Once all of a socket's RPCs have been reaped, the rest of
+ * its cleanup is done and it is removed from the list. Invoked by
+ * homa_timer, so that closing a socket with many RPCs doesn't delay
+ * the closing thread.
+ * @socktab:  Table whose dying sockets should be processed.
+ * @all:      False means do one bounded batch of work for each of at most
+ *            REAP_DYING_SOCKETS sockets (and do nothing if some other
+ *            thread is already reaping); true means don't return until all
+ *            dying sockets have been fully cleaned up.
+ */
+void homa_socktab_reap_dying(struct homa_socktab *socktab, bool all)
+{
+#ifdef __UNIT_TEST__
+#define REAP_DYING_SOCKETS 2
+#else /* __UNIT_TEST__ */
+#define REAP_DYING_SOCKETS 4
+#endif /* __UNIT_TEST__ */
+	struct homa_sock *hsk;
+	IF_NO_STRIP(u64 start);
+	bool destroyed;
+	int count = 0;
+
+	/* Only one thread may reap at a time: otherwise two threads could
+	 * both finish the same socket and destroy or release it twice.
+	 */
+	if (all) {
+		mutex_lock(&socktab->reap_mutex);
+	} else if (!mutex_trylock(&socktab->reap_mutex)) {
+		tt_record("homa_socktab_reap_dying skipping: already running");
+		return;
+	}
+
+	spin_lock_bh(&socktab->write_lock);
+	list_for_each_entry(hsk, &socktab->dying, dying_links)
+		count++;
+	spin_unlock_bh(&socktab->write_lock);
+	if (count == 0)
+		goto done;
+
+	/* The socktab is shared by all network namespaces, so the dying
+	 * list can be long; bound the work done in one timer tick. Sockets
+	 * are rotated through the list, so each will eventually get a turn.
+	 */
+	if (!all && count > REAP_DYING_SOCKETS)
+		count = REAP_DYING_SOCKETS;
+
+	IF_NO_STRIP(start = homa_clock());
+	for ( ; count > 0; count--) {
+		/* Rotate the first socket to the end of the list, so that
+		 * each socket gets a turn.
+		 */
+		spin_lock_bh(&socktab->write_lock);
+		if (list_empty(&socktab->dying)) {
+			spin_unlock_bh(&socktab->write_lock);
+			break;
+		}
+		hsk = list_first_entry(&socktab->dying, struct homa_sock,
+				       dying_links);
+		list_move_tail(&hsk->dying_links, &socktab->dying);
+		spin_unlock_bh(&socktab->write_lock);
+
+		if (!homa_sock_teardown_batch(hsk, all))
+			continue;
+
+		/* Claim the socket only if it is still on the list. */
+		spin_lock_bh(&socktab->write_lock);
+		if (list_empty(&hsk->dying_links)) {
+			spin_unlock_bh(&socktab->write_lock);
+			continue;
+		}
+		list_del_init(&hsk->dying_links);
+		destroyed = hsk->destroyed;
+		spin_unlock_bh(&socktab->write_lock);
+		tt_record1("Finished background teardown for socket %d",
+			   hsk->port);
+		if (destroyed)
+			homa_sock_destroy(&hsk->sock);
+		sock_put(&hsk->sock);
+	}
+	INC_METRIC(sock_teardown_cycles, homa_clock() - start);
+
+done:
+	mutex_unlock(&socktab->reap_mutex);
+}
+
 /**
  * homa_sock_destroy() - Release all of the internal resources associated
  * with a socket; is invoked at time when that is safe (i.e., all references
@@ -329,6 +529,19 @@ void homa_sock_destroy(struct sock *sk)
 	if (!hsk->homa)
 		return;
 
+	spin_lock_bh(&hsk->homa->socktab->write_lock);
+	if (!list_empty(&hsk->dying_links)) {
+		/* RPCs are still being torn down in the background;
+		 * homa_socktab_reap_dying will invoke this function again
+		 * once that completes.
+		 */
+		hsk->destroyed = true;
+		spin_unlock_bh(&hsk->homa->socktab->write_lock);
+		tt_record1("Deferring destruction of socket %d", hsk->port);
+		return;
+	}
+	spin_unlock_bh(&hsk->homa->socktab->write_lock);
+
 	tt_record1("Starting to destroy socket %d", hsk->port);
 	while (!list_empty(&hsk->dead_rpcs)) {
 		homa_rpc_reap(hsk, true);
@@ -356,6 +569,12 @@ void homa_sock_destroy(struct sock *sk)
 		homa_pool_free(hsk->buffer_pool);
 		hsk->buffer_pool = NULL;
 	}
+#ifndef __STRIP__ /* See strip.py */
+	if (hsk->sndbuf) {
+		homa_sndbuf_free(hsk->sndbuf);
+		hsk->sndbuf = NULL;
+	}
+#endif /* See strip.py */
 	tt_record1("Finished destroying socket %d", hsk->port);
 }
 
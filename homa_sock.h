@@ -37,6 +37,22 @@ struct homa_socktab {
 	 * consist of homa_sock objects.
 	 */
 	struct hlist_head buckets[HOMA_SOCKTAB_BUCKETS];
+
+	/**
+	 * @dying: Sockets that have been shut down but still have RPCs to
+	 * end or reap (linked through their dying_links); this work is
+	 * done in the background by homa_socktab_reap_dying. Each socket
+	 * on this list has a reference held on it. Protected by
+	 * @write_lock.
+	 */
+	struct list_head dying;
+
+	/**
+	 * @reap_mutex: Held while executing homa_socktab_reap_dying, so
+	 * that the timer and homa_socktab_destroy can't both try to finish
+	 * off the same socket.
+	 */
+	struct mutex reap_mutex;
 };
 
 /**
@@ -166,6 +182,38 @@ struct homa_sock {
 	 */
 	bool is_server;
 
+#ifndef __STRIP__ /* See strip.py */
+	/**
+	 * @grant_weight: Weight of this socket relative to others when
+	 * dividing the entries in grant->active_rpcs among sockets (see
+	 * homa_grant_share). Set with SO_HOMA_GRANT_WEIGHT; defaults to 1.
+	 * Modified only while holding the grant lock.
+	 */
+	int grant_weight;
+
+	/**
+	 * @grant_active_rpcs: Number of this socket's RPCs that are
+	 * currently in grant->active_rpcs. Protected by the grant lock.
+	 */
+	int grant_active_rpcs;
+
+	/**
+	 * @num_grantable_rpcs: Number of this socket's RPCs whose incoming
+	 * messages still need grants (i.e., they are in either
+	 * grant->active_rpcs or grant->grantable_peers). Protected by the
+	 * grant lock.
+	 */
+	int num_grantable_rpcs;
+
+	/**
+	 * @sndbuf: Region of user memory registered with SO_HOMA_SNDBUF,
+	 * from which outgoing messages can be copied without faulting.
+	 * NULL if no region has been registered. Once set, this doesn't
+	 * change until the socket is destroyed.
+	 */
+	struct homa_sndbuf *sndbuf;
+#endif /* See strip.py */
+
 	/**
 	 * @shutdown: True means the socket is no longer usable (either
 	 * shutdown has already been invoked, or the socket was never
@@ -175,13 +223,29 @@ struct homa_sock {
 
 	/**
 	 * @ip_header_length: Length of IP headers for this socket (depends
-	 * on IPv4 vs. IPv6).
+	 * on IPv4 vs. IPv6). Includes the UDP header if packets are
+	 * encapsulated in UDP.
 	 */
 	int ip_header_length;
 
 	/** @socktab_links: Links this socket into a homa_socktab bucket. */
 	struct hlist_node socktab_links;
 
+	/**
+	 * @dying_links: Links this socket into homa_socktab->dying while
+	 * its RPCs are being torn down in the background; empty otherwise.
+	 * Protected by the socktab's write_lock.
+	 */
+	struct list_head dying_links;
+
+	/**
+	 * @destroyed: True means homa_sock_destroy was invoked while the
+	 * socket was on homa_socktab->dying, so the rest of its cleanup
+	 * must be done once background teardown completes. Protected by
+	 * the socktab's write_lock.
+	 */
+	bool destroyed;
+
 	/* Information above is (almost) never modified; start a new
 	 * cache line below for info that is modified frequently.
 	 */
@@ -277,6 +341,7 @@ void               homa_sock_destroy(struct sock *sk);
 struct homa_sock  *homa_sock_find(struct homa_net *hnet, u16 port);
 int                homa_sock_init(struct homa_sock *hsk);
 void               homa_sock_shutdown(struct homa_sock *hsk);
+bool               homa_sock_teardown_batch(struct homa_sock *hsk, bool all);
 void               homa_sock_unlink(struct homa_sock *hsk);
 int                homa_sock_wait_wmem(struct homa_sock *hsk, int nonblocking);
 void               homa_socktab_destroy(struct homa_socktab *socktab,
@@ -284,6 +349,8 @@ void               homa_socktab_destroy(struct homa_socktab *socktab,
 void               homa_socktab_end_scan(struct homa_socktab_scan *scan);
 void               homa_socktab_init(struct homa_socktab *socktab);
 struct homa_sock  *homa_socktab_next(struct homa_socktab_scan *scan);
+void               homa_socktab_reap_dying(struct homa_socktab *socktab,
+					   bool all);
 struct homa_sock  *homa_socktab_start_scan(struct homa_socktab *socktab,
 					   struct homa_socktab_scan *scan);
 
@@ -19,6 +19,9 @@ static inline int homa_skb_init(struct homa *homa)
 static inline void homa_skb_cleanup(struct homa *homa)
 {}
 
+static inline void homa_skb_request_refill(struct homa *homa)
+{}
+
 static inline void homa_skb_release_pages(struct homa *homa)
 {}
 
@@ -29,6 +29,22 @@ void homa_timer_check_rpc(struct homa_rpc *rpc)
 {
 	struct homa *homa = rpc->hsk->homa;
 
+	if (homa_rpc_expired(rpc, homa_clock()) && rpc->error == 0 &&
+	    !(homa_is_client(rpc->id) && rpc->msgin.length >= 0 &&
+	      rpc->msgin.bytes_remaining == 0)) {
+		/* The RPC's deadline has passed (and, for clients, the
+		 * response hasn't been fully received). Discard it now
+		 * rather than spending more resources on it. No packets
+		 * are sent: the peer has the same deadline and will discard
+		 * its state on its own.
+		 */
+		INC_METRIC(rpc_deadline_expirations, 1);
+		tt_record3("RPC id %d, peer 0x%x, aborted because deadline passed, state %d",
+			   rpc->id, tt_addr(rpc->peer->addr), rpc->state);
+		homa_rpc_abort(rpc, -ETIME);
+		return;
+	}
+
 	/* See if we need to request an ack for this RPC. */
 	if (!homa_is_client(rpc->id) && rpc->state == RPC_OUTGOING &&
 	    rpc->msgout.next_xmit_offset >= rpc->msgout.length) {
@@ -236,14 +252,19 @@ void homa_timer(struct homa *homa)
 		homa_unprotect_rpcs(hsk);
 	}
 	homa_socktab_end_scan(&scan);
+	homa_socktab_reap_dying(homa->socktab, false);
 #ifndef __STRIP__ /* See strip.py */
 	tt_record4("homa_timer found %d incoming RPCs, incoming sum %d, rec_sum %d, homa->total_incoming %d",
 		   total_incoming_rpcs, sum_incoming, sum_incoming_rec,
 		   atomic_read(&homa->grant->total_incoming));
 #endif /* See strip.py */
 	homa_skb_release_pages(homa);
+	homa_skb_request_refill(homa);
 	homa_peer_gc(homa->peertab);
 #ifndef __STRIP__ /* See strip.py */
+	if (homa->prio_adapt_ticks > 0 &&
+	    homa->timer_ticks % homa->prio_adapt_ticks == 0)
+		homa_prio_adapt(homa);
 	end = homa_clock();
 	INC_METRIC(timer_cycles, end - start);
 #endif /* See strip.py */
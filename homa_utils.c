@@ -10,6 +10,8 @@
 #include "homa_rpc.h"
 #ifndef __STRIP__ /* See strip.py */
 #include "homa_grant.h"
+#include "homa_impair.h"
+#include "homa_offload.h"
 #include "homa_skb.h"
 #endif /* See strip.py */
 
@@ -74,6 +76,7 @@ int homa_init(struct homa *homa)
 	homa->unsched_bytes = 40000;
 	homa->poll_usecs = 50;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
+	homa->pacer->urgent_prio = homa->num_priorities - 1;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
 	homa->max_sched_prio = HOMA_MAX_PRIORITIES - 5;
@@ -97,6 +100,7 @@ int homa_init(struct homa *homa)
 	homa->request_ack_ticks = 2;
 	homa->reap_limit = 10;
 	homa->dead_buffs_limit = 5000;
+	homa->teardown_rpcs = 1000;
 #ifndef __STRIP__ /* See strip.py */
 	homa->verbose = 0;
 #endif /* See strip.py */
@@ -111,6 +115,12 @@ int homa_init(struct homa *homa)
 	homa->bpage_lease_usecs = 10000;
 #ifndef __STRIP__ /* See strip.py */
 	homa_incoming_sysctl_changed(homa);
+	homa->prio_counts = alloc_percpu_gfp(struct homa_prio_counts,
+					     __GFP_ZERO);
+	if (!homa->prio_counts) {
+		pr_err("%s couldn't allocate prio_counts\n", __func__);
+		return -ENOMEM;
+	}
 #endif /* See strip.py */
 	return 0;
 }
@@ -148,6 +158,10 @@ void homa_destroy(struct homa *homa)
 		homa->peertab = NULL;
 	}
 #ifndef __STRIP__ /* See strip.py */
+	if (homa->prio_counts) {
+		free_percpu(homa->prio_counts);
+		homa->prio_counts = NULL;
+	}
 
 	homa_skb_cleanup(homa);
 #endif /* See strip.py */
@@ -166,6 +180,22 @@ int homa_net_init(struct homa_net *hnet, struct net *net, struct homa *homa)
 	hnet->net = net;
 	hnet->homa = homa;
 	hnet->prev_default_port = HOMA_MIN_DEFAULT_PORT - 1;
+#ifndef __STRIP__ /* See strip.py */
+	hnet->impair = homa_impair_alloc(net);
+	if (IS_ERR(hnet->impair)) {
+		int err = PTR_ERR(hnet->impair);
+
+		hnet->impair = NULL;
+		return err;
+	}
+	mutex_init(&hnet->udp_mutex);
+
+	/* Failure to open the tunnel sockets has already been logged; the
+	 * namespace is still usable without UDP encapsulation.
+	 */
+	if (homa->udp_encap_port)
+		homa_udp_tunnel_update(hnet);
+#endif /* See strip.py */
 	return 0;
 }
 
@@ -176,6 +206,13 @@ int homa_net_init(struct homa_net *hnet, struct net *net, struct homa *homa)
  */
 void homa_net_destroy(struct homa_net *hnet)
 {
+#ifndef __STRIP__ /* See strip.py */
+	homa_udp_tunnel_close(hnet);
+	if (hnet->impair) {
+		homa_impair_free(hnet->impair);
+		hnet->impair = NULL;
+	}
+#endif /* See strip.py */
 	homa_socktab_destroy(hnet->homa->socktab, hnet);
 	homa_peer_free_net(hnet);
 }
@@ -217,6 +254,119 @@ void homa_prios_changed(struct homa *homa)
 		}
 	}
 	homa->cutoff_version++;
+	homa_pacer_clamp_urgent_prio(homa->pacer);
+}
+
+/**
+ * homa_prio_count_msg() - Record the makeup of a new incoming message, for
+ * use by homa_prio_adapt. Must be invoked with preemption disabled (e.g.
+ * in SoftIRQ context).
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @length:   Total number of bytes in the message.
+ * @unsched:  Number of unscheduled bytes the sender will transmit.
+ */
+void homa_prio_count_msg(struct homa *homa, int length, int unsched)
+{
+	struct homa_prio_counts *counts;
+
+	if (length <= 0)
+		return;
+	if (unsched > length)
+		unsched = length;
+	counts = this_cpu_ptr(homa->prio_counts);
+	counts->unsched_hist[ilog2(length)] += unsched;
+	counts->sched_bytes += length - unsched;
+}
+
+/**
+ * homa_prio_adapt() - Invoked periodically by homa_timer when the
+ * prio_adapt_ticks sysctl parameter is set. Uses the traffic recorded by
+ * homa_prio_count_msg to decide how many priority levels should be used for
+ * unscheduled packets: levels are divided in proportion to unscheduled vs.
+ * scheduled bytes, but each RPC being actively granted gets a scheduled
+ * level of its own (up to half of the levels). Shifts in the traffic mix
+ * move the boundary at most one level per call, and only when the ideal
+ * split has moved well past the current one (so the cutoffs don't flap).
+ * When the boundary moves, unsched_cutoffs are recomputed so that each
+ * unscheduled level carries about the same number of bytes; the new cutoffs
+ * reach senders in CUTOFFS packets because cutoff_version changes.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_prio_adapt(struct homa *homa)
+{
+	int num_prios = homa->num_priorities;
+	struct homa_prio_counts totals;
+	u64 hist[HOMA_PRIO_HIST_BUCKETS];
+	int levels, new_levels, target;
+	u64 unsched, sched, cum;
+	int level, contention, core, i;
+
+	if (num_prios < 2)
+		return;
+
+	/* Sum the per-core counts; the new traffic is the difference from
+	 * the totals consumed by the last evaluation (the per-core counts
+	 * are never reset, so no updates can be lost).
+	 */
+	memset(&totals, 0, sizeof(totals));
+	for (core = 0; core < nr_cpu_ids; core++) {
+		struct homa_prio_counts *counts;
+
+		counts = per_cpu_ptr(homa->prio_counts, core);
+		for (i = 0; i < HOMA_PRIO_HIST_BUCKETS; i++)
+			totals.unsched_hist[i] +=
+					READ_ONCE(counts->unsched_hist[i]);
+		totals.sched_bytes += READ_ONCE(counts->sched_bytes);
+	}
+	sched = totals.sched_bytes - homa->prio_consumed.sched_bytes;
+	unsched = 0;
+	for (i = 0; i < HOMA_PRIO_HIST_BUCKETS; i++) {
+		hist[i] = totals.unsched_hist[i] -
+			  homa->prio_consumed.unsched_hist[i];
+		unsched += hist[i];
+	}
+	if (unsched + sched < HOMA_PRIO_ADAPT_MIN_BYTES)
+		/* Not enough data yet; keep accumulating. */
+		return;
+	homa->prio_consumed = totals;
+
+	/* Ideal number of unscheduled levels, in thousandths of a level. */
+	target = div64_u64(1000ULL * num_prios * unsched, unsched + sched);
+	levels = num_prios - 1 - homa->max_sched_prio;
+	new_levels = levels;
+	if (target > levels * 1000 + 500 + HOMA_PRIO_ADAPT_HYSTERESIS)
+		new_levels++;
+	else if (target < levels * 1000 - 500 - HOMA_PRIO_ADAPT_HYSTERESIS)
+		new_levels--;
+	contention = min(READ_ONCE(homa->grant->num_active_rpcs),
+			 num_prios / 2);
+	if (new_levels > num_prios - contention)
+		new_levels = num_prios - contention;
+	new_levels = clamp(new_levels, 1, num_prios - 1);
+	tt_record4("homa_prio_adapt: target %d, contention %d, levels %d -> %d",
+		   target, contention, levels, new_levels);
+	if (new_levels == levels)
+		return;
+
+	/* Pick cutoffs at (approximately) equal-byte quantiles of the
+	 * unscheduled traffic, using at most one level per bucket.
+	 */
+	level = num_prios - 1;
+	cum = 0;
+	for (i = 0; i < HOMA_PRIO_HIST_BUCKETS &&
+	     level > num_prios - new_levels; i++) {
+		cum += hist[i];
+		if (cum * new_levels >= unsched * (num_prios - level))
+			homa->unsched_cutoffs[level--] =
+				min((2 << i) - 1, HOMA_MAX_MESSAGE_LENGTH - 1);
+	}
+	for (; level > num_prios - new_levels; level--)
+		homa->unsched_cutoffs[level] = HOMA_MAX_MESSAGE_LENGTH - 1;
+	homa->unsched_cutoffs[level] = HOMA_MAX_MESSAGE_LENGTH;
+	for (level--; level > 0; level--)
+		homa->unsched_cutoffs[level] = 0;
+	homa_prios_changed(homa);
+	INC_METRIC(prio_adapt_changes, 1);
 }
 #endif /* See strip.py */
 
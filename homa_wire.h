@@ -345,12 +345,56 @@ struct homa_data_hdr {
 	 */
 	u8 retransmit;
 
-	char pad[3];
+	/**
+	 * @deadline_us: 24-bit big-endian count of the microseconds that
+	 * remained before the RPC's deadline when this packet was created
+	 * (a relative time is used because clocks on different hosts are
+	 * not synchronized). 0 means the RPC has no deadline, and
+	 * HOMA_MAX_WIRE_DEADLINE means the deadline is too far away to
+	 * represent. Access with homa_data_get_deadline and
+	 * homa_data_set_deadline. Occupies what used to be padding, so
+	 * older senders always send 0.
+	 */
+	u8 deadline_us[3];
 
 	/** @seg: First of possibly many segments. */
 	struct homa_seg_hdr seg;
 } __packed;
 
+/**
+ * define HOMA_MAX_WIRE_DEADLINE - Largest value that can be stored in
+ * homa_data_hdr->deadline_us (about 16.7 seconds).
+ */
+#define HOMA_MAX_WIRE_DEADLINE 0xffffff
+
+/**
+ * homa_data_set_deadline() - Store a deadline in a DATA packet header.
+ * @h:      Header to modify.
+ * @usecs:  Microseconds remaining before the RPC's deadline, or 0 if the
+ *          RPC has no deadline. Values too large for the header are
+ *          stored as HOMA_MAX_WIRE_DEADLINE.
+ */
+static inline void homa_data_set_deadline(struct homa_data_hdr *h, u32 usecs)
+{
+	if (usecs > HOMA_MAX_WIRE_DEADLINE)
+		usecs = HOMA_MAX_WIRE_DEADLINE;
+	h->deadline_us[0] = usecs >> 16;
+	h->deadline_us[1] = usecs >> 8;
+	h->deadline_us[2] = usecs;
+}
+
+/**
+ * homa_data_get_deadline() - Extract the deadline from a DATA packet header.
+ * @h:      Header of an incoming DATA packet.
+ * Return:  Microseconds remaining before the RPC's deadline (as of when
+ *          the packet was sent), or 0 if the RPC has no deadline.
+ */
+static inline u32 homa_data_get_deadline(struct homa_data_hdr *h)
+{
+	return (h->deadline_us[0] << 16) | (h->deadline_us[1] << 8) |
+	       h->deadline_us[2];
+}
+
 /**
  * homa_data_len() - Returns the total number of bytes in a DATA packet
  * after the homa_data_hdr. Note: if the packet is a GSO packet, the result
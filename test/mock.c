@@ -8,12 +8,14 @@
 #include "homa_impl.h"
 #include "homa_pool.h"
 #ifndef __STRIP__ /* See strip.py */
+#include "homa_impair.h"
 #include "homa_skb.h"
 #endif /* See strip.py */
 #include "ccutils.h"
 #include "utils.h"
 
 #include <linux/rhashtable.h>
+#include <net/udp_tunnel.h>
 
 /* It isn't safe to include some header files, such as stdlib, because
  * they conflict with kernel header files. The explicit declarations
@@ -37,6 +39,7 @@ int mock_alloc_skb_errors;
 int mock_copy_data_errors;
 int mock_copy_to_iter_errors;
 int mock_copy_to_user_errors;
+int mock_csum_errors;
 int mock_cpu_idle;
 int mock_dst_check_errors;
 int mock_import_ubuf_errors;
@@ -45,6 +48,7 @@ int mock_ip6_xmit_errors;
 int mock_ip_queue_xmit_errors;
 int mock_kmalloc_errors;
 int mock_kthread_create_errors;
+int mock_pin_user_pages_errors;
 int mock_prepare_to_wait_errors;
 int mock_register_protosw_errors;
 int mock_register_sysctl_errors;
@@ -53,6 +57,7 @@ int mock_rht_insert_errors;
 int mock_route_errors;
 int mock_spin_lock_held;
 int mock_trylock_errors;
+int mock_udp_sock_errors;
 int mock_vmalloc_errors;
 int mock_wait_intr_irq_errors;
 
@@ -64,8 +69,25 @@ int mock_prepare_to_wait_status = -ERESTARTSYS;
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending;
 
+/* Used as the address space of mock_task. */
+struct mm_struct mock_mm = {.mm_count = ATOMIC_INIT(1)};
+
 /* Used as current task during tests. Also returned by kthread_run. */
-struct task_struct mock_task;
+struct task_struct mock_task = {.mm = &mock_mm};
+
+/* The return value from calls to capable(). */
+int mock_capable;
+
+/* The value returned by rlimit() (in bytes). */
+unsigned long mock_memlock_limit = 1UL << 30;
+
+/* The gup_flags argument from the most recent call to pin_user_pages_fast. */
+unsigned int mock_pin_user_pages_flags;
+
+/* If nonzero, pin_user_pages_fast will pin at most this many pages in
+ * each call.
+ */
+int mock_pin_user_pages_max;
 
 /* If a test sets this variable to nonzero, ip_queue_xmit will log
  * outgoing packets using the long format rather than short.
@@ -254,11 +276,18 @@ const struct net_offload *inet_offloads[MAX_INET_PROTOS];
 const struct net_offload *inet6_offloads[MAX_INET_PROTOS];
 struct net_offload tcp_offload;
 struct net_offload tcp_v6_offload;
+const int sysctl_vals[] = { 0, 1, 2, 3, 4, 100, 200, 1000, 3000, INT_MAX,
+			    65535, -1 };
+
+/* Configuration passed to the most recent call to setup_udp_tunnel_sock. */
+struct udp_tunnel_sock_cfg mock_udp_tunnel_cfg;
 
 static struct hrtimer_clock_base clock_base;
 struct task_struct *current_task = &mock_task;
 unsigned long ex_handler_refcount;
 struct net init_net;
+LIST_HEAD(net_namespace_list);
+struct rw_semaphore net_rwsem;
 unsigned long volatile jiffies = 1100;
 unsigned int nr_cpu_ids = 8;
 unsigned long page_offset_base;
@@ -338,13 +367,35 @@ void call_rcu(struct rcu_head *head, void free_func(struct rcu_head *head))
 	unit_log_printf("; ", "call_rcu invoked");
 }
 
+bool capable(int cap)
+{
+	return mock_capable;
+}
+
 bool cancel_work_sync(struct work_struct *work)
 {
 	return false;
 }
 
+__sum16 __skb_checksum_complete(struct sk_buff *skb)
+{
+	return mock_check_error(&mock_csum_errors) ? 0xffff : 0;
+}
+
+__sum16 __skb_checksum_complete_head(struct sk_buff *skb, int len)
+{
+	return mock_check_error(&mock_csum_errors) ? 0xffff : 0;
+}
+
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
+__sum16 csum_ipv6_magic(const struct in6_addr *saddr,
+			const struct in6_addr *daddr,
+			__u32 len, __u8 proto, __wsum sum)
+{
+	return 0;
+}
+
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 {
 	size_t bytes_left = bytes;
@@ -356,6 +407,27 @@ size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 				iter->count);
 		return 0;
 	}
+	if (iov_iter_is_bvec(iter)) {
+		/* Data really is copied from the pages of a bvec iterator. */
+		char *dst = addr;
+
+		while (bytes_left > 0) {
+			const struct bio_vec *bvec = iter->bvec;
+			size_t chunk_bytes = bvec->bv_len - iter->iov_offset;
+
+			if (chunk_bytes > bytes_left)
+				chunk_bytes = bytes_left;
+			unit_log_printf("; ", "_copy_from_iter %lu bytes from bvec offset %lu",
+					chunk_bytes, iter->iov_offset);
+			memcpy(dst, (char *)page_address(bvec->bv_page) +
+			       bvec->bv_offset + iter->iov_offset,
+			       chunk_bytes);
+			dst += chunk_bytes;
+			bytes_left -= chunk_bytes;
+			iov_iter_advance(iter, chunk_bytes);
+		}
+		return bytes;
+	}
 	while (bytes_left > 0) {
 		struct iovec *iov = (struct iovec *) iter_iov(iter);
 		u64 int_base = (u64) iov->iov_base;
@@ -444,6 +516,11 @@ int do_wait_intr_irq(wait_queue_head_t *, wait_queue_entry_t *)
 	return 0;
 }
 
+void down_read(struct rw_semaphore *sem)
+{
+	mock_active_locks++;
+}
+
 void dst_release(struct dst_entry *dst)
 {
 	if (!dst)
@@ -679,6 +756,36 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->count = count;
 }
 
+void iov_iter_advance(struct iov_iter *i, size_t bytes)
+{
+	if (bytes > i->count)
+		bytes = i->count;
+	i->count -= bytes;
+	if (!iov_iter_is_bvec(i)) {
+		i->iov_offset += bytes;
+		return;
+	}
+	bytes += i->iov_offset;
+	while (bytes > 0 && i->nr_segs > 0 && bytes >= i->bvec->bv_len) {
+		bytes -= i->bvec->bv_len;
+		i->bvec++;
+		i->nr_segs--;
+	}
+	i->iov_offset = bytes;
+}
+
+void iov_iter_bvec(struct iov_iter *i, unsigned int direction,
+		   const struct bio_vec *bvec, unsigned long nr_segs,
+		   size_t count)
+{
+	i->iter_type = ITER_BVEC;
+	i->data_source = direction;
+	i->bvec = bvec;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
@@ -1026,6 +1133,11 @@ ssize_t __modver_version_show(struct module_attribute *a,
 	return 0;
 }
 
+void __mmdrop(struct mm_struct *mm)
+{
+	FAIL(" %s invoked", __func__);
+}
+
 void __mutex_init(struct mutex *lock, const char *name,
 			 struct lock_class_key *key)
 {
@@ -1041,6 +1153,18 @@ void mutex_lock(struct mutex *lock)
 	mock_active_locks++;
 }
 
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+int _mutex_trylock_nest_lock(struct mutex *lock, struct lockdep_map *nest_lock)
+#else
+int mutex_trylock(struct mutex *lock)
+#endif
+{
+	if (mock_check_error(&mock_trylock_errors))
+		return 0;
+	mock_active_locks++;
+	return 1;
+}
+
 void mutex_unlock(struct mutex *lock)
 {
 	UNIT_HOOK("unlock");
@@ -1056,6 +1180,23 @@ int netif_receive_skb(struct sk_buff *skb)
 	return 0;
 }
 
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+			unsigned int gup_flags, struct page **pages)
+{
+	int i;
+
+	if (mock_check_error(&mock_pin_user_pages_errors))
+		return -EFAULT;
+	mock_pin_user_pages_flags = gup_flags;
+	if (mock_pin_user_pages_max && nr_pages > mock_pin_user_pages_max)
+		nr_pages = mock_pin_user_pages_max;
+	unit_log_printf("; ", "pin_user_pages_fast %d pages at 0x%lx",
+			nr_pages, start);
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = mock_alloc_pages(GFP_KERNEL, 0);
+	return nr_pages;
+}
+
 void preempt_count_add(int val)
 {
 	int i;
@@ -1139,6 +1280,17 @@ int proc_dointvec(const struct ctl_table *table, int write,
 	return 0;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
+int proc_dointvec_minmax(struct ctl_table *table, int write,
+			 void __user *buffer, size_t *lenp, loff_t *ppos)
+#else
+int proc_dointvec_minmax(const struct ctl_table *table, int write,
+			 void __user *buffer, size_t *lenp, loff_t *ppos)
+#endif
+{
+	return 0;
+}
+
 void proc_remove(struct proc_dir_entry *de)
 {
 	if (!de)
@@ -1307,6 +1459,13 @@ int __SCT__might_resched(void)
 void __SCT__preempt_schedule(void)
 {}
 
+void setup_udp_tunnel_sock(struct net *net, struct socket *sock,
+			   struct udp_tunnel_sock_cfg *cfg)
+{
+	UNIT_LOG("; ", "setup_udp_tunnel_sock family %d", sock->sk->sk_family);
+	mock_udp_tunnel_cfg = *cfg;
+}
+
 void security_sk_classify_flow(const struct sock *sk,
 		struct flowi_common *flic)
 {}
@@ -1315,6 +1474,18 @@ void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 		int max_zone_idx)
 {}
 
+struct shrinker *shrinker_alloc(unsigned int flags, const char *fmt, ...)
+{
+	return mock_kmalloc(sizeof(struct shrinker), GFP_KERNEL | __GFP_ZERO);
+}
+
+void shrinker_free(struct shrinker *shrinker)
+{
+	kfree(shrinker);
+}
+
+void shrinker_register(struct shrinker *shrinker) {}
+
 void sk_common_release(struct sock *sk)
 {}
 
@@ -1333,6 +1504,35 @@ void sk_skb_reason_drop(struct sock *sk, struct sk_buff *skb,
 #endif
 }
 
+struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	struct skb_shared_info *shinfo;
+	struct sk_buff *clone;
+	int i, size;
+
+	/* Unlike a real clone, this makes a complete copy of the skb's
+	 * data (this makes it easy to free the clone independently).
+	 */
+	if (mock_check_error(&mock_alloc_skb_errors))
+		return NULL;
+	if (skb_shinfo(skb)->frag_list)
+		FAIL(" %s can't handle skbs with frag_lists", __func__);
+	clone = malloc(sizeof(struct sk_buff));
+	memcpy(clone, skb, sizeof(*clone));
+	unit_hash_set(skbs_in_use, clone, "used");
+	size = skb_end_offset(skb) +
+			SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+	clone->head = malloc(size);
+	memcpy(clone->head, skb->head, size);
+	clone->data = clone->head + (skb->data - skb->head);
+	clone->users.refs.counter = 1;
+	clone->_skb_refdst = 0;
+	shinfo = skb_shinfo(clone);
+	for (i = 0; i < shinfo->nr_frags; i++)
+		get_page(skb_frag_page(&shinfo->frags[i]));
+	return clone;
+}
+
 int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 		struct iov_iter *iter, int size)
 {
@@ -1485,6 +1685,49 @@ void tasklet_init(struct tasklet_struct *t,
 void tasklet_kill(struct tasklet_struct *t)
 {}
 
+static int mock_udp_sock_create(struct udp_port_cfg *cfg,
+				struct socket **sockp)
+{
+	struct socket *sock;
+
+	if (mock_check_error(&mock_udp_sock_errors))
+		return -EADDRINUSE;
+	sock = malloc(sizeof(*sock));
+	memset(sock, 0, sizeof(*sock));
+	sock->sk = malloc(sizeof(struct sock));
+	memset(sock->sk, 0, sizeof(struct sock));
+	sock->sk->sk_family = cfg->family;
+	UNIT_LOG("; ", "udp_sock_create family %d port %d", cfg->family,
+		 ntohs(cfg->local_udp_port));
+	*sockp = sock;
+	return 0;
+}
+
+int udp_sock_create4(struct net *net, struct udp_port_cfg *cfg,
+		     struct socket **sockp)
+{
+	return mock_udp_sock_create(cfg, sockp);
+}
+
+int udp_sock_create6(struct net *net, struct udp_port_cfg *cfg,
+		     struct socket **sockp)
+{
+	return mock_udp_sock_create(cfg, sockp);
+}
+
+void udp_tunnel_sock_release(struct socket *sock)
+{
+	UNIT_LOG("; ", "udp_tunnel_sock_release family %d",
+		 sock->sk->sk_family);
+	free(sock->sk);
+	free(sock);
+}
+
+void unpin_user_page(struct page *page)
+{
+	mock_put_page(page);
+}
+
 void unregister_net_sysctl_table(struct ctl_table_header *header)
 {
 	UNIT_LOG("; ", "unregister_net_sysctl_table");
@@ -1493,6 +1736,11 @@ void unregister_net_sysctl_table(struct ctl_table_header *header)
 void unregister_pernet_subsys(struct pernet_operations *)
 {}
 
+void up_read(struct rw_semaphore *sem)
+{
+	mock_active_locks--;
+}
+
 void vfree(const void *block)
 {
 	if (!vmallocs_in_use || unit_hash_get(vmallocs_in_use, block) == NULL) {
@@ -1566,6 +1814,7 @@ struct homa_net *mock_alloc_hnet(struct homa *homa)
 	}
 	hnet = &mock_hnets[mock_num_hnets];
 	homa_net_init(hnet, &mock_nets[mock_num_hnets], homa);
+	list_add_tail(&mock_nets[mock_num_hnets].list, &net_namespace_list);
 	mock_num_hnets++;
 	return hnet;
 }
@@ -1765,6 +2014,17 @@ void mock_put_page(struct page *page)
 	}
 }
 
+/**
+ * mock_rlimit() - Called instead of rlimit when Homa is compiled for
+ * unit testing.
+ * @limit:   Which resource limit to return (ignored).
+ * Return:   The current value of mock_memlock_limit.
+ */
+unsigned long mock_rlimit(unsigned int limit)
+{
+	return mock_memlock_limit;
+}
+
 /**
  * mock_rcu_read_lock() - Called instead of rcu_read_lock when Homa is compiled
  * for unit testing.
@@ -2106,7 +2366,7 @@ void mock_spin_unlock(spinlock_t *lock)
  */
 void mock_teardown(void)
 {
-	int count;
+	int count, i;
 
 	pcpu_hot.cpu_number = 1;
 	pcpu_hot.current_task = &mock_task;
@@ -2130,6 +2390,7 @@ void mock_teardown(void)
 	mock_ip_queue_xmit_errors = 0;
 	mock_kmalloc_errors = 0;
 	mock_kthread_create_errors = 0;
+	mock_pin_user_pages_errors = 0;
 	mock_prepare_to_wait_errors = 0;
 	mock_register_protosw_errors = 0;
 	mock_register_sysctl_errors = 0;
@@ -2144,8 +2405,17 @@ void mock_teardown(void)
 	mock_log_rcu_sched = 0;
 	mock_route_errors = 0;
 	mock_trylock_errors = 0;
+	mock_udp_sock_errors = 0;
 	mock_vmalloc_errors = 0;
+	mock_csum_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
+	mock_task.mm = &mock_mm;
+	atomic_set(&mock_mm.mm_count, 1);
+	atomic64_set(&mock_mm.pinned_vm, 0);
+	mock_capable = 0;
+	mock_memlock_limit = 1UL << 30;
+	mock_pin_user_pages_flags = 0;
+	mock_pin_user_pages_max = 0;
 	mock_prepare_to_wait_status = -ERESTARTSYS;
 	mock_signal_pending = 0;
 	mock_xmit_log_verbose = 0;
@@ -2161,7 +2431,17 @@ void mock_teardown(void)
 	mock_rht_num_walk_results = 0;
 	mock_min_default_port = 0x8000;
 	homa_net_id = 0;
+#ifndef __STRIP__ /* See strip.py */
+	for (i = 0; i < mock_num_hnets; i++) {
+		/* Tests don't normally destroy their homa_nets. */
+		if (mock_hnets[i].impair) {
+			homa_impair_free(mock_hnets[i].impair);
+			mock_hnets[i].impair = NULL;
+		}
+	}
+#endif /* See strip.py */
 	mock_num_hnets = 0;
+	INIT_LIST_HEAD(&net_namespace_list);
 	mock_peer_free_no_fail = 0;
 	mock_net_device.gso_max_size = 0;
 	mock_net_device.gso_max_segs = 1000;
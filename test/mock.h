@@ -8,6 +8,9 @@
 #undef alloc_pages
 #define alloc_pages mock_alloc_pages
 
+#undef alloc_pages_node
+#define alloc_pages_node(nid, gfp, order) mock_alloc_pages(gfp, order)
+
 #undef alloc_percpu_gfp
 #define alloc_percpu_gfp(type, flags) mock_kmalloc(10 * sizeof(type), flags)
 
@@ -85,6 +88,8 @@
 #undef register_net_sysctl
 #define register_net_sysctl mock_register_net_sysctl
 
+#define rlimit(limit) mock_rlimit(limit)
+
 #define signal_pending(...) mock_signal_pending
 
 #undef smp_processor_id
@@ -116,10 +121,12 @@ extern int         mock_bpage_shift;
 extern u64         mock_clock;
 extern u64         mock_clock_tick;
 extern int         mock_compound_order_mask;
+extern int         mock_capable;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
 extern int         mock_cpu_idle;
+extern int         mock_csum_errors;
 extern int         mock_dst_check_errors;
 extern int         mock_import_iovec_errors;
 extern int         mock_import_ubuf_errors;
@@ -142,9 +149,15 @@ extern __u16       mock_min_default_port;
 extern int         mock_mtu;
 extern struct net_device
 		   mock_net_device;
+extern unsigned long mock_memlock_limit;
+extern struct mm_struct
+		   mock_mm;
 extern int         mock_numa_mask;
 extern int         mock_page_nid_mask;
 extern int         mock_peer_free_no_fail;
+extern int         mock_pin_user_pages_errors;
+extern unsigned int mock_pin_user_pages_flags;
+extern int         mock_pin_user_pages_max;
 extern int         mock_prepare_to_wait_status;
 extern char        mock_printk_output[];
 extern int         mock_rht_init_errors;
@@ -159,6 +172,9 @@ extern struct task_struct
 		   mock_task;
 extern int         mock_total_spin_locks;
 extern int         mock_trylock_errors;
+extern struct udp_tunnel_sock_cfg
+		   mock_udp_tunnel_cfg;
+extern int         mock_udp_sock_errors;
 extern u64         mock_tt_cycles;
 extern int         mock_vmalloc_errors;
 extern int         mock_xmit_log_verbose;
@@ -191,6 +207,8 @@ void        mock_preempt_enable(void);
 int         mock_processor_id(void);
 void        mock_put_page(struct page *page);
 void        mock_rcu_read_lock(void);
+unsigned long
+	    mock_rlimit(unsigned int limit);
 void        mock_rcu_read_unlock(void);
 void        mock_record_locked(void *lock);
 void        mock_record_unlocked(void *lock);
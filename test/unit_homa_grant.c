@@ -28,6 +28,24 @@ char *rpc_ids(struct homa_rpc **rpcs, int count)
 	return buffer;
 }
 
+/* Returns the ids of all of the RPCs in grant->fifo_rpcs, in order. */
+char *fifo_ids(struct homa_grant *grant)
+{
+	static char buffer[1000];
+	struct homa_rpc *rpc;
+	size_t length = 0;
+
+	buffer[0] = 0;
+	list_for_each_entry(rpc, &grant->fifo_rpcs, fifo_links) {
+		if (length != 0)
+			length += snprintf(buffer + length,
+					sizeof(buffer) - length, " ");
+		length += snprintf(buffer + length, sizeof(buffer) - length,
+				"%lld", rpc->id);
+	}
+	return buffer;
+}
+
 static int hook_spinlock_count;
 static void grant_spinlock_hook(char *id)
 {
@@ -83,6 +101,7 @@ FIXTURE_SETUP(homa_grant)
 	self->homa.flags |= HOMA_FLAG_DONT_THROTTLE;
 	self->homa.pacer->fifo_fraction = 0;
 	self->homa.grant->fifo_fraction = 0;
+	homa_grant_update_sysctl_deps(self->homa.grant);
 	self->homa.grant->window = 10000;
 	self->homa.grant->max_incoming = 50000;
 	self->homa.grant->max_rpcs_per_peer = 10;
@@ -110,13 +129,14 @@ FIXTURE_TEARDOWN(homa_grant)
 	unit_teardown();
 }
 
-/* Create a client RPC whose msgin is mostly initialized, except
- * homa_grant_init_rpc isn't invoked.
+/* Create a client RPC on a given socket whose msgin is mostly initialized,
+ * except homa_grant_init_rpc isn't invoked.
  */
-static struct homa_rpc *test_rpc(FIXTURE_DATA(homa_grant) *self,
-		u64 id, struct in6_addr *server_ip, int size)
+static struct homa_rpc *test_rpc_hsk(FIXTURE_DATA(homa_grant) *self,
+		struct homa_sock *hsk, u64 id, struct in6_addr *server_ip,
+		int size)
 {
-	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+	struct homa_rpc *rpc = unit_client_rpc(hsk, UNIT_OUTGOING,
 			self->client_ip, server_ip, self->server_port,
 			id, 1000, size);
 
@@ -129,6 +149,15 @@ static struct homa_rpc *test_rpc(FIXTURE_DATA(homa_grant) *self,
 	return rpc;
 }
 
+/* Create a client RPC on self->hsk whose msgin is mostly initialized,
+ * except homa_grant_init_rpc isn't invoked.
+ */
+static struct homa_rpc *test_rpc(FIXTURE_DATA(homa_grant) *self,
+		u64 id, struct in6_addr *server_ip, int size)
+{
+	return test_rpc_hsk(self, &self->hsk, id, server_ip, size);
+}
+
 /* Create a client RPC whose msgin is properly initialized with no
  * unscheduled bytes and no packets received.
  */
@@ -312,7 +341,6 @@ TEST_F(homa_grant, homa_grant_outranks)
 	EXPECT_EQ(0, homa_grant_outranks(rpc2, rpc4));
 	EXPECT_EQ(0, homa_grant_outranks(rpc4, rpc2));
 }
-
 TEST_F(homa_grant, homa_grant_priority__no_extra_levels)
 {
 	self->homa.max_sched_prio = 6;
@@ -328,6 +356,41 @@ TEST_F(homa_grant, homa_grant_priority__extra_levels)
 	EXPECT_EQ(0, homa_grant_priority(&self->homa, 7));
 }
 
+TEST_F(homa_grant, homa_grant_share__only_socket)
+{
+	self->homa.grant->max_overcommit = 8;
+	self->hsk.grant_weight = 3;
+	EXPECT_EQ(8, homa_grant_share(self->homa.grant, &self->hsk));
+	self->hsk.num_grantable_rpcs = 2;
+	self->homa.grant->grantable_weight = 3;
+	EXPECT_EQ(8, homa_grant_share(self->homa.grant, &self->hsk));
+	self->hsk.num_grantable_rpcs = 0;
+	self->homa.grant->grantable_weight = 0;
+}
+TEST_F(homa_grant, homa_grant_share__weighted)
+{
+	self->homa.grant->max_overcommit = 8;
+	self->hsk.grant_weight = 3;
+	self->hsk.num_grantable_rpcs = 1;
+	self->homa.grant->grantable_weight = 4;
+	EXPECT_EQ(6, homa_grant_share(self->homa.grant, &self->hsk));
+
+	/* Socket with no grantable RPCs yet: its weight is added in. */
+	self->hsk.num_grantable_rpcs = 0;
+	self->homa.grant->grantable_weight = 5;
+	EXPECT_EQ(3, homa_grant_share(self->homa.grant, &self->hsk));
+	self->homa.grant->grantable_weight = 0;
+}
+TEST_F(homa_grant, homa_grant_share__at_least_one)
+{
+	self->homa.grant->max_overcommit = 8;
+	self->hsk.num_grantable_rpcs = 1;
+	self->homa.grant->grantable_weight = 100;
+	EXPECT_EQ(1, homa_grant_share(self->homa.grant, &self->hsk));
+	self->hsk.num_grantable_rpcs = 0;
+	self->homa.grant->grantable_weight = 0;
+}
+
 TEST_F(homa_grant, homa_grant_insert_active__basics)
 {
 	struct homa_rpc *rpc1, *rpc2, *rpc3;
@@ -457,6 +520,74 @@ TEST_F(homa_grant, homa_grant_insert_active__insert_in_middle_no_bump)
 	EXPECT_EQ(4, rpc1->peer->active_rpcs);
 }
 
+TEST_F(homa_grant, homa_grant_insert_active__take_slot_from_socket_over_share)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, self->hnet, self->client_port + 1);
+	self->homa.grant->max_overcommit = 4;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+	homa_grant_manage_rpc(test_rpc(self, 104, self->server_ip, 30000));
+	homa_grant_manage_rpc(test_rpc(self, 106, self->server_ip, 40000));
+	EXPECT_EQ(4, self->hsk.grant_active_rpcs);
+
+	/* hsk2's share is 2, so each of its RPCs displaces one from hsk
+	 * even though they are lower priority under SRPT.
+	 */
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 200, self->server_ip,
+					   50000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 202, self->server_ip,
+					   60000));
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 9000; "
+		     "active[1]: id 102 ungranted 19000; "
+		     "active[2]: id 200 ungranted 49000; "
+		     "active[3]: id 202 ungranted 59000; "
+		     "peer 1.2.3.4: id 104 ungranted 29000 "
+		     "id 106 ungranted 39000",
+		     unit_log_get());
+	EXPECT_EQ(2, self->hsk.grant_active_rpcs);
+	EXPECT_EQ(2, hsk2.grant_active_rpcs);
+	EXPECT_EQ(2, self->homa.grant->grantable_weight);
+	unit_sock_destroy(&hsk2);
+}
+TEST_F(homa_grant, homa_grant_insert_active__socket_at_share)
+{
+	struct homa_rpc *rpc1, *rpc2;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, self->hnet, self->client_port + 1);
+	self->homa.grant->max_overcommit = 4;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 200, self->server_ip,
+					   50000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 202, self->server_ip,
+					   60000));
+
+	/* Lower priority than all of hsk2's active RPCs: bumped. */
+	rpc1 = test_rpc_hsk(self, &hsk2, 204, self->server_ip, 70000);
+	homa_grant_manage_rpc(rpc1);
+	EXPECT_EQ(-1, rpc1->msgin.rank);
+
+	/* Higher priority: displaces hsk2's lowest-priority RPC. */
+	rpc2 = test_rpc_hsk(self, &hsk2, 206, self->server_ip, 5000);
+	homa_grant_manage_rpc(rpc2);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 206 ungranted 4000; "
+		     "active[1]: id 100 ungranted 9000; "
+		     "active[2]: id 102 ungranted 19000; "
+		     "active[3]: id 200 ungranted 49000; "
+		     "peer 1.2.3.4: id 202 ungranted 59000 "
+		     "id 204 ungranted 69000",
+		     unit_log_get());
+	EXPECT_EQ(2, hsk2.grant_active_rpcs);
+	unit_sock_destroy(&hsk2);
+}
+
 TEST_F(homa_grant, homa_grant_insert_grantable__insert_in_peer_list)
 {
 	homa_grant_insert_grantable(test_rpc(self, 100, self->server_ip,
@@ -575,6 +706,24 @@ TEST_F(homa_grant, homa_grant_manage_rpc__insert_and_bump_to_grantables)
 	EXPECT_STREQ("active[0]: id 102 ungranted 19000; "
 		     "peer 1.2.3.4: id 100 ungranted 49000", unit_log_get());
 }
+TEST_F(homa_grant, homa_grant_manage_rpc__append_to_fifo_rpcs)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+
+	rpc1 = test_rpc(self, 100, self->server_ip, 50000);
+	rpc2 = test_rpc(self, 102, self->server_ip, 20000);
+	rpc3 = test_rpc(self, 104, self->server_ip+1, 80000);
+
+	self->homa.grant->max_overcommit = 1;
+	mock_clock = 200;
+	homa_grant_manage_rpc(rpc1);
+	mock_clock = 300;
+	homa_grant_manage_rpc(rpc2);
+	mock_clock = 400;
+	homa_grant_manage_rpc(rpc3);
+	EXPECT_STREQ("100 102 104", fifo_ids(self->homa.grant));
+	EXPECT_EQ(400, rpc3->msgin.birth);
+}
 TEST_F(homa_grant, homa_grant_manage_rpc__set_window)
 {
 	struct homa_rpc *rpc1;
@@ -789,6 +938,63 @@ TEST_F(homa_grant, homa_grant_remove_active__skip_overactive_peer)
 	EXPECT_FALSE(homa_grant_cand_empty(&self->cand));
 }
 
+TEST_F(homa_grant, homa_grant_remove_active__prefer_socket_below_share)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *rpc;
+
+	mock_sock_init(&hsk2, self->hnet, self->client_port + 1);
+	self->homa.grant->max_overcommit = 2;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+	rpc = test_rpc_hsk(self, &hsk2, 200, self->server_ip, 40000);
+	homa_grant_manage_rpc(rpc);
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 202, self->server_ip,
+					   50000));
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 9000; "
+		     "active[1]: id 200 ungranted 39000; "
+		     "peer 1.2.3.4: id 102 ungranted 19000 "
+		     "id 202 ungranted 49000",
+		     unit_log_get());
+
+	homa_grant_remove_active(rpc, &self->cand);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 9000; "
+		     "active[1]: id 202 ungranted 49000; "
+		     "peer 1.2.3.4: id 102 ungranted 19000",
+		     unit_log_get());
+	EXPECT_FALSE(homa_grant_cand_empty(&self->cand));
+	homa_grant_cand_check(&self->cand, self->homa.grant);
+	unit_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_grant, homa_grant_pick_grantable__strict)
+{
+	self->homa.grant->max_overcommit = 1;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+
+	/* hsk already has its share of active_rpcs. */
+	EXPECT_EQ(NULL, homa_grant_pick_grantable(self->homa.grant, true));
+	EXPECT_EQ(102, homa_grant_pick_grantable(self->homa.grant,
+						 false)->id);
+}
+TEST_F(homa_grant, homa_grant_pick_grantable__skip_overactive_peer)
+{
+	self->homa.grant->max_overcommit = 1;
+	self->homa.grant->max_rpcs_per_peer = 1;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+	homa_grant_manage_rpc(test_rpc(self, 104, self->server_ip + 1, 30000));
+	self->homa.grant->max_overcommit = 2;
+
+	EXPECT_EQ(104, homa_grant_pick_grantable(self->homa.grant,
+						 false)->id);
+}
+
 TEST_F(homa_grant, homa_grant_unmanage_rpc)
 {
 	struct homa_rpc *rpc;
@@ -807,6 +1013,8 @@ TEST_F(homa_grant, homa_grant_unmanage_rpc)
 		     "peer 1.2.3.4: id 200 ungranted 29000",
 		     unit_log_get());
 	EXPECT_EQ(2, self->homa.grant->num_grantable_rpcs);
+	EXPECT_EQ(2, self->hsk.num_grantable_rpcs);
+	EXPECT_EQ(1, self->homa.grant->grantable_weight);
 	EXPECT_EQ(30000, self->homa.grant->window);
 
 	self->homa.grant->last_grantable_change = 100;
@@ -820,15 +1028,67 @@ TEST_F(homa_grant, homa_grant_unmanage_rpc)
 	EXPECT_EQ(300, homa_metrics_per_cpu()->grantable_rpcs_integral);
 	EXPECT_EQ(250, self->homa.grant->last_grantable_change);
 	EXPECT_EQ(30000, self->homa.grant->window);
+	EXPECT_STREQ("100", fifo_ids(self->homa.grant));
+	EXPECT_TRUE(list_empty(&rpc->fifo_links));
 
 	homa_grant_unmanage_rpc(self->homa.grant->active_rpcs[0], &self->cand);
 	unit_log_clear();
 	unit_log_grantables(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
+	EXPECT_STREQ("", fifo_ids(self->homa.grant));
 	EXPECT_EQ(0, self->homa.grant->num_grantable_rpcs);
+	EXPECT_EQ(0, self->hsk.num_grantable_rpcs);
+	EXPECT_EQ(0, self->homa.grant->grantable_weight);
 	EXPECT_EQ(60000, self->homa.grant->window);
 }
 
+TEST_F(homa_grant, homa_grant_set_weight__no_grantable_rpcs)
+{
+	homa_grant_set_weight(&self->hsk, 4);
+	EXPECT_EQ(4, self->hsk.grant_weight);
+	EXPECT_EQ(0, self->homa.grant->grantable_weight);
+}
+TEST_F(homa_grant, homa_grant_set_weight__rebalance)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, self->hnet, self->client_port + 1);
+	self->homa.grant->max_overcommit = 4;
+	homa_grant_manage_rpc(test_rpc(self, 100, self->server_ip, 10000));
+	homa_grant_manage_rpc(test_rpc(self, 102, self->server_ip, 20000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 200, self->server_ip,
+					   30000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 202, self->server_ip,
+					   40000));
+	homa_grant_manage_rpc(test_rpc_hsk(self, &hsk2, 204, self->server_ip,
+					   50000));
+	homa_grant_manage_rpc(test_rpc(self, 104, self->server_ip, 60000));
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 9000; "
+		     "active[1]: id 102 ungranted 19000; "
+		     "active[2]: id 200 ungranted 29000; "
+		     "active[3]: id 202 ungranted 39000; "
+		     "peer 1.2.3.4: id 204 ungranted 49000 "
+		     "id 104 ungranted 59000",
+		     unit_log_get());
+
+	homa_grant_set_weight(&self->hsk, 3);
+	EXPECT_EQ(4, self->homa.grant->grantable_weight);
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 9000; "
+		     "active[1]: id 102 ungranted 19000; "
+		     "active[2]: id 200 ungranted 29000; "
+		     "active[3]: id 104 ungranted 59000; "
+		     "peer 1.2.3.4: id 202 ungranted 39000 "
+		     "id 204 ungranted 49000",
+		     unit_log_get());
+	EXPECT_EQ(3, self->hsk.grant_active_rpcs);
+	EXPECT_EQ(1, hsk2.grant_active_rpcs);
+	unit_sock_destroy(&hsk2);
+}
+
 TEST_F(homa_grant, homa_grant_update_incoming)
 {
 	struct homa_rpc *rpc;
@@ -875,6 +1135,26 @@ TEST_F(homa_grant, homa_grant_update_granted__basics)
 	EXPECT_EQ(10000, rpc->msgin.granted);
 	EXPECT_EQ(INT_MAX, atomic_read(&self->homa.grant->stalled_rank));
 }
+TEST_F(homa_grant, homa_grant_update_granted__decrement_nonfifo_left)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, 20000);
+	rpc->msgin.rank = 0;
+	EXPECT_EQ(0, homa_grant_update_granted(rpc, self->homa.grant));
+	EXPECT_EQ(10000, rpc->msgin.granted);
+	EXPECT_EQ(11000, atomic_read(&self->homa.grant->nonfifo_left));
+}
+TEST_F(homa_grant, homa_grant_update_granted__fifo_grants_disabled)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+
+	atomic_set(&self->homa.grant->nonfifo_left, 20000);
+	rpc->msgin.rank = 0;
+	EXPECT_EQ(0, homa_grant_update_granted(rpc, self->homa.grant));
+	EXPECT_EQ(20000, atomic_read(&self->homa.grant->nonfifo_left));
+}
 TEST_F(homa_grant, homa_grant_update_granted__rpc_idle)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
@@ -1025,6 +1305,25 @@ TEST_F(homa_grant, homa_grant_check_rpc__update_incoming_even_if_rpc_no_longer_a
 	EXPECT_EQ(0, rpc->msgin.rec_incoming);
 	EXPECT_EQ(0, homa_metrics_per_cpu()->grant_check_locked);
 }
+TEST_F(homa_grant, homa_grant_check_rpc__deadline_passed)
+{
+	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			100, 1000, 20000);
+
+	homa_message_in_init(rpc, 20000, 0);
+	mock_clock = 5000;
+	rpc->deadline = 5000;
+
+	unit_log_clear();
+	homa_rpc_lock(rpc);
+	homa_grant_check_rpc(rpc);
+	homa_rpc_unlock(rpc);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_check_calls);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->grant_check_locked);
+	EXPECT_EQ(0, rpc->msgin.granted);
+}
 TEST_F(homa_grant, homa_grant_check_rpc__fix_order)
 {
 	struct homa_rpc *rpc1, *rpc2, *rpc3;
@@ -1056,6 +1355,53 @@ TEST_F(homa_grant, homa_grant_check_rpc__fix_order)
 	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_check_recalcs);
 	EXPECT_EQ(40000, self->homa.grant->next_recalc);
 }
+TEST_F(homa_grant, homa_grant_check_rpc__fix_order_not_needed_one_rpc)
+{
+	struct homa_rpc *rpc;
+
+	rpc = test_rpc_init(self, 100, self->server_ip, 20000);
+	mock_clock = self->homa.grant->next_recalc + 100;
+
+	unit_log_clear();
+	homa_rpc_lock(rpc);
+	homa_grant_check_rpc(rpc);
+	homa_rpc_unlock(rpc);
+	EXPECT_STREQ("xmit GRANT 10000@0", unit_log_get());
+	EXPECT_EQ(0, homa_metrics_per_cpu()->grant_check_locked);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->grant_check_recalcs);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_check_recalc_skips);
+	EXPECT_EQ(mock_clock + self->homa.grant->recalc_cycles,
+		  self->homa.grant->next_recalc);
+}
+TEST_F(homa_grant, homa_grant_check_rpc__fix_order_no_headroom)
+{
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
+	u64 next_recalc;
+
+	rpc1 = test_rpc_init(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip, 30000);
+	rpc3 = test_rpc_init(self, 104, self->server_ip, 40000);
+	rpc3->msgin.granted = 25000;
+	rpc3->msgin.bytes_remaining = 15000;
+	atomic_set(&self->homa.grant->total_incoming,
+		   self->homa.grant->max_incoming);
+	next_recalc = self->homa.grant->next_recalc;
+	mock_clock = next_recalc;
+
+	unit_log_clear();
+	homa_rpc_lock(rpc2);
+	homa_grant_check_rpc(rpc2);
+	homa_rpc_unlock(rpc2);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_clear();
+	unit_log_grantables(&self->homa);
+	EXPECT_STREQ("active[0]: id 100 ungranted 20000; "
+		     "active[1]: id 102 ungranted 30000; "
+		     "active[2]: id 104 ungranted 15000", unit_log_get());
+	EXPECT_EQ(0, homa_metrics_per_cpu()->grant_check_recalcs);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_check_recalc_skips);
+	EXPECT_EQ(next_recalc, self->homa.grant->next_recalc);
+}
 TEST_F(homa_grant, homa_grant_check_rpc__fast_path)
 {
 	struct homa_rpc *rpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1259,6 +1605,49 @@ TEST_F(homa_grant, homa_grant_check_rpc__skip_dead_rpc_when_checking_needy)
 	rpc2->state = saved_state;
 }
 
+TEST_F(homa_grant, homa_grant_check_rpc__send_fifo_grant)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	self->homa.grant->max_overcommit = 1;
+	self->homa.max_sched_prio = 5;
+	rpc1 = test_rpc_init(self, 100, self->server_ip, 100000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip, 20000);
+	EXPECT_EQ(-1, rpc1->msgin.rank);
+	EXPECT_EQ(0, rpc2->msgin.rank);
+	self->homa.grant->grant_nonfifo = 5000;
+	atomic_set(&self->homa.grant->nonfifo_left, 5000);
+
+	unit_log_clear();
+	homa_rpc_lock(rpc2);
+	homa_grant_check_rpc(rpc2);
+	homa_rpc_unlock(rpc2);
+	EXPECT_STREQ("xmit GRANT 10000@0; xmit GRANT 10000@5", unit_log_get());
+	EXPECT_EQ(10000, rpc1->msgin.granted);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->fifo_grants);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_check_locked);
+	EXPECT_EQ(0, atomic_read(&self->homa.grant->nonfifo_left));
+}
+TEST_F(homa_grant, homa_grant_check_rpc__not_time_for_fifo_grant)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	self->homa.grant->max_overcommit = 1;
+	rpc1 = test_rpc_init(self, 100, self->server_ip, 100000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip, 20000);
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, 20000);
+
+	unit_log_clear();
+	homa_rpc_lock(rpc2);
+	homa_grant_check_rpc(rpc2);
+	homa_rpc_unlock(rpc2);
+	EXPECT_STREQ("xmit GRANT 10000@0", unit_log_get());
+	EXPECT_EQ(0, rpc1->msgin.granted);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->fifo_grants);
+	EXPECT_EQ(10000, atomic_read(&self->homa.grant->nonfifo_left));
+}
+
 TEST_F(homa_grant, homa_grant_fix_order)
 {
 	struct homa_rpc *rpc3, *rpc4;
@@ -1288,48 +1677,117 @@ TEST_F(homa_grant, homa_grant_fix_order)
 	EXPECT_EQ(3, homa_metrics_per_cpu()->grant_priority_bumps);
 }
 
-#if 0
 TEST_F(homa_grant, homa_grant_find_oldest__basics)
 {
-	mock_clock_tick = 10;
-	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
-			self->server_ip, self->client_port, 11, 40000, 100);
-	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
-			self->server_ip, self->client_port, 33, 30000, 100);
-	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
-			self->server_ip, self->client_port, 55, 20000, 100);
+	struct homa_rpc *rpc1, *rpc2, *rpc3;
 
-	unit_log_clear();
-	homa_grant_find_oldest(&self->homa);
-	EXPECT_NE(NULL, self->homa.oldest_rpc);
-	EXPECT_EQ(11, self->homa.oldest_rpc->id);
+	self->homa.grant->max_overcommit = 1;
+	rpc1 = test_rpc_init(self, 100, self->server_ip, 40000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip+1, 30000);
+	rpc3 = test_rpc_init(self, 104, self->server_ip, 20000);
+	EXPECT_EQ(-1, rpc1->msgin.rank);
+	EXPECT_EQ(-1, rpc2->msgin.rank);
+	EXPECT_EQ(0, rpc3->msgin.rank);
+
+	EXPECT_EQ(rpc1, homa_grant_find_oldest(self->homa.grant));
+}
+TEST_F(homa_grant, homa_grant_find_oldest__skip_active_rpcs)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	self->homa.grant->max_overcommit = 1;
+	rpc1 = test_rpc_init(self, 100, self->server_ip, 20000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip+1, 30000);
+	EXPECT_EQ(0, rpc1->msgin.rank);
+
+	EXPECT_EQ(rpc2, homa_grant_find_oldest(self->homa.grant));
 }
 TEST_F(homa_grant, homa_grant_find_oldest__fifo_grant_unused)
 {
-	struct homa_rpc *srpc1, *srpc2;
+	struct homa_rpc *rpc1, *rpc2;
 
-	mock_clock_tick = 10;
-	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
-			self->server_ip, self->client_port, 11, 400000, 100);
-	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip+1,
-			self->server_ip, self->client_port, 33, 300000, 100);
-	unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
-			self->server_ip, self->client_port, 55, 200000, 100);
-	ASSERT_NE(NULL, srpc1);
-	ASSERT_NE(NULL, srpc2);
-	srpc1->msgin.granted += + 2*self->homa.fifo_grant_increment;
+	self->homa.grant->max_overcommit = 1;
+	test_rpc_init(self, 100, self->server_ip, 20000);
+	rpc1 = test_rpc_init(self, 102, self->server_ip, 400000);
+	rpc2 = test_rpc_init(self, 104, self->server_ip+1, 300000);
+	rpc1->msgin.granted += self->homa.grant->window +
+			2 * self->homa.grant->fifo_grant_increment;
 
-	unit_log_clear();
-	homa_grant_find_oldest(&self->homa);
-	EXPECT_NE(NULL, self->homa.oldest_rpc);
-	EXPECT_EQ(33, self->homa.oldest_rpc->id);
+	EXPECT_EQ(rpc2, homa_grant_find_oldest(self->homa.grant));
 }
 TEST_F(homa_grant, homa_grant_find_oldest__no_good_candidates)
 {
-	homa_grant_find_oldest(&self->homa);
-	EXPECT_EQ(NULL, self->homa.oldest_rpc);
+	EXPECT_EQ(NULL, homa_grant_find_oldest(self->homa.grant));
+}
+
+TEST_F(homa_grant, homa_grant_check_fifo__basics)
+{
+	struct homa_rpc *rpc;
+
+	self->homa.grant->max_overcommit = 1;
+	self->homa.max_sched_prio = 3;
+	test_rpc_init(self, 100, self->server_ip, 20000);
+	rpc = test_rpc_init(self, 102, self->server_ip, 100000);
+	rpc->msgin.bytes_remaining = 95000;
+	rpc->msgin.granted = 5000;
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, -100);
+
+	unit_log_clear();
+	homa_grant_check_fifo(self->homa.grant);
+	EXPECT_STREQ("xmit GRANT 15000@3", unit_log_get());
+	EXPECT_EQ(15000, rpc->msgin.granted);
+	EXPECT_EQ(10000, rpc->msgin.rec_incoming);
+	EXPECT_EQ(49900, atomic_read(&self->homa.grant->nonfifo_left));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->fifo_grants);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->fifo_grants_no_incoming);
+	EXPECT_EQ(0, atomic_read(&rpc->refs));
+}
+TEST_F(homa_grant, homa_grant_check_fifo__not_time_yet)
+{
+	self->homa.grant->max_overcommit = 1;
+	test_rpc_init(self, 100, self->server_ip, 20000);
+	test_rpc_init(self, 102, self->server_ip, 100000);
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, 1);
+
+	unit_log_clear();
+	homa_grant_check_fifo(self->homa.grant);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, atomic_read(&self->homa.grant->nonfifo_left));
+}
+TEST_F(homa_grant, homa_grant_check_fifo__no_candidate)
+{
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, 0);
+
+	unit_log_clear();
+	homa_grant_check_fifo(self->homa.grant);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(50000, atomic_read(&self->homa.grant->nonfifo_left));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->fifo_grants);
+}
+TEST_F(homa_grant, homa_grant_check_fifo__message_becomes_fully_granted)
+{
+	struct homa_rpc *rpc1, *rpc2;
+
+	self->homa.grant->max_overcommit = 1;
+	self->homa.grant->max_rpcs_per_peer = 1;
+	rpc1 = test_rpc_init(self, 100, self->server_ip+1, 20000);
+	rpc2 = test_rpc_init(self, 102, self->server_ip, 25000);
+	rpc2->msgin.granted = 18000;
+	rpc2->msgin.bytes_remaining = 7000;
+	self->homa.grant->grant_nonfifo = 50000;
+	atomic_set(&self->homa.grant->nonfifo_left, 0);
+
+	unit_log_clear();
+	homa_grant_check_fifo(self->homa.grant);
+	EXPECT_STREQ("xmit GRANT 25000@3", unit_log_get());
+	EXPECT_EQ(25000, rpc2->msgin.granted);
+	EXPECT_TRUE(list_empty(&rpc2->fifo_links));
+	EXPECT_STREQ("100", fifo_ids(self->homa.grant));
+	EXPECT_EQ(0, rpc1->msgin.rank);
 }
-#endif
 
 TEST_F(homa_grant, homa_grant_cand_add__basics)
 {
@@ -1489,6 +1947,7 @@ TEST_F(homa_grant, homa_grant_update_sysctl_deps__grant_nonfifo)
 	self->homa.grant->fifo_fraction = 100;
 	homa_grant_update_sysctl_deps(self->homa.grant);
 	EXPECT_EQ(90000, self->homa.grant->grant_nonfifo);
+	EXPECT_EQ(90000, atomic_read(&self->homa.grant->nonfifo_left));
 }
 TEST_F(homa_grant, homa_grant_update_sysctl_deps__recalc_cycles)
 {
@@ -0,0 +1,405 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "homa_impl.h"
+#include "homa_impair.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* Passes @count DATA packets through @impair, returning a string with one
+ * character per packet: 'd' (dropped or held) or '.' (passed on).
+ */
+static char *rx_pattern(struct homa_impair *impair,
+			struct homa_data_hdr *data, struct in6_addr *saddr,
+			int count)
+{
+	static char buffer[200];
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i < count && i < sizeof(buffer) - 1; i++) {
+		skb = mock_skb_alloc(saddr, &data->common, 1400, 0);
+		if (homa_impair_rx(impair, skb)) {
+			buffer[i] = 'd';
+		} else {
+			buffer[i] = '.';
+			kfree_skb(skb);
+		}
+	}
+	buffer[i] = 0;
+	return buffer;
+}
+
+FIXTURE(homa_impair) {
+	struct in6_addr client_ip[1];
+	int client_port;
+	struct in6_addr server_ip[1];
+	int server_port;
+	struct homa homa;
+	struct homa_net *hnet;
+	struct homa_sock hsk;
+	struct homa_impair *impair;
+	struct homa_data_hdr data;
+};
+FIXTURE_SETUP(homa_impair)
+{
+	self->client_ip[0] = unit_get_in_addr("196.168.0.1");
+	self->client_port = 40000;
+	self->server_ip[0] = unit_get_in_addr("1.2.3.4");
+	self->server_port = 99;
+	homa_init(&self->homa);
+	self->hnet = mock_alloc_hnet(&self->homa);
+	mock_sock_init(&self->hsk, self->hnet, 0);
+	homa_sock_bind(self->hnet, &self->hsk, self->server_port);
+	self->impair = self->hnet->impair;
+	memset(&self->data, 0, sizeof(self->data));
+	self->data = (struct homa_data_hdr){.common = {
+		.sport = htons(self->client_port),
+		.dport = htons(self->server_port),
+		.type = DATA,
+		.sender_id = cpu_to_be64(1234)},
+		.message_length = htonl(10000),
+		.incoming = htonl(10000),
+	};
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_impair)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+TEST_F(homa_impair, homa_impair_alloc__success)
+{
+	struct homa_impair *impair;
+
+	impair = homa_impair_alloc(self->hnet->net);
+	ASSERT_FALSE(IS_ERR(impair));
+	EXPECT_EQ(HOMA_IMPAIR_RX, impair->dirs);
+	EXPECT_EQ(1, impair->burst);
+	EXPECT_EQ(0, impair->rx_active);
+	EXPECT_EQ(0, impair->tx_active);
+	homa_impair_free(impair);
+}
+TEST_F(homa_impair, homa_impair_alloc__cant_allocate_memory)
+{
+	struct homa_impair *impair;
+
+	mock_kmalloc_errors = 1;
+	impair = homa_impair_alloc(self->hnet->net);
+	EXPECT_TRUE(IS_ERR(impair));
+	EXPECT_EQ(ENOMEM, -PTR_ERR(impair));
+}
+TEST_F(homa_impair, homa_impair_alloc__cant_register_sysctls)
+{
+	struct homa_impair *impair;
+
+	mock_register_sysctl_errors = 1;
+	impair = homa_impair_alloc(self->hnet->net);
+	EXPECT_TRUE(IS_ERR(impair));
+	EXPECT_EQ(ENOMEM, -PTR_ERR(impair));
+}
+
+TEST_F(homa_impair, homa_impair_free__discard_held_packets)
+{
+	struct homa_impair *impair;
+
+	impair = homa_impair_alloc(self->hnet->net);
+	impair->delay_usecs = 100;
+	homa_impair_update_sysctl_deps(impair);
+	EXPECT_STREQ("dd", rx_pattern(impair, &self->data, self->client_ip,
+		     2));
+	impair->delay_usecs = 0;
+	impair->reorder_ppm = 1000000;
+	homa_impair_update_sysctl_deps(impair);
+	EXPECT_STREQ("d", rx_pattern(impair, &self->data, self->client_ip,
+		     1));
+	EXPECT_EQ(3, impair->num_held);
+	EXPECT_EQ(1, unit_list_length(&impair->reorder));
+	unit_log_clear();
+	homa_impair_free(impair);
+	EXPECT_STREQ("unregister_net_sysctl_table", unit_log_get());
+}
+
+TEST_F(homa_impair, homa_impair_rand)
+{
+	u64 state1 = 99, state2 = 99;
+	u32 first;
+	int i;
+
+	first = homa_impair_rand(&state1);
+	EXPECT_EQ(first, homa_impair_rand(&state2));
+	EXPECT_NE(first, homa_impair_rand(&state1));
+	for (i = 0; i < 100; i++) {
+		homa_impair_rand(&state1);
+		EXPECT_NE(0, state1);
+	}
+}
+
+TEST_F(homa_impair, homa_impair_rx_pkt__repeatable_loss)
+{
+	char first[200];
+	int drops, i;
+
+	self->impair->loss_ppm = 100000;
+	self->impair->seed = 12345;
+	homa_impair_update_sysctl_deps(self->impair);
+	strcpy(first, rx_pattern(self->impair, &self->data, self->client_ip,
+	       150));
+	drops = 0;
+	for (i = 0; first[i] != 0; i++)
+		drops += first[i] == 'd';
+	EXPECT_LT(0, drops);
+	EXPECT_GT(75, drops);
+	EXPECT_EQ(drops, homa_metrics_per_cpu()->impair_drops);
+
+	/* Rewriting a parameter restarts the same sequence. */
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_STREQ(first, rx_pattern(self->impair, &self->data,
+		     self->client_ip, 150));
+
+	/* A different seed gives a different sequence. */
+	self->impair->seed = 54321;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_STRNE(first, rx_pattern(self->impair, &self->data,
+		     self->client_ip, 150));
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__burst_loss)
+{
+	self->impair->loss_ppm = 1000000;
+	self->impair->burst = 3;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_STREQ("d", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+	self->impair->loss_ppm = 0;
+	self->impair->reorder_ppm = 0;
+	EXPECT_STREQ("dd..", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 4));
+	EXPECT_EQ(3, homa_metrics_per_cpu()->impair_drops);
+	EXPECT_EQ(2, self->impair->rx_count);
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__delay)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->impair->delay_cycles = 500;
+	WRITE_ONCE(self->impair->rx_active, true);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_TRUE(homa_impair_rx(self->impair, skb));
+	EXPECT_EQ(1, self->impair->num_held);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->impair_holds);
+
+	EXPECT_EQ(1500, self->impair->timer_time);
+
+	mock_clock = 1499;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(1, self->impair->num_held);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+
+	mock_clock = 1500;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(0, self->impair->num_held);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__jitter)
+{
+	struct homa_impair_pkt *pkt;
+
+	mock_clock = 1000;
+	self->impair->jitter_usecs = 1;
+	homa_impair_update_sysctl_deps(self->impair);
+	self->impair->jitter_cycles = 100;
+	rx_pattern(self->impair, &self->data, self->client_ip, 10);
+	list_for_each_entry(pkt, &self->impair->held, links) {
+		EXPECT_LE(1000, pkt->release_time);
+		EXPECT_GT(1100, pkt->release_time);
+	}
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__held_sorted_by_release_time)
+{
+	struct homa_impair_pkt *pkt;
+	u64 prev = 0;
+
+	mock_clock = 1000;
+	self->impair->jitter_usecs = 1;
+	homa_impair_update_sysctl_deps(self->impair);
+	self->impair->jitter_cycles = 100;
+	rx_pattern(self->impair, &self->data, self->client_ip, 20);
+	EXPECT_EQ(20, unit_list_length(&self->impair->held));
+	list_for_each_entry(pkt, &self->impair->held, links) {
+		EXPECT_LE(prev, pkt->release_time);
+		prev = pkt->release_time;
+	}
+
+	/* The timer is armed for the earliest packet. */
+	pkt = list_first_entry(&self->impair->held, struct homa_impair_pkt,
+			       links);
+	EXPECT_EQ(pkt->release_time, self->impair->timer_time);
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__reorder)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->impair->reorder_ppm = 1000000;
+	self->impair->reorder_depth = 2;
+	homa_impair_update_sysctl_deps(self->impair);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_TRUE(homa_impair_rx(self->impair, skb));
+
+	/* Packet is released once 2 later packets have passed. */
+	self->impair->reorder_ppm = 0;
+	EXPECT_STREQ(".", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+	homa_impair_release(self->impair);
+	EXPECT_EQ(1, self->impair->num_held);
+	EXPECT_STREQ(".", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+	homa_impair_release(self->impair);
+	EXPECT_EQ(0, self->impair->num_held);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__reorder_expires)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->impair->reorder_ppm = 1000000;
+	homa_impair_update_sysctl_deps(self->impair);
+	self->impair->reorder_cycles = 200;
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_TRUE(homa_impair_rx(self->impair, skb));
+
+	mock_clock = 1199;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(1, self->impair->num_held);
+	mock_clock = 1200;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(0, self->impair->num_held);
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__reorder_after_delay)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->impair->reorder_ppm = 1000000;
+	self->impair->reorder_depth = 1;
+	homa_impair_update_sysctl_deps(self->impair);
+	self->impair->delay_cycles = 100;
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_TRUE(homa_impair_rx(self->impair, skb));
+	self->impair->reorder_ppm = 0;
+	EXPECT_STREQ("d", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+
+	/* Once the delay has elapsed, the first packet waits for the
+	 * second one to be passed on.
+	 */
+	mock_clock = 1100;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(0, self->impair->num_held);
+	EXPECT_EQ(1, self->impair->rx_count);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__too_many_held)
+{
+	self->impair->delay_usecs = 100;
+	homa_impair_update_sysctl_deps(self->impair);
+	self->impair->num_held = HOMA_IMPAIR_MAX_HELD;
+	EXPECT_STREQ(".", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+	self->impair->num_held = 0;
+}
+TEST_F(homa_impair, homa_impair_rx_pkt__cant_allocate_memory)
+{
+	self->impair->delay_usecs = 100;
+	homa_impair_update_sysctl_deps(self->impair);
+	mock_kmalloc_errors = 1;
+	EXPECT_STREQ(".", rx_pattern(self->impair, &self->data,
+		     self->client_ip, 1));
+	EXPECT_EQ(0, self->impair->num_held);
+}
+
+TEST_F(homa_impair, homa_impair_tx_pkt)
+{
+	self->impair->dirs = HOMA_IMPAIR_TX;
+	self->impair->loss_ppm = 1000000;
+	self->impair->burst = 2;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_FALSE(self->impair->rx_active);
+	EXPECT_TRUE(homa_impair_tx(self->impair));
+	self->impair->loss_ppm = 0;
+	EXPECT_TRUE(homa_impair_tx(self->impair));
+	EXPECT_FALSE(homa_impair_tx(self->impair));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->impair_drops);
+}
+
+TEST_F(homa_impair, homa_impair_release__only_heads_examined)
+{
+	mock_clock = 1000;
+	self->impair->delay_cycles = 500;
+	WRITE_ONCE(self->impair->rx_active, true);
+	rx_pattern(self->impair, &self->data, self->client_ip, 2);
+	mock_clock = 1200;
+	self->impair->delay_cycles = 100;
+	rx_pattern(self->impair, &self->data, self->client_ip, 1);
+	EXPECT_EQ(3, self->impair->num_held);
+	EXPECT_EQ(1300, self->impair->timer_time);
+
+	mock_clock = 1300;
+	homa_impair_release(self->impair);
+	EXPECT_EQ(2, self->impair->num_held);
+	EXPECT_EQ(1, self->impair->rx_count);
+	EXPECT_EQ(1500, self->impair->timer_time);
+}
+
+TEST_F(homa_impair, homa_impair_timer)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->impair->delay_cycles = 500;
+	WRITE_ONCE(self->impair->rx_active, true);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 0);
+	EXPECT_TRUE(homa_impair_rx(self->impair, skb));
+	EXPECT_EQ(1500, self->impair->timer_time);
+
+	mock_clock = 1500;
+	EXPECT_EQ(HRTIMER_NORESTART, homa_impair_timer(&self->impair->timer));
+	EXPECT_EQ(0, self->impair->num_held);
+	EXPECT_EQ(0, self->impair->timer_time);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+
+TEST_F(homa_impair, homa_impair_update_sysctl_deps)
+{
+	self->impair->burst = 0;
+	self->impair->reorder_depth = -1;
+	self->impair->seed = 0;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_EQ(1, self->impair->burst);
+	EXPECT_EQ(1, self->impair->reorder_depth);
+	EXPECT_EQ(1, self->impair->rx_rand);
+	EXPECT_NE(self->impair->rx_rand, self->impair->tx_rand);
+	EXPECT_FALSE(self->impair->rx_active);
+	EXPECT_FALSE(self->impair->tx_active);
+
+	self->impair->loss_ppm = 10;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_TRUE(self->impair->rx_active);
+	EXPECT_FALSE(self->impair->tx_active);
+
+	self->impair->dirs = HOMA_IMPAIR_RX | HOMA_IMPAIR_TX;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_TRUE(self->impair->tx_active);
+
+	/* Delay applies only to incoming packets. */
+	self->impair->loss_ppm = 0;
+	self->impair->delay_usecs = 10;
+	homa_impair_update_sysctl_deps(self->impair);
+	EXPECT_TRUE(self->impair->rx_active);
+	EXPECT_FALSE(self->impair->tx_active);
+}
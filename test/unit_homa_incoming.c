@@ -230,6 +230,32 @@ TEST_F(homa_incoming, homa_request_retrans__request_gaps)
 #endif /* See strip.py */
 }
 #ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_incoming, homa_request_retrans__defer_young_gaps)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk2, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 10000, 100);
+
+	self->homa.reorder_cycles = 500;
+	mock_clock = 1000;
+	homa_gap_alloc(&srpc->msgin.gaps, 1000, 2000);
+	mock_clock = 1600;
+	homa_gap_alloc(&srpc->msgin.gaps, 4000, 6000);
+	srpc->msgin.granted = srpc->msgin.recv_end;
+	self->homa.num_priorities = 8;
+	unit_log_clear();
+
+	homa_request_retrans(srpc);
+	EXPECT_STREQ("xmit RESEND 1000-1999@7", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->resends_deferred);
+
+	mock_clock = 2100;
+	unit_log_clear();
+	homa_request_retrans(srpc);
+	EXPECT_STREQ("xmit RESEND 1000-1999@7; xmit RESEND 4000-5999@7",
+		     unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->resends_deferred);
+}
 TEST_F(homa_incoming, homa_request_retrans__no_granted_but_not_received_data)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk2, UNIT_RCVD_ONE_PKT,
@@ -670,6 +696,33 @@ TEST_F(homa_incoming, homa_add_packet__metrics)
 	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
 	EXPECT_EQ(1, homa_metrics_per_cpu()->resent_packets_used);
 }
+TEST_F(homa_incoming, homa_add_packet__reordered_packets_metric)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+
+	homa_message_in_init(crpc, 10000, 0);
+	self->data.seg.offset = htonl(0);
+	homa_add_packet(crpc, mock_skb_alloc(self->client_ip,
+			&self->data.common, 1400, 0));
+	self->data.seg.offset = htonl(4200);
+	homa_add_packet(crpc, mock_skb_alloc(self->client_ip,
+			&self->data.common, 1400, 4200));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->reordered_packets);
+
+	self->data.seg.offset = htonl(2800);
+	homa_add_packet(crpc, mock_skb_alloc(self->client_ip,
+			&self->data.common, 1400, 2800));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reordered_packets);
+
+	self->data.retransmit = 1;
+	self->data.seg.offset = htonl(1400);
+	homa_add_packet(crpc, mock_skb_alloc(self->client_ip,
+			&self->data.common, 1400, 1400));
+	EXPECT_EQ(4, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reordered_packets);
+}
 #endif /* See strip.py */
 
 TEST_F(homa_incoming, homa_copy_to_user__basics)
@@ -2132,7 +2185,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__basics)
 	ASSERT_NE(NULL, crpc2);
 	ASSERT_NE(NULL, crpc3);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, 0, -EPROTONOSUPPORT);
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -EPROTONOSUPPORT);
 	EXPECT_EQ(2, unit_list_length(&self->hsk.ready_rpcs));
 	EXPECT_EQ(0, list_empty(&crpc1->ready_links));
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc1->error);
@@ -2157,7 +2210,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__multiple_sockets)
 	ASSERT_NE(NULL, crpc2);
 	ASSERT_NE(NULL, crpc3);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, 0, -EPROTONOSUPPORT);
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -EPROTONOSUPPORT);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_rpcs));
 	EXPECT_EQ(0, list_empty(&crpc1->ready_links));
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc1->error);
@@ -2183,7 +2236,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__select_addr)
 	ASSERT_NE(NULL, crpc2);
 	ASSERT_NE(NULL, crpc3);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, self->server_port,
+	homa_abort_rpcs(self->hnet, self->server_ip, self->server_port,
 			-ENOTCONN);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_rpcs));
 	EXPECT_EQ(0, list_empty(&crpc1->ready_links));
@@ -2206,7 +2259,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__select_port)
 	ASSERT_NE(NULL, crpc2);
 	ASSERT_NE(NULL, crpc3);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, self->server_port,
+	homa_abort_rpcs(self->hnet, self->server_ip, self->server_port,
 			-ENOTCONN);
 	EXPECT_EQ(2, unit_list_length(&self->hsk.ready_rpcs));
 	EXPECT_EQ(0, list_empty(&crpc1->ready_links));
@@ -2231,7 +2284,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__any_port)
 	ASSERT_NE(NULL, crpc2);
 	ASSERT_NE(NULL, crpc3);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, 0, -ENOTCONN);
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -ENOTCONN);
 	EXPECT_EQ(0, list_empty(&crpc1->ready_links));
 	EXPECT_EQ(0, list_empty(&crpc2->ready_links));
 	EXPECT_EQ(0, list_empty(&crpc3->ready_links));
@@ -2246,7 +2299,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__ignore_dead_rpcs)
 	homa_rpc_end(crpc);
 	EXPECT_EQ(RPC_DEAD, crpc->state);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->server_ip, 0, -ENOTCONN);
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -ENOTCONN);
 	EXPECT_EQ(-EINVAL, crpc->error);
 }
 TEST_F(homa_incoming, homa_abort_rpcs__free_server_rpc)
@@ -2257,9 +2310,96 @@ TEST_F(homa_incoming, homa_abort_rpcs__free_server_rpc)
 
 	ASSERT_NE(NULL, srpc);
 	unit_log_clear();
-	homa_abort_rpcs(&self->homa, self->client_ip, 0, 0);
+	homa_abort_rpcs(self->hnet, self->client_ip, 0, 0);
 	EXPECT_EQ(RPC_DEAD, srpc->state);
 }
+TEST_F(homa_incoming, homa_abort_rpcs__no_matching_rpcs)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1600);
+
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+	homa_abort_rpcs(self->hnet, self->server_ip+1, 0, -ENOTCONN);
+	EXPECT_EQ(RPC_OUTGOING, crpc->state);
+	EXPECT_EQ(0, crpc->error);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_rpcs));
+}
+TEST_F(homa_incoming, homa_abort_rpcs__client_rpc_already_aborted)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1600);
+
+	ASSERT_NE(NULL, crpc);
+	crpc->error = -EFAULT;
+	unit_log_clear();
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -ENOTCONN);
+	EXPECT_EQ(EFAULT, -crpc->error);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_rpcs));
+}
+TEST_F(homa_incoming, homa_abort_rpcs__server_rpcs_in_same_bucket)
+{
+	struct homa_rpc *srpc1, *srpc2, *srpc3;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			20000, 100);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port,
+			self->server_id + 2*HOMA_SERVER_RPC_BUCKETS, 20000, 100);
+	srpc3 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port,
+			self->server_id + 4*HOMA_SERVER_RPC_BUCKETS, 20000, 100);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	ASSERT_NE(NULL, srpc3);
+	EXPECT_EQ(homa_server_rpc_bucket(&self->hsk, srpc1->id),
+		  homa_server_rpc_bucket(&self->hsk, srpc3->id));
+	unit_log_clear();
+	homa_abort_rpcs(self->hnet, self->client_ip, 0, -ENOTCONN);
+	EXPECT_EQ(RPC_DEAD, srpc1->state);
+	EXPECT_EQ(RPC_DEAD, srpc2->state);
+	EXPECT_EQ(RPC_DEAD, srpc3->state);
+}
+TEST_F(homa_incoming, homa_abort_rpcs__skip_other_namespaces)
+{
+	struct homa_rpc *crpc;
+	struct homa_net hnet2;
+
+	crpc = unit_client_rpc(&self->hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 1600);
+	ASSERT_NE(NULL, crpc);
+	self->hsk2.hnet = &hnet2;
+	homa_abort_rpcs(self->hnet, self->server_ip, 0, -ENOTCONN);
+	self->hsk2.hnet = self->hnet;
+	EXPECT_EQ(0, crpc->error);
+	EXPECT_EQ(0, unit_list_length(&self->hsk2.ready_rpcs));
+}
+TEST_F(homa_incoming, homa_abort_rpcs__lock_only_nonempty_buckets)
+{
+	struct homa_rpc *crpc;
+	int locks;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 1600);
+	ASSERT_NE(NULL, crpc);
+	mock_total_spin_locks = 0;
+	homa_abort_rpcs(self->hnet, self->server_ip+1, 0, -ENOTCONN);
+	locks = mock_total_spin_locks;
+
+	/* One more nonempty bucket means one more lock acquisition. */
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+2,
+			5000, 1600);
+	ASSERT_NE(NULL, crpc);
+	mock_total_spin_locks = 0;
+	homa_abort_rpcs(self->hnet, self->server_ip+1, 0, -ENOTCONN);
+	EXPECT_EQ(locks + 1, mock_total_spin_locks);
+}
 
 TEST_F(homa_incoming, homa_abort_sock_rpcs__basics)
 {
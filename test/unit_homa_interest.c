@@ -67,6 +67,16 @@ FIXTURE_SETUP(homa_interest)
 	self->server_addr.in6.sin6_family = self->hsk.inet.sk.sk_family;
 	self->server_addr.in6.sin6_addr = self->server_ip;
 	self->server_addr.in6.sin6_port =  htons(self->server_port);
+#ifndef __STRIP__ /* See strip.py */
+	/* Pairs of cores are SMT siblings, groups of 4 share an LLC and
+	 * a NUMA node.
+	 */
+	for (int i = 0; i < nr_cpu_ids; i++) {
+		per_cpu(homa_offload_core, i).smt_id = i & ~1;
+		per_cpu(homa_offload_core, i).llc_id = i & ~3;
+		per_cpu(homa_offload_core, i).numa_node = i >> 2;
+	}
+#endif /* See strip.py */
 	unit_log_clear();
 }
 FIXTURE_TEARDOWN(homa_interest)
@@ -280,7 +290,7 @@ TEST_F(homa_interest, homa_choose_interest__find_idle_core)
 	struct homa_interest interest1, interest2, interest3;
 
 	homa_interest_init_shared(&interest1, &self->hsk);
-	interest1.core = 1;
+	interest1.core = 5;
 	homa_interest_init_shared(&interest2, &self->hsk);
 	interest2.core = 2;
 	homa_interest_init_shared(&interest3, &self->hsk);
@@ -288,14 +298,15 @@ TEST_F(homa_interest, homa_choose_interest__find_idle_core)
 
 	mock_clock = 5000;
 	self->homa.busy_cycles = 1000;
-	per_cpu(homa_offload_core, 1).last_active = 2000;
+	per_cpu(homa_offload_core, 5).last_active = 2000;
 	per_cpu(homa_offload_core, 2).last_active = 3500;
 	per_cpu(homa_offload_core, 3).last_active = 4100;
 
 	struct homa_interest *result = homa_choose_interest(&self->hsk);
 	EXPECT_EQ(&interest2, result);
 	EXPECT_EQ(2, result->core);
-	IF_NO_STRIP(EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_alt_thread));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_alt_thread);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->handoffs_other_llc);
 	INIT_LIST_HEAD(&self->hsk.interests);
 }
 TEST_F(homa_interest, homa_choose_interest__all_cores_busy)
@@ -303,7 +314,7 @@ TEST_F(homa_interest, homa_choose_interest__all_cores_busy)
 	struct homa_interest interest1, interest2, interest3;
 
 	homa_interest_init_shared(&interest1, &self->hsk);
-	interest1.core = 1;
+	interest1.core = 0;
 	homa_interest_init_shared(&interest2, &self->hsk);
 	interest2.core = 2;
 	homa_interest_init_shared(&interest3, &self->hsk);
@@ -311,13 +322,71 @@ TEST_F(homa_interest, homa_choose_interest__all_cores_busy)
 
 	mock_clock = 5000;
 	self->homa.busy_cycles = 1000;
-	per_cpu(homa_offload_core, 1).last_active = 4100;
+	per_cpu(homa_offload_core, 0).last_active = 4100;
 	per_cpu(homa_offload_core, 2).last_active = 4001;
 	per_cpu(homa_offload_core, 3).last_active = 4800;
 
 	struct homa_interest *result = homa_choose_interest(&self->hsk);
-	EXPECT_EQ(3, result->core);
-	IF_NO_STRIP(EXPECT_EQ(0, homa_metrics_per_cpu()->handoffs_alt_thread));
+	EXPECT_EQ(0, result->core);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_alt_thread);
+	INIT_LIST_HEAD(&self->hsk.interests);
+}
+TEST_F(homa_interest, homa_choose_interest__all_cores_busy_and_equally_far)
+{
+	struct homa_interest interest1, interest2;
+
+	homa_interest_init_shared(&interest1, &self->hsk);
+	interest1.core = 2;
+	homa_interest_init_shared(&interest2, &self->hsk);
+	interest2.core = 3;
+
+	mock_clock = 5000;
+	self->homa.busy_cycles = 1000;
+	per_cpu(homa_offload_core, 2).last_active = 4100;
+	per_cpu(homa_offload_core, 3).last_active = 4800;
+
+	struct homa_interest *result = homa_choose_interest(&self->hsk);
+	EXPECT_EQ(&interest2, result);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->handoffs_alt_thread);
+	INIT_LIST_HEAD(&self->hsk.interests);
+}
+TEST_F(homa_interest, homa_choose_interest__prefer_smt_sibling)
+{
+	struct homa_interest interest1, interest2;
+
+	homa_interest_init_shared(&interest1, &self->hsk);
+	interest1.core = 0;
+	homa_interest_init_shared(&interest2, &self->hsk);
+	interest2.core = 2;
+
+	mock_clock = 5000;
+	self->homa.busy_cycles = 1000;
+	per_cpu(homa_offload_core, 0).last_active = 2000;
+	per_cpu(homa_offload_core, 2).last_active = 2000;
+
+	struct homa_interest *result = homa_choose_interest(&self->hsk);
+	EXPECT_EQ(&interest1, result);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_alt_thread);
+	INIT_LIST_HEAD(&self->hsk.interests);
+}
+TEST_F(homa_interest, homa_choose_interest__idle_remote_core_beats_busy_sibling)
+{
+	struct homa_interest interest1, interest2;
+
+	homa_interest_init_shared(&interest1, &self->hsk);
+	interest1.core = 6;
+	homa_interest_init_shared(&interest2, &self->hsk);
+	interest2.core = 0;
+
+	mock_clock = 5000;
+	self->homa.busy_cycles = 1000;
+	per_cpu(homa_offload_core, 0).last_active = 4500;
+	per_cpu(homa_offload_core, 6).last_active = 2000;
+
+	struct homa_interest *result = homa_choose_interest(&self->hsk);
+	EXPECT_EQ(&interest1, result);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_other_llc);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_other_node);
 	INIT_LIST_HEAD(&self->hsk.interests);
 }
 #endif /* See strip.py */
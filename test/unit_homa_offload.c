@@ -3,6 +3,8 @@
 #include "homa_impl.h"
 #include "homa_offload.h"
 #include "homa_rpc.h"
+
+#include <net/udp_tunnel.h>
 #define KSELFTEST_NOT_MAIN 1
 #include "kselftest_harness.h"
 #include "ccutils.h"
@@ -24,6 +26,36 @@ static struct sk_buff *unit_tcp6_gro_receive(struct list_head *held_list,
 	return NULL;
 }
 
+/* Create a Homa packet encapsulated in UDP (the UDP header is inserted
+ * between the IP header and the Homa header).
+ */
+static struct sk_buff *test_udp_skb(struct in6_addr *saddr,
+				    struct homa_common_hdr *h, int dport)
+{
+	struct sk_buff *skb;
+	struct udphdr *uh;
+	int length;
+
+	skb = mock_skb_alloc(saddr, h, 1400 + sizeof(*uh), 0);
+	length = skb_tail_pointer(skb) - skb_transport_header(skb) -
+			sizeof(*uh);
+	memmove(skb_transport_header(skb) + sizeof(*uh),
+		skb_transport_header(skb), length);
+	uh = (struct udphdr *)skb_transport_header(skb);
+	uh->source = htons(40000);
+	uh->dest = htons(dport);
+	uh->len = htons(length + sizeof(*uh));
+	uh->check = 0;
+	if (mock_ipv6) {
+		ipv6_hdr(skb)->nexthdr = IPPROTO_UDP;
+		ipv6_hdr(skb)->payload_len = uh->len;
+	} else {
+		ip_hdr(skb)->protocol = IPPROTO_UDP;
+		ip_hdr(skb)->tot_len = htons(skb->len);
+	}
+	return skb;
+}
+
 FIXTURE(homa_offload)
 {
 	struct homa homa;
@@ -104,6 +136,26 @@ FIXTURE_TEARDOWN(homa_offload)
 	unit_teardown();
 }
 
+TEST_F(homa_offload, homa_offload_init__topology)
+{
+	struct homa_offload_core *offload_core;
+
+	offload_core = &per_cpu(homa_offload_core, 7);
+	EXPECT_EQ(6, offload_core->smt_id);
+	EXPECT_EQ(4, offload_core->llc_id);
+	EXPECT_EQ(0, offload_core->numa_node);
+	EXPECT_EQ(1, per_cpu(homa_offload_core, 2).numa_node);
+}
+
+TEST_F(homa_offload, homa_core_distance)
+{
+	EXPECT_EQ(HOMA_CORE_DIST_SAME, homa_core_distance(3, 3));
+	EXPECT_EQ(HOMA_CORE_DIST_SMT, homa_core_distance(4, 5));
+	EXPECT_EQ(HOMA_CORE_DIST_LLC, homa_core_distance(4, 7));
+	EXPECT_EQ(HOMA_CORE_DIST_NODE, homa_core_distance(1, 4));
+	EXPECT_EQ(HOMA_CORE_DIST_REMOTE, homa_core_distance(0, 4));
+}
+
 TEST_F(homa_offload, homa_gro_hook_tcp)
 {
 	homa_gro_hook_tcp();
@@ -200,6 +252,210 @@ TEST_F(homa_offload, homa_tcp_gro_receive__pass_to_homa_ipv4)
 	homa_gro_unhook_tcp();
 }
 
+TEST_F(homa_offload, homa_udp_gro_receive__checksum_not_validated)
+{
+	struct sk_buff *skb;
+
+	mock_ipv6 = false;
+	skb = test_udp_skb(&self->ip, &self->header.common, 4000);
+	udp_hdr(skb)->check = htons(0x1234);
+	skb->ip_summed = CHECKSUM_NONE;
+	NAPI_GRO_CB(skb)->csum_valid = 0;
+	NAPI_GRO_CB(skb)->flush = 0;
+	EXPECT_EQ(NULL, homa_udp_gro_receive(NULL, &self->empty_list, skb));
+	EXPECT_EQ(1, NAPI_GRO_CB(skb)->flush);
+	EXPECT_EQ(IPPROTO_UDP, ip_hdr(skb)->protocol);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->udp_encap_packets);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_udp_gro_receive__pass_to_homa_ipv4)
+{
+	struct homa_data_hdr *h;
+	struct sk_buff *skb;
+	int length;
+
+	mock_ipv6 = false;
+	self->header.seg.offset = htonl(6000);
+	skb = test_udp_skb(&self->ip, &self->header.common, 4000);
+	udp_hdr(skb)->check = htons(0x1234);
+	NAPI_GRO_CB(skb)->csum_valid = 1;
+	NAPI_GRO_CB(skb)->data_offset = sizeof(struct iphdr) +
+			sizeof(struct udphdr);
+	length = skb->len;
+	NAPI_GRO_CB(skb)->same_flow = 0;
+	cur_offload_core->held_skb = NULL;
+	cur_offload_core->held_bucket = 99;
+	EXPECT_EQ(NULL, homa_udp_gro_receive(NULL, &self->empty_list, skb));
+	EXPECT_EQ(skb, cur_offload_core->held_skb);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(length - sizeof(struct udphdr), skb->len);
+	EXPECT_EQ(4, ip_hdr(skb)->version);
+	EXPECT_EQ(IPPROTO_HOMA, ip_hdr(skb)->protocol);
+	EXPECT_EQ(sizeof(struct iphdr), NAPI_GRO_CB(skb)->data_offset);
+	EXPECT_EQ(sizeof(struct iphdr),
+		  skb_transport_header(skb) - skb_network_header(skb));
+	h = (struct homa_data_hdr *)skb_transport_header(skb);
+	EXPECT_EQ(DATA, h->common.type);
+	EXPECT_EQ(6000, ntohl(h->seg.offset));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->udp_encap_packets);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_udp_gro_receive__pass_to_homa_ipv6)
+{
+	struct homa_data_hdr *h;
+	struct sk_buff *skb;
+	int length;
+
+	mock_ipv6 = true;
+	self->header.seg.offset = htonl(6000);
+	skb = test_udp_skb(&self->ip, &self->header.common, 4000);
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	length = ntohs(ipv6_hdr(skb)->payload_len);
+	NAPI_GRO_CB(skb)->same_flow = 0;
+	cur_offload_core->held_skb = NULL;
+	cur_offload_core->held_bucket = 99;
+	EXPECT_EQ(NULL, homa_udp_gro_receive(NULL, &self->empty_list, skb));
+	EXPECT_EQ(skb, cur_offload_core->held_skb);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(IPPROTO_HOMA, ipv6_hdr(skb)->nexthdr);
+	EXPECT_EQ(length - sizeof(struct udphdr),
+		  ntohs(ipv6_hdr(skb)->payload_len));
+	h = (struct homa_data_hdr *)skb_transport_header(skb);
+	EXPECT_EQ(DATA, h->common.type);
+	EXPECT_EQ(6000, ntohl(h->seg.offset));
+	kfree_skb(skb);
+}
+
+TEST_F(homa_offload, homa_udp_encap_rcv__bad_checksum)
+{
+	struct sk_buff *skb;
+
+	mock_ipv6 = false;
+	skb = test_udp_skb(&self->ip, &self->header.common, 4000);
+	udp_hdr(skb)->check = htons(0x1234);
+	mock_csum_errors = 1;
+	EXPECT_EQ(0, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->udp_encap_packets);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->softirq_calls);
+}
+TEST_F(homa_offload, homa_udp_encap_rcv__pass_to_homa)
+{
+	struct sk_buff *skb;
+
+	mock_ipv6 = false;
+	self->header.common.dport = htons(99);
+	skb = test_udp_skb(&self->ip, &self->header.common, 4000);
+	udp_hdr(skb)->check = htons(0x1234);
+	EXPECT_EQ(0, homa_udp_encap_rcv(NULL, skb));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->udp_encap_packets);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->softirq_calls);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+}
+
+TEST_F(homa_offload, homa_udp_tunnel_update__open_and_close)
+{
+	self->homa.udp_encap_port = 4000;
+	EXPECT_EQ(0, homa_udp_tunnel_update(self->hnet));
+	EXPECT_STREQ("udp_sock_create family 2 port 4000; "
+		     "setup_udp_tunnel_sock family 2; "
+		     "udp_sock_create family 10 port 4000; "
+		     "setup_udp_tunnel_sock family 10", unit_log_get());
+	EXPECT_EQ(4000, self->hnet->udp_port);
+	EXPECT_EQ(&homa_udp_encap_rcv, mock_udp_tunnel_cfg.encap_rcv);
+	EXPECT_EQ(&homa_udp_gro_receive, mock_udp_tunnel_cfg.gro_receive);
+	EXPECT_EQ(&homa_udp_gro_complete, mock_udp_tunnel_cfg.gro_complete);
+
+	/* Port unchanged: nothing to do. */
+	unit_log_clear();
+	EXPECT_EQ(0, homa_udp_tunnel_update(self->hnet));
+	EXPECT_STREQ("", unit_log_get());
+
+	/* Port changed: reopen. */
+	self->homa.udp_encap_port = 4001;
+	EXPECT_EQ(0, homa_udp_tunnel_update(self->hnet));
+	EXPECT_STREQ("udp_tunnel_sock_release family 2; "
+		     "udp_tunnel_sock_release family 10; "
+		     "udp_sock_create family 2 port 4001; "
+		     "setup_udp_tunnel_sock family 2; "
+		     "udp_sock_create family 10 port 4001; "
+		     "setup_udp_tunnel_sock family 10", unit_log_get());
+
+	/* Port 0: close. */
+	unit_log_clear();
+	self->homa.udp_encap_port = 0;
+	EXPECT_EQ(0, homa_udp_tunnel_update(self->hnet));
+	EXPECT_STREQ("udp_tunnel_sock_release family 2; "
+		     "udp_tunnel_sock_release family 10", unit_log_get());
+	EXPECT_EQ(NULL, self->hnet->udp4_sock);
+	EXPECT_EQ(NULL, self->hnet->udp6_sock);
+	EXPECT_EQ(0, self->hnet->udp_port);
+	EXPECT_EQ(0, mock_active_locks);
+}
+TEST_F(homa_offload, homa_udp_tunnel_update__error_opening_ipv6_socket)
+{
+	self->homa.udp_encap_port = 4000;
+	mock_udp_sock_errors = 2;
+	EXPECT_EQ(EADDRINUSE, -homa_udp_tunnel_update(self->hnet));
+	EXPECT_STREQ("udp_sock_create family 2 port 4000; "
+		     "setup_udp_tunnel_sock family 2; "
+		     "udp_tunnel_sock_release family 2", unit_log_get());
+	EXPECT_EQ(NULL, self->hnet->udp4_sock);
+	EXPECT_EQ(NULL, self->hnet->udp6_sock);
+	EXPECT_EQ(0, self->hnet->udp_port);
+	EXPECT_EQ(0, mock_active_locks);
+}
+
+TEST_F(homa_offload, homa_udp_tunnel_update_all__all_namespaces)
+{
+	struct homa_net *hnet2;
+
+	hnet2 = mock_alloc_hnet(&self->homa);
+	self->homa.udp_encap_port = 4000;
+	unit_log_clear();
+	EXPECT_EQ(0, homa_udp_tunnel_update_all(&self->homa));
+	EXPECT_EQ(4000, self->hnet->udp_port);
+	EXPECT_EQ(4000, hnet2->udp_port);
+	EXPECT_EQ(0, mock_active_locks);
+
+	self->homa.udp_encap_port = 0;
+	EXPECT_EQ(0, homa_udp_tunnel_update_all(&self->homa));
+	EXPECT_EQ(NULL, self->hnet->udp4_sock);
+	EXPECT_EQ(NULL, hnet2->udp4_sock);
+}
+TEST_F(homa_offload, homa_udp_tunnel_update_all__skip_other_homa)
+{
+	struct homa_net *hnet2;
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	hnet2 = mock_alloc_hnet(&homa2);
+	self->homa.udp_encap_port = 4000;
+	EXPECT_EQ(0, homa_udp_tunnel_update_all(&self->homa));
+	EXPECT_EQ(4000, self->hnet->udp_port);
+	EXPECT_EQ(0, hnet2->udp_port);
+
+	self->homa.udp_encap_port = 0;
+	EXPECT_EQ(0, homa_udp_tunnel_update_all(&self->homa));
+}
+TEST_F(homa_offload, homa_udp_tunnel_update_all__error_in_second_namespace)
+{
+	struct homa_net *hnet2;
+
+	hnet2 = mock_alloc_hnet(&self->homa);
+	self->homa.udp_encap_port = 4000;
+	mock_udp_sock_errors = 4;
+	unit_log_clear();
+	EXPECT_EQ(EADDRINUSE, -homa_udp_tunnel_update_all(&self->homa));
+	EXPECT_EQ(4000, self->hnet->udp_port);
+	EXPECT_EQ(0, hnet2->udp_port);
+	EXPECT_EQ(NULL, hnet2->udp4_sock);
+	EXPECT_EQ(0, mock_active_locks);
+
+	self->homa.udp_encap_port = 0;
+	EXPECT_EQ(0, homa_udp_tunnel_update_all(&self->homa));
+	EXPECT_EQ(NULL, self->hnet->udp4_sock);
+}
+
 TEST_F(homa_offload, homa_gso_segment_set_ip_ids)
 {
 	struct sk_buff *skb, *segs;
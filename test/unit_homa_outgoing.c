@@ -6,7 +6,9 @@
 #include "homa_peer.h"
 #include "homa_rpc.h"
 #ifndef __STRIP__ /* See strip.py */
+#include "homa_impair.h"
 #include "homa_skb.h"
+#include "homa_sndbuf.h"
 #else /* See strip.py */
 #include "homa_stub.h"
 #endif /* See strip.py */
@@ -28,6 +30,17 @@ static void unlock_hook(char *id)
 	}
 }
 
+/* The following hook function logs the first time an RPC is unlocked. */
+static void log_unlock_hook(char *id)
+{
+	if (strcmp(id, "unlock") != 0)
+		return;
+	if (hook_rpc) {
+		unit_log_printf("; ", "first unlock");
+		hook_rpc = NULL;
+	}
+}
+
 /* The following hook function frees an RPC when it is locked. */
 static void lock_free_hook(char *id)
 {
@@ -236,6 +249,50 @@ TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__include_acks)
 			unit_ack_string(&h.ack));
 	kfree_skb(skb);
 }
+TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__include_deadline)
+{
+	struct iov_iter *iter = unit_iov_iter((void *)1000, 5000);
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+	struct homa_data_hdr h;
+	struct sk_buff *skb;
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 500);
+
+	/* No deadline. */
+	skb = homa_tx_data_pkt_alloc(crpc, iter, 0, 500, 2000);
+	ASSERT_NE(NULL, skb);
+	homa_skb_get(skb, &h, 0, sizeof(h));
+	EXPECT_EQ(0, homa_data_get_deadline(&h));
+	kfree_skb(skb);
+
+	/* Deadline 25 usecs in the future. */
+	mock_clock = 10000;
+	crpc->deadline = 35000;
+	skb = homa_tx_data_pkt_alloc(crpc, iter, 0, 500, 2000);
+	ASSERT_NE(NULL, skb);
+	homa_skb_get(skb, &h, 0, sizeof(h));
+	EXPECT_EQ(25, homa_data_get_deadline(&h));
+	kfree_skb(skb);
+
+	/* Deadline has passed. */
+	mock_clock = 40000;
+	skb = homa_tx_data_pkt_alloc(crpc, iter, 0, 500, 2000);
+	ASSERT_NE(NULL, skb);
+	homa_skb_get(skb, &h, 0, sizeof(h));
+	EXPECT_EQ(1, homa_data_get_deadline(&h));
+	kfree_skb(skb);
+
+	/* Deadline too far away for the header. */
+	crpc->deadline = 40000 + 20000000000ULL;
+	skb = homa_tx_data_pkt_alloc(crpc, iter, 0, 500, 2000);
+	ASSERT_NE(NULL, skb);
+	homa_skb_get(skb, &h, 0, sizeof(h));
+	EXPECT_EQ(HOMA_MAX_WIRE_DEADLINE, homa_data_get_deadline(&h));
+	kfree_skb(skb);
+}
 TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__multiple_segments_homa_fill_data_interleaved)
 {
 	struct iov_iter *iter = unit_iov_iter((void *)1000, 5000);
@@ -307,6 +364,49 @@ TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__multiple_segments_tcp_hijacking)
 	kfree_skb(skb);
 	unit_sock_destroy(&hsk);
 }
+TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__multiple_segments_udp_encap)
+{
+	struct iov_iter *iter = unit_iov_iter((void *)1000, 5000);
+	struct homa_data_hdr h;
+	struct homa_rpc *crpc;
+	struct homa_sock hsk;
+	struct sk_buff *skb;
+
+	self->homa.udp_encap_port = 4000;
+	mock_sock_init(&hsk, self->hnet, self->client_port+1);
+	EXPECT_EQ(IPPROTO_UDP, hsk.sock.sk_protocol);
+	crpc = homa_rpc_alloc_client(&hsk, &self->server_addr);
+	homa_rpc_unlock(crpc);
+	homa_message_out_init(crpc, 10000);
+
+	unit_log_clear();
+	skb = homa_tx_data_pkt_alloc(crpc, iter, 10000, 5000, 1500);
+	EXPECT_STREQ("_copy_from_iter 1500 bytes at 1000; "
+			"_copy_from_iter 1500 bytes at 2500; "
+			"_copy_from_iter 1500 bytes at 4000; "
+			"_copy_from_iter 500 bytes at 5500", unit_log_get());
+	EXPECT_EQ(5000 + 4*sizeof(struct homa_data_hdr), skb->len);
+	EXPECT_EQ(4, skb_shinfo(skb)->gso_segs);
+	EXPECT_EQ(1500 + sizeof(struct homa_data_hdr),
+		  skb_shinfo(skb)->gso_size);
+	EXPECT_EQ(SKB_GSO_UDP_L4, skb_shinfo(skb)->gso_type);
+	EXPECT_EQ(4*(sizeof(struct homa_data_hdr) + hsk.ip_header_length
+			+ HOMA_ETH_OVERHEAD) + 5000,
+			homa_get_skb_info(skb)->wire_bytes);
+
+	/* Each segment should have a complete Homa header. */
+	homa_skb_get(skb, &h, 0, sizeof(h));
+	EXPECT_EQ(10000, ntohl(h.seg.offset));
+	EXPECT_EQ(sizeof(struct homa_data_hdr) << 2, h.common.doff);
+	homa_skb_get(skb, &h, 2*(sizeof(h) + 1500), sizeof(h));
+	EXPECT_EQ(DATA, h.common.type);
+	EXPECT_EQ(13000, ntohl(h.common.sequence));
+	EXPECT_EQ(13000, ntohl(h.seg.offset));
+	EXPECT_EQ(10000, ntohl(h.message_length));
+	EXPECT_EQ(sizeof(struct homa_data_hdr) << 2, h.common.doff);
+	kfree_skb(skb);
+	unit_sock_destroy(&hsk);
+}
 TEST_F(homa_outgoing, homa_tx_data_pkt_alloc__error_copying_data_hijacking_path)
 {
 	struct iov_iter *iter = unit_iov_iter((void *) 1000, 5000);
@@ -395,6 +495,33 @@ TEST_F(homa_outgoing, homa_message_out_fill__basics)
 	EXPECT_EQ(3, crpc->msgout.num_skbs);
 	EXPECT_EQ(3000, crpc->msgout.copied_from_user);
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_outgoing, homa_message_out_fill__copy_from_sndbuf)
+{
+	struct homa_rpc *crpc;
+	struct iov_iter iter;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)0x100000,
+					     3 * PAGE_SIZE));
+	ASSERT_EQ(0, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)4000, 3000), &iter));
+	crpc = homa_rpc_alloc_client(&self->hsk, &self->server_addr);
+	mock_set_ipv6(&self->hsk);
+
+	ASSERT_FALSE(crpc == NULL);
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc, &iter, 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_STREQ("mtu 1496, max_seg_data 1400, max_gso_data 1400; "
+			"_copy_from_iter 96 bytes from bvec offset 4000; "
+			"_copy_from_iter 1304 bytes from bvec offset 0; "
+			"_copy_from_iter 1400 bytes from bvec offset 1304; "
+			"_copy_from_iter 200 bytes from bvec offset 2704",
+			unit_log_get());
+	EXPECT_EQ(3000, crpc->msgout.copied_from_user);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sndbuf_msgs);
+}
+#endif /* See strip.py */
 TEST_F(homa_outgoing, homa_message_out_fill__message_too_long)
 {
 	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
@@ -452,6 +579,36 @@ TEST_F(homa_outgoing, homa_message_out_fill__gso_geometry_hijacking)
 	homa_rpc_unlock(crpc2);
 	EXPECT_SUBSTR("max_seg_data 1400, max_gso_data 4200", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_fill__gso_geometry_udp_encap)
+{
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_sock hsk;
+
+	self->homa.udp_encap_port = 4000;
+	mock_sock_init(&hsk, self->hnet, self->client_port+1);
+	crpc1 = homa_rpc_alloc_client(&hsk, &self->server_addr);
+	ASSERT_FALSE(crpc1 == NULL);
+
+	/* First try: not quite enough space for 3 packets in GSO. */
+	mock_net_device.gso_max_size = mock_mtu - 1 +
+			2 * (UNIT_TEST_DATA_PER_PACKET +
+			     sizeof(struct homa_data_hdr));
+	ASSERT_EQ(0, -homa_message_out_fill(crpc1,
+			unit_iov_iter((void *) 1000, 10000), 0));
+	homa_rpc_unlock(crpc1);
+	EXPECT_SUBSTR("max_seg_data 1400, max_gso_data 2800", unit_log_get());
+
+	/* Second try: just barely enough space for 3 packets in GSO. */
+	crpc2 = homa_rpc_alloc_client(&hsk, &self->server_addr);
+	ASSERT_FALSE(crpc2 == NULL);
+	mock_net_device.gso_max_size += 1;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc2,
+			unit_iov_iter((void *) 1000, 10000), 0));
+	homa_rpc_unlock(crpc2);
+	EXPECT_SUBSTR("max_seg_data 1400, max_gso_data 4200", unit_log_get());
+	unit_sock_destroy(&hsk);
+}
 #endif /* See strip.py */
 TEST_F(homa_outgoing, homa_message_out_fill__gso_geometry_no_hijacking)
 {
@@ -584,6 +741,25 @@ TEST_F(homa_outgoing, homa_message_out_fill__rpc_freed_during_copy)
 	EXPECT_EQ(1, refcount_read(&self->hsk.sock.sk_wmem_alloc));
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_outgoing, homa_message_out_fill__unlocked_before_geometry)
+{
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_set_ipv6(&self->hsk);
+	unit_log_clear();
+	unit_hook_register(log_unlock_hook);
+	hook_rpc = crpc;
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 1000, 2000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_STREQ("first unlock; "
+			"mtu 1496, max_seg_data 1400, max_gso_data 1400; "
+			"_copy_from_iter 1400 bytes at 1000; "
+			"_copy_from_iter 600 bytes at 2400", unit_log_get());
+	EXPECT_EQ(2000, crpc->msgout.copied_from_user);
+}
 TEST_F(homa_outgoing, homa_message_out_fill__add_to_throttled)
 {
 	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
@@ -603,6 +779,57 @@ TEST_F(homa_outgoing, homa_message_out_fill__add_to_throttled)
 	EXPECT_STREQ("request id 2, next_offset 0",
 			unit_log_get());
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_outgoing, homa_message_out_fill__pipeline_ramp)
+{
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_set_ipv6(&self->hsk);
+
+	/* Room for exactly 4 segments per GSO packet. */
+	mock_net_device.gso_max_size = mock_mtu +
+			3 * (UNIT_TEST_DATA_PER_PACKET +
+			     sizeof(struct homa_seg_hdr));
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 1000, 20000), 1));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("xmit DATA 1400@0; ", unit_log_get());
+	EXPECT_SUBSTR("xmit DATA 1400@1400 1400@2800", unit_log_get());
+	EXPECT_NOSUBSTR("xmit DATA 1400@4200", unit_log_get());
+	unit_log_clear();
+	unit_log_filled_skbs(crpc->msgout.packets, 0);
+	EXPECT_STREQ("DATA 1400@0; "
+			"DATA 1400@1400 1400@2800; "
+			"DATA 1400@4200 1400@5600 1400@7000 1400@8400; "
+			"DATA 200@9800; "
+			"DATA 1400@10000 1400@11400 1400@12800 1400@14200; "
+			"DATA 1400@15600 1400@17000 1400@18400 200@19800",
+			unit_log_get());
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 2, next_offset 4200", unit_log_get());
+}
+#endif /* See strip.py */
+TEST_F(homa_outgoing, homa_message_out_fill__no_ramp_without_xmit)
+{
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	mock_set_ipv6(&self->hsk);
+	mock_net_device.gso_max_size = mock_mtu +
+			3 * (UNIT_TEST_DATA_PER_PACKET +
+			     sizeof(struct homa_seg_hdr));
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 1000, 12000), 0));
+	homa_rpc_unlock(crpc);
+	unit_log_clear();
+	unit_log_filled_skbs(crpc->msgout.packets, 0);
+	EXPECT_SUBSTR("DATA 1400@0 1400@1400 1400@2800 1400@4200; ",
+			unit_log_get());
+}
 TEST_F(homa_outgoing, homa_message_out_fill__too_short_for_pipelining)
 {
 	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
@@ -708,6 +935,22 @@ TEST_F(homa_outgoing, __homa_xmit_control__pad_packet)
 			unit_log_get());
 }
 #ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_outgoing, __homa_xmit_control__impairment_drops_packet)
+{
+	struct homa_rpc *srpc;
+	struct homa_busy_hdr h;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+		self->server_ip, self->client_port, 1111, 10000, 10000);
+	ASSERT_NE(NULL, srpc);
+	self->hnet->impair->dirs = HOMA_IMPAIR_TX;
+	self->hnet->impair->loss_ppm = 1000000;
+	homa_impair_update_sysctl_deps(self->hnet->impair);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_xmit_control(BUSY, &h, sizeof(h), srpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->impair_drops);
+}
 TEST_F(homa_outgoing, __homa_xmit_control__ipv4_error)
 {
 	struct homa_grant_hdr h;
@@ -776,6 +1019,20 @@ TEST_F(homa_outgoing, homa_xmit_unknown)
 }
 #endif /* See strip.py */
 
+TEST_F(homa_outgoing, homa_xmit_data__rpc_aborted)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 6000, 1000);
+
+	crpc->error = -ETIME;
+	unit_log_clear();
+	homa_rpc_lock(crpc);
+	homa_xmit_data(crpc, false);
+	homa_rpc_unlock(crpc);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, crpc->msgout.next_xmit_offset);
+}
 TEST_F(homa_outgoing, homa_xmit_data__basics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -881,6 +1138,96 @@ TEST_F(homa_outgoing, homa_xmit_data__force)
 	EXPECT_STREQ("request id 1234, next_offset 2800; "
 			"request id 1236, next_offset 1400", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_xmit_data__srpt_xmit)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 6000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 1000);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+4, 2000, 1000);
+
+	/* First, get an RPC on the throttled list. */
+	atomic64_set(&self->homa.pacer->link_idle_time, 11000);
+	self->homa.pacer->max_nic_queue_cycles = 3000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	homa_rpc_lock(crpc1);
+	homa_xmit_data(crpc1, false);
+	homa_rpc_unlock(crpc1);
+	unit_log_clear();
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 2800", unit_log_get());
+
+	/* Now the NIC queue drains, but crpc2 is longer than crpc1. */
+	atomic64_set(&self->homa.pacer->link_idle_time, 0);
+	self->homa.flags |= HOMA_FLAG_SRPT_XMIT;
+	unit_log_clear();
+	homa_rpc_lock(crpc2);
+	homa_xmit_data(crpc2, false);
+	homa_rpc_unlock(crpc2);
+	EXPECT_STREQ("", unit_log_get());
+	unit_log_throttled(&self->homa);
+	EXPECT_STREQ("request id 1234, next_offset 2800; "
+			"request id 1236, next_offset 0", unit_log_get());
+
+	/* crpc3 is shorter than anything throttled, so it transmits. */
+	unit_log_clear();
+	homa_rpc_lock(crpc3);
+	homa_xmit_data(crpc3, false);
+	homa_rpc_unlock(crpc3);
+	EXPECT_STREQ("xmit DATA 1400@0; xmit DATA 600@1400", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_xmit_data__unsent_bytes)
+{
+	atomic64_t *unsent = &self->homa.pacer->unsent_bytes[12];
+	struct homa_rpc *crpc;
+
+	self->homa.pacer->track_unsent = true;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 6000, 1000);
+	EXPECT_EQ(6000, atomic64_read(unsent));
+
+	atomic64_set(&self->homa.pacer->link_idle_time, 11000);
+	self->homa.pacer->max_nic_queue_cycles = 3000;
+	self->homa.flags &= ~HOMA_FLAG_DONT_THROTTLE;
+	homa_rpc_lock(crpc);
+	homa_xmit_data(crpc, false);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(3200, atomic64_read(unsent));
+
+	homa_rpc_end(crpc);
+	EXPECT_EQ(0, atomic64_read(unsent));
+}
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_outgoing, homa_xmit_data__unsent_bytes_only_granted)
+{
+	struct homa_rpc *crpc;
+
+	self->homa.pacer->track_unsent = true;
+	self->homa.unsched_bytes = 2000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 6000, 1000);
+	EXPECT_EQ(2000 - crpc->msgout.next_xmit_offset,
+		  atomic64_read(&self->homa.pacer->unsent_bytes[12]));
+	homa_rpc_end(crpc);
+	EXPECT_EQ(0, atomic64_read(&self->homa.pacer->unsent_bytes[12]));
+}
+#endif /* See strip.py */
+TEST_F(homa_outgoing, homa_xmit_data__unsent_bytes_not_tracked)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 6000, 1000);
+	EXPECT_FALSE(crpc->msgout.track_unsent);
+	EXPECT_EQ(0, atomic64_read(&self->homa.pacer->unsent_bytes[12]));
+}
 TEST_F(homa_outgoing, homa_xmit_data__throttle)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -924,6 +1271,96 @@ TEST_F(homa_outgoing, homa_xmit_data__rpc_freed)
 }
 
 #ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_outgoing, homa_flow_entropy)
+{
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+	u32 entropy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+
+	/* Feature disabled. */
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 100000));
+
+	/* First chunk uses the normal flow. */
+	self->homa.flow_chunk_bytes = 10000;
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 0));
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 9999));
+
+	/* Same value within a chunk, different values across chunks. */
+	entropy = homa_flow_entropy(crpc, 10000);
+	EXPECT_NE(0, entropy);
+	EXPECT_EQ(entropy, homa_flow_entropy(crpc, 19999));
+	EXPECT_NE(entropy, homa_flow_entropy(crpc, 20000));
+}
+TEST_F(homa_outgoing, homa_flow_entropy__spray)
+{
+	struct homa_rpc *crpc = homa_rpc_alloc_client(&self->hsk,
+			&self->server_addr);
+	u32 entropy;
+
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+	crpc->msgout.unscheduled = 10000;
+	self->homa.flow_spray = 1;
+
+	/* Unscheduled bytes use the normal flow. */
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 0));
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 9999));
+
+	/* No chunk size: every packet gets different entropy. */
+	entropy = homa_flow_entropy(crpc, 10000);
+	EXPECT_NE(0, entropy);
+	EXPECT_NE(entropy, homa_flow_entropy(crpc, 11400));
+
+	/* Chunk size applies to scheduled bytes. */
+	self->homa.flow_chunk_bytes = 4000;
+	entropy = homa_flow_entropy(crpc, 12000);
+	EXPECT_NE(0, entropy);
+	EXPECT_EQ(entropy, homa_flow_entropy(crpc, 15999));
+	EXPECT_NE(entropy, homa_flow_entropy(crpc, 16000));
+
+	/* Chunks in the unscheduled bytes still get their own entropy. */
+	EXPECT_EQ(0, homa_flow_entropy(crpc, 3999));
+	EXPECT_NE(0, homa_flow_entropy(crpc, 4000));
+}
+TEST_F(homa_outgoing, homa_udp_encap)
+{
+	struct homa_rpc *crpc;
+	struct homa_sock hsk;
+	struct sk_buff *skb;
+	struct udphdr *uh;
+
+	self->homa.udp_encap_port = 4000;
+	mock_sock_init(&hsk, self->hnet, self->client_port+1);
+	crpc = homa_rpc_alloc_client(&hsk, &self->server_addr);
+	ASSERT_FALSE(crpc == NULL);
+	homa_rpc_unlock(crpc);
+
+	skb = homa_skb_alloc_tx(100);
+	skb_put(skb, 60);
+	homa_udp_encap(skb, &hsk, crpc->peer, 0);
+	uh = (struct udphdr *)skb_transport_header(skb);
+	EXPECT_EQ(skb->data, (unsigned char *)uh);
+	EXPECT_EQ(68, skb->len);
+	EXPECT_EQ(40001, ntohs(uh->source));
+	EXPECT_EQ(4000, ntohs(uh->dest));
+	EXPECT_EQ(68, ntohs(uh->len));
+	EXPECT_EQ(CHECKSUM_PARTIAL, skb->ip_summed);
+	EXPECT_EQ(offsetof(struct udphdr, check), skb->csum_offset);
+	kfree_skb(skb);
+
+	/* Nonzero entropy selects the source port. */
+	skb = homa_skb_alloc_tx(100);
+	skb_put(skb, 60);
+	homa_udp_encap(skb, &hsk, crpc->peer, 0x12345);
+	uh = (struct udphdr *)skb_transport_header(skb);
+	EXPECT_EQ(0xa345, ntohs(uh->source));
+	kfree_skb(skb);
+	unit_sock_destroy(&hsk);
+}
+
 TEST_F(homa_outgoing, __homa_xmit_data__update_cutoff_version)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -997,6 +1434,99 @@ TEST_F(homa_outgoing, __homa_xmit_data__ipv6_transmit_error)
 	__homa_xmit_data(crpc->msgout.packets, crpc, 5);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->data_xmit_errors);
 }
+TEST_F(homa_outgoing, __homa_xmit_data__flow_entropy)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 1000);
+	struct sk_buff *skb;
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.flow_chunk_bytes = 2000;
+	unit_log_clear();
+
+	/* First packet: offset 0, no entropy. */
+	skb = crpc->msgout.packets;
+	skb->hash = 0;
+	skb_get(skb);
+	__homa_xmit_data(skb, crpc, 5);
+	EXPECT_EQ(0, skb->hash);
+
+	/* Third packet: offset 2800, second chunk. */
+	skb = homa_get_skb_info(skb)->next_skb;
+	skb = homa_get_skb_info(skb)->next_skb;
+	skb->hash = 0;
+	skb_get(skb);
+	__homa_xmit_data(skb, crpc, 5);
+	EXPECT_EQ(homa_flow_entropy(crpc, 2800), skb->hash);
+	EXPECT_EQ(1, skb->l4_hash);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->flow_entropy_packets);
+}
+TEST_F(homa_outgoing, __homa_xmit_data__impairment_drops_packet)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+	struct sk_buff *skb;
+
+	ASSERT_NE(NULL, crpc);
+	self->hnet->impair->dirs = HOMA_IMPAIR_TX;
+	self->hnet->impair->loss_ppm = 1000000;
+	homa_impair_update_sysctl_deps(self->hnet->impair);
+	unit_log_clear();
+	skb = crpc->msgout.packets;
+	skb_get(skb);
+	__homa_xmit_data(skb, crpc, 5);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->impair_drops);
+}
+TEST_F(homa_outgoing, __homa_xmit_data__udp_encap)
+{
+	struct homa_rpc *crpc;
+	struct homa_sock hsk;
+	struct sk_buff *skb;
+
+	self->homa.udp_encap_port = 4000;
+	mock_sock_init(&hsk, self->hnet, self->client_port+1);
+	crpc = unit_client_rpc(&hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	skb = crpc->msgout.packets;
+	unit_log_clear();
+	skb_get(skb);
+	__homa_xmit_data(skb, crpc, 5);
+	EXPECT_SUBSTR("xmit", unit_log_get());
+
+	/* A clone was transmitted; the original must still refer to the
+	 * Homa header.
+	 */
+	EXPECT_EQ(1, refcount_read(&skb->users));
+	EXPECT_EQ(skb_transport_header(skb), skb->data);
+	EXPECT_EQ(DATA, ((struct homa_common_hdr *)
+			 skb_transport_header(skb))->type);
+	unit_sock_destroy(&hsk);
+}
+TEST_F(homa_outgoing, __homa_xmit_data__udp_encap_cant_clone)
+{
+	struct homa_rpc *crpc;
+	struct homa_sock hsk;
+
+	self->homa.udp_encap_port = 4000;
+	mock_sock_init(&hsk, self->hnet, self->client_port+1);
+	crpc = unit_client_rpc(&hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+	mock_alloc_skb_errors = 1;
+	skb_get(crpc->msgout.packets);
+	__homa_xmit_data(crpc->msgout.packets, crpc, 5);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, refcount_read(&crpc->msgout.packets->users));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->data_xmit_errors);
+	unit_sock_destroy(&hsk);
+}
 #endif /* See strip.py */
 
 TEST_F(homa_outgoing, homa_resend_data__basics)
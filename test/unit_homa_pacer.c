@@ -9,6 +9,16 @@
 #include "mock.h"
 #include "utils.h"
 
+#ifdef __STRIP__ /* See strip.py */
+static int mock_check_nic_q(struct homa_pacer *pacer, struct sk_buff *skb,
+			    bool force, int priority)
+{
+	return homa_pacer_check_nic_q(pacer, skb, force);
+}
+#define homa_pacer_check_nic_q(pacer, skb, force, priority) \
+		mock_check_nic_q(pacer, skb, force, priority)
+#endif /* See strip.py */
+
 static struct homa_rpc *hook_rpc;
 static int hook_count;
 static void unmanage_hook(char *id) {
@@ -161,7 +171,7 @@ TEST_F(homa_pacer, homa_pacer_check_nic_q__success)
 	mock_clock = 8000;
 	self->homa.pacer->max_nic_queue_cycles = 1000;
 	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
-					    crpc->msgout.packets, false));
+					    crpc->msgout.packets, false, 0));
 	EXPECT_EQ(9500, atomic64_read(&self->homa.pacer->link_idle_time));
 }
 TEST_F(homa_pacer, homa_pacer_check_nic_q__queue_full)
@@ -178,9 +188,64 @@ TEST_F(homa_pacer, homa_pacer_check_nic_q__queue_full)
 	mock_clock = 7999;
 	self->homa.pacer->max_nic_queue_cycles = 1000;
 	EXPECT_EQ(0, homa_pacer_check_nic_q(self->homa.pacer,
-					    crpc->msgout.packets, false));
+					    crpc->msgout.packets, false, 0));
 	EXPECT_EQ(9000, atomic64_read(&self->homa.pacer->link_idle_time));
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_pacer, homa_pacer_check_nic_q__urgent_budget)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 500, 1000);
+
+	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
+	unit_log_clear();
+	atomic64_set(&self->homa.pacer->link_idle_time, 9000);
+	mock_clock = 6900;
+	self->homa.pacer->max_nic_queue_cycles = 1000;
+	self->homa.pacer->urgent_nic_queue_cycles = 1500;
+	self->homa.pacer->urgent_prio = 6;
+
+	/* Priority too low for the urgent budget. */
+	EXPECT_EQ(0, homa_pacer_check_nic_q(self->homa.pacer,
+					    crpc->msgout.packets, false, 5));
+	EXPECT_EQ(9000, atomic64_read(&self->homa.pacer->link_idle_time));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacer_urgent_bytes);
+
+	/* Urgent packet fits within the reserved budget. */
+	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
+					    crpc->msgout.packets, false, 6));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.pacer->link_idle_time));
+	EXPECT_EQ(500, homa_metrics_per_cpu()->pacer_urgent_bytes);
+
+	/* Reserved budget is now exhausted. */
+	EXPECT_EQ(0, homa_pacer_check_nic_q(self->homa.pacer,
+					    crpc->msgout.packets, false, 7));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.pacer->link_idle_time));
+}
+TEST_F(homa_pacer, homa_pacer_check_nic_q__urgent_but_queue_short)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 500, 1000);
+
+	homa_get_skb_info(crpc->msgout.packets)->wire_bytes = 500;
+	unit_log_clear();
+	atomic64_set(&self->homa.pacer->link_idle_time, 9000);
+	mock_clock = 8500;
+	self->homa.pacer->max_nic_queue_cycles = 1000;
+	self->homa.pacer->urgent_nic_queue_cycles = 1500;
+	self->homa.pacer->urgent_prio = 6;
+	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
+					    crpc->msgout.packets, false, 7));
+	EXPECT_EQ(9500, atomic64_read(&self->homa.pacer->link_idle_time));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->pacer_urgent_bytes);
+}
+#endif /* See strip.py */
 TEST_F(homa_pacer, homa_pacer_check_nic_q__queue_full_but_force)
 {
 	struct homa_rpc *crpc;
@@ -195,7 +260,7 @@ TEST_F(homa_pacer, homa_pacer_check_nic_q__queue_full_but_force)
 	mock_clock = 7999;
 	self->homa.pacer->max_nic_queue_cycles = 1000;
 	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
-					    crpc->msgout.packets, true));
+					    crpc->msgout.packets, true, 0));
 	EXPECT_EQ(9500, atomic64_read(&self->homa.pacer->link_idle_time));
 }
 TEST_F(homa_pacer, homa_pacer_check_nic_q__pacer_metrics)
@@ -214,7 +279,7 @@ TEST_F(homa_pacer, homa_pacer_check_nic_q__pacer_metrics)
 	mock_clock = 10000;
 	self->homa.pacer->max_nic_queue_cycles = 1000;
 	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
-					    crpc->msgout.packets, true));
+					    crpc->msgout.packets, true, 0));
 	EXPECT_EQ(10500, atomic64_read(&self->homa.pacer->link_idle_time));
 #ifndef __STRIP__ /* See strip.py */
 	EXPECT_EQ(500, homa_metrics_per_cpu()->pacer_bytes);
@@ -235,7 +300,7 @@ TEST_F(homa_pacer, homa_pacer_check_nic_q__queue_empty)
 	mock_clock = 10000;
 	self->homa.pacer->max_nic_queue_cycles = 1000;
 	EXPECT_EQ(1, homa_pacer_check_nic_q(self->homa.pacer,
-					    crpc->msgout.packets, true));
+					    crpc->msgout.packets, true, 0));
 	EXPECT_EQ(10500, atomic64_read(&self->homa.pacer->link_idle_time));
 }
 
@@ -574,6 +639,19 @@ TEST_F(homa_pacer, homa_pacer_manage_rpc__basics)
 		"request id 8, next_offset 0; "
 		"request id 6, next_offset 0", unit_log_get());
 }
+TEST_F(homa_pacer, homa_pacer_manage_rpc__socket_shutdown)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 5000, 1000);
+	ASSERT_NE(NULL, crpc);
+	self->hsk.shutdown = true;
+	homa_pacer_manage_rpc(crpc);
+	self->hsk.shutdown = false;
+	EXPECT_TRUE(list_empty(&self->homa.pacer->throttled_rpcs));
+}
 #ifndef __STRIP__ /* See strip.py */
 TEST_F(homa_pacer, homa_pacer_manage_rpc__inc_metrics)
 {
@@ -603,6 +681,76 @@ TEST_F(homa_pacer, homa_pacer_manage_rpc__inc_metrics)
 }
 #endif /* See strip.py */
 
+TEST_F(homa_pacer, homa_pacer_update_unsent)
+{
+	struct homa_rpc *crpc;
+
+	self->homa.pacer->track_unsent = true;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			       self->server_ip, self->server_port,
+			       self->client_id, 20000, 1000);
+	crpc->msgout.next_xmit_offset = 5000;
+#ifndef __STRIP__ /* See strip.py */
+	crpc->msgout.granted = 15000;
+#endif /* See strip.py */
+	homa_pacer_update_unsent(crpc);
+#ifndef __STRIP__ /* See strip.py */
+	EXPECT_EQ(10000, atomic64_read(&self->homa.pacer->unsent_bytes[14]));
+#else /* See strip.py */
+	EXPECT_EQ(15000, atomic64_read(&self->homa.pacer->unsent_bytes[14]));
+#endif /* See strip.py */
+
+	crpc->state = RPC_DEAD;
+	homa_pacer_update_unsent(crpc);
+	EXPECT_EQ(0, atomic64_read(&self->homa.pacer->unsent_bytes[14]));
+	EXPECT_EQ(0, crpc->msgout.unsent_recorded);
+	crpc->state = RPC_OUTGOING;
+}
+TEST_F(homa_pacer, homa_pacer_predict_cycles)
+{
+	self->homa.pacer->cycles_per_mbyte = 2000000;
+	mock_clock = 10000;
+
+	/* NIC queue empty, no unsent bytes. */
+	atomic64_set(&self->homa.pacer->link_idle_time, 9000);
+	EXPECT_EQ(2000, homa_pacer_predict_cycles(self->homa.pacer, 1000));
+	EXPECT_TRUE(self->homa.pacer->track_unsent);
+
+	/* NIC queue backlog and unsent bytes; bytes from longer
+	 * messages are ignored.
+	 */
+	atomic64_set(&self->homa.pacer->link_idle_time, 12000);
+	atomic64_set(&self->homa.pacer->unsent_bytes[3], 300);
+	atomic64_set(&self->homa.pacer->unsent_bytes[9], 200);
+	atomic64_set(&self->homa.pacer->unsent_bytes[10], 10000);
+	EXPECT_EQ(5000, homa_pacer_predict_cycles(self->homa.pacer, 1000));
+}
+TEST_F(homa_pacer, homa_pacer_outranked)
+{
+	struct homa_rpc *crpc1, *crpc2, *crpc3;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id, 5000, 1000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 2, 3000, 1000);
+	crpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 4, 8000, 1000);
+
+	/* Throttled list empty. */
+	EXPECT_FALSE(homa_pacer_outranked(self->homa.pacer, crpc1));
+
+	homa_pacer_manage_rpc(crpc1);
+	EXPECT_FALSE(homa_pacer_outranked(self->homa.pacer, crpc1));
+	EXPECT_FALSE(homa_pacer_outranked(self->homa.pacer, crpc2));
+	EXPECT_TRUE(homa_pacer_outranked(self->homa.pacer, crpc3));
+
+	/* Ranking is based on bytes remaining, not message length. */
+	crpc3->msgout.next_xmit_offset = 4000;
+	EXPECT_FALSE(homa_pacer_outranked(self->homa.pacer, crpc3));
+}
 TEST_F(homa_pacer, homa_pacer_unmanage_rpc__basics)
 {
 	struct homa_rpc *crpc;
@@ -660,14 +808,47 @@ TEST_F(homa_pacer, homa_pacer_unmanage_rpc__metrics)
 }
 #endif /* See strip.py */
 
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_pacer, homa_pacer_clamp_urgent_prio)
+{
+	EXPECT_EQ(HOMA_MAX_PRIORITIES - 1, self->homa.pacer->urgent_prio);
+
+	self->homa.num_priorities = 4;
+	homa_pacer_clamp_urgent_prio(self->homa.pacer);
+	EXPECT_EQ(3, self->homa.pacer->urgent_prio);
+
+	self->homa.pacer->urgent_prio = -2;
+	homa_pacer_clamp_urgent_prio(self->homa.pacer);
+	EXPECT_EQ(0, self->homa.pacer->urgent_prio);
+
+	self->homa.pacer->urgent_prio = 2;
+	homa_pacer_clamp_urgent_prio(self->homa.pacer);
+	EXPECT_EQ(2, self->homa.pacer->urgent_prio);
+}
+#endif /* See strip.py */
+
 TEST_F(homa_pacer, homa_pacer_update_sysctl_deps)
 {
 	self->homa.pacer->max_nic_queue_ns = 6000;
 	self->homa.pacer->link_mbps = 10000;
+#ifndef __STRIP__ /* See strip.py */
+	self->homa.pacer->urgent_nic_queue_ns = 2000;
+#endif /* See strip.py */
 	homa_pacer_update_sysctl_deps(self->homa.pacer);
 	EXPECT_EQ(6000, self->homa.pacer->max_nic_queue_cycles);
+#ifndef __STRIP__ /* See strip.py */
+	EXPECT_EQ(2000, self->homa.pacer->urgent_nic_queue_cycles);
+#endif /* See strip.py */
 	EXPECT_EQ(808000, self->homa.pacer->cycles_per_mbyte);
 
+#ifndef __STRIP__ /* See strip.py */
+	/* urgent_prio is clamped to the available priority levels. */
+	self->homa.pacer->urgent_prio = 20;
+	homa_pacer_update_sysctl_deps(self->homa.pacer);
+	EXPECT_EQ(self->homa.num_priorities - 1,
+		  self->homa.pacer->urgent_prio);
+#endif /* See strip.py */
+
 	self->homa.pacer->link_mbps = 1000;
 	homa_pacer_update_sysctl_deps(self->homa.pacer);
 	EXPECT_EQ(8080000, self->homa.pacer->cycles_per_mbyte);
@@ -1,6 +1,10 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include "homa_impl.h"
+#ifndef __STRIP__ /* See strip.py */
+#include "homa_impair.h"
+#include "homa_sndbuf.h"
+#endif /* See strip.py */
 #include "homa_peer.h"
 #include "homa_pool.h"
 #define KSELFTEST_NOT_MAIN 1
@@ -374,7 +378,64 @@ TEST_F(homa_plumbing, homa_setsockopt__server_success)
 			SO_HOMA_SERVER, self->optval, sizeof(int)));
 	EXPECT_EQ(0, self->hsk.is_server);
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_plumbing, homa_setsockopt__grant_weight_bad_optlen)
+{
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(int) - 1));
+}
+TEST_F(homa_plumbing, homa_setsockopt__grant_weight_copy_from_sockptr_fails)
+{
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(int)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__grant_weight_out_of_range)
+{
+	int arg = 0;
 
+	self->optval.user = &arg;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(int)));
+	arg = HOMA_MAX_GRANT_WEIGHT + 1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(int)));
+	EXPECT_EQ(1, self->hsk.grant_weight);
+}
+TEST_F(homa_plumbing, homa_setsockopt__grant_weight_success)
+{
+	int arg = 5;
+
+	self->optval.user = &arg;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_GRANT_WEIGHT, self->optval, sizeof(int)));
+	EXPECT_EQ(5, self->hsk.grant_weight);
+}
+TEST_F(homa_plumbing, homa_setsockopt__sndbuf_bad_optlen)
+{
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SNDBUF, self->optval,
+			sizeof(struct homa_sndbuf_args) - 1));
+}
+TEST_F(homa_plumbing, homa_setsockopt__sndbuf_copy_from_sockptr_fails)
+{
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SNDBUF, self->optval,
+			sizeof(struct homa_sndbuf_args)));
+}
+TEST_F(homa_plumbing, homa_setsockopt__sndbuf_success)
+{
+	struct homa_sndbuf_args args = {0x100000, 3 * PAGE_SIZE};
+
+	self->optval.user = &args;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SNDBUF, self->optval, sizeof(args)));
+	ASSERT_NE(NULL, self->hsk.sndbuf);
+	EXPECT_EQ(0x100000, self->hsk.sndbuf->start);
+	EXPECT_EQ(3, self->hsk.sndbuf->num_pages);
+}
+#endif /* See strip.py */
 
 TEST_F(homa_plumbing, homa_getsockopt__recvbuf_success)
 {
@@ -442,6 +503,40 @@ TEST_F(homa_plumbing, homa_getsockopt__server_success)
 	EXPECT_EQ(0, is_server);
 	EXPECT_EQ(sizeof(int), size);
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_plumbing, homa_getsockopt__grant_weight)
+{
+	int weight;
+	int size = sizeof(weight) - 1;
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_GRANT_WEIGHT, (char *)&weight, &size));
+
+	self->hsk.grant_weight = 7;
+	size = 20;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_GRANT_WEIGHT, (char *)&weight, &size));
+	EXPECT_EQ(7, weight);
+	EXPECT_EQ(sizeof(int), size);
+}
+TEST_F(homa_plumbing, homa_getsockopt__sndbuf)
+{
+	struct homa_sndbuf_args args;
+	int size = sizeof(args) - 1;
+
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_SNDBUF, (char *)&args, &size));
+
+	EXPECT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)0x100000,
+					     2 * PAGE_SIZE));
+	size = sizeof(args) + 10;
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_SNDBUF, (char *)&args, &size));
+	EXPECT_EQ(0x100000, args.start);
+	EXPECT_EQ(2 * PAGE_SIZE, args.length);
+	EXPECT_EQ(sizeof(args), size);
+}
+#endif /* See strip.py */
 TEST_F(homa_plumbing, homa_getsockopt__bad_optname)
 {
 	struct homa_rcvbuf_args val;
@@ -503,13 +598,56 @@ TEST_F(homa_plumbing, homa_sendmsg__illegal_flag)
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 }
-TEST_F(homa_plumbing, homa_sendmsg__nonzero_reserved_field)
+TEST_F(homa_plumbing, homa_sendmsg__sndbuf_offset_invalid)
 {
-	self->sendmsg_args.reserved = 0x1000;
+	self->sendmsg_args.flags = HOMA_SENDMSG_SNDBUF;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_sendmsg__sndbuf_offset)
+{
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)0x100000,
+					     3 * PAGE_SIZE));
+	self->sendmsg_args.flags = HOMA_SENDMSG_SNDBUF;
+	self->send_vec[0].iov_base = (void *)1000;
+	iov_iter_init(&self->sendmsg_hdr.msg_iter, WRITE, self->send_vec,
+		      1, 100);
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("_copy_from_iter 100 bytes from bvec offset 1000",
+		      unit_log_get());
+	EXPECT_SUBSTR("xmit DATA 100@0", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sndbuf_msgs);
+}
+TEST_F(homa_plumbing, homa_sendmsg__deadline_cant_be_met)
+{
+	self->homa.pacer->cycles_per_mbyte = 1000000;
+	atomic64_set(&self->homa.pacer->unsent_bytes[0], 10000);
+	self->sendmsg_args.deadline_us = 10;
+	EXPECT_EQ(ETIME, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->send_deadline_rejects);
+}
+TEST_F(homa_plumbing, homa_sendmsg__deadline_ok)
+{
+	struct homa_rpc *crpc;
+
+	self->homa.pacer->cycles_per_mbyte = 1000000;
+	self->sendmsg_args.deadline_us = 10;
+	mock_clock = 1000;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	ASSERT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->send_deadline_rejects);
+	EXPECT_TRUE(self->homa.pacer->track_unsent);
+	crpc = list_first_entry(&self->hsk.active_rpcs, struct homa_rpc,
+				active_links);
+	EXPECT_EQ(11000, crpc->deadline);
+}
 TEST_F(homa_plumbing, homa_sendmsg__bad_address_family)
 {
 	self->client_addr.in4.sin_family = 1;
@@ -876,6 +1014,35 @@ TEST_F(homa_plumbing, homa_recvmsg__server_normal_completion)
 	EXPECT_EQ(0, srpc->peer->num_acks);
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
+TEST_F(homa_plumbing, homa_recvmsg__server_deadline)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 200);
+
+	EXPECT_NE(NULL, srpc);
+	mock_clock = 10000;
+	srpc->deadline = 40000;
+	self->recvmsg_args.deadline_us = 99;
+	EXPECT_EQ(100, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
+	EXPECT_EQ(30, self->recvmsg_args.deadline_us);
+}
+TEST_F(homa_plumbing, homa_recvmsg__no_deadline_for_responses)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 2000);
+
+	EXPECT_NE(NULL, crpc);
+	crpc->deadline = 40000;
+	self->recvmsg_args.deadline_us = 99;
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, self->recvmsg_args.id);
+	EXPECT_EQ(0, self->recvmsg_args.deadline_us);
+}
 TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
@@ -973,6 +1140,60 @@ TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 	EXPECT_EQ(1, homa_metrics_per_cpu()->short_packets);
 #endif /* See strip.py */
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_plumbing, homa_softirq__impairment_drops_packet)
+{
+	struct sk_buff *skb;
+
+	self->hnet->impair->loss_ppm = 1000000;
+	homa_impair_update_sysctl_deps(self->hnet->impair);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 1400);
+	homa_softirq(skb);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->impair_drops);
+}
+TEST_F(homa_plumbing, homa_softirq__impairment_drops_first_packet_in_batch)
+{
+	struct sk_buff *skb, *skb2;
+
+	/* The first packet is freed by the impairment stage; softirq must
+	 * not follow its next pointer afterwards.
+	 */
+	self->hnet->impair->loss_ppm = 1000000;
+	homa_impair_update_sysctl_deps(self->hnet->impair);
+	EXPECT_TRUE(self->hnet->impair->rx_active);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 1400);
+	self->data.common.sender_id = cpu_to_be64(self->client_id + 2);
+	skb2 = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 1400);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = NULL;
+	homa_softirq(skb);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->impair_drops);
+}
+TEST_F(homa_plumbing, homa_softirq__release_held_packets)
+{
+	struct sk_buff *skb;
+
+	mock_clock = 1000;
+	self->hnet->impair->delay_usecs = 1;
+	homa_impair_update_sysctl_deps(self->hnet->impair);
+	self->hnet->impair->delay_cycles = 100;
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 1400);
+	homa_softirq(skb);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, self->hnet->impair->num_held);
+
+	/* The next call to homa_softirq releases the held packet. */
+	mock_clock = 1100;
+	self->hnet->impair->delay_cycles = 0;
+	self->data.common.sender_id = cpu_to_be64(self->client_id + 2);
+	skb = mock_skb_alloc(self->client_ip, &self->data.common, 1400, 1400);
+	homa_softirq(skb);
+	EXPECT_EQ(0, self->hnet->impair->num_held);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+}
+#endif /* See strip.py */
 TEST_F(homa_plumbing, homa_softirq__process_short_messages_first)
 {
 	struct sk_buff *skb, *skb2, *skb3, *skb4;
@@ -168,6 +168,34 @@ TEST_F(homa_rpc, homa_rpc_alloc_server__normal)
 	EXPECT_EQ(1, created);
 	homa_rpc_end(srpc);
 }
+TEST_F(homa_rpc, homa_rpc_alloc_server__deadline)
+{
+	struct homa_rpc *srpc;
+	int created;
+
+	mock_clock = 10000;
+	homa_data_set_deadline(&self->data, 50);
+	srpc = homa_rpc_alloc_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	ASSERT_FALSE(IS_ERR(srpc));
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(60000, srpc->deadline);
+	homa_rpc_end(srpc);
+}
+TEST_F(homa_rpc, homa_rpc_alloc_server__deadline_too_far_away)
+{
+	struct homa_rpc *srpc;
+	int created;
+
+	homa_data_set_deadline(&self->data, 100000000);
+	EXPECT_EQ(HOMA_MAX_WIRE_DEADLINE, homa_data_get_deadline(&self->data));
+	srpc = homa_rpc_alloc_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	ASSERT_FALSE(IS_ERR(srpc));
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(0, srpc->deadline);
+	homa_rpc_end(srpc);
+}
 TEST_F(homa_rpc, homa_rpc_alloc_server__no_buffer_pool)
 {
 	struct homa_rpc *srpc;
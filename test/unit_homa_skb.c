@@ -107,6 +107,9 @@ TEST_F(homa_skb, homa_skb_init__success)
 	EXPECT_EQ(self->homa.page_pools[0], get_skb_core(6)->pool);
 	EXPECT_EQ(self->homa.page_pools[1], get_skb_core(7)->pool);
 	EXPECT_EQ(1, self->homa.max_numa);
+	ASSERT_NE(NULL, self->homa.skb_page_shrinker);
+	EXPECT_EQ(&self->homa, self->homa.skb_page_shrinker->private_data);
+	EXPECT_NE(NULL, self->homa.skb_refill_kthread);
 }
 TEST_F(homa_skb, homa_skb_init__kmalloc_failure)
 {
@@ -119,6 +122,23 @@ TEST_F(homa_skb, homa_skb_init__kmalloc_failure)
 	EXPECT_EQ(NULL, self->homa.page_pools[1]);
 	EXPECT_EQ(NULL, self->homa.page_pools[2]);
 }
+TEST_F(homa_skb, homa_skb_init__shrinker_alloc_failure)
+{
+	homa_skb_cleanup(&self->homa);
+	mock_kmalloc_errors = 0x4;
+	EXPECT_EQ(ENOMEM, -homa_skb_init(&self->homa));
+	EXPECT_NE(NULL, self->homa.page_pools[0]);
+	EXPECT_NE(NULL, self->homa.page_pools[1]);
+	EXPECT_EQ(NULL, self->homa.skb_page_shrinker);
+}
+TEST_F(homa_skb, homa_skb_init__cant_create_refill_thread)
+{
+	homa_skb_cleanup(&self->homa);
+	mock_kthread_create_errors = 1;
+	EXPECT_EQ(EACCES, -homa_skb_init(&self->homa));
+	EXPECT_EQ(NULL, self->homa.skb_refill_kthread);
+	EXPECT_NE(NULL, self->homa.skb_page_shrinker);
+}
 
 TEST_F(homa_skb, homa_skb_cleanup)
 {
@@ -133,10 +153,15 @@ TEST_F(homa_skb, homa_skb_cleanup)
 	EXPECT_EQ(2, get_skb_core(3)->pool->avail);
 	EXPECT_EQ(2, get_skb_core(3)->num_stashed_pages);
 
+	unit_log_clear();
 	homa_skb_cleanup(&self->homa);
+	EXPECT_SUBSTR("kthread_stop", unit_log_get());
+	EXPECT_TRUE(self->homa.skb_refill_exit);
+	EXPECT_EQ(NULL, self->homa.skb_refill_kthread);
 	EXPECT_EQ(NULL, skb_core->pool);
 	EXPECT_EQ(NULL, skb_core->skb_page);
 	EXPECT_EQ(0, get_skb_core(3)->num_stashed_pages);
+	EXPECT_EQ(NULL, self->homa.skb_page_shrinker);
 
 	skb_core = get_skb_core(nr_cpu_ids-1);
 	EXPECT_EQ(NULL, skb_core->pool);
@@ -305,6 +330,7 @@ TEST_F(homa_skb, homa_skb_page_alloc__reuse_existing_page)
 	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
 	EXPECT_EQ(page, skb_core->skb_page);
 	EXPECT_EQ(0, skb_core->page_inuse);
+	EXPECT_EQ(1, skb_core->pages_used);
 }
 TEST_F(homa_skb, homa_skb_page_alloc__from_stash)
 {
@@ -328,6 +354,7 @@ TEST_F(homa_skb, homa_skb_page_alloc__from_pool)
 	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
 	EXPECT_NE(NULL, skb_core->skb_page);
 	EXPECT_EQ(4, skb_core->pool->avail);
+	EXPECT_EQ(1, skb_core->pages_used);
 }
 TEST_F(homa_skb, homa_skb_page_alloc__pool_page_taken_while_locking)
 {
@@ -668,6 +695,55 @@ TEST_F(homa_skb, homa_skb_get)
 	kfree_skb(skb);
 }
 
+TEST_F(homa_skb, homa_skb_update_targets__basics)
+{
+	self->homa.skb_page_reserve_ms = 100;
+	get_skb_core(0)->pages_used = 100;
+	get_skb_core(2)->pages_used = 50;
+	get_skb_core(1)->pages_used = 30;
+	get_skb_core(1)->pages_used_snapshot = 10;
+
+	homa_skb_update_targets(&self->homa);
+	EXPECT_EQ(20, self->homa.page_pools[0]->demand);
+	EXPECT_EQ(4, self->homa.page_pools[0]->target);
+	EXPECT_EQ(150, self->homa.page_pools[1]->demand);
+	EXPECT_EQ(30, self->homa.page_pools[1]->target);
+	EXPECT_EQ(100, get_skb_core(0)->pages_used_snapshot);
+	EXPECT_EQ(30, get_skb_core(1)->pages_used_snapshot);
+}
+TEST_F(homa_skb, homa_skb_update_targets__counter_wraps)
+{
+	self->homa.skb_page_reserve_ms = 500;
+	get_skb_core(1)->pages_used = 5;
+	get_skb_core(1)->pages_used_snapshot = 0xfffffffe;
+
+	homa_skb_update_targets(&self->homa);
+	EXPECT_EQ(7, self->homa.page_pools[0]->demand);
+	EXPECT_EQ(7, self->homa.page_pools[0]->target);
+}
+TEST_F(homa_skb, homa_skb_update_targets__demand_decays_gradually)
+{
+	struct homa_page_pool *pool = get_skb_core(1)->pool;
+
+	self->homa.skb_page_reserve_ms = 500;
+	pool->demand = 100;
+	homa_skb_update_targets(&self->homa);
+	EXPECT_EQ(50, pool->demand);
+	EXPECT_EQ(50, pool->target);
+
+	get_skb_core(1)->pages_used = 80;
+	homa_skb_update_targets(&self->homa);
+	EXPECT_EQ(80, pool->demand);
+	EXPECT_EQ(80, pool->target);
+}
+TEST_F(homa_skb, homa_skb_update_targets__target_limited_by_pool_size)
+{
+	self->homa.skb_page_reserve_ms = 1000;
+	get_skb_core(1)->pages_used = 1000;
+	homa_skb_update_targets(&self->homa);
+	EXPECT_EQ(HOMA_PAGE_POOL_SIZE, get_skb_core(1)->pool->target);
+}
+
 TEST_F(homa_skb, homa_skb_release_pages__basics)
 {
 	EXPECT_EQ(0UL, self->homa.skb_page_free_time);
@@ -763,3 +839,210 @@ TEST_F(homa_skb, homa_skb_release_pages__empty_pool)
 	homa_skb_release_pages(&self->homa);
 	EXPECT_EQ(0, get_skb_core(0)->pool->avail);
 }
+TEST_F(homa_skb, homa_skb_release_pages__limited_by_target)
+{
+	struct homa_page_pool *pool = get_skb_core(0)->pool;
+
+	mock_clock = 1000000;
+	self->homa.skb_page_free_time = 500000;
+	self->homa.skb_page_frees_per_sec = 1000;
+	self->homa.skb_page_pool_min_kb = 0;
+	self->homa.skb_page_reserve_ms = 500;
+	add_to_pool(&self->homa, 10, 0);
+	pool->low_mark = 9;
+	pool->demand = 10;
+
+	homa_skb_release_pages(&self->homa);
+	EXPECT_EQ(5, pool->target);
+	EXPECT_EQ(6, pool->avail);
+}
+TEST_F(homa_skb, homa_skb_release_pages__pick_pool_with_most_excess)
+{
+	mock_clock = 1000000;
+	self->homa.skb_page_free_time = 500000;
+	self->homa.skb_page_frees_per_sec = 1000;
+	self->homa.skb_page_pool_min_kb = 0;
+	self->homa.skb_page_reserve_ms = 500;
+	add_to_pool(&self->homa, 10, 0);
+	get_skb_core(0)->pool->low_mark = 10;
+	get_skb_core(0)->pool->demand = 16;
+	add_to_pool(&self->homa, 4, 1);
+	get_skb_core(1)->pool->low_mark = 4;
+
+	homa_skb_release_pages(&self->homa);
+	EXPECT_EQ(10, get_skb_core(0)->pool->avail);
+	EXPECT_EQ(0, get_skb_core(1)->pool->avail);
+}
+TEST_F(homa_skb, homa_skb_release_pages__nothing_to_release)
+{
+	mock_clock = 1000000;
+	self->homa.skb_page_free_time = 500000;
+	self->homa.skb_page_frees_per_sec = 1000;
+	self->homa.skb_page_pool_min_kb = (5 * HOMA_SKB_PAGE_SIZE) / 1000;
+	add_to_pool(&self->homa, 4, 0);
+	get_skb_core(0)->pool->low_mark = 4;
+
+	homa_skb_release_pages(&self->homa);
+	EXPECT_EQ(4, get_skb_core(0)->pool->avail);
+	EXPECT_EQ(501000000UL, self->homa.skb_page_free_time);
+}
+
+TEST_F(homa_skb, homa_skb_request_refill__pool_below_target)
+{
+	self->homa.page_pools[0]->target = 1;
+	add_to_pool(&self->homa, 1, 0);
+	self->homa.page_pools[1]->target = 1;
+
+	homa_skb_request_refill(&self->homa);
+	EXPECT_TRUE(self->homa.skb_refill_needed);
+
+	/* Pages are allocated only by the refill thread. */
+	EXPECT_EQ(0, self->homa.page_pools[1]->avail);
+}
+TEST_F(homa_skb, homa_skb_request_refill__pools_at_target)
+{
+	self->homa.page_pools[0]->target = 1;
+	add_to_pool(&self->homa, 1, 0);
+
+	homa_skb_request_refill(&self->homa);
+	EXPECT_FALSE(self->homa.skb_refill_needed);
+}
+TEST_F(homa_skb, homa_skb_request_refill__suspended_after_memory_pressure)
+{
+	self->homa.page_pools[0]->target = 1;
+	mock_clock = 1000;
+	self->homa.skb_page_pressure_time = 1001;
+
+	homa_skb_request_refill(&self->homa);
+	EXPECT_FALSE(self->homa.skb_refill_needed);
+}
+
+TEST_F(homa_skb, homa_skb_refill_main__exit)
+{
+	self->homa.page_pools[0]->target = 2;
+	self->homa.skb_refill_needed = true;
+	self->homa.skb_refill_exit = true;
+
+	EXPECT_EQ(0, homa_skb_refill_main(&self->homa));
+	EXPECT_EQ(0, self->homa.page_pools[0]->avail);
+}
+TEST_F(homa_skb, homa_skb_refill_main__refill_then_sleep)
+{
+	self->homa.page_pools[0]->target = 2;
+	self->homa.skb_refill_needed = true;
+
+	/* Make the thread exit the first time it tries to sleep. */
+	mock_prepare_to_wait_errors = 1;
+	mock_prepare_to_wait_status = -EINVAL;
+	homa_skb_refill_main(&self->homa);
+	EXPECT_EQ(2, self->homa.page_pools[0]->avail);
+	EXPECT_FALSE(self->homa.skb_refill_needed);
+}
+
+TEST_F(homa_skb, homa_skb_refill_pages__basics)
+{
+	self->homa.page_pools[0]->target = 2;
+	self->homa.page_pools[1]->target = 3;
+	add_to_pool(&self->homa, 1, 0);
+	mock_page_nid_mask = 0xc;
+
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(2, self->homa.page_pools[0]->avail);
+	EXPECT_EQ(3, self->homa.page_pools[1]->avail);
+	EXPECT_EQ(4, homa_metrics_per_cpu()->skb_page_refills);
+}
+TEST_F(homa_skb, homa_skb_refill_pages__limited_by_batch_size)
+{
+	self->homa.page_pools[0]->target = 100;
+
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(HOMA_SKB_REFILL_BATCH,
+		  homa_metrics_per_cpu()->skb_page_refills);
+
+	/* The unit-test version of homa_skb_cache_pages keeps only 4. */
+	EXPECT_EQ(4, self->homa.page_pools[0]->avail);
+}
+TEST_F(homa_skb, homa_skb_refill_pages__alloc_failure)
+{
+	self->homa.page_pools[0]->target = 3;
+	mock_alloc_page_errors = 0x2;
+
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(1, self->homa.page_pools[0]->avail);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_page_refills);
+
+	mock_alloc_page_errors = 0x1;
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(1, self->homa.page_pools[0]->avail);
+}
+TEST_F(homa_skb, homa_skb_refill_pages__suspended_after_memory_pressure)
+{
+	self->homa.page_pools[0]->target = 2;
+	mock_clock = 1000;
+	self->homa.skb_page_pressure_time = 1001;
+
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(0, self->homa.page_pools[0]->avail);
+
+	mock_clock = 1001;
+	homa_skb_refill_pages(&self->homa);
+	EXPECT_EQ(2, self->homa.page_pools[0]->avail);
+}
+
+TEST_F(homa_skb, homa_skb_shrink_count)
+{
+	struct shrinker *shrinker = self->homa.skb_page_shrinker;
+	struct shrink_control sc = {};
+
+	add_to_pool(&self->homa, 3, 0);
+	sc.nid = 1;
+	EXPECT_EQ(3, homa_skb_shrink_count(shrinker, &sc));
+	sc.nid = 0;
+	EXPECT_EQ(SHRINK_EMPTY, homa_skb_shrink_count(shrinker, &sc));
+	sc.nid = 2;
+	EXPECT_EQ(SHRINK_EMPTY, homa_skb_shrink_count(shrinker, &sc));
+}
+
+TEST_F(homa_skb, homa_skb_shrink_scan__basics)
+{
+	struct shrinker *shrinker = self->homa.skb_page_shrinker;
+	struct homa_page_pool *pool = get_skb_core(0)->pool;
+	struct shrink_control sc = {};
+
+	mock_clock = 5000;
+	add_to_pool(&self->homa, 20, 0);
+	pool->low_mark = 10;
+	sc.nid = 1;
+	sc.nr_to_scan = 18;
+
+	EXPECT_EQ(18, homa_skb_shrink_scan(shrinker, &sc));
+	EXPECT_EQ(18, sc.nr_scanned);
+	EXPECT_EQ(2, pool->avail);
+	EXPECT_EQ(2, pool->low_mark);
+	EXPECT_EQ(18, homa_metrics_per_cpu()->skb_page_shrinks);
+	EXPECT_EQ(1000005000UL, self->homa.skb_page_pressure_time);
+}
+TEST_F(homa_skb, homa_skb_shrink_scan__pool_runs_out)
+{
+	struct shrinker *shrinker = self->homa.skb_page_shrinker;
+	struct shrink_control sc = {};
+
+	add_to_pool(&self->homa, 3, 0);
+	sc.nid = 1;
+	sc.nr_to_scan = 10;
+	EXPECT_EQ(3, homa_skb_shrink_scan(shrinker, &sc));
+	EXPECT_EQ(0, get_skb_core(0)->pool->avail);
+
+	EXPECT_EQ(SHRINK_STOP, homa_skb_shrink_scan(shrinker, &sc));
+	EXPECT_EQ(0, sc.nr_scanned);
+}
+TEST_F(homa_skb, homa_skb_shrink_scan__bad_node)
+{
+	struct shrinker *shrinker = self->homa.skb_page_shrinker;
+	struct shrink_control sc = {};
+
+	sc.nid = 5;
+	sc.nr_to_scan = 10;
+	EXPECT_EQ(SHRINK_STOP, homa_skb_shrink_scan(shrinker, &sc));
+	EXPECT_NE(0UL, self->homa.skb_page_pressure_time);
+}
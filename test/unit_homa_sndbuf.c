@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "homa_impl.h"
+#include "homa_sndbuf.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+#define REGION_START 0x100000
+
+FIXTURE(homa_sndbuf) {
+	struct homa homa;
+	struct homa_net *hnet;
+	struct homa_sock hsk;
+};
+FIXTURE_SETUP(homa_sndbuf)
+{
+	homa_init(&self->homa);
+	self->hnet = mock_alloc_hnet(&self->homa);
+	mock_sock_init(&self->hsk, self->hnet, 0);
+	unit_log_clear();
+}
+FIXTURE_TEARDOWN(homa_sndbuf)
+{
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__basics)
+{
+	struct homa_sndbuf *sndbuf;
+
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 2 * PAGE_SIZE + 100);
+	ASSERT_FALSE(IS_ERR(sndbuf));
+	EXPECT_EQ(REGION_START, sndbuf->start);
+	EXPECT_EQ(2 * PAGE_SIZE + 100, sndbuf->length);
+	EXPECT_EQ(3, sndbuf->num_pages);
+	EXPECT_EQ(PAGE_SIZE, sndbuf->bvecs[2].bv_len);
+	EXPECT_EQ(0, sndbuf->bvecs[2].bv_offset);
+	EXPECT_EQ(3, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(2, atomic_read(&mock_mm.mm_count));
+	EXPECT_STREQ("pin_user_pages_fast 3 pages at 0x100000",
+		     unit_log_get());
+	EXPECT_EQ(FOLL_WRITE | FOLL_LONGTERM, mock_pin_user_pages_flags);
+	homa_sndbuf_free(sndbuf);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__bad_arguments)
+{
+	struct homa_sndbuf *sndbuf;
+
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START + 8, PAGE_SIZE);
+	EXPECT_EQ(EINVAL, -PTR_ERR(sndbuf));
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 0);
+	EXPECT_EQ(EINVAL, -PTR_ERR(sndbuf));
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START,
+				   HOMA_SNDBUF_MAX_LENGTH + 1);
+	EXPECT_EQ(EINVAL, -PTR_ERR(sndbuf));
+	mock_task.mm = NULL;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, PAGE_SIZE);
+	EXPECT_EQ(EINVAL, -PTR_ERR(sndbuf));
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__cant_allocate_memory)
+{
+	struct homa_sndbuf *sndbuf;
+
+	mock_kmalloc_errors = 1;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, PAGE_SIZE);
+	EXPECT_EQ(ENOMEM, -PTR_ERR(sndbuf));
+	mock_kmalloc_errors = 2;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, PAGE_SIZE);
+	EXPECT_EQ(ENOMEM, -PTR_ERR(sndbuf));
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__exceeds_memlock_limit)
+{
+	struct homa_sndbuf *sndbuf;
+
+	atomic64_set(&mock_mm.pinned_vm, 2);
+	mock_memlock_limit = 4 * PAGE_SIZE;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 3 * PAGE_SIZE);
+	EXPECT_EQ(ENOMEM, -PTR_ERR(sndbuf));
+	EXPECT_EQ(2, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(1, atomic_read(&mock_mm.mm_count));
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__capable_ignores_memlock_limit)
+{
+	struct homa_sndbuf *sndbuf;
+
+	mock_memlock_limit = 0;
+	mock_capable = 1;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 3 * PAGE_SIZE);
+	ASSERT_FALSE(IS_ERR(sndbuf));
+	EXPECT_EQ(3, atomic64_read(&mock_mm.pinned_vm));
+	homa_sndbuf_free(sndbuf);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__pin_in_batches)
+{
+	struct homa_sndbuf *sndbuf;
+
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START,
+				   (HOMA_SNDBUF_PIN_BATCH + 2) * PAGE_SIZE);
+	ASSERT_FALSE(IS_ERR(sndbuf));
+	EXPECT_EQ(HOMA_SNDBUF_PIN_BATCH + 2, sndbuf->num_pages);
+	EXPECT_STREQ("pin_user_pages_fast 32 pages at 0x100000; "
+		     "pin_user_pages_fast 2 pages at 0x120000",
+		     unit_log_get());
+	homa_sndbuf_free(sndbuf);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__partial_pins)
+{
+	struct homa_sndbuf *sndbuf;
+
+	mock_pin_user_pages_max = 2;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 5 * PAGE_SIZE);
+	ASSERT_FALSE(IS_ERR(sndbuf));
+	EXPECT_EQ(5, sndbuf->num_pages);
+	EXPECT_STREQ("pin_user_pages_fast 2 pages at 0x100000; "
+		     "pin_user_pages_fast 2 pages at 0x102000; "
+		     "pin_user_pages_fast 1 pages at 0x104000",
+		     unit_log_get());
+	homa_sndbuf_free(sndbuf);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_alloc__pin_fails)
+{
+	struct homa_sndbuf *sndbuf;
+
+	/* Pages pinned by the first call must be released. */
+	mock_pin_user_pages_max = 2;
+	mock_pin_user_pages_errors = 2;
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 4 * PAGE_SIZE);
+	EXPECT_EQ(EFAULT, -PTR_ERR(sndbuf));
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(1, atomic_read(&mock_mm.mm_count));
+}
+
+TEST_F(homa_sndbuf, homa_sndbuf_free)
+{
+	struct homa_sndbuf *sndbuf;
+
+	atomic64_set(&mock_mm.pinned_vm, 10);
+	sndbuf = homa_sndbuf_alloc((void *)REGION_START, 4 * PAGE_SIZE);
+	ASSERT_FALSE(IS_ERR(sndbuf));
+	EXPECT_EQ(14, atomic64_read(&mock_mm.pinned_vm));
+	homa_sndbuf_free(sndbuf);
+	EXPECT_EQ(10, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(1, atomic_read(&mock_mm.mm_count));
+}
+
+TEST_F(homa_sndbuf, homa_sndbuf_set_region__success)
+{
+	EXPECT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+	ASSERT_NE(NULL, self->hsk.sndbuf);
+	EXPECT_EQ(REGION_START, self->hsk.sndbuf->start);
+	EXPECT_EQ(2, self->hsk.sndbuf->num_pages);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_set_region__alloc_fails)
+{
+	EXPECT_EQ(EINVAL, -homa_sndbuf_set_region(&self->hsk,
+						  (void *)REGION_START + 1,
+						  PAGE_SIZE));
+	EXPECT_EQ(NULL, self->hsk.sndbuf);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_set_region__already_registered)
+{
+	EXPECT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_sndbuf_set_region(&self->hsk,
+						  (void *)REGION_START,
+						  4 * PAGE_SIZE));
+	EXPECT_EQ(2, self->hsk.sndbuf->num_pages);
+	EXPECT_EQ(2, atomic64_read(&mock_mm.pinned_vm));
+}
+TEST_F(homa_sndbuf, homa_sndbuf_set_region__freed_with_socket)
+{
+	EXPECT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+	unit_sock_destroy(&self->hsk);
+	EXPECT_EQ(NULL, self->hsk.sndbuf);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+}
+
+TEST_F(homa_sndbuf, homa_sndbuf_get_args)
+{
+	struct homa_sndbuf_args args;
+
+	homa_sndbuf_get_args(&self->hsk, &args);
+	EXPECT_EQ(0, args.start);
+	EXPECT_EQ(0, args.length);
+
+	EXPECT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE + 10));
+	homa_sndbuf_get_args(&self->hsk, &args);
+	EXPECT_EQ(REGION_START, args.start);
+	EXPECT_EQ(2 * PAGE_SIZE + 10, args.length);
+}
+
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__no_region)
+{
+	struct iov_iter dst;
+
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)0, 100), &dst));
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__different_mm)
+{
+	struct mm_struct other_mm;
+	struct iov_iter dst;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+	mock_task.mm = &other_mm;
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)0, 100), &dst));
+	mock_task.mm = &mock_mm;
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__multiple_segments)
+{
+	struct iovec iovecs[2] = {{(void *)0, 100}, {(void *)200, 100}};
+	struct iov_iter iter, dst;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+	iov_iter_init(&iter, WRITE, iovecs, 2, 200);
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk, &iter,
+						     &dst));
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__bad_range)
+{
+	struct iov_iter dst;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     2 * PAGE_SIZE));
+
+	/* Empty message. */
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)0, 0), &dst));
+
+	/* Beyond the end. */
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)(2 * PAGE_SIZE), 100), &dst));
+
+	/* Straddles the end. */
+	EXPECT_EQ(EINVAL, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)(2 * PAGE_SIZE - 50), 100),
+			&dst));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->sndbuf_msgs);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__success)
+{
+	struct homa_sndbuf *sndbuf;
+	struct iov_iter dst;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     3 * PAGE_SIZE));
+	sndbuf = self->hsk.sndbuf;
+	EXPECT_EQ(0, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)(PAGE_SIZE + 100), PAGE_SIZE),
+			&dst));
+	EXPECT_TRUE(iov_iter_is_bvec(&dst));
+	EXPECT_EQ(PAGE_SIZE, dst.count);
+	EXPECT_EQ(2, dst.nr_segs);
+	EXPECT_EQ(100, dst.iov_offset);
+	EXPECT_EQ(&sndbuf->bvecs[1], dst.bvec);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sndbuf_msgs);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__copy_data)
+{
+	struct homa_sndbuf *sndbuf;
+	struct iov_iter dst;
+	char buffer[PAGE_SIZE];
+	int i;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     3 * PAGE_SIZE));
+	sndbuf = self->hsk.sndbuf;
+	for (i = 0; i < sndbuf->num_pages; i++)
+		memset(page_address(sndbuf->bvecs[i].bv_page), 'a' + i,
+		       PAGE_SIZE);
+
+	/* Data starts near the end of page 1 and spills into page 2. */
+	EXPECT_EQ(0, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)(2 * PAGE_SIZE - 3), 5), &dst));
+	unit_log_clear();
+	memset(buffer, 0, sizeof(buffer));
+	EXPECT_EQ(5, copy_from_iter(buffer, 5, &dst));
+	EXPECT_STREQ("bbbcc", buffer);
+	EXPECT_STREQ("_copy_from_iter 3 bytes from bvec offset 4093; "
+		     "_copy_from_iter 2 bytes from bvec offset 0",
+		     unit_log_get());
+	EXPECT_EQ(0, dst.count);
+}
+TEST_F(homa_sndbuf, homa_sndbuf_import_offset__entire_region)
+{
+	struct iov_iter dst;
+
+	ASSERT_EQ(0, -homa_sndbuf_set_region(&self->hsk, (void *)REGION_START,
+					     3 * PAGE_SIZE));
+	EXPECT_EQ(0, -homa_sndbuf_import_offset(&self->hsk,
+			unit_iov_iter((void *)0, 3 * PAGE_SIZE), &dst));
+	EXPECT_EQ(3 * PAGE_SIZE, dst.count);
+	EXPECT_EQ(3, dst.nr_segs);
+	EXPECT_EQ(0, dst.iov_offset);
+}
@@ -2,6 +2,7 @@
 
 #include "homa_impl.h"
 #include "homa_interest.h"
+#include "homa_pacer.h"
 #include "homa_sock.h"
 #define KSELFTEST_NOT_MAIN 1
 #include "kselftest_harness.h"
@@ -27,6 +28,21 @@ static void schedule_hook(char *id)
 				   + 100;
 }
 
+/* Takes the first socket off the dying list just before the
+ * hook_count'th spinlock acquisition (simulates another reaper).
+ */
+static void remove_dying_hook(char *id)
+{
+	if (strcmp(id, "spin_lock") != 0)
+		return;
+	if (hook_count <= 0)
+		return;
+	hook_count--;
+	if (hook_count != 0)
+		return;
+	list_del_init(&hook_hsk->dying_links);
+}
+
 FIXTURE(homa_sock) {
 	struct homa homa;
 	struct homa_net *hnet;
@@ -299,6 +315,201 @@ TEST_F(homa_sock, homa_sock_shutdown__wakeup_interests)
 	EXPECT_STREQ("wake_up; wake_up", unit_log_get());
 	homa_sock_destroy(&self->hsk.sock);
 }
+TEST_F(homa_sock, homa_sock_shutdown__teardown_in_background)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 2*i, 5000, 5000);
+	self->homa.teardown_rpcs = 3;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_TRUE(self->hsk.shutdown);
+	EXPECT_EQ(3, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(1, mock_sock_holds);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->sock_async_teardowns);
+
+	/* Destruction must wait for the background teardown. */
+	homa_sock_destroy(&self->hsk.sock);
+	EXPECT_TRUE(self->hsk.destroyed);
+	EXPECT_NE(NULL, self->hsk.buffer_pool);
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.dead_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(0, mock_sock_holds);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+}
+TEST_F(homa_sock, homa_sock_shutdown__background_teardown_unmanages_rpcs)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id, 5000, 5000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 2, 5000, 5000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_pacer_manage_rpc(crpc2);
+	EXPECT_FALSE(list_empty(&self->homa.pacer->throttled_rpcs));
+	self->homa.teardown_rpcs = 2;
+	unit_log_clear();
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_TRUE(list_empty(&self->homa.pacer->throttled_rpcs));
+	EXPECT_SUBSTR("removing id 1236 from throttled list", unit_log_get());
+
+	/* RPCs can't be throttled again once the socket is shut down. */
+	homa_pacer_manage_rpc(crpc1);
+	EXPECT_TRUE(list_empty(&self->homa.pacer->throttled_rpcs));
+	homa_socktab_reap_dying(self->homa.socktab, true);
+	homa_sock_destroy(&self->hsk.sock);
+}
+TEST_F(homa_sock, homa_sock_shutdown__too_few_rpcs_for_background)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 2*i, 5000, 5000);
+	self->homa.teardown_rpcs = 4;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->sock_async_teardowns);
+	homa_sock_destroy(&self->hsk.sock);
+}
+
+TEST_F(homa_sock, homa_sock_teardown_batch__all)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+				self->server_ip, self->server_port,
+				self->client_id + 2*i, 5000, 5000);
+	self->homa.teardown_rpcs = 1;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(5, unit_list_length(&self->hsk.active_rpcs));
+
+	EXPECT_FALSE(homa_sock_teardown_batch(&self->hsk, false));
+	EXPECT_EQ(3, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_TRUE(homa_sock_teardown_batch(&self->hsk, true));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.dead_rpcs));
+}
+
+TEST_F(homa_sock, homa_socktab_reap_dying__socket_not_destroyed)
+{
+	unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 5000);
+	self->homa.teardown_rpcs = 1;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(0, mock_sock_holds);
+	EXPECT_NE(NULL, self->hsk.buffer_pool);
+	homa_sock_destroy(&self->hsk.sock);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+}
+TEST_F(homa_sock, homa_socktab_reap_dying__bounded_sockets_per_call)
+{
+	struct homa_sock hsks[3];
+	int i;
+
+	self->homa.teardown_rpcs = 1;
+	for (i = 0; i < 3; i++) {
+		mock_sock_init(&hsks[i], self->hnet, 0);
+		ASSERT_NE(NULL, unit_client_rpc(&hsks[i], UNIT_OUTGOING,
+				self->client_ip, self->server_ip,
+				self->server_port, self->client_id, 5000,
+				5000));
+		homa_sock_shutdown(&hsks[i]);
+	}
+	EXPECT_EQ(3, unit_list_length(&self->homa.socktab->dying));
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_FALSE(list_empty(&hsks[2].dying_links));
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	for (i = 0; i < 3; i++)
+		homa_sock_destroy(&hsks[i].sock);
+	EXPECT_EQ(0, mock_sock_holds);
+}
+TEST_F(homa_sock, homa_socktab_reap_dying__another_reaper_running)
+{
+	unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 5000);
+	self->homa.teardown_rpcs = 1;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+
+	mock_trylock_errors = 1;
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(1, mock_sock_holds);
+	EXPECT_EQ(0, mock_active_locks);
+
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(0, mock_active_locks);
+	homa_sock_destroy(&self->hsk.sock);
+}
+TEST_F(homa_sock, homa_socktab_reap_dying__list_emptied_concurrently)
+{
+	unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 5000);
+	self->homa.teardown_rpcs = 1;
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+
+	/* Simulate the socket being claimed after the list was counted. */
+	unit_hook_register(remove_dying_hook);
+	hook_hsk = &self->hsk;
+	hook_count = 2;
+	homa_socktab_reap_dying(self->homa.socktab, false);
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(1, mock_sock_holds);
+	EXPECT_EQ(0, mock_active_locks);
+	homa_sock_teardown_batch(&self->hsk, true);
+	sock_put(&self->hsk.sock);
+	homa_sock_destroy(&self->hsk.sock);
+}
+TEST_F(homa_sock, homa_socktab_destroy__finishes_dying_sockets)
+{
+	unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			5000, 5000);
+	self->homa.teardown_rpcs = 1;
+	homa_sock_shutdown(&self->hsk);
+	homa_sock_destroy(&self->hsk.sock);
+	EXPECT_EQ(1, unit_list_length(&self->homa.socktab->dying));
+
+	homa_socktab_destroy(self->homa.socktab, NULL);
+	EXPECT_EQ(0, unit_list_length(&self->homa.socktab->dying));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+	EXPECT_EQ(0, mock_sock_holds);
+}
 
 TEST_F(homa_sock, homa_sock_bind)
 {
@@ -2,6 +2,7 @@
 
 #include "homa_impl.h"
 #include "homa_grant.h"
+#include "homa_pacer.h"
 #include "homa_peer.h"
 #include "homa_rpc.h"
 #define KSELFTEST_NOT_MAIN 1
@@ -51,6 +52,65 @@ FIXTURE_TEARDOWN(homa_timer)
 	unit_teardown();
 }
 
+TEST_F(homa_timer, homa_timer_check_rpc__client_deadline_passed)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	mock_clock = 10000;
+
+	/* First call: deadline hasn't passed yet. */
+	crpc->deadline = 10001;
+	homa_rpc_lock(crpc);
+	homa_timer_check_rpc(crpc);
+	EXPECT_EQ(0, crpc->error);
+
+	/* Second call: deadline passed; the RPC must also stop
+	 * transmitting.
+	 */
+	crpc->deadline = 10000;
+	homa_pacer_manage_rpc(crpc);
+	EXPECT_FALSE(list_empty(&crpc->throttled_links));
+	homa_timer_check_rpc(crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(ETIME, -crpc->error);
+	EXPECT_TRUE(list_empty(&crpc->throttled_links));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_deadline_expirations);
+}
+TEST_F(homa_timer, homa_timer_check_rpc__client_deadline_passed_but_response_received)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	mock_clock = 10000;
+	crpc->deadline = 5000;
+	homa_rpc_lock(crpc);
+	homa_timer_check_rpc(crpc);
+	homa_rpc_unlock(crpc);
+	EXPECT_EQ(0, crpc->error);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->rpc_deadline_expirations);
+}
+TEST_F(homa_timer, homa_timer_check_rpc__server_deadline_passed)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 20000);
+
+	ASSERT_NE(NULL, srpc);
+	mock_clock = 10000;
+	srpc->deadline = 5000;
+	unit_log_clear();
+	homa_rpc_lock(srpc);
+	homa_timer_check_rpc(srpc);
+	homa_rpc_unlock(srpc);
+	EXPECT_EQ(RPC_DEAD, srpc->state);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_deadline_expirations);
+}
 TEST_F(homa_timer, homa_timer_check_rpc__request_ack)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include "homa_impl.h"
+#include "homa_grant.h"
 #include "homa_peer.h"
 #include "homa_sock.h"
 #define KSELFTEST_NOT_MAIN 1
@@ -131,6 +132,20 @@ TEST_F(homa_utils, homa_init__homa_skb_init_failure)
 		      mock_printk_output);
 	homa_destroy(&homa2);
 }
+TEST_F(homa_utils, homa_init__prio_counts_alloc_failure)
+{
+	struct homa homa2;
+
+	/* homa_skb_init allocates 2 page pools (mock_numa_mask is 5) and
+	 * a shrinker.
+	 */
+	mock_kmalloc_errors = 0x100;
+	EXPECT_EQ(ENOMEM, -homa_init(&homa2));
+	EXPECT_SUBSTR("homa_init couldn't allocate prio_counts",
+		      mock_printk_output);
+	EXPECT_EQ(NULL, homa2.prio_counts);
+	homa_destroy(&homa2);
+}
 #endif /* See strip.py */
 
 TEST_F(homa_utils, homa_destroy)
@@ -181,6 +196,25 @@ TEST_F(homa_utils, homa_net_destroy__delete_peers)
 	homa_net_destroy(hnet);
 	EXPECT_EQ(1, unit_count_peers(&self->homa));
 }
+#ifndef __STRIP__ /* See strip.py */
+TEST_F(homa_utils, homa_net_init_and_destroy__udp_tunnel)
+{
+	struct homa_net *hnet;
+
+	self->homa.udp_encap_port = 4000;
+	unit_log_clear();
+	hnet = mock_alloc_hnet(&self->homa);
+	EXPECT_EQ(4000, hnet->udp_port);
+	EXPECT_SUBSTR("udp_sock_create family 2 port 4000", unit_log_get());
+
+	unit_log_clear();
+	homa_net_destroy(hnet);
+	EXPECT_STREQ("udp_tunnel_sock_release family 2; "
+		     "udp_tunnel_sock_release family 10; "
+		     "unregister_net_sysctl_table", unit_log_get());
+	EXPECT_EQ(NULL, hnet->udp4_sock);
+}
+#endif /* See strip.py */
 
 #ifndef __STRIP__ /* See strip.py */
 TEST_F(homa_utils, homa_print_ipv4_addr)
@@ -248,6 +282,13 @@ TEST_F(homa_utils, homa_prios_changed__num_priorities_too_large)
 	homa_prios_changed(&self->homa);
 	EXPECT_EQ(8, self->homa.num_priorities);
 }
+TEST_F(homa_utils, homa_prios_changed__clamp_urgent_prio)
+{
+	EXPECT_EQ(HOMA_MAX_PRIORITIES - 1, self->homa.pacer->urgent_prio);
+	self->homa.num_priorities = 3;
+	homa_prios_changed(&self->homa);
+	EXPECT_EQ(2, self->homa.pacer->urgent_prio);
+}
 TEST_F(homa_utils, homa_prios_changed__share_lowest_priority)
 {
 	set_cutoffs(&self->homa, 90, 80, 70, 60, 50, 40, 30, 0);
@@ -258,4 +299,91 @@ TEST_F(homa_utils, homa_prios_changed__share_lowest_priority)
 	EXPECT_EQ(0x7fffffff, self->homa.unsched_cutoffs[0]);
 	EXPECT_EQ(0, self->homa.max_sched_prio);
 }
+
+TEST_F(homa_utils, homa_prio_count_msg)
+{
+	homa_prio_count_msg(&self->homa, 1000, 5000);
+	mock_set_core(2);
+	homa_prio_count_msg(&self->homa, 100000, 40000);
+	homa_prio_count_msg(&self->homa, 0, 0);
+	EXPECT_EQ(1000, per_cpu_ptr(self->homa.prio_counts, 1)
+			->unsched_hist[9]);
+	EXPECT_EQ(40000, per_cpu_ptr(self->homa.prio_counts, 2)
+			->unsched_hist[16]);
+	EXPECT_EQ(60000, per_cpu_ptr(self->homa.prio_counts, 2)->sched_bytes);
+}
+TEST_F(homa_utils, homa_prio_adapt__not_enough_data)
+{
+	homa_prio_count_msg(&self->homa, 100000, 100000);
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(3, self->homa.max_sched_prio);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+	EXPECT_EQ(0, self->homa.prio_consumed.unsched_hist[16]);
+}
+TEST_F(homa_utils, homa_prio_adapt__add_unsched_level)
+{
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[6] += 500000;
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[10] += 500000;
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[14] += 500000;
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[17] += 500000;
+	per_cpu_ptr(self->homa.prio_counts, 4)->sched_bytes += 1000000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(127, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(2047, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(32767, self->homa.unsched_cutoffs[5]);
+	EXPECT_EQ(262143, self->homa.unsched_cutoffs[4]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, self->homa.unsched_cutoffs[3]);
+	EXPECT_EQ(0, self->homa.unsched_cutoffs[2]);
+	EXPECT_EQ(2, self->homa.max_sched_prio);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->prio_adapt_changes);
+	EXPECT_EQ(500000, self->homa.prio_consumed.unsched_hist[6]);
+	EXPECT_EQ(1000000, self->homa.prio_consumed.sched_bytes);
+}
+TEST_F(homa_utils, homa_prio_adapt__remove_unsched_level)
+{
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[8] += 200000;
+	per_cpu_ptr(self->homa.prio_counts, 4)->sched_bytes += 1800000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(511, self->homa.unsched_cutoffs[7]);
+	EXPECT_EQ(1023, self->homa.unsched_cutoffs[6]);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, self->homa.unsched_cutoffs[5]);
+	EXPECT_EQ(4, self->homa.max_sched_prio);
+}
+TEST_F(homa_utils, homa_prio_adapt__hysteresis)
+{
+	/* Ideal split is 3.7 unscheduled levels: stay at 4. */
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[8] += 925000;
+	per_cpu_ptr(self->homa.prio_counts, 4)->sched_bytes += 1075000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(3, self->homa.max_sched_prio);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+	EXPECT_EQ(925000, self->homa.prio_consumed.unsched_hist[8]);
+
+	/* Ideal split is 3.2 unscheduled levels: move to 3. */
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[8] += 800000;
+	per_cpu_ptr(self->homa.prio_counts, 4)->sched_bytes += 1200000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(4, self->homa.max_sched_prio);
+	EXPECT_EQ(1, self->homa.cutoff_version);
+}
+TEST_F(homa_utils, homa_prio_adapt__grant_contention)
+{
+	self->homa.max_sched_prio = 0;
+	self->homa.grant->num_active_rpcs = 6;
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[8] += 2000000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(3, self->homa.max_sched_prio);
+	EXPECT_EQ(HOMA_MAX_MESSAGE_LENGTH, self->homa.unsched_cutoffs[4]);
+}
+TEST_F(homa_utils, homa_prio_adapt__too_few_priorities)
+{
+	self->homa.num_priorities = 1;
+	per_cpu_ptr(self->homa.prio_counts, 3)->unsched_hist[8] += 2000000;
+	homa_prio_adapt(&self->homa);
+	EXPECT_EQ(0, self->homa.cutoff_version);
+	EXPECT_EQ(2000000, per_cpu_ptr(self->homa.prio_counts, 3)
+			->unsched_hist[8]);
+	EXPECT_EQ(0, self->homa.prio_consumed.unsched_hist[8]);
+}
 #endif /* See strip.py */
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -35,6 +37,7 @@
 #include <deque>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <random>
@@ -73,6 +76,13 @@ const char *workload = "100";
 int unloaded = 0;
 bool client_iovec = false;
 bool server_iovec = false;
+bool client_verify = false;
+bool server_verify = false;
+bool tcp_epollet = false;
+bool tcp_zerocopy = false;
+int tcp_busy_poll = 0;
+std::string service_spec;
+int service_mem_kb = 0;
 int inet_family = AF_INET;
 int server_core = -1;
 int buf_bpages = 1000;
@@ -201,6 +211,13 @@ std::vector<uint64_t> last_server_bytes_in;
  */
 std::vector<uint64_t> last_server_bytes_out;
 
+/**
+ * @last_server_service: entries correspond to @experiments; total rdtsc
+ * cycles spent emulating service times for that experiment as of the last
+ * time we printed statistics.
+ */
+std::vector<uint64_t> last_server_service;
+
 /**
  * @last_per_server_rpcs: server->requests for each individual server,
  * as of the last time we printed statistics.
@@ -272,9 +289,13 @@ void print_help(const char *name)
 	printf("    --buf-bpages      Number of bpages to allocate in the buffer poool for\n"
 		"                      incoming messages (default: %d)\n",
 			buf_bpages);
+	printf("    --busy-poll       For TCP, set SO_BUSY_POLL on each connection to this\n"
+		"                      many microseconds (default: 0, meaning don't set)\n");
 	printf("    --client-max      Maximum number of outstanding requests from a single\n"
 		"                      client machine (divided equally among client ports)\n"
 		"                      (default: %d)\n", client_max);
+	printf("    --epollet         For TCP, always use edge-triggered epoll (by default\n"
+		"                      it is used only with multiple receiving threads)\n");
 	printf("    --exp             Name of the experiment in which these client threads\n");
 	printf("                      will be participating; used to label measurement data\n");
 	printf("                      (defaults to <protocol>_<workload>)\n");
@@ -309,9 +330,12 @@ void print_help(const char *name)
 	printf("    --unloaded        Nonzero means run test in special mode for collecting\n"
 		"                      baseline data, with the given number of measurements\n"
 		"                      per length in the distribution (Homa only, default: 0)\n");
+	printf("    --verify          Fill requests with verifiable data and check the\n"
+		"                      contents of every response (Homa only)\n");
 	printf("    --workload        Name of distribution for request lengths (e.g., 'w1')\n"
-		"                      or integer for fixed length (default: %s)\n\n",
+		"                      or integer for fixed length (default: %s)\n",
 			workload);
+	printf("    --zerocopy        For TCP, transmit message data with MSG_ZEROCOPY\n\n");
 	printf("debug value value ... Set one or more int64_t values that may be used for\n"
 		"                      various debugging purposes\n\n");
 	printf("dump_times file [exp] Log RTT times (and lengths) for clients running\n");
@@ -329,6 +353,10 @@ void print_help(const char *name)
 	printf("    --buf-bpages      Number of bpages to allocate in the buffer poool for\n"
 		"                      incoming messages (default: %d)\n",
 			buf_bpages);
+	printf("    --busy-poll       For TCP, set SO_BUSY_POLL on each connection to this\n"
+		"                      many microseconds (default: 0, meaning don't set)\n");
+	printf("    --epollet         Ignored (servers always use edge-triggered epoll);\n"
+		"                      allows clients and servers to share TCP options\n");
 	printf("    --exp             Name of the experiment in which these server ports\n");
 	printf("                      will be participating; used to label measurement data\n");
 	printf("                      (defaults to <protocol>_<workload>)\n");
@@ -343,8 +371,21 @@ void print_help(const char *name)
 	printf("    --port-threads    Number of server threads to service each port\n"
 		"                      (Homa only, default: %d)\n",
 			port_threads);
-	printf("    --ports           Number of ports to listen on (default: %d)\n\n",
+	printf("    --ports           Number of ports to listen on (default: %d)\n",
 			server_ports);
+	printf("    --service         Emulate CPU work before responding to each request;\n"
+		"                      comma-separated list of request classes, each\n"
+		"                      <dist>[@<max_length>], where <dist> is <usecs>,\n"
+		"                      exp:<mean>, uniform:<min>:<max>, or file:<path>\n"
+		"                      (service times, optionally followed by cumulative\n"
+		"                      fractions); the first class whose max_length is at\n"
+		"                      least the request length is used (default: none)\n");
+	printf("    --service-mem     If nonzero, service time is spent touching a\n"
+		"                      per-thread buffer with this many Kbytes instead\n"
+		"                      of spinning (default: 0)\n");
+	printf("    --verify          Check the contents of every request (requires\n"
+		"                      clients to use --verify; Homa only)\n");
+	printf("    --zerocopy        For TCP, transmit message data with MSG_ZEROCOPY\n\n");
 	printf("stop [options]        Stop existing client and/or server threads; each\n"
 		"                      option must be either 'clients' or 'servers'\n\n");
 	printf(" tt [options]         Manage time tracing:\n");
@@ -506,6 +547,44 @@ struct message_header {
 	uint32_t msg_id;
 };
 
+/**
+ * verify_message() - Check that the contents of an incoming Homa message
+ * following its message_header are what seed_buffer would have produced
+ * (used for --verify). Logs a message if the contents are incorrect.
+ * @receiver:   Holds the message to check.
+ * @what:       Describes the message in log messages (e.g. "request").
+ * Return:      True if the message contents are correct, false otherwise.
+ */
+bool verify_message(homa::receiver *receiver, const char *what)
+{
+	size_t length = receiver->length();
+	size_t offset = sizeof(message_header);
+	uint32_t expected;
+	int storage;
+
+	if (length < offset + sizeof(int))
+		return true;
+	expected = *receiver->get<int>(offset, &storage);
+	while (offset + sizeof(int) <= length) {
+		const int *ints = receiver->get<int>(offset);
+		size_t count = receiver->contiguous(offset)/sizeof(int);
+		size_t bad = check_ints(ints, count, expected);
+
+		if (bad < count) {
+			log(NORMAL, "ERROR: corrupted data in Homa %s (id %lu, "
+					"length %lu) at offset %lu: expected "
+					"0x%08x, got 0x%08x\n", what,
+					receiver->id(), length,
+					offset + bad*sizeof(int),
+					expected + (uint32_t) bad, ints[bad]);
+			return false;
+		}
+		expected += count;
+		offset += count*sizeof(int);
+	}
+	return true;
+}
+
 /**
  * class spin_lock - Implements simple spin lock guards: lock is acquired by
  * constructor, released by destructor.
@@ -549,8 +628,10 @@ public:
 			sockaddr_in_union peer);
 	size_t pending();
 	int read(bool loop, std::function<void (message_header *header)> func);
+	void reap_zerocopy();
 	bool send_message(message_header *header);
 	void set_epoll_events(int epoll_fd, uint32_t events);
+	void set_options(bool zerocopy, int busy_poll);
 	bool xmit();
 
 	/** @fd: File descriptor to use for reading and writing data. */
@@ -606,6 +687,26 @@ public:
 	 */
 	uint32_t epoll_events;
 
+	/**
+	 * @zerocopy: True means message data (but not headers) is
+	 * transmitted with MSG_ZEROCOPY.
+	 */
+	bool zerocopy;
+
+	/**
+	 * @zerocopy_pending: Number of MSG_ZEROCOPY sends whose completion
+	 * notifications haven't yet been read from the socket's error
+	 * queue (approximate, since notifications can be read by a
+	 * receiving thread).
+	 */
+	std::atomic<int> zerocopy_pending;
+
+	/**
+	 * @zerocopy_copied: True means the kernel has reported that it
+	 * copied data for a MSG_ZEROCOPY send (we only log this once).
+	 */
+	bool zerocopy_copied;
+
 	/**
 	 * @error_message: holds human-readable error information after
 	 * an error.
@@ -613,6 +714,13 @@ public:
 	char error_message[200];
 };
 
+/**
+ * @zerocopy_buffer: Source of message data for MSG_ZEROCOPY sends. The
+ * contents are never modified, so there is no need to wait for
+ * completions before reusing it.
+ */
+static char zerocopy_buffer[HOMA_MAX_MESSAGE_LENGTH];
+
 /**
  * tcp_connection:: tcp_connection() - Constructor for tcp_connection objects.
  * @fd:        File descriptor from which to read data.
@@ -632,6 +740,9 @@ tcp_connection::tcp_connection(int fd, uint32_t epoll_id, int port,
         , outgoing()
         , bytes_sent(0)
         , epoll_events(0)
+        , zerocopy(false)
+        , zerocopy_pending(0)
+        , zerocopy_copied(false)
 {
 }
 
@@ -785,6 +896,52 @@ int tcp_connection::read(bool loop,
 	}
 }
 
+/**
+ * tcp_connection::reap_zerocopy() - Read all of the available completion
+ * notifications for MSG_ZEROCOPY sends from the socket's error queue (if
+ * they aren't read, the socket eventually runs out of option memory and
+ * MSG_ZEROCOPY sends fail).
+ */
+void tcp_connection::reap_zerocopy()
+{
+	char control[100];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	if (!zerocopy)
+		return;
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+			return;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+				cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr;
+
+			if (!((cm->cmsg_level == SOL_IP)
+					&& (cm->cmsg_type == IP_RECVERR))
+					&& !((cm->cmsg_level == SOL_IPV6)
+					&& (cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = reinterpret_cast<struct sock_extended_err *>(
+					CMSG_DATA(cm));
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			zerocopy_pending -= serr->ee_data - serr->ee_info + 1;
+			if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					&& !zerocopy_copied) {
+				zerocopy_copied = true;
+				log(NORMAL, "WARNING: kernel copied MSG_ZEROCOPY "
+						"data for TCP connection to %s "
+						"(port %d)\n",
+						print_address(&peer), port);
+			}
+		}
+	}
+}
+
 /**
  * tcp_connection::set_epoll_events() - Convenience method to set events
  * for epolling on this connection.
@@ -809,6 +966,40 @@ void tcp_connection::set_epoll_events(int epoll_fd, uint32_t events)
 	epoll_events = events;
 }
 
+/**
+ * tcp_connection::set_options() - Configure the socket for this connection
+ * according to the TCP options selected on the command line.
+ * @zerocopy:   True means transmit message data with MSG_ZEROCOPY.
+ * @busy_poll:  If nonzero, set SO_BUSY_POLL for the socket to this many
+ *              microseconds.
+ */
+void tcp_connection::set_options(bool zerocopy, int busy_poll)
+{
+	int one = 1;
+
+	if (busy_poll != 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+				sizeof(busy_poll)) != 0)
+			log(NORMAL, "ERROR: couldn't set SO_BUSY_POLL for "
+					"TCP connection to %s: %s\n",
+					print_address(&peer), strerror(errno));
+
+		/* Not available in older kernels; ignore errors. */
+		setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+				sizeof(one));
+	}
+	if (zerocopy) {
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+				sizeof(one)) != 0)
+			log(NORMAL, "ERROR: couldn't set SO_ZEROCOPY for "
+					"TCP connection to %s (will copy "
+					"instead): %s\n",
+					print_address(&peer), strerror(errno));
+		else
+			this->zerocopy = true;
+	}
+}
+
 /**
  * tcp_connection::send_message() - Begin the process of sending a message
  * to a peer; the message may not be completely transmitted at the time this
@@ -841,25 +1032,53 @@ bool tcp_connection::xmit()
 {
 	char buffer[100000];
 	struct message_header *header;
-	int start;
-	int send_length;
+	int send_length, limit, flags;
 	ssize_t result;
+	char *data;
 
 	while (true) {
 		if (outgoing.size() == 0)
 			return true;
 		header = &outgoing[0];
+		flags = MSG_NOSIGNAL|MSG_DONTWAIT;
+		send_length = header->length - bytes_sent;
 		if (bytes_sent < sizeof32(*header)) {
 			*(reinterpret_cast<message_header *>(buffer))
 					= *header;
-			start = bytes_sent;
-		} else
-			start = 0;
-		send_length = header->length - bytes_sent;
-		if (send_length > (sizeof32(buffer) - start))
-			send_length = sizeof32(buffer) - start;
-		result = send(fd, buffer + start, send_length,
-				MSG_NOSIGNAL|MSG_DONTWAIT);
+			data = buffer + bytes_sent;
+			limit = sizeof32(buffer) - bytes_sent;
+			if (zerocopy && (send_length > sizeof32(*header)
+					- bytes_sent)) {
+				/* Copy the header by itself, so that
+				 * MSG_ZEROCOPY is only used for
+				 * zerocopy_buffer, which never changes.
+				 */
+				send_length = sizeof32(*header) - bytes_sent;
+				flags |= MSG_MORE;
+			}
+		} else if (zerocopy) {
+			data = zerocopy_buffer;
+			limit = sizeof32(zerocopy_buffer);
+			flags |= MSG_ZEROCOPY;
+		} else {
+			data = buffer;
+			limit = sizeof32(buffer);
+		}
+		if (send_length > limit)
+			send_length = limit;
+		result = send(fd, data, send_length, flags);
+		if ((result < 0) && (errno == ENOBUFS)
+				&& (flags & MSG_ZEROCOPY)) {
+			/* Unread completions have used up the socket's
+			 * option memory; reap them and copy this chunk.
+			 */
+			reap_zerocopy();
+			result = send(fd, data, send_length,
+					flags & ~MSG_ZEROCOPY);
+		} else if ((result >= 0) && (flags & MSG_ZEROCOPY)) {
+			if (++zerocopy_pending >= 64)
+				reap_zerocopy();
+		}
 		if (result >= 0)
 			bytes_sent += result;
 		else {
@@ -914,8 +1133,15 @@ public:
 	 */
 	uint64_t bytes_out;
 
+	/**
+	 * @service_cycles: Total rdtsc cycles spent emulating service
+	 * times for requests (see --service).
+	 */
+	uint64_t service_cycles;
+
 	server_metrics(std::string& experiment) : experiment(experiment),
-			requests(0), bytes_in(0), bytes_out(0) {}
+			requests(0), bytes_in(0), bytes_out(0),
+			service_cycles(0) {}
 };
 
 /**
@@ -925,6 +1151,363 @@ public:
  */
 std::vector<server_metrics *> metrics;
 
+/**
+ * class service_model - Describes how much CPU work a server should do
+ * for each request before responding (by default servers respond
+ * immediately). The model consists of one or more request classes, each
+ * selected by request length and each with its own distribution of
+ * service times. A service_model is immutable once constructed, so it
+ * can be shared by all of the threads of a server.
+ */
+class service_model {
+public:
+	service_model();
+	bool parse(const std::string &spec);
+	uint64_t service_cycles(int length, std::mt19937 &rand_gen) const;
+
+	/**
+	 * enum kind - Identifies the distribution used for a request class.
+	 * FIXED:       Every request takes @param1 usecs.
+	 * EXPONENTIAL: Exponential distribution with mean @param1 usecs.
+	 * UNIFORM:     Uniform distribution between @param1 and @param2
+	 *              usecs.
+	 * SAMPLES:     Service times are drawn from @samples.
+	 */
+	enum kind {FIXED, EXPONENTIAL, UNIFORM, SAMPLES};
+
+	/**
+	 * struct request_class - Service time distribution for requests
+	 * within a range of lengths.
+	 */
+	struct request_class {
+		/**
+		 * @max_length: This class applies to requests with this
+		 * many bytes or fewer (that aren't matched by an earlier
+		 * class). -1 means no limit.
+		 */
+		int max_length;
+
+		/** @kind: Type of distribution. */
+		enum kind kind;
+
+		/** @param1: First parameter for @kind, in usecs. */
+		double param1;
+
+		/** @param2: Second parameter for @kind, in usecs. */
+		double param2;
+
+		/**
+		 * @samples: For SAMPLES, a CDF in the form of pairs
+		 * <cumulative fraction, usecs>, in increasing order.
+		 */
+		std::vector<std::pair<double, double>> samples;
+	};
+
+	/** @classes: All of the request classes, in order of matching. */
+	std::vector<request_class> classes;
+
+	/**
+	 * @touch_memory: True means service time is spent touching cache
+	 * lines in a per-thread buffer; false means it is spent spinning.
+	 */
+	bool touch_memory;
+
+	/** @mem_bytes: Size of each thread's buffer if @touch_memory. */
+	size_t mem_bytes;
+
+	/** @cycles_per_usec: Cached value of get_cycles_per_sec()/1e06. */
+	double cycles_per_usec;
+
+private:
+	bool read_samples(const char *file, request_class *rc);
+};
+
+/**
+ * service_model::service_model() - Constructor for service_models;
+ * the new model has no request classes, so all requests are serviced
+ * immediately.
+ */
+service_model::service_model()
+	: classes()
+	, touch_memory(false)
+	, mem_bytes(0)
+	, cycles_per_usec(get_cycles_per_sec()*1e-06)
+{
+}
+
+/**
+ * service_model::parse() - Add request classes to a model, based on a
+ * textual description.
+ * @spec:    Comma-separated list of request classes. Each class has the
+ *           form <dist>[@<max_length>], where <dist> is <usecs> (fixed
+ *           service time), exp:<mean>, uniform:<min>:<max>, or
+ *           file:<path>; <max_length> limits the class to requests with
+ *           no more than that many bytes. Classes are matched in order;
+ *           requests that match no class get no service time.
+ * Return:   True for success, false if @spec was malformed (a message will
+ *           have been printed).
+ */
+bool service_model::parse(const std::string &spec)
+{
+	size_t start = 0;
+
+	while (start < spec.size()) {
+		size_t end = spec.find(',', start);
+		if (end == std::string::npos)
+			end = spec.size();
+		std::string item = spec.substr(start, end - start);
+		request_class rc;
+		char *after;
+
+		start = end + 1;
+		rc.max_length = -1;
+		rc.param1 = rc.param2 = 0.0;
+		size_t at = item.rfind('@');
+		if (at != std::string::npos) {
+			rc.max_length = strtol(item.c_str() + at + 1, &after,
+					10);
+			if ((*after != 0) || (after == item.c_str() + at + 1)
+					|| (rc.max_length < 0)) {
+				printf("Bad request length in service class "
+						"'%s'\n", item.c_str());
+				return false;
+			}
+			item.resize(at);
+		}
+		const char *dist = item.c_str();
+		if (strncmp(dist, "file:", 5) == 0) {
+			rc.kind = SAMPLES;
+			if (!read_samples(dist + 5, &rc))
+				return false;
+		} else {
+			if (strncmp(dist, "exp:", 4) == 0) {
+				rc.kind = EXPONENTIAL;
+				dist += 4;
+			} else if (strncmp(dist, "uniform:", 8) == 0) {
+				rc.kind = UNIFORM;
+				dist += 8;
+			} else
+				rc.kind = FIXED;
+			rc.param1 = strtod(dist, &after);
+			if ((rc.kind == UNIFORM) && (*after == ':'))
+				rc.param2 = strtod(after + 1, &after);
+			else if (rc.kind == UNIFORM)
+				after = (char *) "?";
+			if ((*after != 0) || (rc.param1 < 0)
+					|| (rc.param2 < 0)) {
+				printf("Bad service time distribution '%s' "
+						"(must be <usecs>, exp:<mean>, "
+						"uniform:<min>:<max>, or "
+						"file:<path>)\n", item.c_str());
+				return false;
+			}
+		}
+		classes.push_back(std::move(rc));
+	}
+	return true;
+}
+
+/**
+ * service_model::read_samples() - Read a file of service times for a
+ * request class. Each line of the file contains either a single service
+ * time in usecs (e.g. a trace of measured service times; all lines are
+ * equally likely) or a service time followed by the cumulative fraction
+ * of requests with that service time or less (a CDF, like the workload
+ * distributions in dist.cc). Blank lines and lines starting with "#" are
+ * ignored.
+ * @file:    Name of the file to read.
+ * @rc:      Samples are stored in rc->samples.
+ * Return:   True for success, false for error (a message will have been
+ *           printed).
+ */
+bool service_model::read_samples(const char *file, request_class *rc)
+{
+	bool is_cdf = false;
+	char line[200];
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		printf("Couldn't open service time file %s: %s\n", file,
+				strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double usecs, fraction;
+		int count;
+
+		if ((line[0] == '#') || (strspn(line, " \t\r\n")
+				== strlen(line)))
+			continue;
+		count = sscanf(line, "%lf %lf", &usecs, &fraction);
+		if ((count < 1) || (usecs < 0) || (!rc->samples.empty()
+				&& ((count == 2) != is_cdf))) {
+			printf("Bad line in service time file %s: %s", file,
+					line);
+			fclose(f);
+			return false;
+		}
+		is_cdf = (count == 2);
+		rc->samples.emplace_back(is_cdf ? fraction : 0.0, usecs);
+	}
+	fclose(f);
+	if (rc->samples.empty()) {
+		printf("Service time file %s contains no samples\n", file);
+		return false;
+	}
+	if (is_cdf)
+		std::sort(rc->samples.begin(), rc->samples.end());
+	else {
+		std::sort(rc->samples.begin(), rc->samples.end(),
+				[](auto &a, auto &b) {return a.second < b.second;});
+		for (size_t i = 0; i < rc->samples.size(); i++)
+			rc->samples[i].first = (i + 1.0) / rc->samples.size();
+	}
+	return true;
+}
+
+/**
+ * service_model::service_cycles() - Choose a service time for a request.
+ * @length:    Length of the request message, in bytes.
+ * @rand_gen:  Random number generator to use (must belong to the calling
+ *             thread).
+ * Return:     Number of rdtsc cycles of work that the server should do
+ *             before responding to the request.
+ */
+uint64_t service_model::service_cycles(int length,
+		std::mt19937 &rand_gen) const
+{
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double usecs;
+
+	for (const request_class &rc: classes) {
+		if ((rc.max_length >= 0) && (length > rc.max_length))
+			continue;
+		switch (rc.kind) {
+		case FIXED:
+			usecs = rc.param1;
+			break;
+		case EXPONENTIAL:
+			usecs = -rc.param1 * log1p(-uniform(rand_gen));
+			break;
+		case UNIFORM:
+			usecs = rc.param1 + (rc.param2 - rc.param1)
+					* uniform(rand_gen);
+			break;
+		default: {
+			double fraction = uniform(rand_gen);
+			auto it = std::lower_bound(rc.samples.begin(),
+					rc.samples.end(),
+					std::make_pair(fraction, 0.0));
+			if (it == rc.samples.end())
+				it--;
+			usecs = it->second;
+			break;
+		}
+		}
+		return static_cast<uint64_t>(usecs * cycles_per_usec);
+	}
+	return 0;
+}
+
+/**
+ * class service_worker - Per-thread state used by a server thread to
+ * emulate service times from a service_model.
+ */
+class service_worker {
+public:
+	service_worker(std::shared_ptr<service_model> model, int seed);
+	~service_worker();
+	uint64_t service(int length);
+
+	/** @model: Describes service times; NULL means no service time. */
+	std::shared_ptr<service_model> model;
+
+	/** @rand_gen: Random number generator for this thread. */
+	std::mt19937 rand_gen;
+
+	/**
+	 * @mem: Buffer whose cache lines are touched to consume service
+	 * time, if model->touch_memory; otherwise NULL.
+	 */
+	uint64_t *mem;
+
+	/** @mem_index: Index in @mem of the next word to touch. */
+	size_t mem_index;
+};
+
+/**
+ * service_worker::service_worker() - Constructor for service_workers.
+ * @model:   Service times to emulate (may be NULL).
+ * @seed:    Seed for this thread's random number generator.
+ */
+service_worker::service_worker(std::shared_ptr<service_model> model,
+		int seed)
+	: model(model)
+	, rand_gen(seed)
+	, mem(NULL)
+	, mem_index(0)
+{
+	if (model && model->touch_memory) {
+		mem = new uint64_t[model->mem_bytes/sizeof(uint64_t)];
+		memset(mem, 0, model->mem_bytes);
+	}
+}
+
+service_worker::~service_worker()
+{
+	delete[] mem;
+}
+
+/**
+ * service_worker::service() - Perform the work for a single request:
+ * either spin or touch memory for a service time chosen from the model.
+ * @length:   Length of the request, in bytes.
+ * Return:    The number of rdtsc cycles actually spent.
+ */
+uint64_t service_worker::service(int length)
+{
+	uint64_t start, stop, now, cycles;
+	size_t words, i;
+
+	if (!model)
+		return 0;
+	cycles = model->service_cycles(length, rand_gen);
+	if (cycles == 0)
+		return 0;
+	start = rdtsc();
+	stop = start + cycles;
+	if (mem == NULL) {
+		do {
+			__builtin_ia32_pause();
+			now = rdtsc();
+		} while (now < stop);
+		return now - start;
+	}
+
+	/* Touch one word in each of a pseudo-random sequence of cache
+	 * lines, so that the work has a realistic cache footprint; check
+	 * the clock every 16 lines.
+	 */
+	words = model->mem_bytes/sizeof(uint64_t);
+	i = mem_index;
+	do {
+		for (int j = 0; j < 16; j++) {
+			mem[i]++;
+			i = (i + 8*2654435761UL) % words;
+		}
+		now = rdtsc();
+	} while (now < stop);
+	mem_index = i;
+	return now - start;
+}
+
+/**
+ * @server_service: service times for servers created by the most recent
+ * "server" command, or NULL if servers should respond immediately.
+ */
+std::shared_ptr<service_model> server_service;
+
 /**
  * class homa_server - Holds information about a single port used
  * to receive incoming requests, including one or more threads that
@@ -958,6 +1541,12 @@ public:
 	/** @buf_size: number of bytes available at @buf_region. */
 	size_t buf_size;
 
+	/**
+	 * @service: service times to emulate for requests, or NULL
+	 * (value of server_service when this server was created).
+	 */
+	std::shared_ptr<service_model> service;
+
 	/** @threads: One or more threads that service incoming requests*/
 	std::vector<std::thread> threads;
 };
@@ -984,6 +1573,7 @@ homa_server::homa_server(int port, int id, int inet_family, int num_threads,
 	, experiment(experiment)
         , buf_region(NULL)
         , buf_size(0)
+        , service(server_service)
         , threads()
 {
 	sockaddr_in_union addr;
@@ -1076,6 +1666,7 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 
 	snprintf(thread_name, sizeof(thread_name), "S%d.%d", id, thread_id);
 	time_trace::thread_buffer thread_buffer(thread_name);
+	service_worker worker(service, rdtsc() + thread_id);
 	if (server_core >= 0) {
 		printf("Pinning thread %s to core %d\n", thread_name,
 				server_core);
@@ -1100,6 +1691,8 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 		header = receiver.get<message_header>(0);
 		tt("Received Homa request, cid 0x%08x, id %u, length %d",
 				header->cid, header->msg_id, header->length);
+		if (server_verify)
+			verify_message(&receiver, "request");
 		if ((header->freeze) && !time_trace::frozen) {
 			tt("Freezing timetrace because of request on "
 					"cid 0x%08x", header->cid);
@@ -1108,6 +1701,7 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 			time_trace::freeze();
 			kfreeze();
 		}
+		metrics->service_cycles += worker.service(length);
 		if ((header->short_response) && (header->length > 100)) {
 			header->length = 100;
 		}
@@ -1149,7 +1743,7 @@ public:
 	tcp_server(int port, int id, int num_threads, std::string& experiment);
 	~tcp_server();
 	void accept(int epoll_fd);
-	void read(int fd, int pid);
+	void read(int fd, int pid, service_worker *worker);
 	void server(int thread_id);
 
 	/**
@@ -1198,6 +1792,24 @@ public:
 
 	/** @stop: True means that background threads should exit. */
 	bool stop;
+
+	/**
+	 * @zerocopy: True means connections should use MSG_ZEROCOPY
+	 * (value of --zerocopy when the server was created).
+	 */
+	bool zerocopy;
+
+	/**
+	 * @busy_poll: Value of --busy-poll when the server was created;
+	 * used for SO_BUSY_POLL on connections.
+	 */
+	int busy_poll;
+
+	/**
+	 * @service: service times to emulate for requests, or NULL
+	 * (value of server_service when this server was created).
+	 */
+	std::shared_ptr<service_model> service;
 };
 
 /** @tcp_servers: keeps track of all existing Homa clients. */
@@ -1224,6 +1836,9 @@ tcp_server::tcp_server(int port, int id, int num_threads,
         , metrics()
         , threads()
         , stop(false)
+        , zerocopy(tcp_zerocopy)
+        , busy_poll(tcp_busy_poll)
+        , service(server_service)
 {
 	if (std::find(experiments.begin(), experiments.end(), experiment)
 			== experiments.end())
@@ -1359,6 +1974,7 @@ void tcp_server::server(int thread_id)
 
 	snprintf(thread_name, sizeof(thread_name), "S%d.%d", id, thread_id);
 	time_trace::thread_buffer thread_buffer(thread_name);
+	service_worker worker(service, rdtsc() + thread_id);
 	int pid = syscall(__NR_gettid);
 	if (server_core >= 0) {
 		printf("Pinning thread %s to core %d\n", thread_name,
@@ -1393,9 +2009,12 @@ void tcp_server::server(int thread_id)
 				accept(epoll_fd);
 			} else {
 				spin_lock lock_guard(&fd_locks[fd]);
+				if ((events[i].events & EPOLLERR) &&
+						(connections[fd] != NULL))
+					connections[fd]->reap_zerocopy();
 				if ((events[i].events & EPOLLIN) &&
 						(connections[fd] != NULL))
-					read(fd, pid);
+					read(fd, pid, &worker);
 				if ((events[i].events & EPOLLOUT) &&
 						(connections[fd] != NULL)) {
 					if (connections[fd]->xmit())
@@ -1468,6 +2087,7 @@ void tcp_server::accept(int epoll_fd)
 	tcp_connection *connection = new tcp_connection(fd, fd, port,
 			client_addr);
 	connections[fd] = connection;
+	connection->set_options(zerocopy, busy_poll);
 	connection->set_epoll_events(epoll_fd, EPOLLIN|epollet);
 }
 
@@ -1477,11 +2097,12 @@ void tcp_server::accept(int epoll_fd)
  * @fd:        File descriptor for connection; connections must hold
  *             state information for this descriptor.
  * @pid:       Pid for the thread (for messages).
+ * @worker:    Used to emulate service times for requests.
  */
-void tcp_server::read(int fd, int pid)
+void tcp_server::read(int fd, int pid, service_worker *worker)
 {
 	int error = connections[fd]->read(epollet,
-			[this, fd, pid](message_header *header) {
+			[this, fd, pid, worker](message_header *header) {
 		metrics->requests++;
 		metrics->bytes_in += header->length;
 		tt("Received TCP request, cid 0x%08x, id %u, length %d, pid %d",
@@ -1495,6 +2116,7 @@ void tcp_server::read(int fd, int pid)
 			time_trace::freeze();
 			kfreeze();
 		}
+		metrics->service_cycles += worker->service(header->length);
 		if ((header->short_response) && (header->length > 100))
 			header->length = 100;
 		metrics->bytes_out += header->length;
@@ -2098,6 +2720,8 @@ bool homa_client::wait_response(homa::receiver *receiver, uint64_t rpc_id)
 	uint64_t end_time = rdtsc();
 	tt("Received response, cid 0x%08x, id %x, %d bytes",
 			header->cid, header->msg_id, length);
+	if (client_verify)
+		verify_message(receiver, "response");
 	record(end_time, header);
 	return true;
 }
@@ -2178,6 +2802,9 @@ void homa_client::sender()
 		header->freeze = freeze[header->cid.server];
 		header->short_response = one_way;
 		header->msg_id = slot;
+		if (client_verify)
+			seed_buffer(header + 1, header->length - sizeof(*header),
+					static_cast<int>(now));
 		tt("sending request, cid 0x%08x, id %u, length %d",
 				header->cid, header->msg_id, header->length);
 
@@ -2384,8 +3011,8 @@ public:
 	/**
 	 * @epollet: EPOLLET if this flag should be used, or 0 otherwise.
 	 * We only use edge triggering if there are multiple receiving
-	 * threads (it's unneeded if there's only a single thread, and
-	 * it's faster not to use it).
+	 * threads or --epollet was specified (it's unneeded if there's
+	 * only a single thread).
 	 */
 	int epollet;
 
@@ -2416,7 +3043,7 @@ tcp_client::tcp_client(int id, std::string& experiment)
         , bytes_rcvd(NULL)
         , backups(0)
         , epoll_fd(-1)
-	, epollet((port_receivers > 1) ? EPOLLET : 0)
+	, epollet(((port_receivers > 1) || tcp_epollet) ? EPOLLET : 0)
         , stop(false)
         , receiving_threads()
         , sending_thread()
@@ -2469,6 +3096,8 @@ tcp_client::tcp_client(int id, std::string& experiment)
 		}
 		connections.emplace_back(new tcp_connection(fd, i,
 				ntohs(addr.in4.sin_port), server_addrs[i]));
+		connections[connections.size()-1]->set_options(tcp_zerocopy,
+				tcp_busy_poll);
 		connections[connections.size()-1]->set_epoll_events(epoll_fd,
 				EPOLLIN|epollet);
 	}
@@ -2661,6 +3290,8 @@ void tcp_client::receiver(int receiver_id)
 		for (int i = 0; i < num_events; i++) {
 			int fd = events[i].data.fd;
 			tcp_connection *connection = connections[fd];
+			if (events[i].events & EPOLLERR)
+				connection->reap_zerocopy();
 			if (events[i].events & EPOLLIN) {
 				spin_lock lock_guard(&fd_locks[fd]);
 				read(connection, pid);
@@ -2704,6 +3335,7 @@ void server_stats(uint64_t now)
 	last_server_rpcs.resize(experiments.size(), 0);
 	last_server_bytes_in.resize(experiments.size(), 0);
 	last_server_bytes_out.resize(experiments.size(), 0);
+	last_server_service.resize(experiments.size(), 0);
 
 	for (size_t i = 0; i < experiments.size(); i++) {
 		std::string& exp = experiments[i];
@@ -2713,6 +3345,7 @@ void server_stats(uint64_t now)
 		uint64_t server_rpcs = 0;
 		uint64_t server_bytes_in = 0;
 		uint64_t server_bytes_out = 0;
+		uint64_t server_service_cycles = 0;
 
 		details[0] = 0;
 		for (uint32_t i = 0; i < metrics.size(); i++) {
@@ -2722,6 +3355,7 @@ void server_stats(uint64_t now)
 			server_rpcs += smetrics->requests;
 			server_bytes_in += smetrics->bytes_in;
 			server_bytes_out += smetrics->bytes_out;
+			server_service_cycles += smetrics->service_cycles;
 			length = snprintf(details + offset,
 					sizeof(details) - offset,
 					"%s%lu", (offset != 0) ? " " : "",
@@ -2748,10 +3382,20 @@ void server_stats(uint64_t now)
 					in_delta/rpcs);
 			log(NORMAL, "RPCs per %s server thread: %s\n",
 					exp.c_str(), details);
+			if (server_service_cycles != last_server_service[i]) {
+				double service = (double) (server_service_cycles
+						- last_server_service[i]);
+				log(NORMAL, "%s server service time: avg. "
+						"%.2f us per request, %.2f cores "
+						"busy\n", exp.c_str(),
+						1e06*to_seconds(service)/rpcs,
+						service/(now - last_stats_time));
+			}
 		}
 		last_server_rpcs[i] = server_rpcs;
 		last_server_bytes_in[i] = server_bytes_in;
 		last_server_bytes_out[i] = server_bytes_out;
+		last_server_service[i] = server_service_cycles;
 	}
 }
 
@@ -2932,6 +3576,10 @@ int client_cmd(std::vector<string> &words)
 	tcp_trunc = true;
 	one_way = false;
 	unloaded = 0;
+	client_verify = false;
+	tcp_busy_poll = 0;
+	tcp_epollet = false;
+	tcp_zerocopy = false;
 	workload = "100";
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
@@ -2940,11 +3588,18 @@ int client_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--busy-poll") == 0) {
+			if (!parse(words, i+1, &tcp_busy_poll, option,
+					"integer"))
+				return 0;
+			i++;
 		} else if (strcmp(option, "--client-max") == 0) {
 			if (!parse(words, i+1, (int *) &client_max,
 					option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--epollet") == 0) {
+			tcp_epollet = true;
 		} else if (strcmp(option, "--exp") == 0) {
 			if ((i + 1) >= words.size()) {
 				printf("No value provided for %s\n",
@@ -3014,6 +3669,8 @@ int client_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &unloaded, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--verify") == 0) {
+			client_verify = true;
 		} else if (strcmp(option, "--workload") == 0) {
 			if ((i + 1) >= words.size()) {
 				printf("No value provided for %s\n",
@@ -3023,6 +3680,8 @@ int client_cmd(std::vector<string> &words)
 			workload_string = words[i+1];
 			workload = workload_string.c_str();
 			i++;
+		} else if (strcmp(option, "--zerocopy") == 0) {
+			tcp_zerocopy = true;
 		} else {
 			printf("Unknown option '%s'\n", option);
 			return 0;
@@ -3285,6 +3944,11 @@ int server_cmd(std::vector<string> &words)
 	server_core = -1;
 	server_ports = 1;
 	server_iovec = false;
+	server_verify = false;
+	service_mem_kb = 0;
+	service_spec.clear();
+	tcp_busy_poll = 0;
+	tcp_zerocopy = false;
 
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
@@ -3293,6 +3957,13 @@ int server_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--busy-poll") == 0) {
+			if (!parse(words, i+1, &tcp_busy_poll, option,
+					"integer"))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--epollet") == 0) {
+			/* Servers always use EPOLLET. */
 		} else if (strcmp(option, "--exp") == 0) {
 			if ((i + 1) >= words.size()) {
 				printf("No value provided for %s\n",
@@ -3330,6 +4001,23 @@ int server_cmd(std::vector<string> &words)
 			protocol_string = words[i+1];
 			protocol = protocol_string.c_str();
 			i++;
+		} else if (strcmp(option, "--service") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			service_spec = words[i+1];
+			i++;
+		} else if (strcmp(option, "--service-mem") == 0) {
+			if (!parse(words, i+1, &service_mem_kb, option,
+					"integer"))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--verify") == 0) {
+			server_verify = true;
+		} else if (strcmp(option, "--zerocopy") == 0) {
+			tcp_zerocopy = true;
 		} else {
 			printf("Unknown option '%s'\n", option);
 			return 0;
@@ -3340,6 +4028,14 @@ int server_cmd(std::vector<string> &words)
 		experiment += "_";
 		experiment += workload;
 	}
+	server_service.reset();
+	if (!service_spec.empty()) {
+		server_service = std::make_shared<service_model>();
+		if (!server_service->parse(service_spec))
+			return 0;
+		server_service->touch_memory = (service_mem_kb > 0);
+		server_service->mem_bytes = 1024*(size_t) service_mem_kb;
+	}
 
 	if (strcmp(protocol, "homa") == 0) {
 		if (first_port == -1)
@@ -274,6 +274,11 @@ def get_parser(description, usage, defaults = {}):
             metavar='count', default=defaults['server_ports'],
             help='Number of ports on which each server should listen '
             '(default: %d)'% (defaults['server_ports']))
+    parser.add_argument('--service', dest='service', default='',
+            metavar='classes', help='Service times for servers to emulate '
+            'before responding to each request (passed to the --service '
+            'option of cp_node server, such as "exp:20" or '
+            '"5@1000,file:times.txt"; default: respond immediately)')
     parser.add_argument('--set-ids', dest='set_ids', type=boolean,
             default=True, metavar="T/F", help="Boolean value: if true, the "
             "next_id sysctl parameter will be set on each node in order to "
@@ -296,6 +301,10 @@ def get_parser(description, usage, defaults = {}):
             metavar='count', default=defaults['tcp_client_ports'],
             help='Number of ports on which each TCP client should issue requests '
             '(default: %d)'% (defaults['tcp_client_ports']))
+    parser.add_argument('--tcp-options', dest='tcp_options', default='',
+            metavar='opts', help='Additional options to pass to cp_node for '
+            'TCP clients and servers, such as "--zerocopy --busy-poll 50" '
+            '(default: none)')
     parser.add_argument('--tcp-port-receivers', type=int,
             dest='tcp_port_receivers', metavar='count',
             default=defaults['tcp_port_receivers'],
@@ -645,14 +654,18 @@ def start_servers(exp, ids, options):
         do_cmd("stop servers", server_nodes)
         server_nodes = []
     start_nodes(ids, options)
+    service = ""
+    if options.service:
+        service = "--service %s" % (options.service)
     if options.protocol == "homa":
-        do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s"
+        do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s %s"
                % (options.server_ports, options.port_threads,
-                options.protocol, exp, options.ipv6), ids)
+                options.protocol, exp, options.ipv6, service), ids)
     else:
-        do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s"
+        do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s %s %s"
                % (options.tcp_server_ports, options.tcp_port_threads,
-                options.protocol, exp, options.ipv6), ids)
+                options.protocol, exp, options.ipv6, options.tcp_options,
+                service), ids)
     server_nodes = ids
     if options.debug:
         input("Pausing for debug setup, type <Enter> to continue: ")
@@ -713,7 +726,7 @@ def run_experiment(name, clients, options):
                 client_max = options.client_max
             command = "client --ports %d --port-receivers %d --server-ports %d " \
                     "--workload %s --servers %s --gbps %.3f %s --client-max %d " \
-                    "--protocol %s --id %d --exp %s %s" % (
+                    "--protocol %s --id %d --exp %s %s %s" % (
                     options.tcp_client_ports,
                     options.tcp_port_receivers,
                     options.tcp_server_ports,
@@ -725,7 +738,8 @@ def run_experiment(name, clients, options):
                     options.protocol,
                     id,
                     name,
-                    options.ipv6)
+                    options.ipv6,
+                    options.tcp_options)
         active_nodes[id].stdin.write(command + "\n")
         try:
             active_nodes[id].stdin.flush()
@@ -824,6 +838,7 @@ def run_experiments(*args):
              tcp_client_max (or client_max)
              tcp_client_ports
              tcp_server_ports
+             tcp_options
 
              There may be additional optional values that used if present.
     """
@@ -856,16 +871,20 @@ def run_experiments(*args):
             log("Starting servers for %s experiment on nodes %s" % (exp.name,
                     exp.servers))
             start_nodes(exp.servers, exp)
+            service = ""
+            if "service" in exp and exp.service:
+                service = "--service %s" % (exp.service)
             if exp.protocol == "homa":
                 do_cmd("server --ports %d --port-threads %d --protocol homa "
-                       "--exp %s %s"
+                       "--exp %s %s %s"
                         % (exp.server_ports, exp.port_threads,
-                        exp.name, exp.ipv6), exp.servers)
+                        exp.name, exp.ipv6, service), exp.servers)
             else:
                 do_cmd("server --ports %d --port-threads %d --protocol tcp "
-                       "--exp %s %s"
+                       "--exp %s %s %s %s"
                         % (exp.tcp_server_ports, exp.tcp_port_threads,
-                        exp.name, exp.ipv6), exp.servers)
+                        exp.name, exp.ipv6, exp.tcp_options, service),
+                        exp.servers)
 
     # Start clients for all experiments
     for exp in args:
@@ -893,7 +912,7 @@ def run_experiments(*args):
                     client_max = exp.client_max
                 command = "client --ports %d --port-receivers %d --server-ports %d " \
                         "--workload %s --servers %s --gbps %.3f --client-max %d " \
-                        "--protocol tcp --id %d --exp %s %s" % (
+                        "--protocol tcp --id %d --exp %s %s %s" % (
                         exp.tcp_client_ports,
                         exp.tcp_port_receivers,
                         exp.tcp_server_ports,
@@ -903,7 +922,8 @@ def run_experiments(*args):
                         client_max,
                         id,
                         exp.name,
-                        exp.ipv6)
+                        exp.ipv6,
+                        exp.tcp_options)
             active_nodes[id].stdin.write(command + "\n")
             try:
                 active_nodes[id].stdin.flush()
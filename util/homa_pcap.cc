@@ -0,0 +1,1221 @@
+/* Copyright (c) 2026 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This file contains a program that reads packet captures (in pcap format)
+ * containing Homa traffic and reconstructs the timeline of each RPC: when
+ * its messages started and completed, how many bytes were sent unscheduled
+ * and scheduled, how quickly grants were issued and acted upon, and how
+ * much time was spent recovering lost packets. It also reports how
+ * heavily each priority level was used. The output is organized into
+ * sections in the same style as tthoma.py, and --data generates files
+ * with one line per RPC for plotting. Type "homa_pcap --help" for
+ * information about command-line arguments.
+ *
+ * The capture files are mapped into memory and headers are parsed in
+ * place, so large captures (e.g. from switch port mirrors) can be
+ * processed at close to disk bandwidth. The capture should be taken
+ * on the wire (or with TSO/GRO disabled on the capturing host):
+ * segmentation-offload packets containing multiple segments are treated
+ * as a single packet.
+ */
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "test_utils.h"
+
+/* The following definitions mirror the wire format in homa_wire.h (which
+ * can't be included here because it depends on kernel headers). They
+ * must be kept in sync with that file.
+ */
+enum homa_packet_type {
+	DATA               = 0x10,
+	GRANT              = 0x11,
+	RESEND             = 0x12,
+	RPC_UNKNOWN        = 0x13,
+	BUSY               = 0x14,
+	CUTOFFS            = 0x15,
+	FREEZE             = 0x16,
+	NEED_ACK           = 0x17,
+	ACK                = 0x18,
+	MAX_OP             = 0x18,
+};
+
+#define HOMA_ETH_OVERHEAD 42
+#define HOMA_MAX_PRIORITIES 8
+#define HOMA_TCP_FLAGS 6
+#define HOMA_TCP_URGENT 0xb97d
+
+struct homa_common_hdr {
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t sequence;
+	char ack[3];
+	uint8_t type;
+	uint8_t doff;
+	uint8_t flags;
+	uint16_t window;
+	uint16_t checksum;
+	uint16_t urgent;
+	uint64_t sender_id;
+} __attribute__((packed));
+
+struct homa_ack {
+	uint64_t client_id;
+	uint16_t server_port;
+} __attribute__((packed));
+
+struct homa_seg_hdr {
+	uint32_t offset;
+} __attribute__((packed));
+
+struct homa_data_hdr {
+	struct homa_common_hdr common;
+	uint32_t message_length;
+	uint32_t incoming;
+	struct homa_ack ack;
+	uint16_t cutoff_version;
+	uint8_t retransmit;
+	uint8_t deadline_us[3];
+	struct homa_seg_hdr seg;
+} __attribute__((packed));
+
+struct homa_grant_hdr {
+	struct homa_common_hdr common;
+	uint32_t offset;
+	uint8_t priority;
+	uint8_t resend_all;
+} __attribute__((packed));
+
+struct homa_resend_hdr {
+	struct homa_common_hdr common;
+	uint32_t offset;
+	uint32_t length;
+	uint8_t priority;
+} __attribute__((packed));
+
+/* Definitions for the pcap file format. */
+#define PCAP_MAGIC_USECS  0xa1b2c3d4
+#define PCAP_MAGIC_NSECS  0xa1b23c4d
+#define PCAPNG_MAGIC      0x0a0d0d0a
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW      101
+#define LINKTYPE_SLL      113
+#define LINKTYPE_SLL2     276
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __attribute__((packed));
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} __attribute__((packed));
+
+/* Values of command-line arguments (and their default values): */
+
+const char *data_dir = NULL;
+uint64_t rpc_filter = 0;
+int num_rpcs = 10;
+int udp_port = 0;
+
+/**
+ * struct addr - An IP address; IPv4 addresses are stored in IPv4-mapped
+ * IPv6 form.
+ */
+struct addr {
+	uint8_t bytes[16];
+
+	bool operator==(const addr &other) const
+	{
+		return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+	}
+};
+
+/**
+ * struct rpc_key - Uniquely identifies an RPC within a capture: the
+ * client's address plus the client's id for the RPC.
+ */
+struct rpc_key {
+	struct addr client;
+	uint64_t id;
+
+	bool operator==(const rpc_key &other) const
+	{
+		return (id == other.id) && (client == other.client);
+	}
+};
+
+struct rpc_key_hash {
+	size_t operator()(const rpc_key &key) const
+	{
+		uint64_t h = key.id * 0x9e3779b97f4a7c15ULL;
+		uint64_t a, b;
+
+		memcpy(&a, key.client.bytes, 8);
+		memcpy(&b, key.client.bytes + 8, 8);
+		return h ^ (a * 0xff51afd7ed558ccdULL) ^ (b >> 7) ^ (b << 29);
+	}
+};
+
+/**
+ * struct msg_info - Information collected about one direction (request
+ * or response) of an RPC.
+ */
+struct msg_info {
+	/** @length: Total message length, or -1 if no DATA seen yet. */
+	int64_t length;
+
+	/** @first_time: Time of the first DATA packet (0 means none). */
+	int64_t first_time;
+
+	/**
+	 * @done_time: Time of the packet that made the message complete
+	 * (0 means the message never completed).
+	 */
+	int64_t done_time;
+
+	/**
+	 * @unsched_limit: Offsets below this were sent without grants
+	 * (taken from the incoming field of the first DATA packet).
+	 */
+	int64_t unsched_limit;
+
+	/** @received: Number of distinct message bytes seen so far. */
+	int64_t received;
+
+	/** @unsched_bytes: Bytes of original data below @unsched_limit. */
+	int64_t unsched_bytes;
+
+	/** @sched_bytes: Bytes of original data at or above @unsched_limit. */
+	int64_t sched_bytes;
+
+	/** @retrans_bytes: Bytes in DATA packets with the retransmit flag. */
+	int64_t retrans_bytes;
+
+	/** @data_end: Highest offset + length among data packets so far. */
+	int64_t data_end;
+
+	/** @granted: Highest grant offset seen so far. */
+	int64_t granted;
+
+	/** @first_grant_time: Time of the first GRANT (0 means none). */
+	int64_t first_grant_time;
+
+	/** @grants: Number of GRANT packets for this message. */
+	int grants;
+
+	/** @resends: Number of RESEND packets for this message. */
+	int resends;
+
+	/** @episodes: Number of distinct RESEND episodes. */
+	int episodes;
+
+	/**
+	 * @episode_start: Time of the RESEND that started the current
+	 * episode, or 0 if no episode is in progress.
+	 */
+	int64_t episode_start;
+
+	/**
+	 * @ranges: Sorted, non-overlapping [start, end) ranges of the
+	 * message that have been seen.
+	 */
+	std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+	/**
+	 * @pending: Grants that haven't yet been followed by new data:
+	 * each entry holds the time of the grant and the grant offset
+	 * that preceded it.
+	 */
+	std::vector<std::pair<int64_t, int64_t>> pending;
+
+	msg_info()
+		: length(-1), first_time(0), done_time(0), unsched_limit(0),
+		received(0), unsched_bytes(0), sched_bytes(0),
+		retrans_bytes(0), data_end(0), granted(0),
+		first_grant_time(0), grants(0), resends(0), episodes(0),
+		episode_start(0), ranges(), pending()
+	{}
+};
+
+/** struct rpc_info - Information collected about a single RPC. */
+struct rpc_info {
+	/** @client: Address of the client. */
+	struct addr client;
+
+	/** @server: Address of the server. */
+	struct addr server;
+
+	/** @id: Client's identifier for the RPC. */
+	uint64_t id;
+
+	/** @client_port: Homa port on the client. */
+	int client_port;
+
+	/** @server_port: Homa port on the server. */
+	int server_port;
+
+	/** @request: Information about the request message. */
+	struct msg_info request;
+
+	/** @response: Information about the response message. */
+	struct msg_info response;
+};
+
+/**
+ * struct prio_info - Statistics about traffic at a given priority level
+ * (as indicated by the DSCP field of the IP header).
+ */
+struct prio_info {
+	/** @data_pkts: DATA packets at this priority. */
+	int64_t data_pkts;
+
+	/** @ctrl_pkts: Packets other than DATA at this priority. */
+	int64_t ctrl_pkts;
+
+	/** @unsched_bytes: Bytes of unscheduled message data. */
+	int64_t unsched_bytes;
+
+	/** @sched_bytes: Bytes of scheduled message data. */
+	int64_t sched_bytes;
+
+	/** @wire_bytes: Total bytes on the wire, including all overheads. */
+	int64_t wire_bytes;
+};
+
+/** @rpcs: All of the RPCs seen so far. */
+std::unordered_map<rpc_key, rpc_info, rpc_key_hash> rpcs;
+
+/** @prios: Statistics for each priority level. */
+struct prio_info prios[HOMA_MAX_PRIORITIES];
+
+/** @type_counts: Number of Homa packets seen of each type. */
+int64_t type_counts[MAX_OP + 1];
+
+/** @retransmits: Number of DATA packets with the retransmit flag. */
+int64_t retransmits;
+
+/** @total_pkts: Total number of packets in the capture(s). */
+int64_t total_pkts;
+
+/** @homa_pkts: Number of packets that were recognized as Homa. */
+int64_t homa_pkts;
+
+/** @short_pkts: Homa packets skipped because the capture was truncated. */
+int64_t short_pkts;
+
+/** @first_time: Time of the first packet (ns since the epoch). */
+int64_t first_time;
+
+/** @last_time: Time of the last packet (ns since the epoch). */
+int64_t last_time;
+
+/** @grant_lags: Elapsed time from each GRANT to the first new data. */
+std::vector<double> grant_lags;
+
+/** @episode_times: Elapsed time for each completed RESEND episode. */
+std::vector<double> episode_times;
+
+/** @events: Timeline for the RPC selected with --rpc. */
+std::vector<std::string> events;
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+void print_help(const char *name)
+{
+	printf("Usage: %s [options] file.pcap ...\n\n"
+		"Reads one or more packet captures containing Homa traffic and\n"
+		"prints statistics about RPCs, grants, retransmissions, and\n"
+		"priority usage. The following options are available:\n"
+		"--data dir        Write a file rpcs.dat in dir with one line\n"
+		"                  per RPC, giving the timeline for that RPC\n"
+		"--help            Print this message\n"
+		"--rpc id          Print all of the packets for the RPC whose\n"
+		"                  client id is id\n"
+		"--rpcs count      Number of slowest RPCs to list (default: %d)\n"
+		"--udp-port port   Also decode Homa packets encapsulated in UDP\n"
+		"                  with this destination port (0 means no UDP\n"
+		"                  decoding; default: %d)\n",
+		name, num_rpcs, udp_port);
+}
+
+/**
+ * print_addr() - Return a printable version of an address.
+ * @a:      Address to print.
+ * Return:  Static buffer containing the printable address (only valid
+ *          until the next call).
+ */
+const char *print_addr(const struct addr &a)
+{
+	static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+			0xff, 0xff};
+	static char buffer[INET6_ADDRSTRLEN];
+
+	if (memcmp(a.bytes, mapped, sizeof(mapped)) == 0)
+		inet_ntop(AF_INET, a.bytes + 12, buffer, sizeof(buffer));
+	else
+		inet_ntop(AF_INET6, a.bytes, buffer, sizeof(buffer));
+	return buffer;
+}
+
+/**
+ * usecs() - Convert a capture time to microseconds since the start of the
+ * capture.
+ * @t:      Time in nanoseconds since the epoch.
+ * Return:  See above.
+ */
+static inline double usecs(int64_t t)
+{
+	return (t - first_time) * 1e-3;
+}
+
+/**
+ * add_event() - If an RPC is being traced with --rpc, append a line to its
+ * timeline.
+ * @t:       Time of the event.
+ * @format:  printf-style format string, followed by arguments.
+ */
+void add_event(int64_t t, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void add_event(int64_t t, const char *format, ...)
+{
+	char buffer[200];
+	int used;
+	va_list ap;
+
+	used = snprintf(buffer, sizeof(buffer), "%9.3f ", usecs(t));
+	va_start(ap, format);
+	vsnprintf(buffer + used, sizeof(buffer) - used, format, ap);
+	va_end(ap);
+	events.emplace_back(buffer);
+}
+
+/**
+ * add_range() - Record that a range of bytes in a message has been seen.
+ * @msg:     Message containing the range.
+ * @start:   Offset of the first byte in the range.
+ * @end:     Offset just after the last byte in the range.
+ * Return:   The number of bytes in the range that hadn't been seen before.
+ */
+int64_t add_range(struct msg_info *msg, uint32_t start, uint32_t end)
+{
+	std::vector<std::pair<uint32_t, uint32_t>> &r = msg->ranges;
+	int64_t added = end - start;
+	size_t i;
+
+	/* Fast path: packets usually arrive in order. */
+	if (r.empty() || start > r.back().second) {
+		r.emplace_back(start, end);
+		return added;
+	}
+	if (start >= r.back().first) {
+		if (end <= r.back().second)
+			return 0;
+		added = end - r.back().second;
+		r.back().second = end;
+		return added;
+	}
+
+	/* Slow path: merge with all overlapping ranges. */
+	for (i = 0; i < r.size() && r[i].second < start; i++) {}
+	size_t j = i;
+	uint32_t new_start = start, new_end = end;
+	for ( ; j < r.size() && r[j].first <= end; j++) {
+		uint32_t lo = std::max(start, r[j].first);
+		uint32_t hi = std::min(end, r[j].second);
+
+		if (hi > lo)
+			added -= hi - lo;
+		new_start = std::min(new_start, r[j].first);
+		new_end = std::max(new_end, r[j].second);
+	}
+	r.erase(r.begin() + i, r.begin() + j);
+	r.insert(r.begin() + i, std::make_pair(new_start, new_end));
+	return added;
+}
+
+/**
+ * homa_pkt() - Process a single Homa packet.
+ * @t:        Capture time of the packet (ns since the epoch).
+ * @src:      Source address of the packet.
+ * @dst:      Destination address of the packet.
+ * @prio:     Priority of the packet (from the IP header).
+ * @h:        Homa header of the packet.
+ * @length:   Number of bytes in the packet, starting at @h (from the
+ *            IP header, so it is valid even if the capture truncated
+ *            the packet).
+ * @caplen:   Number of bytes actually available starting at @h.
+ */
+void homa_pkt(int64_t t, const struct addr &src, const struct addr &dst,
+		int prio, const struct homa_common_hdr *h, int length,
+		int caplen)
+{
+	uint64_t sender_id = be64toh(h->sender_id);
+	bool from_client = !(sender_id & 1);
+	struct prio_info *p = &prios[prio];
+	struct msg_info *msg;
+	struct rpc_info *rpc;
+	struct rpc_key key;
+	bool traced;
+
+	if (h->type < DATA || h->type > MAX_OP)
+		return;
+	homa_pkts++;
+	type_counts[h->type]++;
+	p->wire_bytes += length + HOMA_ETH_OVERHEAD;
+	if (h->type != DATA)
+		p->ctrl_pkts++;
+	else
+		p->data_pkts++;
+	if (h->type != DATA && h->type != GRANT && h->type != RESEND)
+		return;
+
+	key.client = from_client ? src : dst;
+	key.id = sender_id & ~1ULL;
+	auto it = rpcs.find(key);
+	if (it == rpcs.end()) {
+		it = rpcs.emplace(key, rpc_info()).first;
+		rpc = &it->second;
+		rpc->client = key.client;
+		rpc->server = from_client ? dst : src;
+		rpc->id = key.id;
+		rpc->client_port = ntohs(from_client ? h->sport : h->dport);
+		rpc->server_port = ntohs(from_client ? h->dport : h->sport);
+	}
+	rpc = &it->second;
+	traced = (rpc_filter != 0) && (key.id == rpc_filter);
+
+	if (h->type == DATA) {
+		const struct homa_data_hdr *d = (const struct homa_data_hdr *) h;
+		uint32_t offset;
+		int64_t added, end, bytes;
+
+		if (caplen < (int) sizeof(*d)) {
+			short_pkts++;
+			return;
+		}
+		msg = from_client ? &rpc->request : &rpc->response;
+		offset = ntohl(d->seg.offset);
+		if (offset == 0xffffffff)
+			offset = ntohl(h->sequence);
+		bytes = length - sizeof(*d);
+		if (bytes < 0)
+			bytes = 0;
+		if (msg->length < 0) {
+			msg->length = ntohl(d->message_length);
+			msg->first_time = t;
+			msg->unsched_limit = std::min<int64_t>(
+					ntohl(d->incoming), msg->length);
+		}
+		end = std::min<int64_t>(offset + bytes, msg->length);
+		if (end < offset)
+			end = offset;
+		added = add_range(msg, offset, end);
+		msg->received += added;
+		if (msg->received >= msg->length && msg->done_time == 0)
+			msg->done_time = t;
+		if (d->retransmit) {
+			/* Retransmitted data is accounted for below. */
+		} else if (offset < msg->unsched_limit) {
+			int64_t unsched = std::min(end, msg->unsched_limit)
+					- offset;
+
+			msg->unsched_bytes += unsched;
+			msg->sched_bytes += (end - offset) - unsched;
+			p->unsched_bytes += unsched;
+			p->sched_bytes += (end - offset) - unsched;
+		} else {
+			msg->sched_bytes += end - offset;
+			p->sched_bytes += end - offset;
+		}
+		if (d->retransmit) {
+			retransmits++;
+			msg->retrans_bytes += end - offset;
+			if (msg->episode_start != 0) {
+				episode_times.push_back((t - msg->episode_start)
+						* 1e-3);
+				msg->episode_start = 0;
+			}
+		} else {
+			size_t i;
+
+			for (i = 0; i < msg->pending.size(); i++) {
+				if (offset < msg->pending[i].second)
+					break;
+				grant_lags.push_back((t - msg->pending[i].first)
+						* 1e-3);
+			}
+			msg->pending.erase(msg->pending.begin(),
+					msg->pending.begin() + i);
+		}
+		if (end > msg->data_end)
+			msg->data_end = end;
+		if (traced)
+			add_event(t, "DATA  %s offset %u length %ld incoming %u "
+					"prio %d%s\n",
+					from_client ? "request" : "response",
+					offset, end - offset,
+					ntohl(d->incoming), prio,
+					d->retransmit ? " retransmit" : "");
+	} else if (h->type == GRANT) {
+		const struct homa_grant_hdr *g =
+				(const struct homa_grant_hdr *) h;
+		int64_t offset;
+
+		if (caplen < (int) sizeof(*g)) {
+			short_pkts++;
+			return;
+		}
+
+		/* Grants flow in the opposite direction from data. */
+		msg = from_client ? &rpc->response : &rpc->request;
+		offset = ntohl(g->offset);
+		msg->grants++;
+		if (msg->first_grant_time == 0)
+			msg->first_grant_time = t;
+		if (offset > msg->granted) {
+			if (msg->data_end < offset)
+				msg->pending.emplace_back(t,
+						std::max(msg->granted,
+						msg->data_end));
+			msg->granted = offset;
+		}
+		if (traced)
+			add_event(t, "GRANT %s offset %ld priority %d%s\n",
+					from_client ? "response" : "request",
+					offset, g->priority,
+					g->resend_all ? " resend_all" : "");
+	} else {
+		const struct homa_resend_hdr *r =
+				(const struct homa_resend_hdr *) h;
+
+		if (caplen < (int) sizeof(*r)) {
+			short_pkts++;
+			return;
+		}
+		msg = from_client ? &rpc->response : &rpc->request;
+		msg->resends++;
+		if (msg->episode_start == 0) {
+			msg->episodes++;
+			msg->episode_start = t;
+		}
+		if (traced)
+			add_event(t, "RESEND %s offset %u length %d\n",
+					from_client ? "response" : "request",
+					ntohl(r->offset), (int) ntohl(r->length));
+	}
+}
+
+/**
+ * ip_pkt() - Process a single IPv4 or IPv6 packet, passing it on to
+ * homa_pkt if it contains Homa.
+ * @t:        Capture time of the packet (ns since the epoch).
+ * @ip:       First byte of the IP header.
+ * @caplen:   Number of bytes available starting at @ip.
+ */
+void ip_pkt(int64_t t, const uint8_t *ip, int caplen)
+{
+	const struct homa_common_hdr *h;
+	struct addr src, dst;
+	int proto, prio, length, hdr_length;
+
+	if (caplen < 1)
+		return;
+	if ((ip[0] >> 4) == 4) {
+		if (caplen < 20)
+			return;
+
+		/* Ignore all but the first fragment. */
+		if ((ntohs(*(const uint16_t *) (ip + 6)) & 0x1fff) != 0)
+			return;
+		hdr_length = (ip[0] & 0xf) * 4;
+		length = ntohs(*(const uint16_t *) (ip + 2)) - hdr_length;
+		proto = ip[9];
+		prio = ip[1] >> 5;
+		memset(src.bytes, 0, 10);
+		src.bytes[10] = src.bytes[11] = 0xff;
+		dst = src;
+		memcpy(src.bytes + 12, ip + 12, 4);
+		memcpy(dst.bytes + 12, ip + 16, 4);
+	} else if ((ip[0] >> 4) == 6) {
+		if (caplen < 40)
+			return;
+		hdr_length = 40;
+		length = ntohs(*(const uint16_t *) (ip + 4));
+		proto = ip[6];
+		prio = ip[0] & (HOMA_MAX_PRIORITIES - 1);
+		memcpy(src.bytes, ip + 8, 16);
+		memcpy(dst.bytes, ip + 24, 16);
+	} else {
+		return;
+	}
+	ip += hdr_length;
+	caplen -= hdr_length;
+
+	if (proto == 17) {
+		/* Possibly Homa encapsulated in UDP. */
+		if (udp_port == 0 || caplen < 8 ||
+				ntohs(*(const uint16_t *) (ip + 2)) != udp_port)
+			return;
+		ip += 8;
+		caplen -= 8;
+		length -= 8;
+	} else if (proto != 6 && proto != IPPROTO_HOMA) {
+		return;
+	}
+	if (caplen < (int) sizeof(struct homa_common_hdr)) {
+		if (proto == IPPROTO_HOMA)
+			short_pkts++;
+		return;
+	}
+	h = (const struct homa_common_hdr *) ip;
+	if (proto == 6 && (h->flags != HOMA_TCP_FLAGS ||
+			ntohs(h->urgent) != HOMA_TCP_URGENT))
+		return;
+	homa_pkt(t, src, dst, prio, h, length, caplen);
+}
+
+/**
+ * process_file() - Read a pcap file and process all of the packets in it.
+ * @name:    Name of the file.
+ * Return:   0 for success, -1 if the file couldn't be processed.
+ */
+int process_file(const char *name)
+{
+	const struct pcap_file_hdr *fh;
+	const uint8_t *base, *p, *end;
+	bool swapped, nsecs;
+	struct stat st;
+	uint32_t linktype;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		printf("Couldn't open %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*fh)) {
+		printf("%s is too short to be a pcap file\n", name);
+		close(fd);
+		return -1;
+	}
+	base = (const uint8_t *) mmap(NULL, st.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Couldn't map %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	madvise((void *) base, st.st_size, MADV_SEQUENTIAL);
+	end = base + st.st_size;
+
+	fh = (const struct pcap_file_hdr *) base;
+	swapped = false;
+	nsecs = false;
+	if (fh->magic == PCAP_MAGIC_USECS) {
+	} else if (fh->magic == PCAP_MAGIC_NSECS) {
+		nsecs = true;
+	} else if (fh->magic == __builtin_bswap32(PCAP_MAGIC_USECS)) {
+		swapped = true;
+	} else if (fh->magic == __builtin_bswap32(PCAP_MAGIC_NSECS)) {
+		swapped = true;
+		nsecs = true;
+	} else {
+		if (fh->magic == PCAPNG_MAGIC)
+			printf("%s is in pcapng format, which isn't supported; "
+				"convert it with 'editcap -F pcap'\n", name);
+		else
+			printf("%s isn't a pcap file\n", name);
+		munmap((void *) base, st.st_size);
+		return -1;
+	}
+#define GET32(x) (swapped ? __builtin_bswap32(x) : (x))
+	linktype = GET32(fh->linktype) & 0xffff;
+	if (linktype != LINKTYPE_ETHERNET && linktype != LINKTYPE_RAW &&
+			linktype != LINKTYPE_SLL && linktype != LINKTYPE_SLL2) {
+		printf("%s has unsupported link type %u\n", name, linktype);
+		munmap((void *) base, st.st_size);
+		return -1;
+	}
+
+	for (p = base + sizeof(*fh); p + sizeof(struct pcap_rec_hdr) <= end; ) {
+		const struct pcap_rec_hdr *rh = (const struct pcap_rec_hdr *) p;
+		const uint8_t *pkt = p + sizeof(*rh);
+		int caplen = GET32(rh->incl_len);
+		int64_t t;
+		int ethertype;
+
+		if (pkt + caplen > end)
+			break;
+		p = pkt + caplen;
+		total_pkts++;
+		t = (int64_t) GET32(rh->ts_sec) * 1000000000 +
+				(int64_t) GET32(rh->ts_frac) * (nsecs ? 1 : 1000);
+		if (first_time == 0)
+			first_time = t;
+		last_time = t;
+
+		if (linktype == LINKTYPE_RAW) {
+			ip_pkt(t, pkt, caplen);
+			continue;
+		} else if (linktype == LINKTYPE_SLL) {
+			if (caplen < 16)
+				continue;
+			ethertype = ntohs(*(const uint16_t *) (pkt + 14));
+			pkt += 16;
+			caplen -= 16;
+		} else if (linktype == LINKTYPE_SLL2) {
+			if (caplen < 20)
+				continue;
+			ethertype = ntohs(*(const uint16_t *) pkt);
+			pkt += 20;
+			caplen -= 20;
+		} else {
+			if (caplen < 14)
+				continue;
+			ethertype = ntohs(*(const uint16_t *) (pkt + 12));
+			pkt += 14;
+			caplen -= 14;
+		}
+
+		/* Skip VLAN tags. */
+		while ((ethertype == 0x8100 || ethertype == 0x88a8) &&
+				caplen >= 4) {
+			ethertype = ntohs(*(const uint16_t *) (pkt + 2));
+			pkt += 4;
+			caplen -= 4;
+		}
+		if (ethertype == 0x0800 || ethertype == 0x86dd)
+			ip_pkt(t, pkt, caplen);
+	}
+#undef GET32
+	munmap((void *) base, st.st_size);
+	return 0;
+}
+
+/**
+ * percentile() - Return a given percentile from a sorted vector.
+ * @v:      Values (must be sorted in increasing order and nonempty).
+ * @pct:    Desired percentile (0-100).
+ * Return:  See above.
+ */
+double percentile(const std::vector<double> &v, double pct)
+{
+	size_t i = (size_t) (pct * v.size() / 100.0);
+
+	if (i >= v.size())
+		i = v.size() - 1;
+	return v[i];
+}
+
+/**
+ * print_dist_line() - Print a one-line summary of a distribution of
+ * times.
+ * @label:   Describes the values (printed first on the line).
+ * @v:       Values in microseconds; will be sorted.
+ */
+void print_dist_line(const char *label, std::vector<double> &v)
+{
+	double sum = 0.0;
+
+	if (v.empty()) {
+		printf("%-28s no samples\n", label);
+		return;
+	}
+	std::sort(v.begin(), v.end());
+	for (double x : v)
+		sum += x;
+	printf("%-28s P50 %8.1f us, P90 %8.1f us, P99 %8.1f us, "
+			"Max %8.1f us, Avg %8.1f us (%lu samples)\n", label,
+			percentile(v, 50), percentile(v, 90), percentile(v, 99),
+			v.back(), sum / v.size(), v.size());
+}
+
+/**
+ * rpc_elapsed() - Return the elapsed time for an RPC (in ns), from the
+ * first request packet to the last response packet, or -1 if the RPC
+ * didn't complete within the capture.
+ * @rpc:    RPC of interest.
+ * Return:  See above.
+ */
+int64_t rpc_elapsed(const struct rpc_info *rpc)
+{
+	if (rpc->request.first_time == 0 || rpc->response.done_time == 0)
+		return -1;
+	return rpc->response.done_time - rpc->request.first_time;
+}
+
+/**
+ * print_header() - Print the banner that starts each section of output
+ * (same format as tthoma.py).
+ * @name:   Name of the section.
+ */
+void print_header(const char *name)
+{
+	printf("\n-----------------\n");
+	printf("Analyzer: %s\n", name);
+	printf("-----------------\n");
+}
+
+/**
+ * print_pcap() - Print overall information about the capture.
+ */
+void print_pcap(void)
+{
+	static const char *names[] = {"DATA", "GRANT", "RESEND", "RPC_UNKNOWN",
+			"BUSY", "CUTOFFS", "FREEZE", "NEED_ACK", "ACK"};
+
+	print_header("pcap");
+	printf("Packets in capture:  %ld\n", total_pkts);
+	printf("Homa packets:        %ld (%ld truncated)\n", homa_pkts,
+			short_pkts);
+	printf("Capture duration:    %.1f us\n", usecs(last_time));
+	printf("Homa packets by type:\n");
+	for (int i = DATA; i <= MAX_OP; i++) {
+		if (type_counts[i] == 0)
+			continue;
+		printf("  %-12s %10ld", names[i - DATA], type_counts[i]);
+		if (i == DATA)
+			printf(" (%ld retransmitted)", retransmits);
+		printf("\n");
+	}
+}
+
+/**
+ * print_rpcs() - Print information about RPCs and their messages.
+ * @sorted:   All RPCs, sorted by decreasing elapsed time.
+ */
+void print_rpcs(std::vector<const struct rpc_info *> &sorted)
+{
+	int64_t unsched = 0, sched = 0, retrans = 0;
+	int complete = 0, req_complete = 0;
+	std::vector<double> elapsed;
+
+	for (const struct rpc_info *rpc : sorted) {
+		int64_t e = rpc_elapsed(rpc);
+
+		if (e >= 0) {
+			complete++;
+			elapsed.push_back(e * 1e-3);
+		}
+		if (rpc->request.done_time != 0)
+			req_complete++;
+		for (const struct msg_info *msg : {&rpc->request,
+				&rpc->response}) {
+			unsched += msg->unsched_bytes;
+			sched += msg->sched_bytes;
+			retrans += msg->retrans_bytes;
+		}
+	}
+
+	print_header("rpcs");
+	printf("RPCs: %lu (%d with complete requests, %d complete)\n",
+			sorted.size(), req_complete, complete);
+	printf("Message bytes: %ld unscheduled (%.1f%%), %ld scheduled, "
+			"%ld retransmitted\n", unsched,
+			100.0 * unsched / std::max<int64_t>(unsched + sched, 1),
+			sched, retrans);
+	print_dist_line("RPC elapsed times:", elapsed);
+	if (sorted.empty() || num_rpcs <= 0)
+		return;
+
+	printf("\nSlowest RPCs (complete RPCs only):\n");
+	printf("RPC:      Client's id for the RPC\n");
+	printf("Client:   Address of the client\n");
+	printf("Server:   Address of the server\n");
+	printf("ReqLen:   Length of the request message\n");
+	printf("RspLen:   Length of the response message\n");
+	printf("Start:    Time of first request packet (us)\n");
+	printf("Elapsed:  Time until last response packet (us)\n");
+	printf("ReqDone:  Time until request fully received (us)\n");
+	printf("Unsched:  Unscheduled bytes (both messages)\n");
+	printf("Grants:   GRANT packets (both messages)\n");
+	printf("Resends:  RESEND packets (both messages)\n\n");
+	printf("        RPC           Client           Server   ReqLen   "
+			"RspLen     Start  Elapsed  ReqDone  Unsched "
+			"Grants Resends\n");
+	int printed = 0;
+	for (const struct rpc_info *rpc : sorted) {
+		int64_t e = rpc_elapsed(rpc);
+		std::string client;
+
+		if (e < 0)
+			break;
+		if (printed >= num_rpcs)
+			break;
+		printed++;
+		client = print_addr(rpc->client);
+		printf("%11lu %16s %16s %8ld %8ld %9.1f %8.1f %8.1f %8ld "
+				"%6d %7d\n", rpc->id, client.c_str(),
+				print_addr(rpc->server), rpc->request.length,
+				rpc->response.length,
+				usecs(rpc->request.first_time), e * 1e-3,
+				(rpc->request.done_time -
+				rpc->request.first_time) * 1e-3,
+				rpc->request.unsched_bytes +
+				rpc->response.unsched_bytes,
+				rpc->request.grants + rpc->response.grants,
+				rpc->request.resends + rpc->response.resends);
+	}
+}
+
+/**
+ * print_grants() - Print information about grants.
+ */
+void print_grants(void)
+{
+	std::vector<double> first_grant;
+	int granted_msgs = 0, msgs = 0;
+
+	for (auto &it : rpcs) {
+		for (const struct msg_info *msg : {&it.second.request,
+				&it.second.response}) {
+			if (msg->first_time == 0)
+				continue;
+			msgs++;
+			if (msg->first_grant_time == 0)
+				continue;
+			granted_msgs++;
+			first_grant.push_back((msg->first_grant_time -
+					msg->first_time) * 1e-3);
+		}
+	}
+	print_header("grants");
+	printf("Messages: %d (%d received grants)\n", msgs, granted_msgs);
+	printf("First grant delay: time from first DATA packet to first GRANT\n");
+	printf("Grant lag: time from a GRANT to the first new DATA packet at "
+			"or above\n");
+	printf("           the previous grant offset\n");
+	print_dist_line("First grant delay:", first_grant);
+	print_dist_line("Grant lag:", grant_lags);
+}
+
+/**
+ * print_resends() - Print information about RESEND episodes.
+ */
+void print_resends(void)
+{
+	int msgs = 0, episodes = 0, open = 0;
+
+	for (auto &it : rpcs) {
+		for (const struct msg_info *msg : {&it.second.request,
+				&it.second.response}) {
+			if (msg->resends == 0)
+				continue;
+			msgs++;
+			episodes += msg->episodes;
+			if (msg->episode_start != 0)
+				open++;
+		}
+	}
+	print_header("resends");
+	printf("An episode starts with a RESEND and ends with the first "
+			"retransmitted\n");
+	printf("DATA packet for the same message\n");
+	printf("RESEND packets: %ld\n", type_counts[RESEND]);
+	printf("Messages with RESENDs: %d\n", msgs);
+	printf("Episodes: %d (%d never ended)\n", episodes, open);
+	print_dist_line("Episode duration:", episode_times);
+}
+
+/**
+ * print_prios() - Print information about how each priority level was used.
+ */
+void print_prios(void)
+{
+	double secs = (last_time - first_time) * 1e-9;
+	int64_t total = 0;
+
+	for (int i = 0; i < HOMA_MAX_PRIORITIES; i++)
+		total += prios[i].wire_bytes;
+	print_header("prios");
+	printf("Prio:     Priority level (from the IP DSCP/traffic class)\n");
+	printf("Data:     DATA packets\n");
+	printf("Ctrl:     Other Homa packets\n");
+	printf("Unsched:  Unscheduled message data (KB)\n");
+	printf("Sched:    Scheduled message data (KB)\n");
+	printf("Gbps:     Average bandwidth over the capture, including "
+			"all overheads\n");
+	printf("Frac:     Fraction of all Homa bytes on the wire\n\n");
+	printf("Prio       Data       Ctrl    Unsched      Sched    Gbps   "
+			"Frac\n");
+	for (int i = HOMA_MAX_PRIORITIES - 1; i >= 0; i--) {
+		struct prio_info *p = &prios[i];
+
+		if (p->wire_bytes == 0)
+			continue;
+		printf("%4d %10ld %10ld %10.1f %10.1f %7.2f %5.1f%%\n", i,
+				p->data_pkts, p->ctrl_pkts,
+				p->unsched_bytes * 1e-3, p->sched_bytes * 1e-3,
+				secs > 0 ? p->wire_bytes * 8e-9 / secs : 0.0,
+				100.0 * p->wire_bytes / std::max<int64_t>(total,
+				1));
+	}
+}
+
+/**
+ * write_data() - Write rpcs.dat in @data_dir.
+ * @sorted:   All RPCs (will be re-sorted by start time).
+ */
+void write_data(std::vector<const struct rpc_info *> &sorted)
+{
+	std::string name = std::string(data_dir) + "/rpcs.dat";
+	FILE *f = fopen(name.c_str(), "w");
+
+	if (f == NULL) {
+		printf("Couldn't create %s: %s\n", name.c_str(),
+				strerror(errno));
+		return;
+	}
+	std::sort(sorted.begin(), sorted.end(),
+			[](const struct rpc_info *a, const struct rpc_info *b) {
+		return a->request.first_time < b->request.first_time;
+	});
+	fprintf(f, "# Timeline for each RPC in the capture, generated by "
+			"homa_pcap. All times are\n");
+	fprintf(f, "# in microseconds relative to the start of the capture; "
+			"missing values are -1.\n");
+	fprintf(f, "# Id:        Client's id for the RPC\n");
+	fprintf(f, "# Client:    Client address:port\n");
+	fprintf(f, "# Server:    Server address:port\n");
+	fprintf(f, "# ReqLen:    Request length\n");
+	fprintf(f, "# RspLen:    Response length\n");
+	fprintf(f, "# ReqStart:  First request DATA packet\n");
+	fprintf(f, "# ReqGrant:  First grant for the request\n");
+	fprintf(f, "# ReqDone:   Request fully received\n");
+	fprintf(f, "# RspStart:  First response DATA packet\n");
+	fprintf(f, "# RspGrant:  First grant for the response\n");
+	fprintf(f, "# RspDone:   Response fully received\n");
+	fprintf(f, "# Unsched:   Unscheduled bytes (both messages)\n");
+	fprintf(f, "# Sched:     Scheduled bytes (both messages)\n");
+	fprintf(f, "# Retrans:   Retransmitted bytes (both messages)\n");
+	fprintf(f, "# Resends:   RESEND packets (both messages)\n");
+	fprintf(f, "# Episodes:  RESEND episodes (both messages)\n");
+	fprintf(f, "Id Client Server ReqLen RspLen ReqStart ReqGrant ReqDone "
+			"RspStart RspGrant RspDone Unsched Sched Retrans "
+			"Resends Episodes\n");
+	for (const struct rpc_info *rpc : sorted) {
+		const struct msg_info *req = &rpc->request;
+		const struct msg_info *rsp = &rpc->response;
+		std::string client = print_addr(rpc->client);
+		double times[6];
+		int64_t raw[6] = {req->first_time, req->first_grant_time,
+				req->done_time, rsp->first_time,
+				rsp->first_grant_time, rsp->done_time};
+
+		for (int i = 0; i < 6; i++)
+			times[i] = raw[i] ? usecs(raw[i]) : -1.0;
+		fprintf(f, "%lu %s:%d %s:%d %ld %ld %.3f %.3f %.3f %.3f %.3f "
+				"%.3f %ld %ld %ld %d %d\n",
+				rpc->id, client.c_str(), rpc->client_port,
+				print_addr(rpc->server), rpc->server_port,
+				req->length, rsp->length, times[0], times[1],
+				times[2], times[3], times[4], times[5],
+				req->unsched_bytes + rsp->unsched_bytes,
+				req->sched_bytes + rsp->sched_bytes,
+				req->retrans_bytes + rsp->retrans_bytes,
+				req->resends + rsp->resends,
+				req->episodes + rsp->episodes);
+	}
+	fclose(f);
+}
+
+int main(int argc, const char** argv)
+{
+	std::vector<const char *> files;
+
+	for (int i = 1; i < argc; i++) {
+		const char *option = argv[i];
+
+		if (strcmp(option, "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		} else if (option[0] != '-') {
+			files.push_back(option);
+			continue;
+		}
+		if (i + 1 >= argc) {
+			printf("No value provided for %s\n", option);
+			exit(1);
+		}
+		if (strcmp(option, "--data") == 0) {
+			data_dir = argv[i+1];
+		} else if (strcmp(option, "--rpc") == 0) {
+			rpc_filter = strtoull(argv[i+1], NULL, 10) & ~1ULL;
+		} else if (strcmp(option, "--rpcs") == 0) {
+			num_rpcs = get_int(argv[i+1],
+					"Bad value for --rpcs: %s\n");
+		} else if (strcmp(option, "--udp-port") == 0) {
+			udp_port = get_int(argv[i+1],
+					"Bad value for --udp-port: %s\n");
+		} else {
+			printf("Unknown option %s; type '%s --help' for help\n",
+					option, argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+	if (files.empty()) {
+		print_help(argv[0]);
+		exit(1);
+	}
+
+	rpcs.reserve(100000);
+	for (const char *file : files) {
+		if (process_file(file) != 0)
+			exit(1);
+	}
+
+	std::vector<const struct rpc_info *> sorted;
+	sorted.reserve(rpcs.size());
+	for (auto &it : rpcs)
+		sorted.push_back(&it.second);
+	std::sort(sorted.begin(), sorted.end(),
+			[](const struct rpc_info *a, const struct rpc_info *b) {
+		return rpc_elapsed(a) > rpc_elapsed(b);
+	});
+
+	print_pcap();
+	print_rpcs(sorted);
+	print_grants();
+	print_resends();
+	print_prios();
+	if (rpc_filter != 0) {
+		print_header("rpc");
+		printf("Packets for RPC %lu:\n", rpc_filter);
+		for (const std::string &e : events)
+			printf("%s", e.c_str());
+	}
+	if (data_dir != NULL)
+		write_data(sorted);
+	exit(0);
+}
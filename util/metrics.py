@@ -384,6 +384,14 @@ if elapsed_secs != 0:
                     /deltas["handoffs_thread_waiting"])
         else:
             alt_thread_percent = 0.0
+        if deltas["handoffs_thread_waiting"] and ("handoffs_other_llc" in deltas):
+            other_llc_percent = (100.0*deltas["handoffs_other_llc"]
+                    /deltas["handoffs_thread_waiting"])
+            other_node_percent = (100.0*deltas["handoffs_other_node"]
+                    /deltas["handoffs_thread_waiting"])
+        else:
+            other_llc_percent = 0.0
+            other_node_percent = 0.0
         if deltas["packets_rcvd_DATA"]:
             data_bypass_percent = (100.0*deltas["gro_data_bypasses"]
                         /deltas["packets_rcvd_DATA"])
@@ -399,6 +407,8 @@ if elapsed_secs != 0:
         print("Blocked at least once:        %5.1f%%" % (sleep_percent))
         print("Alternate GRO handoffs:       %5.1f%%" % (gen3_alt_percent))
         print("Alternate thread handoffs:    %5.1f%%" % (alt_thread_percent))
+        print("Handoffs outside LLC:         %5.1f%%" % (other_llc_percent))
+        print("Handoffs to other NUMA node:  %5.1f%%" % (other_node_percent))
         print("GRO bypass for data packets:  %5.1f%%" % (data_bypass_percent))
         print("GRO bypass for grant packets: %5.1f%%" % (grant_bypass_percent))
 
@@ -0,0 +1,161 @@
+/* Copyright (c) 2026 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This program measures the throughput of seed_buffer, check_buffer, and
+ * check_message (in test_utils.cc) for each of the SIMD implementations
+ * supported by this machine, and also checks that each implementation
+ * detects corrupted data. Type "test_payload --help" for information about
+ * command-line arguments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "test_utils.h"
+
+/* Values of command-line arguments (and their default values): */
+
+int count = 1000;
+int length = HOMA_MAX_MESSAGE_LENGTH;
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+void print_help(const char *name)
+{
+	printf("Usage: %s [options]\n\n"
+		"Measures the speed of message seeding and checking. The following\n"
+		"options are supported:\n\n"
+		"--count      Number of times to repeat each measurement "
+		"(default: %d)\n"
+		"--length     Size of messages, in bytes (default: %d)\n",
+		name, count, length);
+}
+
+/**
+ * gbps() - Compute throughput in GB/sec.
+ * @start:   rdtsc time when the measurement started.
+ * Return:   Gbytes/sec for processing @count messages of @length bytes.
+ */
+double gbps(uint64_t start)
+{
+	return (double) count * length / to_seconds(rdtsc() - start) * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+	static const char *names[] = {"scalar", "avx2", "avx512"};
+	struct homa_recvmsg_args control;
+	int num_bpages, errors = 0;
+	char *buffer, *region;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		} else if (i == (argc-1)) {
+			printf("No value provided for %s option\n", argv[i]);
+			exit(1);
+		} else if (strcmp(argv[i], "--count") == 0) {
+			count = get_int(argv[i+1],
+					"Bad count %s; must be positive integer\n");
+		} else if (strcmp(argv[i], "--length") == 0) {
+			length = get_int(argv[i+1],
+					"Bad message length %s; must be positive "
+					"integer\n");
+			if (length > HOMA_MAX_MESSAGE_LENGTH) {
+				length = HOMA_MAX_MESSAGE_LENGTH;
+				printf("Reducing message length to %d\n",
+						length);
+			}
+		} else {
+			printf("Unknown option %s; type '%s --help' for help\n",
+				argv[i], argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+	length &= ~(sizeof(int) - 1);
+	if (length <= 0) {
+		printf("Message length must be at least %lu\n", sizeof(int));
+		exit(1);
+	}
+
+	/* Lay out the bpages for check_message in reverse order, so the
+	 * message is fragmented the way it would be after recvmsg.
+	 */
+	num_bpages = (length + HOMA_BPAGE_SIZE - 1) / HOMA_BPAGE_SIZE;
+	region = (char *) mmap(NULL, num_bpages * HOMA_BPAGE_SIZE,
+			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	buffer = new char[length];
+	if (region == MAP_FAILED) {
+		printf("Couldn't mmap buffer region\n");
+		exit(1);
+	}
+	control.num_bpages = num_bpages;
+	for (int i = 0; i < num_bpages; i++)
+		control.bpage_offsets[i] = (num_bpages - 1 - i)
+				* HOMA_BPAGE_SIZE;
+
+	printf("Message length %d bytes, %d bpages\n", length, num_bpages);
+	printf("Impl        Seed (GB/s)   Check (GB/s)   Message (GB/s)\n");
+	for (int level = SIMD_NONE; level <= SIMD_AVX512; level++) {
+		double seed_rate, check_rate, msg_rate;
+		uint64_t start;
+		int *ints;
+
+		if (select_simd(level) != level)
+			break;
+
+		start = rdtsc();
+		for (int i = 0; i < count; i++)
+			seed_buffer(buffer, length, i);
+		seed_rate = gbps(start);
+
+		start = rdtsc();
+		for (int i = 0; i < count; i++)
+			check_buffer(buffer, length);
+		check_rate = gbps(start);
+
+		for (int i = 0; i < num_bpages; i++) {
+			int bytes = length - i * HOMA_BPAGE_SIZE;
+
+			if (bytes > HOMA_BPAGE_SIZE)
+				bytes = HOMA_BPAGE_SIZE;
+			memcpy(region + control.bpage_offsets[i],
+					buffer + i * HOMA_BPAGE_SIZE, bytes);
+		}
+		start = rdtsc();
+		for (int i = 0; i < count; i++)
+			check_message(&control, region, length, 0);
+		msg_rate = gbps(start);
+		printf("%-10s %12.2f %14.2f %16.2f\n", names[level],
+				seed_rate, check_rate, msg_rate);
+
+		/* Make sure that corruption is detected at every position
+		 * within a vector.
+		 */
+		ints = reinterpret_cast<int *>(buffer);
+		for (int i = 0; i < 64 && i < length / 4; i++) {
+			size_t bad;
+
+			ints[i] ^= 0x100;
+			bad = check_ints(ints, length / 4, ints[0]);
+			if ((i != 0) && (bad != (size_t) i)) {
+				printf("ERROR: %s implementation reported "
+						"corruption at index %lu, "
+						"should have been %d\n",
+						names[level], bad, i);
+				errors++;
+			}
+			ints[i] ^= 0x100;
+		}
+	}
+	delete[] buffer;
+	munmap(region, num_bpages * HOMA_BPAGE_SIZE);
+	exit(errors ? 1 : 0);
+}
@@ -14,12 +14,215 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include <algorithm>
 #include <atomic>
 
 #include "test_utils.h"
 
+/**
+ * @simd: The implementation currently used by seed_buffer, check_buffer,
+ * check_ints, and check_message (one of the values of enum simd_level),
+ * or -1 if select_simd hasn't been invoked yet.
+ */
+static int simd = -1;
+
+/**
+ * seed_ints_scalar() - Portable implementation of seed_ints.
+ * @ints:    Where to store values.
+ * @count:   Number of values to store.
+ * @first:   Value to store in @ints[0]; successive elements get
+ *           successively larger values.
+ */
+static void seed_ints_scalar(int *ints, size_t count, int first)
+{
+	for (size_t i = 0; i < count; i++)
+		ints[i] = static_cast<int>(static_cast<uint32_t>(first) + i);
+}
+
+/**
+ * check_ints_scalar() - Portable implementation of check_ints.
+ * @ints:    Values to check.
+ * @count:   Number of values in @ints.
+ * @first:   Expected value of @ints[0]; successive elements should have
+ *           successively larger values.
+ *
+ * Return: The index of the first element that doesn't have the expected
+ * value, or @count if they all match.
+ */
+static size_t check_ints_scalar(const int *ints, size_t count, int first)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (ints[i] != static_cast<int>(static_cast<uint32_t>(first) + i))
+			return i;
+	}
+	return count;
+}
+
+#ifdef __x86_64__
+/* AVX2 version of seed_ints_scalar. */
+__attribute__((target("avx2")))
+static void seed_ints_avx2(int *ints, size_t count, int first)
+{
+	__m256i v = _mm256_add_epi32(_mm256_set1_epi32(first),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i step = _mm256_set1_epi32(8);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(ints + i), v);
+		v = _mm256_add_epi32(v, step);
+	}
+	seed_ints_scalar(ints + i, count - i,
+			static_cast<int>(static_cast<uint32_t>(first) + i));
+}
+
+/* AVX2 version of check_ints_scalar. */
+__attribute__((target("avx2")))
+static size_t check_ints_avx2(const int *ints, size_t count, int first)
+{
+	__m256i v = _mm256_add_epi32(_mm256_set1_epi32(first),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i step = _mm256_set1_epi32(8);
+	size_t i;
+
+	/* Check two vectors per iteration; on a mismatch, fall through
+	 * to the scalar code to find the exact index.
+	 */
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i v2 = _mm256_add_epi32(v, step);
+		__m256i eq = _mm256_and_si256(
+				_mm256_cmpeq_epi32(_mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(ints + i)),
+				v),
+				_mm256_cmpeq_epi32(_mm256_loadu_si256(
+				reinterpret_cast<const __m256i *>(ints + i + 8)),
+				v2));
+
+		if (_mm256_movemask_epi8(eq) != -1)
+			break;
+		v = _mm256_add_epi32(v2, step);
+	}
+	return i + check_ints_scalar(ints + i, count - i,
+			static_cast<int>(static_cast<uint32_t>(first) + i));
+}
+
+/* AVX-512 version of seed_ints_scalar. */
+__attribute__((target("avx512f")))
+static void seed_ints_avx512(int *ints, size_t count, int first)
+{
+	__m512i v = _mm512_add_epi32(_mm512_set1_epi32(first),
+			_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0));
+	__m512i step = _mm512_set1_epi32(16);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		_mm512_storeu_si512(ints + i, v);
+		v = _mm512_add_epi32(v, step);
+	}
+	seed_ints_scalar(ints + i, count - i,
+			static_cast<int>(static_cast<uint32_t>(first) + i));
+}
+
+/* AVX-512 version of check_ints_scalar. */
+__attribute__((target("avx512f")))
+static size_t check_ints_avx512(const int *ints, size_t count, int first)
+{
+	__m512i v = _mm512_add_epi32(_mm512_set1_epi32(first),
+			_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0));
+	__m512i step = _mm512_set1_epi32(16);
+	size_t i;
+
+	for (i = 0; i + 32 <= count; i += 32) {
+		__m512i v2 = _mm512_add_epi32(v, step);
+
+		if (_mm512_cmpneq_epi32_mask(_mm512_loadu_si512(ints + i), v)
+				| _mm512_cmpneq_epi32_mask(
+				_mm512_loadu_si512(ints + i + 16), v2))
+			break;
+		v = _mm512_add_epi32(v2, step);
+	}
+	return i + check_ints_scalar(ints + i, count - i,
+			static_cast<int>(static_cast<uint32_t>(first) + i));
+}
+#endif /* __x86_64__ */
+
+/**
+ * select_simd() - Choose the implementation to use for seed_buffer and the
+ * checking functions: the most capable one supported by this CPU, but no
+ * more capable than @max_level. Invoked automatically with SIMD_AVX512 the
+ * first time one of those functions is called; can also be invoked
+ * explicitly (e.g. to compare implementations).
+ * @max_level:  One of the values of enum simd_level.
+ *
+ * Return: The level selected.
+ */
+int select_simd(int max_level)
+{
+	int level = SIMD_NONE;
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		level = SIMD_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		level = SIMD_AVX512;
+#endif
+	if (level > max_level)
+		level = max_level;
+	simd = level;
+	return level;
+}
+
+/**
+ * seed_ints() - Fill an array of ints with successive values.
+ * @ints:    Where to store values.
+ * @count:   Number of values to store.
+ * @first:   Value to store in @ints[0].
+ */
+static void seed_ints(int *ints, size_t count, int first)
+{
+	if (simd < 0)
+		select_simd(SIMD_AVX512);
+#ifdef __x86_64__
+	if (simd == SIMD_AVX512)
+		seed_ints_avx512(ints, count, first);
+	else if (simd == SIMD_AVX2)
+		seed_ints_avx2(ints, count, first);
+	else
+#endif
+		seed_ints_scalar(ints, count, first);
+}
+
+/**
+ * check_ints() - Check whether an array of ints has successive values,
+ * as generated by seed_buffer. Unlike the other checking functions, this
+ * one doesn't print anything.
+ * @ints:    Values to check.
+ * @count:   Number of values in @ints.
+ * @first:   Expected value of @ints[0].
+ *
+ * Return: The index of the first element that doesn't have the expected
+ * value, or @count if they all match.
+ */
+size_t check_ints(const int *ints, size_t count, int first)
+{
+	if (simd < 0)
+		select_simd(SIMD_AVX512);
+#ifdef __x86_64__
+	if (simd == SIMD_AVX512)
+		return check_ints_avx512(ints, count, first);
+	if (simd == SIMD_AVX2)
+		return check_ints_avx2(ints, count, first);
+#endif
+	return check_ints_scalar(ints, count, first);
+}
+
 /**
  * check_buffer() - Checks whether the data in a buffer is consistent with
  * what would have been produced by seed_buffer. If not, an error message
@@ -32,18 +235,15 @@
 int check_buffer(void *buffer, size_t length)
 {
 	int *int_buffer = (int *) buffer;
-	int num_ints = (length + sizeof(int) - 1)/sizeof(int);
+	size_t num_ints = (length + sizeof(int) - 1)/sizeof(int);
 	int seed = int_buffer[0];
-	int i;
+	size_t i;
 
-	for (i = 0; i < num_ints; i++) {
-		if (int_buffer[i] != seed + i) {
-			printf("Bad value at index %d in "
-				"message; expected %d, got %d\n",
-				i, seed+i, int_buffer[i]);
-			break;
-		}
-	}
+	i = check_ints(int_buffer, num_ints, seed);
+	if (i < num_ints)
+		printf("Bad value at index %lu in "
+			"message; expected %d, got %d\n",
+			i, seed + (int) i, int_buffer[i]);
 	return seed;
 }
 
@@ -54,15 +254,17 @@ int check_buffer(void *buffer, size_t length)
  * @control:   Structure that describes the buffers in the message
  * @region:    Base of the region used for input buffers.
  * @length:    Total length of the message
- * @skip:      This many bytes at the beginning of the message are skipped.
+ * @skip:      This many bytes at the beginning of the message are skipped
+ *             (must be a multiple of sizeof(int)).
  *
  * Return: the seed value that was used to generate the buffer.
  */
 int check_message(struct homa_recvmsg_args *control, char *region,
 		size_t length, int skip)
 {
-	int num_ints, seed;
-	int count = 0;
+	size_t num_ints, bad;
+	size_t count = 0;
+	int seed;
 
 	seed = *((int *) (region + control->bpage_offsets[0] + skip));
 	for (uint32_t i = 0; i < control->num_bpages; i++) {
@@ -71,15 +273,15 @@ int check_message(struct homa_recvmsg_args *control, char *region,
 		int *ints = (int *) (region + control->bpage_offsets[i] + skip);
 		num_ints = (buf_length + sizeof(int) - 1)/sizeof(int);
 		skip = 0;
-		for (int j = 0; j < num_ints; j++) {
-			if (ints[j] != seed + count) {
-				printf("Bad value at index %d in "
-					"message; expected %d, got %d\n",
-					count, seed+count, ints[j]);
-				return seed;
-			}
-			count++;
+		bad = check_ints(ints, num_ints, seed + (int) count);
+		if (bad < num_ints) {
+			printf("Bad value at index %lu in "
+				"message; expected %d, got %d\n",
+				count + bad, seed + (int) (count + bad),
+				ints[bad]);
+			return seed;
 		}
+		count += num_ints;
 		length -= HOMA_BPAGE_SIZE;
 	}
 	return seed;
@@ -205,13 +407,7 @@ void print_dist(uint64_t times[], int count)
  */
 void seed_buffer(void *buffer, size_t length, int seed)
 {
-	int *int_buffer = (int *) buffer;
-	int num_ints = (length + sizeof(int) - 1)/sizeof(int);
-	int i;
-
-	for (i = 0; i < num_ints; i++) {
-		int_buffer[i] = seed + i;
-	}
+	seed_ints((int *) buffer, (length + sizeof(int) - 1)/sizeof(int), seed);
 }
 
 /**
@@ -41,7 +41,18 @@ static inline uint32_t sockaddr_size(const struct sockaddr *sa)
 
 #define sizeof32(type) static_cast<int>(sizeof(type))
 
+/**
+ * enum simd_level - Instruction-set levels that can be used by seed_buffer
+ * and the checking functions (see select_simd).
+ */
+enum simd_level {
+	SIMD_NONE    = 0,
+	SIMD_AVX2    = 1,
+	SIMD_AVX512  = 2,
+};
+
 extern int     check_buffer(void *buffer, size_t length);
+extern size_t  check_ints(const int *ints, size_t count, int first);
 extern int     check_message(struct homa_recvmsg_args *control,
 	           char *region, size_t length, int skip);
 extern double  get_cycles_per_sec();
@@ -51,6 +62,7 @@ extern const char*
                print_address(const union sockaddr_in_union *addr);
 extern void    print_dist(uint64_t times[], int count);
 extern void    seed_buffer(void *buffer, size_t length, int seed);
+extern int     select_simd(int max_level);
 #ifdef __cplusplus
 extern void    split(const char *s, char sep, std::vector<std::string> &dest);
 #endif
@@ -87,7 +99,7 @@ inline static void init_sendmsg_hdrs(struct msghdr *hdr,
 	args->id = 0;
 	args->completion_cookie = 0;
 	args->flags = 0;
-	args->reserved = 0;
+	args->deadline_us = 0;
 
 	hdr->msg_name = (struct sockaddr *)dest_addr;
 	hdr->msg_namelen = addrlen;